@@ -4,6 +4,12 @@
 # license that can be found in the LICENSE file or at
 # https://opensource.org/licenses/MIT.
 
+option(BRUNSLI_ENABLE_TRACE
+  "Emit trace events, see c/include/brunsli/trace.h" OFF)
+if(BRUNSLI_ENABLE_TRACE)
+  add_definitions(-DBRUNSLI_ENABLE_TRACE)
+endif()
+
 file(GLOB BRUNSLI_COMMON_SOURCES
   c/common/*.cc
 )
@@ -22,6 +28,9 @@ set(BRUNSLI_DEC_SOURCES
   c/dec/huffman_decode.cc
   c/dec/huffman_table.cc
   c/dec/jpeg_data_writer.cc
+  c/dec/jpeg_downscale.cc
+  c/dec/jpeg_optimize.cc
+  c/dec/jpeg_pixels.cc
   c/dec/state.cc
 )
 
@@ -39,6 +48,7 @@ set(BRUNSLI_ENC_SOURCES
   c/enc/huffman_tree.cc
   c/enc/jpeg_data_reader.cc
   c/enc/jpeg_huffman_decode.cc
+  c/enc/jpeg_transform.cc
   c/enc/write_bits.cc
 )
 
@@ -107,6 +117,10 @@ add_executable(dbrunsli c/tools/dbrunsli.cc)
 target_link_libraries(dbrunsli PRIVATE
   brunslidec-static
 )
+add_executable(synth_jpeg c/tools/synth_jpeg.cc c/tools/jpeg_synth.cc)
+target_link_libraries(synth_jpeg PRIVATE
+  brunslidec-static
+)
 if(BRUNSLI_EMSCRIPTEN)
   set(WASM_MODULES brunslicodec-wasm brunslidec-wasm brunslienc-wasm)
   foreach(module IN LISTS WASM_MODULES)
@@ -169,7 +183,7 @@ if(NOT BRUNSLI_EMSCRIPTEN)
 endif() # BRUNSLI_EMSCRIPTEN
 
 # Gather artifacts in a single directory for easier uploading.
-set_target_properties(cbrunsli dbrunsli ${BRUNSLI_LIBRARIES} PROPERTIES
+set_target_properties(cbrunsli dbrunsli synth_jpeg ${BRUNSLI_LIBRARIES} PROPERTIES
   ARCHIVE_OUTPUT_DIRECTORY_RELEASE "${CMAKE_BINARY_DIR}/artifacts"
   LIBRARY_OUTPUT_DIRECTORY_RELEASE "${CMAKE_BINARY_DIR}/artifacts"
   RUNTIME_OUTPUT_DIRECTORY_RELEASE "${CMAKE_BINARY_DIR}/artifacts"
@@ -182,13 +196,25 @@ if (${BUILD_TESTING})
     bit_reader
     build_huffman_table
     c_api
+    complexity
     context
+    context_map
     distributions
     fallback
+    groups
     headerless
     huffman_tree
+    jpeg_downscale
+    jpeg_optimize
+    jpeg_pixels
+    jpeg_synth
+    jpeg_transform
     lehmer_code
+    metadata_rewrite
+    platform
     quant_matrix
+    roundtrip
+    trace
   )
 
   file(MAKE_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}/tests)
@@ -199,6 +225,7 @@ if (${BUILD_TESTING})
       c/dec/decode.cc  # "static" brunslidec-c
       c/enc/encode.cc  # "static" brunslienc-c
       c/tests/test_utils.cc  # test utils
+      c/tools/jpeg_synth.cc  # synthetic images
     )
     target_compile_definitions(${TEST_NAME} PUBLIC
       -DTEST_DATA_PATH="${BRUNSLI_TEST_DATA_PATH}"
@@ -211,4 +238,10 @@ if (${BUILD_TESTING})
     )
     gtest_discover_tests(${TEST_NAME})
   endforeach()
+  # Replaces global operator new; keep it out of other binaries.
+  target_sources(complexity_test PRIVATE c/tests/complexity.cc)
+  # Experimental groups module is not a part of any library.
+  find_package(Threads REQUIRED)
+  target_sources(groups_test PRIVATE c/experimental/groups.cc)
+  target_link_libraries(groups_test Threads::Threads)
 endif()  # BUILD_TESTING
@@ -0,0 +1,40 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef BRUNSLI_COMMON_BASE128_H_
+#define BRUNSLI_COMMON_BASE128_H_
+
+#include "./platform.h"
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+// Parses base-128 value (at most 9 bytes) starting at |data[*pos]|; |*pos| is
+// advanced past the parsed bytes.
+static BRUNSLI_INLINE BrunsliStatus DecodeBase128(const uint8_t* data,
+                                                  size_t len, size_t* pos,
+                                                  size_t* val) {
+  *val = 0;
+  uint64_t b = 0x80;
+  uint64_t v = 0;
+  size_t i = 0;
+  while ((i < 9) && (b & 0x80u)) {
+    if (len - *pos < i + 1) return BRUNSLI_NOT_ENOUGH_DATA;
+    b = data[*pos + i];
+    v |= (b & 0x7Fu) << (i * 7);
+    ++i;
+  }
+  *pos += i;
+  *val = v;
+  bool terminated = ((b & 0x80u) == 0);
+  bool fit = (v == *val);
+  return (terminated && fit) ? BRUNSLI_OK : BRUNSLI_INVALID_BRN;
+}
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_COMMON_BASE128_H_
@@ -0,0 +1,148 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "./baseline_jpeg.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "./constants.h"
+#include <brunsli/jpeg_data.h>
+
+namespace brunsli {
+
+namespace {
+
+void AddStockHuffmanCode(int slot_id, bool is_ac, JPEGData* jpg) {
+  JPEGHuffmanCode huff;
+  huff.slot_id = slot_id + (is_ac ? 0x10 : 0);
+  huff.is_last = false;
+  const int table = (slot_id == 0) ? 0 : 1;
+  const int* counts = is_ac ? kStockACHuffmanCodeCounts[table]
+                            : kStockDCHuffmanCodeCounts[table];
+  const int* values = is_ac ? kStockACHuffmanCodeValues[table]
+                            : kStockDCHuffmanCodeValues[table];
+  const int total_count =
+      is_ac ? kStockACHuffmanCodeTotalCount : kJpegDCAlphabetSize + 1;
+  std::copy(counts, counts + kJpegHuffmanMaxBitLength, &huff.counts[1]);
+  std::copy(values, values + total_count, huff.values.begin());
+  jpg->huffman_code.push_back(huff);
+}
+
+}  // namespace
+
+JPEGScanInfo MakeScan(int Ss, int Se, int Ah, int Al) {
+  JPEGScanInfo scan;
+  scan.Ss = Ss;
+  scan.Se = Se;
+  scan.Ah = Ah;
+  scan.Al = Al;
+  return scan;
+}
+
+bool HasValidCoefficientLayout(const JPEGData& jpg) {
+  if ((jpg.version & 1) == kFallbackVersion) return false;
+  if (jpg.width <= 0 || jpg.height <= 0) return false;
+  if (jpg.components.empty() || jpg.components.size() > kMaxComponents) {
+    return false;
+  }
+  int max_h_samp_factor = 1;
+  int max_v_samp_factor = 1;
+  for (const JPEGComponent& c : jpg.components) {
+    if (c.h_samp_factor <= 0 || c.h_samp_factor > kBrunsliMaxSampling ||
+        c.v_samp_factor <= 0 || c.v_samp_factor > kBrunsliMaxSampling) {
+      return false;
+    }
+    max_h_samp_factor = std::max(max_h_samp_factor, c.h_samp_factor);
+    max_v_samp_factor = std::max(max_v_samp_factor, c.v_samp_factor);
+  }
+  if (jpg.max_h_samp_factor != max_h_samp_factor ||
+      jpg.max_v_samp_factor != max_v_samp_factor) {
+    return false;
+  }
+  if (jpg.MCU_cols != DivCeil(jpg.width, max_h_samp_factor * 8) ||
+      jpg.MCU_rows != DivCeil(jpg.height, max_v_samp_factor * 8)) {
+    return false;
+  }
+  for (const JPEGComponent& c : jpg.components) {
+    if (c.quant_idx >= jpg.quant.size()) return false;
+    if (c.width_in_blocks != static_cast<uint32_t>(jpg.MCU_cols) *
+                                 c.h_samp_factor ||
+        c.height_in_blocks != static_cast<uint32_t>(jpg.MCU_rows) *
+                                  c.v_samp_factor) {
+      return false;
+    }
+    if (c.coeffs.size() < static_cast<size_t>(c.width_in_blocks) *
+                              c.height_in_blocks * kDCTBlockSize) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AddComponentToScan(size_t comp_idx, JPEGScanInfo* scan) {
+  JPEGComponentScanInfo& si = scan->components[scan->num_components++];
+  si.comp_idx = static_cast<uint8_t>(comp_idx);
+  si.dc_tbl_idx = (comp_idx == 0) ? 0 : 1;
+  si.ac_tbl_idx = (comp_idx == 0) ? 0 : 1;
+}
+
+void SetBaselineJpegStructure(JPEGData* jpg) {
+  // All quantization tables go to a single DQT marker.
+  for (JPEGQuantTable& q : jpg->quant) q.is_last = false;
+  if (!jpg->quant.empty()) jpg->quant.back().is_last = true;
+
+  // Standard Huffman codes: luma (slot 0) and chroma (slot 1).
+  jpg->huffman_code.clear();
+  AddStockHuffmanCode(0, false, jpg);
+  AddStockHuffmanCode(0, true, jpg);
+  AddStockHuffmanCode(1, false, jpg);
+  AddStockHuffmanCode(1, true, jpg);
+  jpg->huffman_code.back().is_last = true;
+
+  // Interleaved scan, unless MCU would be too large.
+  int blocks_per_mcu = 0;
+  for (const JPEGComponent& c : jpg->components) {
+    blocks_per_mcu += c.h_samp_factor * c.v_samp_factor;
+  }
+  const size_t num_components = jpg->components.size();
+  const bool interleaved =
+      (num_components <= 4) && (blocks_per_mcu <= kMaxBlocksInMCU);
+  jpg->scan_info.clear();
+  JPEGScanInfo scan = MakeScan(0, 63, 0, 0);
+  for (size_t i = 0; i < num_components; ++i) {
+    AddComponentToScan(i, &scan);
+    if (!interleaved || i + 1 == num_components) {
+      jpg->scan_info.push_back(scan);
+      scan.num_components = 0;
+    }
+  }
+
+  // Metadata is kept in the original order.
+  std::vector<uint8_t> marker_order;
+  for (uint8_t marker : jpg->marker_order) {
+    if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+      marker_order.push_back(marker);
+    }
+  }
+  jpg->marker_order.swap(marker_order);
+  jpg->marker_order.push_back(0xDB);
+  jpg->marker_order.push_back(0xC0);
+  jpg->marker_order.push_back(0xC4);
+  for (size_t i = 0; i < jpg->scan_info.size(); ++i) {
+    jpg->marker_order.push_back(0xDA);
+  }
+  jpg->marker_order.push_back(0xD9);
+
+  // Nothing to reproduce bit-exactly.
+  jpg->restart_interval = 0;
+  jpg->inter_marker_data.clear();
+  jpg->tail_data.clear();
+  jpg->has_zero_padding_bit = false;
+  jpg->padding_bits.clear();
+}
+
+}  // namespace brunsli
@@ -0,0 +1,52 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Utilities for producing new JPEGData objects from the modified coefficients.
+
+#ifndef BRUNSLI_COMMON_BASELINE_JPEG_H_
+#define BRUNSLI_COMMON_BASELINE_JPEG_H_
+
+#include <cstddef>
+
+#include "./platform.h"
+#include <brunsli/jpeg_data.h>
+
+namespace brunsli {
+
+// Components with more blocks per MCU can not be interleaved in one scan.
+static const int kMaxBlocksInMCU = 10;
+
+// Returns ceil(a/b).
+static BRUNSLI_INLINE int DivCeil(int a, int b) { return (a + b - 1) / b; }
+
+// Returns scan of spectral band [Ss, Se] with successive approximation bit
+// positions Ah / Al, and no components yet.
+JPEGScanInfo MakeScan(int Ss, int Se, int Ah, int Al);
+
+// Returns true if |jpg| holds DCT coefficients that could be processed
+// without the original bitstream: image size is positive, there are 1 to
+// kMaxComponents components with valid quantization table indices and
+// sampling factors, MCU and block grid sizes agree with the image size and
+// sampling factors, and coefficient buffers cover all blocks. Fallback
+// (original bytes only) data is rejected.
+bool HasValidCoefficientLayout(const JPEGData& jpg);
+
+// Appends component to the scan; component 0 uses Huffman codes of slot 0
+// (luma), the others use slot 1 (chroma).
+void AddComponentToScan(size_t comp_idx, JPEGScanInfo* scan);
+
+// Fills the parts of |jpg| that are required to serialize it as a baseline
+// JPEG: standard Huffman codes, sequential scans and the marker order.
+// Components (including coefficients) and quantization tables are expected
+// to be already set. APP and COM markers are kept in their original order;
+// anything else that is required only for bit-exact reconstruction is reset.
+// Standard Huffman codes cover all symbols, so any coefficients that fit into
+// the baseline range could be serialized.
+void SetBaselineJpegStructure(JPEGData* jpg);
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_COMMON_BASELINE_JPEG_H_
@@ -71,6 +71,8 @@ static const uint8_t kBrunsliHeaderWidthTag = 0x1;
 static const uint8_t kBrunsliHeaderHeightTag = 0x2;
 static const uint8_t kBrunsliHeaderVersionCompTag = 0x3;
 static const uint8_t kBrunsliHeaderSubsamplingTag = 0x4;
+// Number of MCU rows per AC segment; present iff kACSegmentsVersion is set.
+static const uint8_t kBrunsliHeaderACSegmentRowsTag = 0x5;
 
 static const size_t kBrunsliSignatureSize = 6;
 extern const uint8_t kBrunsliSignature[kBrunsliSignatureSize];
@@ -43,6 +43,17 @@ void ComponentStateDC::InitAll() {
   }
 }
 
+void ComponentStateDC::InitDecay() {
+  is_zero_prob.InitDecay();
+  for (size_t i = 0; i < sign_prob.size(); ++i) sign_prob[i].InitDecay();
+  for (size_t i = 0; i < is_empty_block_prob.size(); ++i) {
+    is_empty_block_prob[i].InitDecay();
+  }
+  for (size_t i = 0; i < first_extra_bit_prob.size(); ++i) {
+    first_extra_bit_prob[i].InitDecay();
+  }
+}
+
 // ComponentState
 
 static const uint8_t kInitProb[64] = {
@@ -247,6 +258,35 @@ void ComponentState::InitAll() {
       non_zero_probs[j].Init(kInitProbNonzero[i][j]);
     }
   }
+
+  // Single-symbol model starts with the distribution of tree leaves.
+  static const uint32_t kInitSymbolTotal = 2048;
+  for (size_t i = 0; i < kNumNonZeroContextCount; ++i) {
+    uint16_t freq[SymbolProb::kSize];
+    for (size_t v = 0; v < SymbolProb::kSize; ++v) {
+      uint32_t leaf_prob = kInitSymbolTotal;
+      size_t ctx = 1;
+      for (size_t b = kNumNonZeroBits; b > 0; --b) {
+        const int bit = (v >> (b - 1)) & 1;
+        const uint32_t p = kInitProbNonzero[i][ctx - 1];
+        leaf_prob = (leaf_prob * (bit ? (256 - p) : p) + 128) >> 8;
+        ctx = 2 * ctx + bit;
+      }
+      freq[v] = static_cast<uint16_t>(leaf_prob > 0 ? leaf_prob : 1);
+    }
+    num_nonzero_symbol_prob[i].Init(freq);
+  }
+}
+
+void ComponentState::InitDecay() {
+  for (size_t i = 0; i < is_zero_prob.size(); ++i) is_zero_prob[i].InitDecay();
+  for (size_t i = 0; i < sign_prob.size(); ++i) sign_prob[i].InitDecay();
+  for (size_t i = 0; i < first_extra_bit_prob.size(); ++i) {
+    first_extra_bit_prob[i].InitDecay();
+  }
+  for (size_t i = 0; i < kNumNonZeroContextCount * kNumNonZeroTreeSize; ++i) {
+    num_nonzero_prob[i].InitDecay();
+  }
 }
 
 }  // namespace brunsli
@@ -332,6 +332,9 @@ struct ComponentStateDC {
     prev_sign.resize(w + 1);
   }
 
+  // Switches all the probabilities to "decay" adaptation.
+  void InitDecay();
+
   int width;
   Prob is_zero_prob;
   std::vector<Prob> is_empty_block_prob;
@@ -362,13 +365,17 @@ struct ComponentState {
     prev_sign.resize(kDCTBlockSize * (w + 1));
   }
 
+  // Switches all the probabilities to "decay" adaptation.
+  void InitDecay();
+
   // Returns the size of the object after constructor and SetWidth(w).
   // Used in estimating peak heap memory usage of the brunsli codec.
   static size_t SizeInBytes(int w) {
     return (4 + (10 + 3 * w) * kDCTBlockSize + 2 * w) * sizeof(int) +
            ((kNumNonzeroBuckets + 2 * kMaxAverageContext + 11) * kDCTBlockSize +
             kNumNonZeroContextCount * kNumNonZeroTreeSize) *
-               sizeof(Prob);
+               sizeof(Prob) +
+           kNumNonZeroContextCount * sizeof(SymbolProb);
   }
 
   int width;
@@ -380,6 +387,8 @@ struct ComponentState {
   std::vector<Prob> is_zero_prob;
   std::vector<Prob> sign_prob;
   Prob num_nonzero_prob[kNumNonZeroContextCount * kNumNonZeroTreeSize];
+  // Used instead of |num_nonzero_prob| when kSymbolNumNonzerosVersion is set.
+  SymbolProb num_nonzero_symbol_prob[kNumNonZeroContextCount];
   std::vector<Prob> first_extra_bit_prob;
   std::vector<int> prev_is_nonempty;
   std::vector<uint8_t> prev_num_nonzeros;
@@ -59,6 +59,13 @@ static BRUNSLI_INLINE uint8_t FastDivide(uint32_t numerator,
 static const uint8_t kInitProb = 134;
 static const uint8_t kInitProbCount = 3;
 
+// Decay adaptation rate starts at 1 / 2^2 and slows down to 1 / 2^7.
+static const uint8_t kDecayInitRate = 1u << 2;
+static const uint8_t kDecayMaxRate = 1u << 7;
+
+static const uint16_t kSymbolFreqIncrement = 24;
+static const uint16_t kSymbolFreqLimit = 1u << 12;
+
 }  // namespace impl
 
 // An adaptive binary distribution with 8-bit precision.
@@ -89,6 +96,27 @@ class Prob {
     }
   }
 
+  // Switches to "decay" adaptation (see kDecayProbVersion); current
+  // probability is preserved, but clamped to the range 1..255.
+  void InitDecay() {
+    const uint16_t p16 = static_cast<uint16_t>((prob8 << 8) | 0x80);
+    count = (p16 < 0x100) ? 0x100 : p16;
+    total = impl::kDecayInitRate;
+    prob8 = static_cast<uint8_t>(count >> 8);
+  }
+
+  // Table-free and branch-free exponential decay update. |count| holds
+  // P(bit = 0) with 16-bit precision, |total| controls the adaptation rate.
+  // Resulting probability is always in the range 1..255.
+  void AddDecay(int val) {
+    const int32_t target = 0xFFFF - val * 0xFEFF;
+    const int32_t p16 = count;
+    const int shift = Log2FloorNonZero(total);
+    count = static_cast<uint16_t>(p16 + ((target - p16) >> shift));
+    total += (total < impl::kDecayMaxRate);
+    prob8 = static_cast<uint8_t>(count >> 8);
+  }
+
   uint8_t get_proba() const { return prob8; }
 
  private:
@@ -99,6 +127,63 @@ class Prob {
   uint16_t count;
 };
 
+// Probability adaptation strategies; used to specialize coding routines.
+struct CountingAdaptation {
+  static BRUNSLI_INLINE void Update(Prob* p, int val) { p->Add(val); }
+};
+
+struct DecayAdaptation {
+  static BRUNSLI_INLINE void Update(Prob* p, int val) { p->AddDecay(val); }
+};
+
+// An adaptive distribution over 64 symbols.
+//
+// Used for coding a 6-bit value as a single arithmetic coder decision, instead
+// of a series of binary decisions. Distribution is represented by cumulative
+// frequencies; |cumul[0]| is always 0 and |cumul[kSize]| is the total.
+// Total never exceeds kSymbolFreqLimit.
+class SymbolProb {
+ public:
+  static const size_t kSize = 64;
+
+  SymbolProb() {
+    for (size_t i = 0; i <= kSize; ++i) cumul_[i] = static_cast<uint16_t>(i);
+  }
+  ~SymbolProb() {}
+
+  // Initializes distribution with given (non-zero) frequencies.
+  void Init(const uint16_t* freq) {
+    cumul_[0] = 0;
+    for (size_t i = 0; i < kSize; ++i) {
+      BRUNSLI_DCHECK(freq[i] > 0);
+      cumul_[i + 1] = cumul_[i] + freq[i];
+    }
+    BRUNSLI_DCHECK(total() <= impl::kSymbolFreqLimit);
+  }
+
+  void Add(size_t val) {
+    BRUNSLI_DCHECK(val < kSize);
+    for (size_t i = val + 1; i <= kSize; ++i) {
+      cumul_[i] += impl::kSymbolFreqIncrement;
+    }
+    if (total() > impl::kSymbolFreqLimit) {
+      // Halve frequencies; every symbol keeps non-zero frequency.
+      uint16_t prev = 0;
+      for (size_t i = 1; i <= kSize; ++i) {
+        uint16_t freq = cumul_[i] - prev;
+        prev = cumul_[i];
+        cumul_[i] = cumul_[i - 1] + ((freq + 1) >> 1);
+      }
+    }
+  }
+
+  uint32_t total() const { return cumul_[kSize]; }
+  const uint16_t* cumul() const { return cumul_; }
+
+ private:
+  uint16_t cumul_[kSize + 1];
+};
+
 }  // namespace brunsli
 
 #endif  // BRUNSLI_COMMON_DISTRIBUTIONS_H_
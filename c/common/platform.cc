@@ -7,7 +7,15 @@
 #include "./platform.h"
 
 #include <cstdio>
-#include <cstdlib>  // for abort
+#include <cstdlib>  // for abort, getenv
+
+#if defined(BRUNSLI_X86_DISPATCH)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 
 namespace brunsli {
 
@@ -17,4 +25,150 @@ void BrunsliDumpAndAbort(const char* f, int l, const char* fn) {
   abort();
 }
 
+namespace {
+
+const char* const kCpuTargetNames[kNumCpuTargets] = {
+    "scalar", "sse2", "sse4.1", "avx2", "avx512", "neon"};
+
+// Target that is extended by the given one.
+const CpuTarget kCpuTargetBase[kNumCpuTargets] = {
+    CPU_TARGET_SCALAR, CPU_TARGET_SCALAR, CPU_TARGET_SSE2,
+    CPU_TARGET_SSE4_1, CPU_TARGET_AVX2,   CPU_TARGET_SCALAR};
+
+#if defined(BRUNSLI_X86_DISPATCH)
+
+// Returns EAX, EBX, ECX, EDX.
+void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* abcd) {
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuidex(regs, static_cast<int>(leaf), static_cast<int>(subleaf));
+  for (size_t i = 0; i < 4; ++i) abcd[i] = static_cast<uint32_t>(regs[i]);
+#else
+  uint32_t a, b, c, d;
+  __cpuid_count(leaf, subleaf, a, b, c, d);
+  abcd[0] = a;
+  abcd[1] = b;
+  abcd[2] = c;
+  abcd[3] = d;
+#endif
+}
+
+// Returns the set of register states the OS saves on context switch.
+uint64_t ReadXcr0() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  uint32_t lo, hi;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+
+uint32_t DetectCpuTargets() {
+  uint32_t targets = 1u << CPU_TARGET_SCALAR;
+#if !defined(_MSC_VER)
+  // Ancient 32-bit CPUs do not have CPUID at all.
+  if (__get_cpuid_max(0, nullptr) == 0) return targets;
+#endif
+  uint32_t abcd[4];
+  Cpuid(0, 0, abcd);
+  const uint32_t max_leaf = abcd[0];
+  if (max_leaf < 1) return targets;
+
+  Cpuid(1, 0, abcd);
+  const uint32_t ecx1 = abcd[2];
+  const uint32_t edx1 = abcd[3];
+  if (!(edx1 & (1u << 26))) return targets;
+  targets |= 1u << CPU_TARGET_SSE2;
+  if (!(ecx1 & (1u << 19))) return targets;
+  targets |= 1u << CPU_TARGET_SSE4_1;
+
+  // OSXSAVE + AVX, and OS saves XMM + YMM state.
+  const uint32_t kAvx = (1u << 27) | (1u << 28);
+  if ((ecx1 & kAvx) != kAvx || max_leaf < 7) return targets;
+  const uint64_t xcr0 = ReadXcr0();
+  if ((xcr0 & 0x6) != 0x6) return targets;
+  Cpuid(7, 0, abcd);
+  const uint32_t ebx7 = abcd[1];
+  if (!(ebx7 & (1u << 5))) return targets;
+  targets |= 1u << CPU_TARGET_AVX2;
+
+  // AVX512F + AVX512BW, and OS saves opmask + ZMM state.
+  const uint32_t kAvx512 = (1u << 16) | (1u << 30);
+  if ((ebx7 & kAvx512) != kAvx512 || (xcr0 & 0xE0) != 0xE0) return targets;
+  targets |= 1u << CPU_TARGET_AVX512;
+  return targets;
+}
+
+#else  // defined(BRUNSLI_X86_DISPATCH)
+
+uint32_t DetectCpuTargets() {
+  uint32_t targets = 1u << CPU_TARGET_SCALAR;
+#if defined(BRUNSLI_NEON_DISPATCH)
+  targets |= 1u << CPU_TARGET_NEON;
+#endif
+  return targets;
+}
+
+#endif  // defined(BRUNSLI_X86_DISPATCH)
+
+uint32_t TargetMask(CpuTarget target) {
+  uint32_t mask = 1u << CPU_TARGET_SCALAR;
+  for (CpuTarget t = target; t != CPU_TARGET_SCALAR; t = kCpuTargetBase[t]) {
+    mask |= 1u << t;
+  }
+  return mask;
+}
+
+uint32_t GetEnvironmentMask() {
+  const char* name = getenv("BRUNSLI_CPU_TARGET");
+  if (name == nullptr) return ~0u;
+  for (size_t i = 0; i < kNumCpuTargets; ++i) {
+    if (strcmp(name, kCpuTargetNames[i]) == 0) {
+      return TargetMask(static_cast<CpuTarget>(i));
+    }
+  }
+  return ~0u;
+}
+
+struct CpuTargetsState {
+  const uint32_t supported = DetectCpuTargets();
+  std::atomic<uint32_t> allowed{GetEnvironmentMask()};
+  std::atomic<uint32_t> generation{0};
+};
+
+CpuTargetsState& GetCpuTargetsState() {
+  static CpuTargetsState state;
+  return state;
+}
+
+}  // namespace
+
+const char* CpuTargetName(CpuTarget target) {
+  return (target < kNumCpuTargets) ? kCpuTargetNames[target] : "unknown";
+}
+
+uint32_t GetCpuTargets() {
+  CpuTargetsState& state = GetCpuTargetsState();
+  return state.supported & state.allowed.load(std::memory_order_relaxed);
+}
+
+bool ForceCpuTarget(CpuTarget target) {
+  BRUNSLI_DCHECK(target < kNumCpuTargets);
+  CpuTargetsState& state = GetCpuTargetsState();
+  state.allowed.store(TargetMask(target), std::memory_order_relaxed);
+  state.generation.fetch_add(1, std::memory_order_release);
+  return (state.supported >> target) & 1u;
+}
+
+void ResetCpuTarget() {
+  CpuTargetsState& state = GetCpuTargetsState();
+  state.allowed.store(~0u, std::memory_order_relaxed);
+  state.generation.fetch_add(1, std::memory_order_release);
+}
+
+uint32_t GetCpuTargetsGeneration() {
+  return GetCpuTargetsState().generation.load(std::memory_order_acquire);
+}
+
 }  // namespace brunsli
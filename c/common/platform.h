@@ -14,11 +14,15 @@
     * BRUNSLI_BUILD_LITTLE_ENDIAN forces to use little-endian optimizations
     * BRUNSLI_DEBUG enables "asserts" and extensive logging
     * BRUNSLI_DISABLE_LOG disables logging (useful for fuzzing)
+    * BRUNSLI_ENABLE_TRACE enables trace events, see <brunsli/trace.h>
+    * BRUNSLI_DISABLE_DISPATCH disables runtime CPU dispatch; only portable
+      kernels are used (useful for sanitizers)
 */
 
 #ifndef BRUNSLI_COMMON_PLATFORM_H_
 #define BRUNSLI_COMMON_PLATFORM_H_
 
+#include <atomic>
 #include <cstring>  /* memcpy */
 #include <iomanip>
 #include <ios>
@@ -220,6 +224,33 @@ OR:
 #define BRUNSLI_TARGET_X64
 #endif
 
+/* Kernels for x86 instruction set extensions are compiled with "target"
+   attribute, so that they could be used without raising the baseline
+   requirements of the binary. */
+#if !defined(BRUNSLI_DISABLE_DISPATCH) &&                          \
+    (defined(BRUNSLI_TARGET_X86) || defined(BRUNSLI_TARGET_X64)) && \
+    (BRUNSLI_GNUC_VERSION_CHECK(4, 9, 0) || defined(__clang__) ||   \
+     BRUNSLI_MSVC_VERSION_CHECK(19, 10, 0))
+#define BRUNSLI_X86_DISPATCH
+#if defined(_MSC_VER) && !defined(__clang__)
+#define BRUNSLI_ATTRIBUTE_TARGET(T)
+#else
+#define BRUNSLI_ATTRIBUTE_TARGET(T) __attribute__((target(T)))
+#endif
+#define BRUNSLI_X86_KERNEL(F) (F)
+#else
+#define BRUNSLI_X86_KERNEL(F) nullptr
+#endif
+
+/* NEON is part of the ARMv8 baseline; on ARMv7 it is used only if the binary
+   is compiled for it. */
+#if !defined(BRUNSLI_DISABLE_DISPATCH) && defined(BRUNSLI_TARGET_NEON)
+#define BRUNSLI_NEON_DISPATCH
+#define BRUNSLI_NEON_KERNEL(F) (F)
+#else
+#define BRUNSLI_NEON_KERNEL(F) nullptr
+#endif
+
 #if defined(__PPC64__)
 #define BRUNSLI_TARGET_POWERPC64
 #endif
@@ -475,6 +506,108 @@ inline int Log2FloorNonZero(uint32_t n) {
 
 #define BRUNSLI_UNUSED(X) (void)(X)
 
+namespace brunsli {
+
+/**
+ * Instruction set extensions kernels could be specialized for.
+ *
+ * Each target implies the ones it extends: AVX-512 (F + BW) > AVX2 > SSE4.1 >
+ * SSE2 > scalar; NEON > scalar.
+ */
+enum CpuTarget {
+  CPU_TARGET_SCALAR,
+  CPU_TARGET_SSE2,
+  CPU_TARGET_SSE4_1,
+  CPU_TARGET_AVX2,
+  CPU_TARGET_AVX512,
+  CPU_TARGET_NEON,
+  kNumCpuTargets
+};
+
+const char* CpuTargetName(CpuTarget target);
+
+/**
+ * Returns the bitmask of targets (1 << CpuTarget) that could be used.
+ *
+ * CPU is inspected once, on the first call. If BRUNSLI_CPU_TARGET environment
+ * variable is set to a target name (e.g. "sse2"), it is forced as if
+ * ForceCpuTarget was invoked.
+ */
+uint32_t GetCpuTargets();
+
+/**
+ * Restricts the set of used targets to |target| and the ones it extends.
+ *
+ * Meant for tests and benchmarks; should not be invoked concurrently with
+ * coding. Returns false if |target| is not supported by CPU; the restriction
+ * is applied anyway.
+ */
+bool ForceCpuTarget(CpuTarget target);
+
+/** Cancels the restriction set by ForceCpuTarget. */
+void ResetCpuTarget();
+
+/** Incremented by each ForceCpuTarget / ResetCpuTarget invocation. */
+uint32_t GetCpuTargetsGeneration();
+
+/**
+ * Table of implementations of a kernel; the best one is selected on the first
+ * use and reselected only if targets are forced.
+ *
+ * Typical use:
+ *
+ *   static CpuDispatch<Fn> dispatch(kImplementations);
+ *   dispatch.Get()(args);
+ *
+ * where kImplementations is indexed by CpuTarget; the scalar implementation
+ * is mandatory, others could be nullptr. Specialized implementations should
+ * be wrapped with BRUNSLI_X86_KERNEL / BRUNSLI_NEON_KERNEL and compiled only
+ * if BRUNSLI_X86_DISPATCH / BRUNSLI_NEON_DISPATCH is defined; x86 ones should
+ * be marked with BRUNSLI_ATTRIBUTE_TARGET.
+ */
+template <typename Fn>
+class CpuDispatch {
+ public:
+  explicit CpuDispatch(const Fn (&table)[kNumCpuTargets])
+      : selected_(nullptr), generation_(~0u) {
+    for (size_t i = 0; i < kNumCpuTargets; ++i) table_[i] = table[i];
+    BRUNSLI_DCHECK(table_[CPU_TARGET_SCALAR] != nullptr);
+  }
+
+  Fn Get() {
+    const uint32_t generation = GetCpuTargetsGeneration();
+    if (BRUNSLI_PREDICT_FALSE(generation !=
+                              generation_.load(std::memory_order_acquire))) {
+      selected_.store(Select(), std::memory_order_relaxed);
+      generation_.store(generation, std::memory_order_release);
+    }
+    return selected_.load(std::memory_order_relaxed);
+  }
+
+  /** Returns the target of implementation Get() returns. */
+  CpuTarget SelectTarget() const {
+    const uint32_t targets = GetCpuTargets();
+    for (size_t i = kNumCpuTargets - 1; i > CPU_TARGET_SCALAR; --i) {
+      if (((targets >> i) & 1u) && (table_[i] != nullptr)) {
+        return static_cast<CpuTarget>(i);
+      }
+    }
+    return CPU_TARGET_SCALAR;
+  }
+
+ private:
+  Fn Select() const { return table_[SelectTarget()]; }
+
+  Fn table_[kNumCpuTargets];
+  std::atomic<Fn> selected_;
+  std::atomic<uint32_t> generation_;
+
+  CpuDispatch(const CpuDispatch&) = delete;
+  CpuDispatch& operator=(const CpuDispatch&) = delete;
+};
+
+}  // namespace brunsli
+
 BRUNSLI_UNUSED_FUNCTION void BrunsliSuppressUnusedFunctions(void) {
   BRUNSLI_UNUSED(
       static_cast<void (*)(std::vector<uint8_t>*, const std::vector<uint8_t>&)>(
@@ -12,55 +12,108 @@
 
 namespace brunsli {
 
+// Scales |in| by |q| / 64.
+static BRUNSLI_INLINE uint8_t QuantMatrixEntry(uint8_t in, uint32_t q) {
+  const uint32_t v = (in * q + 32) >> 6;
+  // clamp to prevent illegal quantizer values
+  return (v < 1) ? 1 : (v > 255) ? 255u : v;
+}
+
 // TODO(eustas): consider high-precision (16-bit) tables in Brunsli v3.
 void FillQuantMatrix(bool is_chroma, uint32_t q,
                      uint8_t dst[kDCTBlockSize]) {
   BRUNSLI_DCHECK(q >= 0 && q < kQFactorLimit);
   const uint8_t* const in = kDefaultQuantMatrix[is_chroma];
   for (int i = 0; i < kDCTBlockSize; ++i) {
-    const uint32_t v = (in[i] * q + 32) >> 6;
-    // clamp to prevent illegal quantizer values
-    dst[i] = (v < 1) ? 1 : (v > 255) ? 255u : v;
+    dst[i] = QuantMatrixEntry(in[i], q);
   }
 }
 
+namespace {
+
+const size_t kMaxDiffCost = 33;
+const size_t kWorstLen = (kDCTBlockSize + 1) * (kMaxDiffCost + 1);
+
+// Number of zig-zag ordered coefficients used to estimate the q-factor.
+const int kNumEstimateSamples = 8;
+
+// Copycat encoder behavior; returns the cost (in bits) of encoding |src|
+// as a difference to the matrix produced by FillQuantMatrix for |q|. Stops as
+// soon as the cost exceeds |limit|; in that case returned value is only
+// guaranteed to be greater than |limit|. Matrix entries are computed on the
+// fly, so rejected candidates cost just a few coefficients.
+size_t QuantMatrixCost(const int* src, bool is_chroma, uint32_t q,
+                       size_t limit) {
+  const uint8_t* const in = kDefaultQuantMatrix[is_chroma];
+  int last_diff = 0;  // difference predictor
+  size_t len = 0;
+  for (int k = 0; k < kDCTBlockSize; ++k) {
+    const int j = kJPEGNaturalOrder[k];
+    const int new_diff = src[j] - QuantMatrixEntry(in[j], q);
+    int diff = new_diff - last_diff;
+    last_diff = new_diff;
+    if (diff != 0) {
+      len += 1;
+      if (diff < 0) diff = -diff;
+      diff -= 1;
+      if (diff == 0) {
+        len++;
+      } else if (diff > 65535) {
+        return kWorstLen;
+      } else {
+        uint32_t diff_len = Log2FloorNonZero(diff) + 1;
+        if (diff_len == 16) diff_len--;
+        len += 2 * diff_len + 1;
+      }
+      if (len > limit) return len;
+    }
+  }
+  return len;
+}
+
+// Inverts FillQuantMatrix using a few low-frequency coefficients.
+uint32_t EstimateQFactor(const int* src, bool is_chroma) {
+  const uint8_t* const in = kDefaultQuantMatrix[is_chroma];
+  int64_t num = 0;
+  int64_t den = 0;
+  for (int k = 0; k < kNumEstimateSamples; ++k) {
+    const int j = kJPEGNaturalOrder[k];
+    num += static_cast<int64_t>(src[j]) * 64;
+    den += in[j];
+  }
+  if (num <= 0) return 0;
+  const int64_t q = (num + den / 2) / den;
+  return static_cast<uint32_t>(
+      q >= static_cast<int64_t>(kQFactorLimit) ? kQFactorLimit - 1 : q);
+}
+
+}  // namespace
+
 // TODO(eustas): consider high-precision (16-bit) tables in Brunsli v3.
 uint32_t FindBestMatrix(const int* src, bool is_chroma,
                         uint8_t dst[kDCTBlockSize]) {
-  uint32_t best_q = 0;
-  const size_t kMaxDiffCost = 33;
-  const size_t kWorstLen = (kDCTBlockSize + 1) * (kMaxDiffCost + 1);
-  size_t best_len = kWorstLen;
-  for (uint32_t q = 0; q < kQFactorLimit; ++q) {
-    FillQuantMatrix(is_chroma, q, dst);
-    // Copycat encoder behavior.
-    int last_diff = 0;  // difference predictor
-    size_t len = 0;
-    for (int k = 0; k < kDCTBlockSize; ++k) {
-      const int j = kJPEGNaturalOrder[k];
-      const int new_diff = src[j] - dst[j];
-      int diff = new_diff - last_diff;
-      last_diff = new_diff;
-      if (diff != 0) {
-        len += 1;
-        if (diff < 0) diff = -diff;
-        diff -= 1;
-        if (diff == 0) {
-          len++;
-        } else if (diff > 65535) {
-          len = kWorstLen;
-          break;
-        } else {
-          uint32_t diff_len = Log2FloorNonZero(diff) + 1;
-          if (diff_len == 16) diff_len--;
-          len += 2 * diff_len + 1;
-        }
+  // Candidates are visited starting from the estimated q-factor and moving
+  // away from it. Once a good candidate is found, cost evaluation for the
+  // others terminates early, usually after a few coefficients; only the
+  // winner is written to |dst|. The result is the same as for exhaustive
+  // search: the smallest q with the lowest cost.
+  const uint32_t estimate = EstimateQFactor(src, is_chroma);
+  uint32_t best_q = estimate;
+  size_t best_len = QuantMatrixCost(src, is_chroma, estimate, kWorstLen);
+  for (uint32_t d = 1; d < kQFactorLimit; ++d) {
+    const uint32_t candidates[2] = {estimate - d, estimate + d};
+    for (uint32_t q : candidates) {
+      // Unsigned wrap-around of "estimate - d" is handled here as well.
+      if (q >= kQFactorLimit) continue;
+      // Ties are resolved in favor of the smaller q.
+      if (q > best_q && best_len == 0) continue;
+      const size_t limit = (q < best_q) ? best_len : best_len - 1;
+      const size_t len = QuantMatrixCost(src, is_chroma, q, limit);
+      if (len <= limit) {
+        best_len = len;
+        best_q = q;
       }
     }
-    if (len < best_len) {
-      best_len = len;
-      best_q = q;
-    }
   }
   FillQuantMatrix(is_chroma, best_q, dst);
   return best_q;
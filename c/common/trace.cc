@@ -0,0 +1,99 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "./trace.h"
+
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdio>
+#include <map>
+#include <mutex>  // NOLINT(build/c++11)
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+namespace {
+
+struct TraceEvent {
+  const char* name;
+  char phase;
+  uint32_t tid;
+  // Microseconds since the start of recording.
+  double ts;
+};
+
+struct Tracer {
+  std::atomic<bool> enabled{false};
+  std::mutex mutex;
+  std::chrono::steady_clock::time_point start;
+  std::vector<TraceEvent> events;
+  // Small sequential numbers are easier to read than native thread IDs.
+  std::map<std::thread::id, uint32_t> thread_ids;
+};
+
+// Never destroyed, so that events could be safely added from threads that
+// outlive static destructors.
+Tracer* GetTracer() {
+  static Tracer* tracer = new Tracer();
+  return tracer;
+}
+
+}  // namespace
+
+void BrunsliStartTrace() {
+  Tracer* tracer = GetTracer();
+  std::lock_guard<std::mutex> lock(tracer->mutex);
+  tracer->events.clear();
+  tracer->thread_ids.clear();
+  tracer->start = std::chrono::steady_clock::now();
+  tracer->enabled.store(true);
+}
+
+bool BrunsliStopTrace(const char* path) {
+  Tracer* tracer = GetTracer();
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(tracer->mutex);
+    tracer->enabled.store(false);
+    events.swap(tracer->events);
+  }
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) return false;
+  bool ok = fprintf(file, "{\"traceEvents\":[") >= 0;
+  for (size_t i = 0; ok && i < events.size(); ++i) {
+    const TraceEvent& e = events[i];
+    ok = fprintf(file,
+                 "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,"
+                 "\"ts\":%.3f}",
+                 (i > 0) ? "," : "", e.name, e.phase, e.tid, e.ts) >= 0;
+  }
+  ok = ok && fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n") >= 0;
+  ok = (fclose(file) == 0) && ok;
+  return ok;
+}
+
+namespace internal {
+
+void AddTraceEvent(const char* name, char phase) {
+  Tracer* tracer = GetTracer();
+  if (!tracer->enabled.load(std::memory_order_relaxed)) return;
+  const auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(tracer->mutex);
+  if (!tracer->enabled.load()) return;
+  const auto inserted = tracer->thread_ids.emplace(
+      std::this_thread::get_id(),
+      static_cast<uint32_t>(tracer->thread_ids.size() + 1));
+  const double ts =
+      std::chrono::duration<double, std::micro>(now - tracer->start).count();
+  tracer->events.push_back({name, phase, inserted.first->second, ts});
+}
+
+}  // namespace internal
+
+}  // namespace brunsli
@@ -0,0 +1,53 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* Trace event instrumentation; see <brunsli/trace.h>.
+
+   BRUNSLI_TRACE_SCOPE("Name") records "begin" event at the point of
+   declaration and "end" event at the end of enclosing scope, both tagged with
+   the current thread ID. Name should be a string literal. Unless
+   BRUNSLI_ENABLE_TRACE is defined, the macro expands to nothing. */
+
+#ifndef BRUNSLI_COMMON_TRACE_H_
+#define BRUNSLI_COMMON_TRACE_H_
+
+#include <brunsli/trace.h>
+
+namespace brunsli {
+namespace internal {
+
+// Does nothing, unless trace recording is started. |phase| is 'B' (begin) or
+// 'E' (end).
+void AddTraceEvent(const char* name, char phase);
+
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name) : name_(name) {
+    AddTraceEvent(name_, 'B');
+  }
+  ~TraceScope() { AddTraceEvent(name_, 'E'); }
+
+ private:
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+  const char* name_;
+};
+
+}  // namespace internal
+}  // namespace brunsli
+
+#if defined(BRUNSLI_ENABLE_TRACE)
+#define BRUNSLI_TRACE_CONCAT_(A, B) A##B
+#define BRUNSLI_TRACE_CONCAT(A, B) BRUNSLI_TRACE_CONCAT_(A, B)
+#define BRUNSLI_TRACE_SCOPE(NAME)                   \
+  ::brunsli::internal::TraceScope BRUNSLI_TRACE_CONCAT( \
+      brunsli_trace_scope_, __LINE__)(NAME)
+#else
+#define BRUNSLI_TRACE_SCOPE(NAME)
+#endif
+
+#endif  // BRUNSLI_COMMON_TRACE_H_
@@ -49,6 +49,43 @@ class BinaryArithmeticDecoder {
     return bit;
   }
 
+  // Returns the next value in the range 0..63 decoded from the bit stream,
+  // based on the given distribution. This distribution must be the same as
+  // the one used by the encoder.
+  size_t ReadSymbol(const SymbolProb& p, WordSource* in) {
+    const uint32_t diff = high_ - low_;
+    const uint32_t total = p.total();
+    if (BRUNSLI_PREDICT_FALSE(diff < total)) {
+      // Range is too narrow to fit all the symbols; use equiprobable bits.
+      size_t val = 0;
+      for (size_t mask = SymbolProb::kSize >> 1; mask != 0; mask >>= 1) {
+        val = (val << 1) | ReadBit(128, in);
+      }
+      return val;
+    }
+    const uint32_t range = diff / total;
+    const uint16_t* cumul = p.cumul();
+    const uint32_t offset = value_ - low_;
+    // Find the last symbol, such that range * cumul[val] < offset.
+    size_t val = 0;
+    if (offset > 0) {
+      const uint32_t target = (offset - 1) / range;
+      for (size_t step = SymbolProb::kSize / 2; step > 0; step >>= 1) {
+        if (cumul[val + step] <= target) val += step;
+      }
+    }
+    const uint32_t low = low_;
+    if (val + 1 < SymbolProb::kSize) high_ = low + range * cumul[val + 1];
+    if (val > 0) low_ = low + range * cumul[val] + 1;
+    if (((low_ ^ high_) >> 16u) == 0) {
+      value_ = (value_ << 16u) | in->GetNextWord();
+      low_ <<= 16u;
+      high_ <<= 16u;
+      high_ |= 0xFFFFu;
+    }
+    return val;
+  }
+
  private:
   uint32_t low_;
   uint32_t high_;
@@ -18,7 +18,8 @@ struct BrunsliBitReader {
   const uint8_t* next_;
   const uint8_t* end_;
   uint32_t num_bits_;
-  uint32_t bits_;
+  // 64-bit window allows refilling from the buffered input in one go.
+  uint64_t bits_;
   /*
      Number of "virtual" zero bytes located after the end of buffer being
      put into the bit buffer.
@@ -82,7 +83,7 @@ static BRUNSLI_INLINE void BrunsliBitReaderMaybeFetchByte(BrunsliBitReader* br,
     if (BRUNSLI_PREDICT_FALSE(br->next_ >= br->end_)) {
       BrunsliBitReaderOweByte(br);
     } else {
-      br->bits_ |= static_cast<uint32_t>(*br->next_) << br->num_bits_;
+      br->bits_ |= static_cast<uint64_t>(*br->next_) << br->num_bits_;
       br->num_bits_ += 8;
       br->next_++;
     }
@@ -105,15 +106,32 @@ void BrunsliBitReaderSetOptimistic(BrunsliBitReader* br);
  */
 bool BrunsliBitReaderCanRead(BrunsliBitReader* br, size_t n_bits);
 
-static BRUNSLI_INLINE uint32_t BrunsliBitReaderGet(BrunsliBitReader* br,
-                                                   uint32_t n_bits) {
-  BRUNSLI_DCHECK(n_bits <= 24);
+/* Internal. */
+static BRUNSLI_INLINE void BrunsliBitReaderFill(BrunsliBitReader* br,
+                                                uint32_t n_bits) {
+  if (BRUNSLI_PREDICT_TRUE(br->end_ - br->next_ >= 8)) {
+    // Fast path: take as many whole bytes as fit into the window.
+    const uint32_t num_bytes = (63 - br->num_bits_) >> 3;
+    const uint64_t bytes = BRUNSLI_UNALIGNED_LOAD64LE(br->next_) &
+                           ((uint64_t{1} << (num_bytes * 8)) - 1);
+    br->bits_ |= bytes << br->num_bits_;
+    br->num_bits_ += num_bytes * 8;
+    br->next_ += num_bytes;
+    return;
+  }
+  // Slow path: near the end of input, or when input is exhausted.
   BrunsliBitReaderMaybeFetchByte(br, n_bits);
   if (n_bits > 8) {
     BrunsliBitReaderMaybeFetchByte(br, n_bits);
     if (n_bits > 16) BrunsliBitReaderMaybeFetchByte(br, n_bits);
   }
-  return br->bits_ & BrunsliBitReaderBitMask(n_bits);
+}
+
+static BRUNSLI_INLINE uint32_t BrunsliBitReaderGet(BrunsliBitReader* br,
+                                                   uint32_t n_bits) {
+  BRUNSLI_DCHECK(n_bits <= 24);
+  if (br->num_bits_ < n_bits) BrunsliBitReaderFill(br, n_bits);
+  return static_cast<uint32_t>(br->bits_) & BrunsliBitReaderBitMask(n_bits);
 }
 
 static BRUNSLI_INLINE void BrunsliBitReaderDrop(BrunsliBitReader* br,
@@ -14,6 +14,7 @@
 #include <vector>
 
 #include <brotli/decode.h>
+#include "../common/base128.h"
 #include "../common/constants.h"
 #include "../common/context.h"
 #include <brunsli/jpeg_data.h>
@@ -21,6 +22,7 @@
 #include "../common/platform.h"
 #include "../common/predict.h"
 #include "../common/quant_matrix.h"
+#include "../common/trace.h"
 #include <brunsli/status.h>
 #include <brunsli/types.h>
 #include "./ans_decode.h"
@@ -69,7 +71,9 @@ static const uint32_t kKnownSectionTags =
 
 static const uint32_t kKnownHeaderVarintTags =
     (1u << kBrunsliHeaderWidthTag) | (1u << kBrunsliHeaderHeightTag) |
-    (1u << kBrunsliHeaderVersionCompTag) | (1u << kBrunsliHeaderSubsamplingTag);
+    (1u << kBrunsliHeaderVersionCompTag) |
+    (1u << kBrunsliHeaderSubsamplingTag) |
+    (1u << kBrunsliHeaderACSegmentRowsTag);
 
 bool IsBrunsli(const uint8_t* data, const size_t len) {
   static const uint8_t kSignature[6] = {
@@ -266,7 +270,10 @@ bool ProcessMetaData(const uint8_t* data, size_t len, MetadataState* state,
           return false;
         }
         dest->emplace_back(head, head + 3);
-        state->multibyte_sink = &dest->back();
+        // Payload arrives in pieces of transient Brotli output; reserve the
+        // whole segment upfront, so that it is copied exactly once.
+        state->multibyte_sink = dest->back().mutable_bytes();
+        state->multibyte_sink->reserve(3 + state->remaining_multibyte_length);
         // Turn state machine to default state in case there is no payload in
         // multibyte sequence. This is important when such a sequence concludes
         // the input.
@@ -576,6 +583,7 @@ static bool BRUNSLI_NOINLINE DecodeCoeffOrder(uint32_t* order, BitSource* br,
 }
 
 /** Reads 0..6 words from |in| and returns the value in the range 0..63. */
+template <typename Adaptation>
 static size_t DecodeNumNonzeros(Prob* p, BinaryArithmeticDecoder* ac,
                                 WordSource* in) {
   // To simplity BST navigation, we use 1-based indexing.
@@ -584,7 +592,7 @@ static size_t DecodeNumNonzeros(Prob* p, BinaryArithmeticDecoder* ac,
 
   for (size_t b = 0; b < kNumNonZeroBits; ++b) {
     const int bit = ac->ReadBit(bst[ctx].get_proba(), in);
-    bst[ctx].Add(bit);
+    Adaptation::Update(&bst[ctx], bit);
     ctx = 2 * ctx + bit;
   }
 
@@ -612,7 +620,8 @@ bool FinalizeSubdecoders(State* state) {
   return true;
 }
 
-BrunsliStatus DecodeDC(State* state, WordSource* in) {
+template <typename Adaptation>
+static BrunsliStatus DecodeDCImpl(State* state, WordSource* in) {
   const std::vector<ComponentMeta>& meta = state->meta;
   const size_t num_components = meta.size();
   const int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
@@ -624,6 +633,7 @@ BrunsliStatus DecodeDC(State* state, WordSource* in) {
     comps.resize(num_components);
     for (size_t c = 0; c < num_components; ++c) {
       comps[c].SetWidth(meta[c].width_in_blocks);
+      if (state->use_decay_prob) comps[c].InitDecay();
     }
   }
 
@@ -673,7 +683,7 @@ BrunsliStatus DecodeDC(State* state, WordSource* in) {
           Prob* BRUNSLI_RESTRICT is_empty_p =
               &c->is_empty_block_prob[is_empty_ctx];
           const bool is_empty_block = !ac.ReadBit(is_empty_p->get_proba(), in);
-          is_empty_p->Add(!is_empty_block);
+          Adaptation::Update(is_empty_p, !is_empty_block);
           c->prev_is_nonempty[x + 1] = !is_empty_block;
           *block_state = is_empty_block;
           int abs_val = 0;
@@ -681,13 +691,13 @@ BrunsliStatus DecodeDC(State* state, WordSource* in) {
           if (!is_empty_block) {
             Prob* BRUNSLI_RESTRICT p_is_zero = &c->is_zero_prob;
             int is_zero = ac.ReadBit(p_is_zero->get_proba(), in);
-            p_is_zero->Add(is_zero);
+            Adaptation::Update(p_is_zero, is_zero);
             if (!is_zero) {
               const int avg_ctx = WeightedAverageContextDC(prev_abs, x);
               const int sign_ctx = prev_sgn[x] * 3 + prev_sgn[x - 1];
               Prob* BRUNSLI_RESTRICT sign_p = &c->sign_prob[sign_ctx];
               sign = ac.ReadBit(sign_p->get_proba(), in);
-              sign_p->Add(sign);
+              Adaptation::Update(sign_p, sign);
               const int entropy_ix = context_map[avg_ctx];
               int code = ans.ReadSymbol(state->entropy_codes[entropy_ix], in);
               if (code < kNumDirectCodes) {
@@ -698,7 +708,7 @@ BrunsliStatus DecodeDC(State* state, WordSource* in) {
                     &c->first_extra_bit_prob[nbits];
                 int first_extra_bit =
                     ac.ReadBit(p_first_extra_bit->get_proba(), in);
-                p_first_extra_bit->Add(first_extra_bit);
+                Adaptation::Update(p_first_extra_bit, first_extra_bit);
                 int extra_bits_val = first_extra_bit << nbits;
                 if (nbits > 0) {
                   extra_bits_val |= static_cast<int>(br.ReadBits(nbits, in));
@@ -738,6 +748,11 @@ BrunsliStatus DecodeDC(State* state, WordSource* in) {
   return BRUNSLI_OK;
 }
 
+BrunsliStatus DecodeDC(State* state, WordSource* in) {
+  return state->use_decay_prob ? DecodeDCImpl<DecayAdaptation>(state, in)
+                               : DecodeDCImpl<CountingAdaptation>(state, in);
+}
+
 static void BRUNSLI_NOINLINE DecodeEmptyAcBlock(
     int* BRUNSLI_RESTRICT prev_sgn, int* BRUNSLI_RESTRICT prev_abs) {
   for (int k = 1; k < kDCTBlockSize; ++k) {
@@ -754,6 +769,8 @@ struct AcBlockCookie {
   int* BRUNSLI_RESTRICT prev_sgn;
   int* BRUNSLI_RESTRICT prev_abs;
   Prob* BRUNSLI_RESTRICT num_nonzero_prob;
+  // nullptr, unless kSymbolNumNonzerosVersion is used.
+  SymbolProb* BRUNSLI_RESTRICT num_nonzero_symbol_prob;
 
   BinaryArithmeticDecoder* BRUNSLI_RESTRICT ac;
   WordSource* BRUNSLI_RESTRICT in;
@@ -776,6 +793,7 @@ struct AcBlockCookie {
   Prob* BRUNSLI_RESTRICT first_extra_bit_prob;
 };
 
+template <typename Adaptation>
 static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
   AcBlockCookie c = cookie;
 
@@ -787,8 +805,15 @@ static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
   size_t num_nonzeros = 0;
 
   const uint8_t nonzero_ctx = NumNonzerosContext(c.prev_num_nonzeros, c.x, c.y);
-  size_t last_nz = DecodeNumNonzeros(
-      c.num_nonzero_prob + kNumNonZeroTreeSize * nonzero_ctx, &ac, in);
+  size_t last_nz;
+  if (c.num_nonzero_symbol_prob) {
+    SymbolProb& p = c.num_nonzero_symbol_prob[nonzero_ctx];
+    last_nz = ac.ReadSymbol(p, in);
+    p.Add(last_nz);
+  } else {
+    last_nz = DecodeNumNonzeros<Adaptation>(
+        c.num_nonzero_prob + kNumNonZeroTreeSize * nonzero_ctx, &ac, in);
+  }
   for (size_t k = last_nz + 1; k < kDCTBlockSize; ++k) {
     c.prev_sgn[k] = 0;
     c.prev_abs[k] = 0;
@@ -800,7 +825,7 @@ static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
       size_t is_zero_ctx = bucket * kDCTBlockSize + k;
       Prob& p = c.is_zero_prob[is_zero_ctx];
       is_zero = ac.ReadBit(p.get_proba(), in);
-      p.Add(is_zero);
+      Adaptation::Update(&p, is_zero);
     }
     int abs_val = 0;
     int sign = 1;
@@ -825,7 +850,7 @@ static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
       sign_ctx = sign_ctx * kDCTBlockSize + k;
       Prob& sign_p = c.sign_prob[sign_ctx];
       sign = ac.ReadBit(sign_p.get_proba(), in);
-      sign_p.Add(sign);
+      Adaptation::Update(&sign_p, sign);
       c.prev_sgn[k] = sign + 1;
       sign = 1 - 2 * sign;
       const size_t z_dens_ctx =
@@ -839,7 +864,7 @@ static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
         int nbits = code - kNumDirectCodes;
         Prob& p = c.first_extra_bit_prob[k * 10 + nbits];
         int first_extra_bit = ac.ReadBit(p.get_proba(), in);
-        p.Add(first_extra_bit);
+        Adaptation::Update(&p, first_extra_bit);
         int extra_bits_val = first_extra_bit << nbits;
         if (nbits > 0) {
           extra_bits_val |= br.ReadBits(nbits, in);
@@ -865,15 +890,25 @@ static size_t BRUNSLI_NOINLINE DecodeAcBlock(const AcBlockCookie& cookie) {
 BrunsliStatus DecodeAC(State* state, WordSource* in) {
   const std::vector<ComponentMeta>& meta = state->meta;
   const size_t num_components = meta.size();
-  const int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
   InternalState& s = *state->internal;
   AcDcState& ac_dc_state = s.ac_dc;
+  // In segmented mode only the current segment is decoded; for the context
+  // model it looks like a separate image.
+  int segment_mcu_y = 0;
+  int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
+  const int segment_mcu_rows = state->ac_segment_mcu_rows;
+  if (segment_mcu_rows != 0) {
+    segment_mcu_y =
+        ac_dc_state.next_mcu_y - ac_dc_state.next_mcu_y % segment_mcu_rows;
+    mcu_rows = std::min(mcu_rows, segment_mcu_y + segment_mcu_rows);
+  }
 
   std::vector<ComponentState>& comps = ac_dc_state.ac;
   if (comps.empty()) {
     comps.resize(num_components);
     for (size_t c = 0; c < num_components; ++c) {
       comps[c].SetWidth(meta[c].width_in_blocks);
+      if (state->use_decay_prob) comps[c].InitDecay();
       ComputeACPredictMultipliers(&meta[c].quant[0], comps[c].mult_row,
                                   comps[c].mult_col);
     }
@@ -903,12 +938,17 @@ BrunsliStatus DecodeAC(State* state, WordSource* in) {
   c.entropy_codes = state->entropy_codes;
   c.context_modes =
       kContextAlgorithm + (state->use_legacy_context_model ? 64 : 0);
+  size_t (*decode_ac_block)(const AcBlockCookie&) =
+      state->use_decay_prob ? DecodeAcBlock<DecayAdaptation>
+                            : DecodeAcBlock<CountingAdaptation>;
 
   for (int mcu_y = ac_dc_state.next_mcu_y; mcu_y < mcu_rows; ++mcu_y) {
     for (size_t i = ac_dc_state.next_component; i < num_components; ++i) {
       ComponentState& cst = comps[i];
       c.prev_num_nonzeros = cst.prev_num_nonzeros.data();
       c.num_nonzero_prob = cst.num_nonzero_prob;
+      c.num_nonzero_symbol_prob =
+          state->use_symbol_num_nonzeros ? cst.num_nonzero_symbol_prob : nullptr;
       c.is_zero_prob = cst.is_zero_prob.data();
       c.order = cst.order;
       c.mult_col = cst.mult_col;
@@ -922,15 +962,17 @@ BrunsliStatus DecodeAC(State* state, WordSource* in) {
       const size_t ac_stride = m.ac_stride;
       const size_t b_stride = m.b_stride;
       const int next_iy = ac_dc_state.next_iy;
-      c.y = mcu_y * m.v_samp + next_iy;
+      const int segment_y = segment_mcu_y * m.v_samp;
+      c.y = (mcu_y - segment_mcu_y) * m.v_samp + next_iy;
       c.prev_row_delta = (1 - 2 * (c.y & 1u)) * (width + 3) * kDCTBlockSize;
       for (int iy = next_iy; iy < m.v_samp; ++iy, ++c.y) {
         const int next_x = ac_dc_state.next_x;
         const size_t block_offset = next_x * kDCTBlockSize;
-        c.coeffs = m.ac_coeffs + c.y * ac_stride + block_offset;
+        const int abs_y = segment_y + c.y;
+        c.coeffs = m.ac_coeffs + abs_y * ac_stride + block_offset;
         c.prev_row_coeffs = c.coeffs - ac_stride;
         c.prev_col_coeffs = c.coeffs - kDCTBlockSize;
-        const uint8_t* block_state = m.block_state + c.y * b_stride + next_x;
+        const uint8_t* block_state = m.block_state + abs_y * b_stride + next_x;
         c.prev_sgn = &cst.prev_sign[kDCTBlockSize] + block_offset;
         c.prev_abs = &cst.prev_abs_coeff[((c.y & 1u) * (width + 3) + 2) *
                                          kDCTBlockSize] +
@@ -945,7 +987,7 @@ BrunsliStatus DecodeAC(State* state, WordSource* in) {
               ac_dc_state.next_x = c.x;
               return BRUNSLI_NOT_ENOUGH_DATA;
             }
-            size_t num_nonzeros = DecodeAcBlock(c);
+            size_t num_nonzeros = decode_ac_block(c);
             BRUNSLI_DCHECK(num_nonzeros <= kNumNonZeroTreeSize);
             c.prev_num_nonzeros[c.x] = static_cast<uint8_t>(num_nonzeros);
           } else {
@@ -965,7 +1007,9 @@ BrunsliStatus DecodeAC(State* state, WordSource* in) {
     }
     ac_dc_state.next_component = 0;
   }
-  ac_dc_state.next_mcu_y = 0;
+  // In segmented mode |next_mcu_y| points to the next segment start.
+  ac_dc_state.next_mcu_y = (segment_mcu_rows != 0) ? mcu_rows : 0;
+  ac_dc_state.ac_coeffs_order_decoded = false;
 
   comps.clear();
   comps.shrink_to_fit();
@@ -991,11 +1035,6 @@ static uint8_t ReadByte(State* state) {
   return state->data[state->pos++];
 }
 
-static uint8_t PeekByte(State* state, size_t offset) {
-  // TODO(eustas): dcheck overflow.
-  return state->data[state->pos + offset];
-}
-
 static void SkipBytes(State* state, size_t len) {
   // TODO(eustas): dcheck overflow.
   state->pos += len;
@@ -1014,21 +1053,7 @@ static size_t SkipAvailableBytes(State* state, size_t len) {
 }
 
 static BrunsliStatus DecodeBase128(State* state, size_t* val) {
-  *val = 0;
-  uint64_t b = 0x80;
-  uint64_t v = 0;
-  size_t i = 0;
-  while ((i < 9) && (b & 0x80u)) {
-    if (!CheckCanRead(state, i + 1)) return BRUNSLI_NOT_ENOUGH_DATA;
-    b = PeekByte(state, i);
-    v |= (b & 0x7Fu) << (i * 7);
-    ++i;
-  }
-  SkipBytes(state, i);
-  *val = v;
-  bool terminated = ((b & 0x80u) == 0);
-  bool fit = (v == *val);
-  return (terminated && fit) ? BRUNSLI_OK : BRUNSLI_INVALID_BRN;
+  return ::brunsli::DecodeBase128(state->data, state->len, &state->pos, val);
 }
 
 static Stage Fail(State* state, BrunsliStatus result) {
@@ -1039,6 +1064,16 @@ static Stage Fail(State* state, BrunsliStatus result) {
   return Stage::ERROR;
 }
 
+// In segmented mode the AC data section is repeated once per segment.
+// Skipped segments are not tracked.
+static bool HasPendingACSegments(State* state) {
+  if (state->ac_segment_mcu_rows == 0) return false;
+  if (state->skip_tags & (1u << kBrunsliACDataTag)) return false;
+  if (!HasSection(state, kBrunsliACDataTag)) return false;
+  const ComponentMeta& m = state->meta[0];
+  return state->internal->ac_dc.next_mcu_y < m.height_in_blocks / m.v_samp;
+}
+
 static BrunsliStatus ReadTag(State* state, SectionState* section) {
   if (!CheckCanReadByte(state)) return BRUNSLI_NOT_ENOUGH_DATA;
   const uint8_t marker = ReadByte(state);
@@ -1055,7 +1090,12 @@ static BrunsliStatus ReadTag(State* state, SectionState* section) {
   section->is_section = (wiring_type == kBrunsliWiringTypeLengthDelimited);
 
   const uint32_t tag_bit = 1u << tag;
-  if (section->tags_met & tag_bit) {
+  const bool is_skipped_ac_segment =
+      (state->ac_segment_mcu_rows != 0) && (state->skip_tags & tag_bit);
+  const bool is_next_ac_segment =
+      (section == &state->internal->section) && (tag == kBrunsliACDataTag) &&
+      (HasPendingACSegments(state) || is_skipped_ac_segment);
+  if ((section->tags_met & tag_bit) && !is_next_ac_segment) {
     BRUNSLI_LOG_ERROR() << "Duplicate marker " << std::hex
                         << static_cast<int>(marker) << BRUNSLI_ENDL();
     return BRUNSLI_INVALID_BRN;
@@ -1204,13 +1244,30 @@ Stage DecodeHeader(State* state, JPEGData* jpg) {
         if ((version & 1u) != 0) {
           return Fail(state, BRUNSLI_INVALID_BRN);
         }
-        // Unknown mode - only 3 bits are defined.
-        if ((version & ~0x7u) != 0) {
+        // Unknown mode.
+        if ((version & ~static_cast<size_t>(kVersionMask)) != 0) {
           return Fail(state, BRUNSLI_INVALID_BRN);
         }
 
         // Otherwise regular brunsli.
         state->use_legacy_context_model = !(version & 2);
+        state->use_symbol_num_nonzeros =
+            (version & kSymbolNumNonzerosVersion) != 0;
+        state->use_decay_prob = (version & kDecayProbVersion) != 0;
+
+        const bool has_segment_rows =
+            hs.section.tags_met & (1u << kBrunsliHeaderACSegmentRowsTag);
+        if (has_segment_rows != ((version & kACSegmentsVersion) != 0)) {
+          return Fail(state, BRUNSLI_INVALID_BRN);
+        }
+        if (has_segment_rows) {
+          const size_t segment_rows =
+              hs.varint_values[kBrunsliHeaderACSegmentRowsTag];
+          if (segment_rows == 0 || segment_rows > kMaxDimPixels) {
+            return Fail(state, BRUNSLI_INVALID_BRN);
+          }
+          state->ac_segment_mcu_rows = static_cast<int>(segment_rows);
+        }
 
         // Do not allow "original_jpg" for regular Brunsli files.
         s.section.tags_met |= 1u << kBrunsliOriginalJpgTag;
@@ -1272,6 +1329,7 @@ Stage DecodeHeader(State* state, JPEGData* jpg) {
 }
 
 static BrunsliStatus DecodeMetaDataSection(State* state, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("DecodeMetaDataSection");
   InternalState& s = *state->internal;
   MetadataState& ms = s.metadata;
 
@@ -1325,8 +1383,13 @@ static BrunsliStatus DecodeMetaDataSection(State* state, JPEGData* jpg) {
       size_t available_in = available_bytes;
       const uint8_t* next_in = state->data + state->pos;
       size_t available_out = 0;
-      BrotliDecoderResult result = BrotliDecoderDecompressStream(
-          ms.brotli, &available_in, &next_in, &available_out, nullptr, nullptr);
+      BrotliDecoderResult result;
+      {
+        BRUNSLI_TRACE_SCOPE("BrotliDecoderDecompressStream");
+        result = BrotliDecoderDecompressStream(ms.brotli, &available_in,
+                                               &next_in, &available_out,
+                                               nullptr, nullptr);
+      }
       if (result == BROTLI_DECODER_RESULT_ERROR) {
         return finish_decompression(BRUNSLI_INVALID_BRN);
       }
@@ -1406,6 +1469,7 @@ static BrunsliStatus SuspendBitReader(BrunsliBitReader* br, State* state,
 }
 
 static BrunsliStatus DecodeJPEGInternalsSection(State* state, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("DecodeJPEGInternalsSection");
   InternalState& s = *state->internal;
   JpegInternalsState& js = s.internals;
   BrunsliBitReader* br = &js.br;
@@ -1633,6 +1697,7 @@ static BrunsliStatus DecodeJPEGInternalsSection(State* state, JPEGData* jpg) {
 }
 
 static BrunsliStatus DecodeQuantDataSection(State* state, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("DecodeQuantDataSection");
   InternalState& s = *state->internal;
   QuantDataState& qs = s.quant;
   BrunsliBitReader* br = &qs.br;
@@ -1796,6 +1861,7 @@ static BrunsliStatus DecodeQuantDataSection(State* state, JPEGData* jpg) {
 }
 
 static BrunsliStatus DecodeHistogramDataSection(State* state, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("DecodeHistogramDataSection");
   InternalState& s = *state->internal;
   HistogramDataState& hs = s.histogram;
   BrunsliBitReader* br = &hs.br;
@@ -1930,6 +1996,7 @@ static BrunsliStatus DecodeHistogramDataSection(State* state, JPEGData* jpg) {
 }
 
 static BrunsliStatus DecodeDCDataSection(State* state) {
+  BRUNSLI_TRACE_SCOPE("DecodeDCDataSection");
   size_t available = GetBytesAvailable(state) & ~1;
   size_t limit = RemainingSectionLength(state);
   BRUNSLI_DCHECK((limit & 1) == 0);
@@ -1953,6 +2020,7 @@ static BrunsliStatus DecodeDCDataSection(State* state) {
 }
 
 static BrunsliStatus DecodeACDataSection(State* state) {
+  BRUNSLI_TRACE_SCOPE("DecodeACDataSection");
   size_t available = GetBytesAvailable(state) & ~1;
   size_t limit = RemainingSectionLength(state);
   BRUNSLI_DCHECK((limit & 1) == 0);
@@ -2054,7 +2122,10 @@ static Stage ParseSection(State* state) {
       case SectionHeaderState::READ_TAG: {
         BrunsliStatus status = ReadTag(state, &s.section);
         if (status == BRUNSLI_NOT_ENOUGH_DATA) {
-          if (HasSection(state, kBrunsliACDataTag)) return Stage::DONE;
+          if (HasSection(state, kBrunsliACDataTag) &&
+              !HasPendingACSegments(state)) {
+            return Stage::DONE;
+          }
         }
         if (status != BRUNSLI_OK) return Fail(state, status);
         if (s.section.is_section) {
@@ -2187,9 +2258,9 @@ static Stage ProcessSection(State* state, JPEGData* jpg) {
     return Fail(state, BRUNSLI_INVALID_BRN);
   }
 
-  // Nothing is expected after the AC data.
+  // Nothing is expected after the (last segment of) AC data.
   if (s.section.tag == kBrunsliACDataTag) {
-    return Stage::DONE;
+    return HasPendingACSegments(state) ? Stage::SECTION : Stage::DONE;
   }
 
   return Stage::SECTION;
@@ -2323,6 +2394,10 @@ void ChargeBuffer(State* state) {
 }
 
 constexpr size_t kBufferMaxReadAhead = 600;
+// Buffered data is compacted only when there is no room to borrow more bytes;
+// this way compaction moves at most kBufferMaxReadAhead bytes per
+// (kBufferCapacity - 2 * kBufferMaxReadAhead) consumed bytes.
+constexpr size_t kBufferCapacity = 4 * kBufferMaxReadAhead;
 
 /** Sets input source either to buffered, or to external data. */
 void LoadInput(State* state) {
@@ -2345,9 +2420,15 @@ void LoadInput(State* state) {
   // buffer is unable to provide enough input, we could switch to unbuffered
   // input.
   b.borrowed_len = std::min(kBufferMaxReadAhead, available);
-  memcpy(b.data.data() + b.data_len, b.external_data + b.external_pos,
-         b.borrowed_len);
-  state->data = b.data.data();
+  if (b.data_start + b.data_len + b.borrowed_len > b.data.size()) {
+    memmove(b.data.data(), b.data.data() + b.data_start, b.data_len);
+    b.bytes_copied += b.data_len;
+    b.data_start = 0;
+  }
+  uint8_t* data = b.data.data() + b.data_start;
+  memcpy(data + b.data_len, b.external_data + b.external_pos, b.borrowed_len);
+  b.bytes_copied += b.borrowed_len;
+  state->data = data;
   state->pos = 0;
   state->len = b.data_len + b.borrowed_len;
 }
@@ -2369,9 +2450,11 @@ bool UnloadInput(State* state, BrunsliStatus result) {
     BRUNSLI_DCHECK(b.data_len == 0);
     size_t available = b.external_len - b.external_pos;
     BRUNSLI_DCHECK(available < kBufferMaxReadAhead);
-    if (b.data.empty()) b.data.resize(2 * kBufferMaxReadAhead);
+    if (b.data.empty()) b.data.resize(kBufferCapacity);
+    b.data_start = 0;
     b.data_len = available;
     memcpy(b.data.data(), b.external_data + b.external_pos, b.data_len);
+    b.bytes_copied += available;
     b.external_pos += available;
     return false;
   }
@@ -2379,6 +2462,7 @@ bool UnloadInput(State* state, BrunsliStatus result) {
   // Buffer depleted; switch to non-buffered input.
   if (state->pos >= b.data_len) {
     size_t used_borrowed_bytes = state->pos - b.data_len;
+    b.data_start = 0;
     b.data_len = 0;
     b.external_pos += used_borrowed_bytes;
     return true;
@@ -2386,6 +2470,7 @@ bool UnloadInput(State* state, BrunsliStatus result) {
 
   // Buffer not depleted; either problem discovered was already buffered data,
   // or extra input was too-short.
+  b.data_start += state->pos;
   b.data_len -= state->pos;
   if (result == BRUNSLI_NOT_ENOUGH_DATA) {
     // We couldn't have taken more bytes.
@@ -2396,9 +2481,6 @@ bool UnloadInput(State* state, BrunsliStatus result) {
     b.external_pos += b.borrowed_len;
   }
   BRUNSLI_DCHECK(!b.data.empty());
-  if (state->pos > 0 && b.data_len > 0) {
-    memmove(b.data.data(), b.data.data() + state->pos, b.data_len);
-  }
   BRUNSLI_DCHECK(b.data_len <= kBufferMaxReadAhead);
 
   return (result != BRUNSLI_NOT_ENOUGH_DATA);
@@ -2415,9 +2497,11 @@ void UnchargeBuffer(State* state) {
 }
 
 BrunsliStatus ProcessJpeg(State* state, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("ProcessJpeg");
   InternalState& s = *state->internal;
 
   if (state->pos > state->len) return BRUNSLI_INVALID_PARAM;
+  const size_t start_pos = state->pos;
   ChargeBuffer(state);
 
   BrunsliStatus result = BRUNSLI_NOT_ENOUGH_DATA;
@@ -2450,6 +2534,7 @@ BrunsliStatus ProcessJpeg(State* state, JPEGData* jpg) {
     if (!UnloadInput(state, result)) break;
   }
   UnchargeBuffer(state);
+  s.buffer.bytes_consumed += state->pos - start_pos;
   return result;
 }
 
@@ -2467,6 +2552,24 @@ BrunsliStatus BrunsliDecodeJpeg(const uint8_t* data, const size_t len,
   return internal::dec::ProcessJpeg(&state, jpg);
 }
 
+BrunsliStatus BrunsliDecodeJpegMetadata(const uint8_t* data, const size_t len,
+                                        JPEGData* jpg) {
+  if (!data) return BRUNSLI_INVALID_PARAM;
+
+  State state;
+  state.data = data;
+  state.len = len;
+  state.skip_tags = (1u << kBrunsliHistogramDataTag) |
+                    (1u << kBrunsliDCDataTag) | (1u << kBrunsliACDataTag);
+
+  BrunsliStatus status = internal::dec::ProcessJpeg(&state, jpg);
+  // Original JPEG is stored as is; there is no separate metadata.
+  if (status == BRUNSLI_OK && jpg->version == kFallbackVersion) {
+    return BRUNSLI_INVALID_BRN;
+  }
+  return status;
+}
+
 size_t BrunsliEstimateDecoderPeakMemoryUsage(const uint8_t* data,
                                              const size_t len) {
   if (!data) return BRUNSLI_INVALID_PARAM;
@@ -2506,6 +2609,14 @@ BrunsliDecoder::BrunsliDecoder() {
 
 BrunsliDecoder::~BrunsliDecoder() {}
 
+BrunsliDecoder::Stats BrunsliDecoder::GetStats() const {
+  const internal::dec::Buffer& b = state_->internal->buffer;
+  Stats stats;
+  stats.bytes_consumed = b.bytes_consumed;
+  stats.bytes_copied = b.bytes_copied;
+  return stats;
+}
+
 BrunsliDecoder::Status BrunsliDecoder::Decode(size_t* available_in,
                                               const uint8_t** next_in,
                                               size_t* available_out,
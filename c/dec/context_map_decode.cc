@@ -6,6 +6,8 @@
 
 #include "./context_map_decode.h"
 
+#include <cstring>
+
 #include "../common/constants.h"
 #include "../common/platform.h"
 #include <brunsli/status.h>
@@ -17,37 +19,37 @@ namespace brunsli {
 
 namespace {
 
-void MoveToFront(uint8_t* v, uint8_t index) {
-  uint8_t value = v[index];
-  uint8_t i = index;
-  for (; i; --i) v[i] = v[i - 1];
-  v[0] = value;
-}
-
 void InverseMoveToFrontTransform(uint8_t* v, size_t v_len) {
   uint8_t mtf[256];
   for (size_t i = 0; i < 256; ++i) {
     mtf[i] = static_cast<uint8_t>(i);
   }
   for (size_t i = 0; i < v_len; ++i) {
-    uint8_t index = v[i];
-    v[i] = mtf[index];
-    if (index) MoveToFront(mtf, index);
+    const uint8_t index = v[i];
+    const uint8_t value = mtf[index];
+    v[i] = value;
+    if (index) {
+      // Vectorized by the library; much faster than byte-by-byte shift.
+      memmove(mtf + 1, mtf, index);
+      mtf[0] = value;
+    }
   }
 }
 
-}  // namespace
-
-BrunsliStatus DecodeContextMap(const HuffmanDecodingData& entropy,
-                               size_t max_run_length_prefix, size_t* index,
-                               std::vector<uint8_t>* context_map,
-                               BrunsliBitReader* br) {
-  size_t& i = *index;
-  uint8_t* map = context_map->data();
-  const size_t length = context_map->size();
+// Decodes context map entries starting from |*index|. If |kCheckInput| is
+// false, then caller guarantees that the input is sufficient to decode all
+// the remaining entries (and the IMTF flag that follows them).
+template <bool kCheckInput>
+BrunsliStatus DecodeContextMapEntries(const HuffmanDecodingData& entropy,
+                                      size_t max_run_length_prefix,
+                                      size_t* index, uint8_t* map,
+                                      size_t length, BrunsliBitReader* br) {
+  size_t i = *index;
   while (i < length) {
     // Check there is enough deta for Huffman code, RLE and IMTF bit.
-    if (!BrunsliBitReaderCanRead(br, 15 + max_run_length_prefix + 1)) {
+    if (kCheckInput &&
+        !BrunsliBitReaderCanRead(br, 15 + max_run_length_prefix + 1)) {
+      *index = i;
       return BRUNSLI_NOT_ENOUGH_DATA;
     }
     uint32_t code = entropy.ReadSymbol(br);
@@ -55,17 +57,37 @@ BrunsliStatus DecodeContextMap(const HuffmanDecodingData& entropy,
       map[i] = 0;
       ++i;
     } else if (code <= max_run_length_prefix) {
-      size_t reps = 1u + (1u << code) + (int)BrunsliBitReaderRead(br, code);
-      while (--reps) {
-        if (i >= length) return BRUNSLI_INVALID_BRN;
-        map[i] = 0;
-        ++i;
-      }
+      size_t reps = (1u << code) + BrunsliBitReaderRead(br, code);
+      if (reps > length - i) return BRUNSLI_INVALID_BRN;
+      memset(map + i, 0, reps);
+      i += reps;
     } else {
-      map[i] = (uint8_t)(code - max_run_length_prefix);
+      map[i] = static_cast<uint8_t>(code - max_run_length_prefix);
       ++i;
     }
   }
+  *index = i;
+  return BRUNSLI_OK;
+}
+
+}  // namespace
+
+BrunsliStatus DecodeContextMap(const HuffmanDecodingData& entropy,
+                               size_t max_run_length_prefix, size_t* index,
+                               std::vector<uint8_t>* context_map,
+                               BrunsliBitReader* br) {
+  uint8_t* map = context_map->data();
+  const size_t length = context_map->size();
+  // Each entry takes at most 15 bits of Huffman code and RLE extra bits.
+  const size_t max_bits = (length - *index) * (15 + max_run_length_prefix) + 1;
+  // When the whole map is available, per-entry input checks are skipped.
+  const BrunsliStatus status =
+      BrunsliBitReaderCanRead(br, max_bits)
+          ? DecodeContextMapEntries<false>(entropy, max_run_length_prefix,
+                                           index, map, length, br)
+          : DecodeContextMapEntries<true>(entropy, max_run_length_prefix,
+                                          index, map, length, br);
+  if (status != BRUNSLI_OK) return status;
   if (BrunsliBitReaderRead(br, 1)) {
     InverseMoveToFrontTransform(map, length);
   }
@@ -6,6 +6,7 @@
 
 #include <brunsli/jpeg_data_writer.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring> /* for memset, memcpy */
@@ -16,6 +17,7 @@
 #include "../common/constants.h"
 #include <brunsli/jpeg_data.h>
 #include "../common/platform.h"
+#include "../common/trace.h"
 #include <brunsli/types.h>
 #include "./serialization_state.h"
 #include "./state.h"
@@ -26,6 +28,7 @@ namespace brunsli {
 using ::brunsli::internal::dec::BitWriter;
 using ::brunsli::internal::dec::DCTCodingState;
 using ::brunsli::internal::dec::EncodeScanState;
+using ::brunsli::internal::dec::FusedScan;
 using ::brunsli::internal::dec::OutputChunk;
 using ::brunsli::internal::dec::SerializationState;
 using ::brunsli::internal::dec::SerializationStatus;
@@ -40,6 +43,9 @@ const int kJpegPrecision = 8;
 // BitWriter: buffer size
 const size_t kBitWriterChunkSize = 16384;
 
+// BitWriter: output windows smaller than this are not written directly.
+const size_t kMinDirectOutputSize = 64;
+
 // Returns ceil(a/b).
 static BRUNSLI_INLINE int DivCeil(int a, int b) { return (a + b - 1) / b; }
 
@@ -51,28 +57,91 @@ static BRUNSLI_INLINE uint64_t HasZeroByte(uint64_t x) {
 
 void BitWriterInit(BitWriter* bw, std::deque<OutputChunk>* output_queue) {
   bw->output = output_queue;
-  bw->chunk = OutputChunk(kBitWriterChunkSize);
+  // Chunk is allocated lazily, see SwapBuffer.
+  bw->chunk = OutputChunk(nullptr, 0);
+  bw->data = nullptr;
   bw->pos = 0;
+  bw->capacity = 0;
+  bw->next_out = nullptr;
+  bw->available_out = nullptr;
+  bw->is_direct = false;
+  bw->has_spilled = false;
   bw->put_buffer = 0;
   bw->put_bits = 64;
   bw->healthy = true;
-  bw->data = bw->chunk.buffer->data();
+}
+
+static void CommitDirectOutput(BitWriter* bw) {
+  BRUNSLI_DCHECK(bw->is_direct);
+  *bw->next_out += bw->pos;
+  *bw->available_out -= bw->pos;
+  bw->is_direct = false;
+  bw->next_out = nullptr;
+  bw->available_out = nullptr;
+  bw->data = nullptr;
+  bw->pos = 0;
+  bw->capacity = 0;
 }
 
 static BRUNSLI_NOINLINE void SwapBuffer(BitWriter* bw) {
-  bw->chunk.len = bw->pos;
-  bw->output->emplace_back(std::move(bw->chunk));
+  if (bw->is_direct) {
+    CommitDirectOutput(bw);
+    bw->has_spilled = true;
+  } else if (bw->pos > 0) {
+    bw->chunk.len = bw->pos;
+    bw->output->emplace_back(std::move(bw->chunk));
+  }
   bw->chunk = OutputChunk(kBitWriterChunkSize);
   bw->data = bw->chunk.buffer->data();
   bw->pos = 0;
+  bw->capacity = kBitWriterChunkSize;
 }
 
 static BRUNSLI_INLINE void Reserve(BitWriter* bw, size_t n_bytes) {
-  if (BRUNSLI_PREDICT_FALSE((bw->pos + n_bytes) > kBitWriterChunkSize)) {
+  if (BRUNSLI_PREDICT_FALSE((bw->pos + n_bytes) > bw->capacity)) {
     SwapBuffer(bw);
   }
 }
 
+/**
+ * Redirects output to the caller-provided window, if possible.
+ *
+ * Direct output is possible only if all the preceding output is already
+ * pushed to the caller.
+ */
+void BitWriterAttach(BitWriter* bw, uint8_t** next_out,
+                     size_t* available_out) {
+  bw->has_spilled = false;
+  if (next_out == nullptr || *available_out < kMinDirectOutputSize) return;
+  if (bw->pos != 0 || !bw->output->empty()) return;
+  bw->chunk = OutputChunk(nullptr, 0);
+  bw->next_out = next_out;
+  bw->available_out = available_out;
+  bw->is_direct = true;
+  bw->data = *next_out;
+  bw->pos = 0;
+  bw->capacity = *available_out;
+}
+
+/**
+ * Makes the output produced since BitWriterAttach visible to the caller.
+ *
+ * Data written to the caller window is committed; if the window has been
+ * exhausted, the spilled data is added to the output queue.
+ */
+void BitWriterDetach(BitWriter* bw) {
+  if (bw->is_direct) {
+    CommitDirectOutput(bw);
+  } else if (bw->has_spilled && bw->pos > 0) {
+    bw->chunk.len = bw->pos;
+    bw->output->emplace_back(std::move(bw->chunk));
+    bw->chunk = OutputChunk(nullptr, 0);
+    bw->data = nullptr;
+    bw->pos = 0;
+    bw->capacity = 0;
+  }
+}
+
 /**
  * Writes the given byte to the output, writes an extra zero if byte is 0xFF.
  *
@@ -174,6 +243,10 @@ bool JumpToByteBoundary(BitWriter* bw, const int** pad_bits,
 }
 
 void BitWriterFinish(BitWriter* bw) {
+  if (bw->is_direct) {
+    CommitDirectOutput(bw);
+    return;
+  }
   if (bw->pos == 0) return;
   bw->chunk.len = bw->pos;
   bw->output->emplace_back(std::move(bw->chunk));
@@ -694,55 +767,38 @@ bool EncodeRefinementBits(const coeff_t* coeffs,
   return true;
 }
 
-template <int kMode>
-SerializationStatus BRUNSLI_NOINLINE DoEncodeScan(const JPEGData& jpg,
-                                                  const State& parsing_state,
-                                                  SerializationState* state) {
-  const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
-  EncodeScanState& ss = state->scan_state;
-
-  const int restart_interval =
-      state->seen_dri_marker ? jpg.restart_interval : 0;
-
-  const auto get_next_extra_zero_run_index = [&ss, &scan_info]() -> int {
-    if (ss.extra_zero_runs_pos < scan_info.extra_zero_runs.size()) {
-      return scan_info.extra_zero_runs[ss.extra_zero_runs_pos].block_idx;
-    } else {
-      return -1;
-    }
-  };
-
-  const auto get_next_reset_point = [&ss, &scan_info]() -> int {
-    if (ss.next_reset_point_pos < scan_info.reset_points.size()) {
-      return scan_info.reset_points[ss.next_reset_point_pos++];
-    } else {
-      return -1;
+void PushOutput(std::deque<OutputChunk>* in, size_t* available_out,
+                uint8_t** next_out) {
+  while (*available_out > 0) {
+    // No more data.
+    if (in->empty()) return;
+    OutputChunk& chunk = in->front();
+    size_t to_copy = std::min(*available_out, chunk.len);
+    if (to_copy > 0) {
+      memcpy(*next_out, chunk.next, to_copy);
+      *next_out += to_copy;
+      *available_out -= to_copy;
+      chunk.next += to_copy;
+      chunk.len -= to_copy;
     }
-  };
-
-  if (ss.stage == EncodeScanState::HEAD) {
-    if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
-    BitWriterInit(&ss.bw, &state->output_queue);
-    DCTCodingStateInit(&ss.coding_state);
-    ss.restarts_to_go = restart_interval;
-    ss.next_restart_marker = 0;
-    ss.block_scan_index = 0;
-    ss.extra_zero_runs_pos = 0;
-    ss.next_extra_zero_run_index = get_next_extra_zero_run_index();
-    ss.next_reset_point_pos = 0;
-    ss.next_reset_point = get_next_reset_point();
-    ss.mcu_y = 0;
-    memset(ss.last_dc_coeff, 0, sizeof(ss.last_dc_coeff));
-    ss.stage = EncodeScanState::BODY;
+    if (chunk.len == 0) in->pop_front();
   }
-  BitWriter* bw = &ss.bw;
-  DCTCodingState* coding_state = &ss.coding_state;
-
-  BRUNSLI_DCHECK(ss.stage == EncodeScanState::BODY);
+}
 
+// Geometry of the scan, measured in MCUs.
+struct ScanLayout {
   // "Non-interleaved" means color data comes in separate scans, in other words
   // each scan can contain only one color component.
-  const bool is_interleaved = (scan_info.num_components > 1);
+  bool is_interleaved;
+  // Number of MCU rows that correspond to one MCU row of interleaved scan.
+  int v_group;
+  int MCUs_per_row;
+  int MCU_rows;
+};
+
+ScanLayout GetScanLayout(const JPEGData& jpg, const JPEGScanInfo& scan_info) {
+  ScanLayout layout;
+  layout.is_interleaved = (scan_info.num_components > 1);
   const JPEGComponent& base_component =
       jpg.components[scan_info.components[0].comp_idx];
   // h_group / v_group act as numerators for converting number of blocks to
@@ -750,123 +806,363 @@ SerializationStatus BRUNSLI_NOINLINE DoEncodeScan(const JPEGData& jpg,
   // max_*_samp_factor blocks. In non-interleaved mode we choose numerator to
   // be the samping factor, consequently MCU is always represented with single
   // block.
-  const int h_group = is_interleaved ? 1 : base_component.h_samp_factor;
-  const int v_group = is_interleaved ? 1 : base_component.v_samp_factor;
-  const int MCUs_per_row =
-      DivCeil(jpg.width * h_group, 8 * jpg.max_h_samp_factor);
-  const int MCU_rows = DivCeil(jpg.height * v_group, 8 * jpg.max_v_samp_factor);
-  const bool is_progressive = state->is_progressive;
+  const int h_group = layout.is_interleaved ? 1 : base_component.h_samp_factor;
+  layout.v_group = layout.is_interleaved ? 1 : base_component.v_samp_factor;
+  layout.MCUs_per_row = DivCeil(jpg.width * h_group, 8 * jpg.max_h_samp_factor);
+  layout.MCU_rows =
+      DivCeil(jpg.height * layout.v_group, 8 * jpg.max_v_samp_factor);
+  return layout;
+}
+
+// Returns the template parameter of EncodeMCURows suitable for the scan.
+int GetScanMode(const JPEGScanInfo& scan_info, bool is_progressive) {
   const int Al = is_progressive ? scan_info.Al : 0;
+  const int Ah = is_progressive ? scan_info.Ah : 0;
   const int Ss = is_progressive ? scan_info.Ss : 0;
   const int Se = is_progressive ? scan_info.Se : 63;
+  const bool need_sequential =
+      !is_progressive || (Ah == 0 && Al == 0 && Ss == 0 && Se == 63);
+  if (need_sequential) {
+    return 0;
+  } else if (Ah == 0) {
+    return 1;
+  } else {
+    return 2;
+  }
+}
 
-  // DC-only is defined by [0..0] spectral range.
-  const bool want_ac = ((Ss != 0) || (Se != 0));
-  const bool complete_ac = (parsing_state.stage == Stage::DONE);
-  const bool has_ac =
-      complete_ac || HasSection(&parsing_state, kBrunsliACDataTag);
-  if (want_ac && !has_ac) return SerializationStatus::NEEDS_MORE_INPUT;
+int GetNextExtraZeroRunIndex(const JPEGScanInfo& scan_info,
+                             const EncodeScanState& ss) {
+  if (ss.extra_zero_runs_pos < scan_info.extra_zero_runs.size()) {
+    return scan_info.extra_zero_runs[ss.extra_zero_runs_pos].block_idx;
+  } else {
+    return -1;
+  }
+}
 
-  // |has_ac| implies |complete_dc| but not vice versa; for the sake of
-  // simplicity we pretend they are equal, because they are separated by just a
-  // few bytes of input.
-  const bool complete_dc = has_ac;
-  const bool complete = want_ac ? complete_ac : complete_dc;
-  // When "incomplete" |ac_dc| tracks information about current ("incomplete")
-  // band parsing progress.
-  const int last_mcu_y =
-      complete ? MCU_rows : parsing_state.internal->ac_dc.next_mcu_y * v_group;
+int GetNextResetPoint(const JPEGScanInfo& scan_info, EncodeScanState* ss) {
+  if (ss->next_reset_point_pos < scan_info.reset_points.size()) {
+    return scan_info.reset_points[ss->next_reset_point_pos++];
+  } else {
+    return -1;
+  }
+}
+
+void StartScan(const JPEGScanInfo& scan_info, int restart_interval,
+               std::deque<OutputChunk>* output_queue, EncodeScanState* ss) {
+  BitWriterInit(&ss->bw, output_queue);
+  DCTCodingStateInit(&ss->coding_state);
+  ss->restarts_to_go = restart_interval;
+  ss->next_restart_marker = 0;
+  ss->block_scan_index = 0;
+  ss->extra_zero_runs_pos = 0;
+  ss->next_extra_zero_run_index = GetNextExtraZeroRunIndex(scan_info, *ss);
+  ss->next_reset_point_pos = 0;
+  ss->next_reset_point = GetNextResetPoint(scan_info, ss);
+  ss->mcu_y = 0;
+  ss->mcu_x = 0;
+  memset(ss->last_dc_coeff, 0, sizeof(ss->last_dc_coeff));
+}
+
+bool FinishScan(EncodeScanState* ss, const int** pad_bits,
+                const int* pad_bits_end) {
+  BitWriter* bw = &ss->bw;
+  Flush(&ss->coding_state, bw);
+  if (!JumpToByteBoundary(bw, pad_bits, pad_bits_end)) return false;
+  BitWriterFinish(bw);
+  return bw->healthy;
+}
 
-  for (; ss.mcu_y < last_mcu_y; ++ss.mcu_y) {
-    for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
+// Encodes MCU rows of the scan until |last_mcu_y| is reached.
+//
+// Returns NEEDS_MORE_OUTPUT if output window is exhausted; encoding could be
+// resumed with the same |ss|.
+template <int kMode>
+SerializationStatus BRUNSLI_INLINE EncodeMCURows(
+    const JPEGData& jpg, const JPEGScanInfo& scan_info,
+    const ScanLayout& layout, const HuffmanCodeTable* dc_huff_table,
+    const HuffmanCodeTable* ac_huff_table, int restart_interval,
+    int last_mcu_y, const int** pad_bits, const int* pad_bits_end,
+    EncodeScanState* ss) {
+  BitWriter* bw = &ss->bw;
+  DCTCodingState* coding_state = &ss->coding_state;
+  const bool is_interleaved = layout.is_interleaved;
+  // Spectral selection / successive approximation parameters are used only in
+  // progressive modes.
+  const int Al = scan_info.Al;
+  const int Ss = scan_info.Ss;
+  const int Se = scan_info.Se;
+
+  for (; ss->mcu_y < last_mcu_y; ++ss->mcu_y) {
+    for (; ss->mcu_x < layout.MCUs_per_row; ++ss->mcu_x) {
+      // Output window is full; suspend until the caller drains the output.
+      if (bw->has_spilled) {
+        BitWriterDetach(bw);
+        if (!bw->healthy) return SerializationStatus::ERROR;
+        return SerializationStatus::NEEDS_MORE_OUTPUT;
+      }
       // Possibly emit a restart marker.
-      if (restart_interval > 0 && ss.restarts_to_go == 0) {
+      if (restart_interval > 0 && ss->restarts_to_go == 0) {
         Flush(coding_state, bw);
-        if (!JumpToByteBoundary(bw, &state->pad_bits, state->pad_bits_end)) {
+        if (!JumpToByteBoundary(bw, pad_bits, pad_bits_end)) {
           return SerializationStatus::ERROR;
         }
-        EmitMarker(bw, 0xD0 + ss.next_restart_marker);
-        ss.next_restart_marker += 1;
-        ss.next_restart_marker &= 0x7;
-        ss.restarts_to_go = restart_interval;
-        memset(ss.last_dc_coeff, 0, sizeof(ss.last_dc_coeff));
+        EmitMarker(bw, 0xD0 + ss->next_restart_marker);
+        ss->next_restart_marker += 1;
+        ss->next_restart_marker &= 0x7;
+        ss->restarts_to_go = restart_interval;
+        memset(ss->last_dc_coeff, 0, sizeof(ss->last_dc_coeff));
       }
       // Encode one MCU
       for (size_t i = 0; i < scan_info.num_components; ++i) {
         const JPEGComponentScanInfo& si = scan_info.components[i];
         const JPEGComponent& c = jpg.components[si.comp_idx];
-        const HuffmanCodeTable& dc_huff = state->dc_huff_table[si.dc_tbl_idx];
-        const HuffmanCodeTable& ac_huff = state->ac_huff_table[si.ac_tbl_idx];
+        const HuffmanCodeTable& dc_huff = dc_huff_table[si.dc_tbl_idx];
+        const HuffmanCodeTable& ac_huff = ac_huff_table[si.ac_tbl_idx];
         int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
         int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
         for (int iy = 0; iy < n_blocks_y; ++iy) {
           for (int ix = 0; ix < n_blocks_x; ++ix) {
-            int block_y = ss.mcu_y * n_blocks_y + iy;
-            int block_x = mcu_x * n_blocks_x + ix;
+            int block_y = ss->mcu_y * n_blocks_y + iy;
+            int block_x = ss->mcu_x * n_blocks_x + ix;
             int block_idx = block_y * c.width_in_blocks + block_x;
-            if (ss.block_scan_index == ss.next_reset_point) {
+            if (ss->block_scan_index == ss->next_reset_point) {
               Flush(coding_state, bw);
-              ss.next_reset_point = get_next_reset_point();
+              ss->next_reset_point = GetNextResetPoint(scan_info, ss);
             }
             int num_zero_runs = 0;
-            if (ss.block_scan_index == ss.next_extra_zero_run_index) {
-              num_zero_runs = scan_info.extra_zero_runs[ss.extra_zero_runs_pos]
+            if (ss->block_scan_index == ss->next_extra_zero_run_index) {
+              num_zero_runs = scan_info.extra_zero_runs[ss->extra_zero_runs_pos]
                                   .num_extra_zero_runs;
-              ++ss.extra_zero_runs_pos;
-              ss.next_extra_zero_run_index = get_next_extra_zero_run_index();
+              ++ss->extra_zero_runs_pos;
+              ss->next_extra_zero_run_index =
+                  GetNextExtraZeroRunIndex(scan_info, *ss);
             }
             const coeff_t* coeffs = &c.coeffs[block_idx << 6];
             bool ok;
             if (kMode == 0) {
-              ok = EncodeDCTBlockSequential(coeffs, dc_huff, ac_huff,
-                                            num_zero_runs,
-                                            ss.last_dc_coeff + si.comp_idx, bw);
+              ok = EncodeDCTBlockSequential(
+                  coeffs, dc_huff, ac_huff, num_zero_runs,
+                  ss->last_dc_coeff + si.comp_idx, bw);
             } else if (kMode == 1) {
               ok = EncodeDCTBlockProgressive(
                   coeffs, dc_huff, ac_huff, Ss, Se, Al, num_zero_runs,
-                  coding_state, ss.last_dc_coeff + si.comp_idx, bw);
+                  coding_state, ss->last_dc_coeff + si.comp_idx, bw);
             } else {
               ok = EncodeRefinementBits(coeffs, ac_huff, Ss, Se, Al,
                                         coding_state, bw);
             }
             if (!ok) return SerializationStatus::ERROR;
-            ++ss.block_scan_index;
+            ++ss->block_scan_index;
           }
         }
       }
-      --ss.restarts_to_go;
+      --ss->restarts_to_go;
     }
+    ss->mcu_x = 0;
   }
-  if (ss.mcu_y < MCU_rows) {
+  return SerializationStatus::DONE;
+}
+
+template <int kMode>
+SerializationStatus BRUNSLI_NOINLINE DoEncodeScan(const JPEGData& jpg,
+                                                  const State& parsing_state,
+                                                  SerializationState* state) {
+  const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
+  EncodeScanState& ss = state->scan_state;
+
+  const int restart_interval =
+      state->seen_dri_marker ? jpg.restart_interval : 0;
+
+  if (ss.stage == EncodeScanState::HEAD) {
+    if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
+    StartScan(scan_info, restart_interval, &state->output_queue, &ss);
+    ss.stage = EncodeScanState::BODY;
+  }
+  BitWriter* bw = &ss.bw;
+  // Scan data could be written directly to the output window, once the
+  // preceding data (e.g. SOS) is pushed.
+  if (state->next_out != nullptr) {
+    PushOutput(&state->output_queue, state->available_out, state->next_out);
+  }
+  BitWriterAttach(bw, state->next_out, state->available_out);
+
+  BRUNSLI_DCHECK(ss.stage == EncodeScanState::BODY);
+
+  const ScanLayout layout = GetScanLayout(jpg, scan_info);
+  const bool is_progressive = state->is_progressive;
+  const int Ss = is_progressive ? scan_info.Ss : 0;
+  const int Se = is_progressive ? scan_info.Se : 63;
+
+  // DC-only is defined by [0..0] spectral range.
+  const bool want_ac = ((Ss != 0) || (Se != 0));
+  const bool complete_ac = (parsing_state.stage == Stage::DONE);
+  const bool has_ac =
+      complete_ac || HasSection(&parsing_state, kBrunsliACDataTag);
+  if (want_ac && !has_ac) return SerializationStatus::NEEDS_MORE_INPUT;
+
+  // |has_ac| implies |complete_dc| but not vice versa; for the sake of
+  // simplicity we pretend they are equal, because they are separated by just a
+  // few bytes of input.
+  const bool complete_dc = has_ac;
+  const bool complete = want_ac ? complete_ac : complete_dc;
+  // When "incomplete" |ac_dc| tracks information about current ("incomplete")
+  // band parsing progress.
+  const int last_mcu_y =
+      complete ? layout.MCU_rows
+               : parsing_state.internal->ac_dc.next_mcu_y * layout.v_group;
+
+  SerializationStatus status = EncodeMCURows<kMode>(
+      jpg, scan_info, layout, state->dc_huff_table.data(),
+      state->ac_huff_table.data(), restart_interval, last_mcu_y,
+      &state->pad_bits, state->pad_bits_end, &ss);
+  if (status != SerializationStatus::DONE) return status;
+  if (ss.mcu_y < layout.MCU_rows) {
+    BitWriterDetach(bw);
     if (!bw->healthy) return SerializationStatus::ERROR;
     return SerializationStatus::NEEDS_MORE_INPUT;
   }
-  Flush(coding_state, bw);
-  if (!JumpToByteBoundary(bw, &state->pad_bits, state->pad_bits_end)) {
-    return SerializationStatus::ERROR;
-  }
-  BitWriterFinish(bw);
+  const bool ok = FinishScan(&ss, &state->pad_bits, state->pad_bits_end);
   ss.stage = EncodeScanState::HEAD;
   state->scan_index++;
-  if (!bw->healthy) return SerializationStatus::ERROR;
+  if (!ok) return SerializationStatus::ERROR;
+
+  return SerializationStatus::DONE;
+}
+
+// Prepares FusedScan objects, replaying the marker sequence to find out which
+// Huffman codes and restart interval are used by each scan.
+bool SetupFusedScans(const JPEGData& jpg, SerializationState* state) {
+  std::vector<HuffmanCodeTable> dc_huff_table(kMaxHuffmanTables);
+  std::vector<HuffmanCodeTable> ac_huff_table(kMaxHuffmanTables);
+  size_t dht_index = 0;
+  bool is_progressive = false;
+  bool seen_dri_marker = false;
+  size_t num_scans = 0;
+  for (uint8_t marker : jpg.marker_order) {
+    if (marker == 0xDA) ++num_scans;
+  }
+  if (num_scans < 2 || num_scans > jpg.scan_info.size()) return false;
+  std::vector<FusedScan>& fused_scans = state->fused_scans;
+  // FusedScan objects are referenced by BitWriter, so they should not move.
+  fused_scans.resize(num_scans);
+  size_t scan_index = 0;
+  for (uint8_t marker : jpg.marker_order) {
+    if (marker >= 0xC0 && marker <= 0xC2) {
+      is_progressive = (marker == 0xC2);
+    } else if (marker == 0xDD) {
+      seen_dri_marker = true;
+    } else if (marker == 0xC4) {
+      while (true) {
+        if (dht_index >= jpg.huffman_code.size()) return false;
+        const JPEGHuffmanCode& huff = jpg.huffman_code[dht_index++];
+        size_t index = huff.slot_id;
+        HuffmanCodeTable* huff_table;
+        if (index & 0x10) {
+          index -= 0x10;
+          huff_table = &ac_huff_table[index];
+        } else {
+          huff_table = &dc_huff_table[index];
+        }
+        if (!BuildHuffmanCodeTable(huff, huff_table)) return false;
+        if (huff.is_last) break;
+      }
+    } else if (marker == 0xDA) {
+      const JPEGScanInfo& scan_info = jpg.scan_info[scan_index];
+      if (scan_info.num_components == 0) return false;
+      for (size_t i = 0; i < scan_info.num_components; ++i) {
+        const JPEGComponentScanInfo& si = scan_info.components[i];
+        if (si.comp_idx >= jpg.components.size()) return false;
+      }
+      FusedScan& fused_scan = fused_scans[scan_index++];
+      fused_scan.dc_huff_table = dc_huff_table;
+      fused_scan.ac_huff_table = ac_huff_table;
+      fused_scan.restart_interval = seen_dri_marker ? jpg.restart_interval : 0;
+      fused_scan.mode = GetScanMode(scan_info, is_progressive);
+      StartScan(scan_info, fused_scan.restart_interval, &fused_scan.output,
+                &fused_scan.scan_state);
+    }
+  }
+  return true;
+}
+
+template <int kMode>
+SerializationStatus BRUNSLI_NOINLINE EncodeFusedScanRows(
+    const JPEGData& jpg, const JPEGScanInfo& scan_info,
+    const ScanLayout& layout, int last_mcu_y, FusedScan* fused_scan) {
+  // Padding bits are not supported by fused mode.
+  const int* pad_bits = nullptr;
+  return EncodeMCURows<kMode>(
+      jpg, scan_info, layout, fused_scan->dc_huff_table.data(),
+      fused_scan->ac_huff_table.data(), fused_scan->restart_interval,
+      last_mcu_y, &pad_bits, nullptr, &fused_scan->scan_state);
+}
+
+// Encodes all the scans at once; coefficients are visited band by band, where
+// each band is an MCU row of an interleaved scan. This way the band stays in
+// cache, while it is revisited by all the scans.
+bool EncodeFusedScans(const JPEGData& jpg, SerializationState* state) {
+  BRUNSLI_TRACE_SCOPE("EncodeFusedScans");
+  if (jpg.has_zero_padding_bit) return false;
+  if (!SetupFusedScans(jpg, state)) return false;
+  std::vector<FusedScan>& fused_scans = state->fused_scans;
+  const size_t num_scans = fused_scans.size();
+  std::vector<ScanLayout> layouts(num_scans);
+  for (size_t i = 0; i < num_scans; ++i) {
+    layouts[i] = GetScanLayout(jpg, jpg.scan_info[i]);
+  }
+  const int num_bands = DivCeil(jpg.height, 8 * jpg.max_v_samp_factor);
+  for (int band = 0; band < num_bands; ++band) {
+    for (size_t i = 0; i < num_scans; ++i) {
+      const ScanLayout& layout = layouts[i];
+      const int last_mcu_y =
+          std::min(layout.MCU_rows, (band + 1) * layout.v_group);
+      FusedScan* fused_scan = &fused_scans[i];
+      SerializationStatus status;
+      if (fused_scan->mode == 0) {
+        status = EncodeFusedScanRows<0>(jpg, jpg.scan_info[i], layout,
+                                        last_mcu_y, fused_scan);
+      } else if (fused_scan->mode == 1) {
+        status = EncodeFusedScanRows<1>(jpg, jpg.scan_info[i], layout,
+                                        last_mcu_y, fused_scan);
+      } else {
+        status = EncodeFusedScanRows<2>(jpg, jpg.scan_info[i], layout,
+                                        last_mcu_y, fused_scan);
+      }
+      if (status != SerializationStatus::DONE) return false;
+    }
+  }
+  for (FusedScan& fused_scan : fused_scans) {
+    const int* pad_bits = nullptr;
+    if (!FinishScan(&fused_scan.scan_state, &pad_bits, nullptr)) return false;
+  }
+  return true;
+}
 
+SerializationStatus EmitFusedScan(const JPEGData& jpg,
+                                  SerializationState* state) {
+  const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
+  if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
+  std::deque<OutputChunk>& output =
+      state->fused_scans[state->scan_index].output;
+  for (OutputChunk& chunk : output) {
+    state->output_queue.emplace_back(std::move(chunk));
+  }
+  output.clear();
+  state->scan_index++;
   return SerializationStatus::DONE;
 }
 
 static SerializationStatus BRUNSLI_INLINE
 EncodeScan(const JPEGData& jpg, const State& parsing_state,
            SerializationState* state) {
+  if (!state->fused_scans.empty()) return EmitFusedScan(jpg, state);
+  BRUNSLI_TRACE_SCOPE("EncodeScan");
   const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
-  const bool is_progressive = state->is_progressive;
-  const int Al = is_progressive ? scan_info.Al : 0;
-  const int Ah = is_progressive ? scan_info.Ah : 0;
-  const int Ss = is_progressive ? scan_info.Ss : 0;
-  const int Se = is_progressive ? scan_info.Se : 63;
-  const bool need_sequential =
-      !is_progressive || (Ah == 0 && Al == 0 && Ss == 0 && Se == 63);
-  if (need_sequential) {
+  const int mode = GetScanMode(scan_info, state->is_progressive);
+  if (mode == 0) {
     return DoEncodeScan<0>(jpg, parsing_state, state);
-  } else if (Ah == 0) {
+  } else if (mode == 1) {
     return DoEncodeScan<1>(jpg, parsing_state, state);
   } else {
     return DoEncodeScan<2>(jpg, parsing_state, state);
@@ -942,22 +1238,18 @@ SerializationStatus SerializeSection(uint8_t marker, const State& parsing_state,
   }
 }
 
-void PushOutput(std::deque<OutputChunk>* in, size_t* available_out,
-                uint8_t** next_out) {
-  while (*available_out > 0) {
-    // No more data.
-    if (in->empty()) return;
-    OutputChunk& chunk = in->front();
-    size_t to_copy = std::min(*available_out, chunk.len);
-    if (to_copy > 0) {
-      memcpy(*next_out, chunk.next, to_copy);
-      *next_out += to_copy;
-      *available_out -= to_copy;
-      chunk.next += to_copy;
-      chunk.len -= to_copy;
-    }
-    if (chunk.len == 0) in->pop_front();
-  }
+// WriteJpegIov: owned chunks shorter than this are merged.
+const size_t kIovMergeThreshold = 1024;
+
+void AppendSpan(JPEGIov* out, const uint8_t* data, size_t len) {
+  if (len == 0) return;
+  out->spans.push_back({data, len});
+}
+
+void FlushMerged(JPEGIov* out, std::unique_ptr<std::vector<uint8_t>>* merged) {
+  if (!*merged || (*merged)->empty()) return;
+  AppendSpan(out, (*merged)->data(), (*merged)->size());
+  out->storage.emplace_back(std::move(*merged));
 }
 
 }  // namespace
@@ -983,10 +1275,58 @@ bool WriteJpeg(const JPEGData& jpg, JPEGOutput out) {
   }
 }
 
+size_t JPEGIov::TotalSize() const {
+  size_t result = 0;
+  for (const JPEGOutputSpan& span : spans) result += span.len;
+  return result;
+}
+
+bool WriteJpegIov(const JPEGData& jpg, JPEGIov* out) {
+  return WriteJpegIov(jpg, /* fuse_scans= */ false, out);
+}
+
+bool WriteJpegIov(const JPEGData& jpg, bool fuse_scans, JPEGIov* out) {
+  out->spans.clear();
+  out->storage.clear();
+  State state;
+  state.stage = Stage::DONE;
+  // With empty output window all the output is accumulated in the queue, so
+  // scans could be encoded all at once without extra memory overhead.
+  state.internal->serialization.fuse_scans = fuse_scans;
+  uint8_t* next_out = nullptr;
+  size_t available_out = 0;
+  SerializationStatus status =
+      SerializeJpeg(&state, jpg, &available_out, &next_out);
+  if (status != SerializationStatus::DONE &&
+      status != SerializationStatus::NEEDS_MORE_OUTPUT) {
+    return false;
+  }
+  std::deque<OutputChunk>& queue = state.internal->serialization.output_queue;
+  // Short marker segments are merged to keep the number of spans low.
+  std::unique_ptr<std::vector<uint8_t>> merged;
+  for (OutputChunk& chunk : queue) {
+    if (!chunk.buffer) {
+      FlushMerged(out, &merged);
+      AppendSpan(out, chunk.next, chunk.len);
+    } else if (chunk.len < kIovMergeThreshold) {
+      if (!merged) merged.reset(new std::vector<uint8_t>());
+      merged->insert(merged->end(), chunk.next, chunk.next + chunk.len);
+    } else {
+      FlushMerged(out, &merged);
+      AppendSpan(out, chunk.next, chunk.len);
+      out->storage.emplace_back(std::move(chunk.buffer));
+    }
+  }
+  FlushMerged(out, &merged);
+  return true;
+}
+
 namespace internal {
 namespace dec {
-SerializationStatus SerializeJpeg(State* state, const JPEGData& jpg,
-                                  size_t* available_out, uint8_t** next_out) {
+
+static SerializationStatus DoSerializeJpeg(State* state, const JPEGData& jpg,
+                                           size_t* available_out,
+                                           uint8_t** next_out) {
   SerializationState& ss = state->internal->serialization;
 
   const auto maybe_push_output = [&]() {
@@ -1046,6 +1386,11 @@ SerializationStatus SerializeJpeg(State* state, const JPEGData& jpg,
           ss.pad_bits = jpg.padding_bits.data();
           ss.pad_bits_end = ss.pad_bits + jpg.padding_bits.size();
         }
+        if (ss.fuse_scans && state->stage == Stage::DONE) {
+          // Fall back to regular scan-by-scan serialization if image is not
+          // suitable (or is broken).
+          if (!EncodeFusedScans(jpg, &ss)) ss.fused_scans.clear();
+        }
 
         EncodeSOI(&ss);
         maybe_push_output();
@@ -1069,6 +1414,12 @@ SerializationStatus SerializeJpeg(State* state, const JPEGData& jpg,
         maybe_push_output();
         if (status == SerializationStatus::NEEDS_MORE_INPUT) {
           return SerializationStatus::NEEDS_MORE_INPUT;
+        } else if (status == SerializationStatus::NEEDS_MORE_OUTPUT) {
+          if (*available_out == 0) {
+            return SerializationStatus::NEEDS_MORE_OUTPUT;
+          }
+          // Spilled output fit into the window; continue serialization.
+          break;
         } else if (status != SerializationStatus::DONE) {
           BRUNSLI_DCHECK(false);
           ss.stage = SerializationState::ERROR;
@@ -1091,6 +1442,20 @@ SerializationStatus SerializeJpeg(State* state, const JPEGData& jpg,
     }
   }
 }
+
+SerializationStatus SerializeJpeg(State* state, const JPEGData& jpg,
+                                  size_t* available_out, uint8_t** next_out) {
+  BRUNSLI_TRACE_SCOPE("SerializeJpeg");
+  SerializationState& ss = state->internal->serialization;
+  ss.next_out = next_out;
+  ss.available_out = available_out;
+  const SerializationStatus status =
+      DoSerializeJpeg(state, jpg, available_out, next_out);
+  // Output window belongs to the caller; it is not valid on the next call.
+  ss.next_out = nullptr;
+  ss.available_out = nullptr;
+  return status;
+}
 }  // namespace dec
 }  // namespace internal
 
@@ -0,0 +1,155 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <brunsli/jpeg_downscale.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../common/baseline_jpeg.h"
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+#include "./state.h"
+
+namespace brunsli {
+
+namespace {
+
+const int kMaxScaleDenom = 8;
+
+// Baseline JPEG limits for quantized coefficients.
+const int kMinCoeff = -1023;
+const int kMaxCoeff = 1023;
+
+// Combines |k| n-point (n = 8 / k) low-frequency coefficient vectors into a
+// single 8-point one: transform[u * 8 + (b * n + w)] is the contribution of
+// coefficient |w| of the source vector |b| to the output coefficient |u|.
+// It is the 8-point DCT of concatenated n-point IDCT outputs; normalization
+// of IDCT is the same for all sizes, so that n-point IDCT produces averages
+// of the 8-point IDCT output.
+struct DownscaleTransform {
+  DownscaleTransform() {
+    const double kPi = 3.14159265358979323846;
+    for (int k = 1; k <= kMaxScaleDenom; k *= 2) {
+      const int n = 8 / k;
+      double* t = transform[k];
+      for (int u = 0; u < 8; ++u) {
+        const double cu = (u == 0) ? std::sqrt(0.5) : 1.0;
+        for (int b = 0; b < k; ++b) {
+          for (int w = 0; w < n; ++w) {
+            const double cw = (w == 0) ? std::sqrt(0.5) : 1.0;
+            double sum = 0.0;
+            for (int x = 0; x < n; ++x) {
+              const int p = b * n + x;
+              sum += cu / 2 * std::cos((2 * p + 1) * u * kPi / 16) * cw / 2 *
+                     std::cos((2 * x + 1) * w * kPi / (2 * n));
+            }
+            t[u * 8 + b * n + w] = sum;
+          }
+        }
+      }
+    }
+  }
+  double transform[kMaxScaleDenom + 1][8 * 8];
+};
+
+const DownscaleTransform& GetDownscaleTransform() {
+  static const DownscaleTransform kDownscaleTransform;
+  return kDownscaleTransform;
+}
+
+// Downscales one component; |from| and |to| are related by |k| factor.
+void DownscaleComponent(const JPEGComponent& from, const int32_t* quant,
+                        int k, JPEGComponent* to) {
+  const int n = 8 / k;
+  const double* t = GetDownscaleTransform().transform[k];
+  to->coeffs.resize(to->num_blocks * kDCTBlockSize);
+  double in[8 * 8];
+  double tmp[8 * 8];
+  for (uint32_t by = 0; by < to->height_in_blocks; ++by) {
+    for (uint32_t bx = 0; bx < to->width_in_blocks; ++bx) {
+      // Gather low-frequency dequantized coefficients of k x k source blocks;
+      // blocks beyond the source edge are replicated.
+      for (int j = 0; j < k; ++j) {
+        const uint32_t src_y = std::min(by * k + j, from.height_in_blocks - 1);
+        for (int i = 0; i < k; ++i) {
+          const uint32_t src_x = std::min(bx * k + i, from.width_in_blocks - 1);
+          const coeff_t* block =
+              &from.coeffs[(src_y * from.width_in_blocks + src_x) *
+                           kDCTBlockSize];
+          for (int v = 0; v < n; ++v) {
+            for (int u = 0; u < n; ++u) {
+              in[(j * n + v) * 8 + i * n + u] =
+                  static_cast<double>(block[v * 8 + u]) * quant[v * 8 + u];
+            }
+          }
+        }
+      }
+      // Vertical pass: tmp = T * in.
+      for (int v = 0; v < 8; ++v) {
+        for (int x = 0; x < 8; ++x) {
+          double sum = 0.0;
+          for (int p = 0; p < 8; ++p) sum += t[v * 8 + p] * in[p * 8 + x];
+          tmp[v * 8 + x] = sum;
+        }
+      }
+      // Horizontal pass: out = tmp * T^T; requantize.
+      coeff_t* out =
+          &to->coeffs[(by * to->width_in_blocks + bx) * kDCTBlockSize];
+      for (int v = 0; v < 8; ++v) {
+        for (int u = 0; u < 8; ++u) {
+          double sum = 0.0;
+          for (int p = 0; p < 8; ++p) sum += tmp[v * 8 + p] * t[u * 8 + p];
+          const int idx = v * 8 + u;
+          const double value = std::round(sum / quant[idx]);
+          out[idx] = static_cast<coeff_t>(
+              std::min<double>(kMaxCoeff, std::max<double>(kMinCoeff, value)));
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+bool BrunsliDownscale(const JPEGData& jpg, int scale_denom, JPEGData* out) {
+  if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 &&
+      scale_denom != 8) {
+    return false;
+  }
+  if (!HasValidCoefficientLayout(jpg)) return false;
+
+  *out = JPEGData();
+  out->width = (jpg.width + scale_denom - 1) / scale_denom;
+  out->height = (jpg.height + scale_denom - 1) / scale_denom;
+  out->version = jpg.version;
+  out->app_data = jpg.app_data;
+  out->com_data = jpg.com_data;
+  out->marker_order = jpg.marker_order;
+  out->components.resize(jpg.components.size());
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = jpg.components[i];
+    JPEGComponent& to = out->components[i];
+    to.id = from.id;
+    to.h_samp_factor = from.h_samp_factor;
+    to.v_samp_factor = from.v_samp_factor;
+    to.quant_idx = from.quant_idx;
+  }
+  if (!internal::dec::UpdateSubsamplingDerivatives(out)) return false;
+
+  out->quant = jpg.quant;
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = jpg.components[i];
+    const int32_t* quant = jpg.quant[from.quant_idx].values.data();
+    DownscaleComponent(from, quant, scale_denom, &out->components[i]);
+  }
+
+  SetBaselineJpegStructure(out);
+  return true;
+}
+
+}  // namespace brunsli
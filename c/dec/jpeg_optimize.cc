@@ -0,0 +1,328 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <vector>
+
+#include "../common/baseline_jpeg.h"
+#include "../common/constants.h"
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
+#include "../common/platform.h"
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+namespace {
+
+// Symbol frequencies; the last entry is reserved for the sentinel symbol.
+typedef std::array<uint64_t, kJpegHuffmanAlphabetSize + 1> Histogram;
+
+// Huffman table indices: 0 for the first component, 1 for the others.
+const int kNumTables = 2;
+
+// Upper bound of code lengths before they are limited to
+// kJpegHuffmanMaxBitLength; depth of the tree grows logarithmically (with
+// Fibonacci base) with the total count of symbols.
+const int kMaxUnlimitedCodeLength = 64;
+
+// Maximal EOB run that fits into a symbol.
+const int kMaxEobRun = 0x7FFF;
+
+// Last AC coefficient of the first luma scan in progressive mode.
+const int kLumaLowBandEnd = 5;
+
+static BRUNSLI_INLINE int NumBits(int value) {
+  return (value == 0) ? 0 : Log2FloorNonZero(value) + 1;
+}
+
+// Counts Huffman symbols that the writer would emit for a scan with no
+// successive approximation (Ah = Al = 0). Returns false if some value can not
+// be represented.
+bool CountScanSymbols(const JPEGData& jpg, const JPEGScanInfo& scan,
+                      Histogram* dc_histo, Histogram* ac_histo) {
+  const bool is_interleaved = (scan.num_components > 1);
+  const JPEGComponent& base_component =
+      jpg.components[scan.components[0].comp_idx];
+  const int h_group = is_interleaved ? 1 : base_component.h_samp_factor;
+  const int v_group = is_interleaved ? 1 : base_component.v_samp_factor;
+  const int MCUs_per_row =
+      DivCeil(jpg.width * h_group, 8 * jpg.max_h_samp_factor);
+  const int MCU_rows = DivCeil(jpg.height * v_group, 8 * jpg.max_v_samp_factor);
+  const bool eob_run_allowed = (scan.Ss > 0);
+  const int ac_begin = std::max(scan.Ss, 1);
+
+  int eob_run = 0;
+  Histogram* eob_histo = nullptr;
+  const auto flush_eob_run = [&eob_run, &eob_histo]() {
+    if (eob_run > 0) {
+      (*eob_histo)[Log2FloorNonZero(eob_run) << 4]++;
+      eob_run = 0;
+    }
+  };
+  coeff_t last_dc[kMaxComponents] = {0};
+
+  for (int mcu_y = 0; mcu_y < MCU_rows; ++mcu_y) {
+    for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
+      for (size_t i = 0; i < scan.num_components; ++i) {
+        const JPEGComponentScanInfo& si = scan.components[i];
+        const JPEGComponent& c = jpg.components[si.comp_idx];
+        Histogram& dc = dc_histo[si.dc_tbl_idx];
+        Histogram& ac = ac_histo[si.ac_tbl_idx];
+        const int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
+        const int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
+        for (int iy = 0; iy < n_blocks_y; ++iy) {
+          for (int ix = 0; ix < n_blocks_x; ++ix) {
+            const int block_y = mcu_y * n_blocks_y + iy;
+            const int block_x = mcu_x * n_blocks_x + ix;
+            const coeff_t* coeffs =
+                &c.coeffs[(block_y * c.width_in_blocks + block_x) << 6];
+            if (scan.Ss == 0) {
+              const int diff = coeffs[0] - last_dc[si.comp_idx];
+              last_dc[si.comp_idx] = coeffs[0];
+              const int nbits = NumBits(std::abs(diff));
+              if (nbits >= kJpegDCAlphabetSize) return false;
+              dc[nbits]++;
+            }
+            int r = 0;
+            for (int k = ac_begin; k <= scan.Se; ++k) {
+              const int value = coeffs[kJPEGNaturalOrder[k]];
+              if (value == 0) {
+                r++;
+                continue;
+              }
+              flush_eob_run();
+              while (r > 15) {
+                ac[0xF0]++;
+                r -= 16;
+              }
+              const int nbits = NumBits(std::abs(value));
+              if (nbits > 15) return false;
+              ac[(r << 4) + nbits]++;
+              r = 0;
+            }
+            if (r > 0) {
+              if (eob_run_allowed) {
+                eob_histo = &ac;
+                if (++eob_run == kMaxEobRun) flush_eob_run();
+              } else {
+                ac[0]++;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  flush_eob_run();
+  return true;
+}
+
+// Builds length-limited optimal Huffman code, as described in JPEG
+// specification (Annex K.2); the same algorithm is used by libjpeg.
+// Codes are produced in "JPEGData" form: the sentinel symbol occupies the
+// all-ones code of the maximal length.
+void BuildOptimalHuffmanCode(const Histogram& histo, int slot_id,
+                             JPEGHuffmanCode* huff) {
+  const int kNumSymbols = kJpegHuffmanAlphabetSize + 1;
+  Histogram freq = histo;
+  // Sentinel reserves one code of the maximal length; it is placed last, so
+  // no real symbol gets the all-ones code.
+  freq[kJpegHuffmanAlphabetSize] = 1;
+  int code_size[kNumSymbols] = {0};
+  int others[kNumSymbols];
+  for (int i = 0; i < kNumSymbols; ++i) others[i] = -1;
+
+  while (true) {
+    // Find the two least frequent symbols; prefer larger symbols on ties.
+    int c1 = -1;
+    int c2 = -1;
+    for (int i = 0; i < kNumSymbols; ++i) {
+      if (freq[i] == 0) continue;
+      if (c1 < 0 || freq[i] <= freq[c1]) {
+        c2 = c1;
+        c1 = i;
+      } else if (c2 < 0 || freq[i] <= freq[c2]) {
+        c2 = i;
+      }
+    }
+    if (c2 < 0) break;
+    // Merge c2 into c1.
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+    code_size[c1]++;
+    while (others[c1] >= 0) {
+      c1 = others[c1];
+      code_size[c1]++;
+    }
+    others[c1] = c2;
+    code_size[c2]++;
+    while (others[c2] >= 0) {
+      c2 = others[c2];
+      code_size[c2]++;
+    }
+  }
+
+  int bits[kMaxUnlimitedCodeLength + 1] = {0};
+  for (int i = 0; i < kNumSymbols; ++i) {
+    BRUNSLI_DCHECK(code_size[i] <= kMaxUnlimitedCodeLength);
+    if (code_size[i] > 0) bits[code_size[i]]++;
+  }
+  // Limit code lengths: move pairs of the longest codes up, splitting some
+  // shorter code.
+  for (int i = kMaxUnlimitedCodeLength; i > kJpegHuffmanMaxBitLength; --i) {
+    while (bits[i] > 0) {
+      int j = i - 2;
+      while (bits[j] == 0) --j;
+      bits[i] -= 2;
+      bits[i - 1]++;
+      bits[j + 1] += 2;
+      bits[j]--;
+    }
+  }
+
+  huff->slot_id = slot_id;
+  huff->is_last = false;
+  huff->counts.fill(0);
+  huff->values.fill(0);
+  for (int i = 1; i <= kJpegHuffmanMaxBitLength; ++i) huff->counts[i] = bits[i];
+  // Symbols sorted by code length are assigned to the lengths above.
+  size_t p = 0;
+  for (int len = 1; len <= kMaxUnlimitedCodeLength; ++len) {
+    for (int i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+      if (code_size[i] == len) huff->values[p++] = i;
+    }
+  }
+  huff->values[p] = kJpegHuffmanAlphabetSize;
+}
+
+// Adds a code for each table that is in use; at least one symbol is needed to
+// make a proper code. Caller is responsible for marking the last code in DHT
+// marker.
+void AddHuffmanCodes(Histogram* histo, int slot_offset,
+                     const bool* table_in_use, JPEGData* jpg) {
+  for (int i = 0; i < kNumTables; ++i) {
+    if (!table_in_use[i]) continue;
+    bool empty = true;
+    for (uint64_t count : histo[i]) empty &= (count == 0);
+    if (empty) histo[i][0] = 1;
+    jpg->huffman_code.emplace_back();
+    BuildOptimalHuffmanCode(histo[i], slot_offset + i,
+                            &jpg->huffman_code.back());
+  }
+}
+
+bool OptimizeSequential(JPEGData* jpg) {
+  Histogram dc_histo[kNumTables] = {};
+  Histogram ac_histo[kNumTables] = {};
+  for (const JPEGScanInfo& scan : jpg->scan_info) {
+    if (!CountScanSymbols(*jpg, scan, dc_histo, ac_histo)) return false;
+  }
+  const bool in_use[kNumTables] = {true, jpg->components.size() > 1};
+  jpg->huffman_code.clear();
+  // Single DHT marker with DC codes followed by AC codes.
+  AddHuffmanCodes(dc_histo, 0, in_use, jpg);
+  AddHuffmanCodes(ac_histo, 0x10, in_use, jpg);
+  jpg->huffman_code.back().is_last = true;
+  return true;
+}
+
+// Spectral selection only (no successive approximation): DC first, then
+// low-frequency luma, chroma, and the rest of luma. Each scan gets its own
+// AC code in a DHT marker just before it.
+bool OptimizeProgressive(JPEGData* jpg) {
+  const size_t num_components = jpg->components.size();
+  std::vector<JPEGScanInfo> scans;
+  int blocks_per_mcu = 0;
+  for (const JPEGComponent& c : jpg->components) {
+    blocks_per_mcu += c.h_samp_factor * c.v_samp_factor;
+  }
+  if (blocks_per_mcu <= kMaxBlocksInMCU) {
+    scans.push_back(MakeScan(0, 0, 0, 0));
+    for (size_t i = 0; i < num_components; ++i) {
+      AddComponentToScan(i, &scans.back());
+    }
+  } else {
+    for (size_t i = 0; i < num_components; ++i) {
+      scans.push_back(MakeScan(0, 0, 0, 0));
+      AddComponentToScan(i, &scans.back());
+    }
+  }
+  const size_t num_dc_scans = scans.size();
+  scans.push_back(MakeScan(1, kLumaLowBandEnd, 0, 0));
+  AddComponentToScan(0, &scans.back());
+  for (size_t i = 1; i < num_components; ++i) {
+    scans.push_back(MakeScan(1, 63, 0, 0));
+    AddComponentToScan(i, &scans.back());
+  }
+  scans.push_back(MakeScan(kLumaLowBandEnd + 1, 63, 0, 0));
+  AddComponentToScan(0, &scans.back());
+  jpg->scan_info.swap(scans);
+
+  // Drop DHT and SOS markers; they are re-added below.
+  std::vector<uint8_t> marker_order;
+  for (uint8_t marker : jpg->marker_order) {
+    if (marker == 0xC4 || marker == 0xDA || marker == 0xD9) continue;
+    marker_order.push_back(marker == 0xC0 ? 0xC2 : marker);
+  }
+  jpg->huffman_code.clear();
+
+  Histogram dc_histo[kNumTables] = {};
+  Histogram unused[kNumTables] = {};
+  for (size_t i = 0; i < num_dc_scans; ++i) {
+    if (!CountScanSymbols(*jpg, jpg->scan_info[i], dc_histo, unused)) {
+      return false;
+    }
+  }
+  const bool dc_in_use[kNumTables] = {true, num_components > 1};
+  AddHuffmanCodes(dc_histo, 0, dc_in_use, jpg);
+  jpg->huffman_code.back().is_last = true;
+  marker_order.push_back(0xC4);
+  for (size_t i = 0; i < num_dc_scans; ++i) marker_order.push_back(0xDA);
+
+  for (size_t i = num_dc_scans; i < jpg->scan_info.size(); ++i) {
+    const JPEGScanInfo& scan = jpg->scan_info[i];
+    Histogram ac_histo[kNumTables] = {};
+    if (!CountScanSymbols(*jpg, scan, unused, ac_histo)) return false;
+    bool in_use[kNumTables] = {false, false};
+    in_use[scan.components[0].ac_tbl_idx] = true;
+    AddHuffmanCodes(ac_histo, 0x10, in_use, jpg);
+    jpg->huffman_code.back().is_last = true;
+    marker_order.push_back(0xC4);
+    marker_order.push_back(0xDA);
+  }
+  marker_order.push_back(0xD9);
+  jpg->marker_order.swap(marker_order);
+  return true;
+}
+
+}  // namespace
+
+bool OptimizeJpegCoding(JPEGData* jpg, bool progressive) {
+  if (!HasValidCoefficientLayout(*jpg)) return false;
+  // Start with sequential scans and stock codes, so that nothing from the
+  // original entropy coding is left.
+  SetBaselineJpegStructure(jpg);
+  jpg->original_jpg = nullptr;
+  jpg->original_jpg_size = 0;
+  return progressive ? OptimizeProgressive(jpg) : OptimizeSequential(jpg);
+}
+
+bool WriteJpeg(const JPEGData& jpg, JPEGWriteMode mode, JPEGOutput out) {
+  if (mode == JPEG_WRITE_ORIGINAL || !HasValidCoefficientLayout(jpg)) {
+    return WriteJpeg(jpg, out);
+  }
+  JPEGData optimized = jpg;
+  if (!OptimizeJpegCoding(&optimized,
+                          mode == JPEG_WRITE_OPTIMIZED_PROGRESSIVE)) {
+    return false;
+  }
+  return WriteJpeg(optimized, out);
+}
+
+}  // namespace brunsli
@@ -0,0 +1,213 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <brunsli/jpeg_pixels.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../common/baseline_jpeg.h"
+#include <brunsli/jpeg_data.h>
+#include "../common/platform.h"
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+namespace {
+
+const int kMaxScaleDenom = 8;
+
+// IDCT basis for reduced sizes: basis[n][x * 8 + u] is
+// C(u) / 2 * cos((2x + 1) * u * pi / (2n)), where C(0) = 1 / sqrt(2) and
+// C(u) = 1 otherwise. Using the same normalization for all sizes makes the
+// reduced IDCT produce averages of the full-size IDCT output (with a minor
+// high-frequency attenuation error, like in other scaled IDCT
+// implementations).
+struct IdctBasis {
+  IdctBasis() {
+    const double kPi = 3.14159265358979323846;
+    for (int n = 1; n <= 8; n *= 2) {
+      float* b = basis[n];
+      for (int x = 0; x < n; ++x) {
+        for (int u = 0; u < 8; ++u) {
+          const double c = (u == 0) ? std::sqrt(0.5) : 1.0;
+          const double value =
+              c / 2 * std::cos((2 * x + 1) * u * kPi / (2 * n));
+          b[x * 8 + u] = (u < n) ? static_cast<float>(value) : 0.0f;
+        }
+      }
+    }
+  }
+  float basis[kMaxScaleDenom + 1][8 * 8];
+};
+
+const IdctBasis& GetIdctBasis() {
+  static const IdctBasis kIdctBasis;
+  return kIdctBasis;
+}
+
+static BRUNSLI_INLINE uint8_t ClampToByte(float v) {
+  const float clamped = std::min(255.0f, std::max(0.0f, v));
+  return static_cast<uint8_t>(clamped + 0.5f);
+}
+
+// Dequantizes the top-left n x n coefficients and produces n x n pixels.
+// Loops have fixed trip counts over contiguous data, so that compilers could
+// vectorize them.
+void InverseDct(const coeff_t* coeffs, const int32_t* quant, const float* basis,
+                int n, uint8_t* out, size_t stride) {
+  float block[8 * 8];
+  for (int v = 0; v < n; ++v) {
+    for (int u = 0; u < 8; ++u) {
+      const int k = v * 8 + u;
+      block[k] = static_cast<float>(coeffs[k] * quant[k]);
+    }
+  }
+  // Vertical pass: tmp[y][u] = sum_v basis[y][v] * block[v][u].
+  float tmp[8 * 8];
+  for (int y = 0; y < n; ++y) {
+    float* row = tmp + y * 8;
+    for (int u = 0; u < 8; ++u) row[u] = 0.0f;
+    for (int v = 0; v < n; ++v) {
+      const float b = basis[y * 8 + v];
+      const float* src = block + v * 8;
+      for (int u = 0; u < 8; ++u) row[u] += b * src[u];
+    }
+  }
+  // Horizontal pass: out[y][x] = sum_u basis[x][u] * tmp[y][u].
+  for (int y = 0; y < n; ++y) {
+    const float* row = tmp + y * 8;
+    uint8_t* dst = out + y * stride;
+    for (int x = 0; x < n; ++x) {
+      const float* b = basis + x * 8;
+      float sum = 128.0f;
+      for (int u = 0; u < 8; ++u) sum += b[u] * row[u];
+      dst[x] = ClampToByte(sum);
+    }
+  }
+}
+
+static BRUNSLI_INLINE void YCbCrToRgb(float y, float cb, float cr,
+                                      uint8_t* out) {
+  cb -= 128.0f;
+  cr -= 128.0f;
+  out[0] = ClampToByte(y + 1.402f * cr);
+  out[1] = ClampToByte(y - 0.344136f * cb - 0.714136f * cr);
+  out[2] = ClampToByte(y + 1.772f * cb);
+}
+
+}  // namespace
+
+bool GetJpegPixelsSize(const JPEGData& jpg, int scale_denom, int* xsize,
+                       int* ysize) {
+  if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 &&
+      scale_denom != 8) {
+    return false;
+  }
+  if (jpg.width <= 0 || jpg.height <= 0) return false;
+  *xsize = (jpg.width + scale_denom - 1) / scale_denom;
+  *ysize = (jpg.height + scale_denom - 1) / scale_denom;
+  return true;
+}
+
+bool RenderJpegPixelRows(const JPEGData& jpg, int scale_denom,
+                         JPEGPixelFormat format, int mcu_y_begin,
+                         int mcu_y_end, uint8_t* out, size_t stride) {
+  int xsize;
+  int ysize;
+  if (!GetJpegPixelsSize(jpg, scale_denom, &xsize, &ysize)) return false;
+  if (!HasValidCoefficientLayout(jpg)) return false;
+  if (mcu_y_begin < 0 || mcu_y_begin > mcu_y_end ||
+      mcu_y_end > jpg.MCU_rows) {
+    return false;
+  }
+  const size_t num_components = jpg.components.size();
+  if (num_components != 1 && num_components != 3) return false;
+  if (stride < static_cast<size_t>(xsize) * kJPEGPixelsBytesPerPixel) {
+    return false;
+  }
+  const int n = 8 / scale_denom;
+  const float* basis = GetIdctBasis().basis[n];
+
+  // Render components to planes of their own resolution.
+  std::vector<std::vector<uint8_t>> planes(num_components);
+  std::vector<size_t> plane_stride(num_components);
+  std::vector<std::vector<int>> x_map(num_components);
+  for (size_t i = 0; i < num_components; ++i) {
+    const JPEGComponent& c = jpg.components[i];
+    const int32_t* quant = jpg.quant[c.quant_idx].values.data();
+    const int by_begin = mcu_y_begin * c.v_samp_factor;
+    const int by_end = mcu_y_end * c.v_samp_factor;
+    plane_stride[i] = c.width_in_blocks * n;
+    planes[i].resize(plane_stride[i] * (by_end - by_begin) * n);
+    for (int by = by_begin; by < by_end; ++by) {
+      const coeff_t* block =
+          &c.coeffs[static_cast<size_t>(by) * c.width_in_blocks *
+                    kDCTBlockSize];
+      uint8_t* dst = planes[i].data() + (by - by_begin) * n * plane_stride[i];
+      for (uint32_t bx = 0; bx < c.width_in_blocks; ++bx) {
+        InverseDct(block, quant, basis, n, dst, plane_stride[i]);
+        block += kDCTBlockSize;
+        dst += n;
+      }
+    }
+    // Box upsampling: output column -> plane column.
+    x_map[i].resize(xsize);
+    for (int x = 0; x < xsize; ++x) {
+      x_map[i][x] = x * c.h_samp_factor / jpg.max_h_samp_factor;
+    }
+  }
+
+  // Upsample and convert colors.
+  const int mcu_height = jpg.max_v_samp_factor * n;
+  const int y_begin = mcu_y_begin * mcu_height;
+  const int y_end = std::min(mcu_y_end * mcu_height, ysize);
+  const uint8_t* rows[3];
+  for (int y = y_begin; y < y_end; ++y) {
+    for (size_t i = 0; i < num_components; ++i) {
+      const JPEGComponent& c = jpg.components[i];
+      const int plane_y = y * c.v_samp_factor / jpg.max_v_samp_factor -
+                          mcu_y_begin * c.v_samp_factor * n;
+      rows[i] = planes[i].data() + plane_y * plane_stride[i];
+    }
+    uint8_t* dst = out + (y - y_begin) * stride;
+    if (num_components == 1) {
+      const bool is_rgb = (format == JPEG_PIXELS_RGB);
+      for (int x = 0; x < xsize; ++x, dst += 3) {
+        const uint8_t value = rows[0][x_map[0][x]];
+        dst[0] = value;
+        dst[1] = is_rgb ? value : 128;
+        dst[2] = is_rgb ? value : 128;
+      }
+    } else if (format == JPEG_PIXELS_RGB) {
+      for (int x = 0; x < xsize; ++x, dst += 3) {
+        YCbCrToRgb(rows[0][x_map[0][x]], rows[1][x_map[1][x]],
+                   rows[2][x_map[2][x]], dst);
+      }
+    } else {
+      for (int x = 0; x < xsize; ++x, dst += 3) {
+        dst[0] = rows[0][x_map[0][x]];
+        dst[1] = rows[1][x_map[1][x]];
+        dst[2] = rows[2][x_map[2][x]];
+      }
+    }
+  }
+  return true;
+}
+
+bool RenderJpegPixels(const JPEGData& jpg, int scale_denom,
+                      JPEGPixelFormat format, std::vector<uint8_t>* pixels) {
+  int xsize;
+  int ysize;
+  if (!GetJpegPixelsSize(jpg, scale_denom, &xsize, &ysize)) return false;
+  const size_t stride = static_cast<size_t>(xsize) * kJPEGPixelsBytesPerPixel;
+  pixels->resize(stride * ysize);
+  return RenderJpegPixelRows(jpg, scale_denom, format, 0, jpg.MCU_rows,
+                             pixels->data(), stride);
+}
+
+}  // namespace brunsli
@@ -25,12 +25,22 @@ namespace internal {
 namespace dec {
 
 // Handles the packing of bits into output bytes.
+//
+// Bytes are written either to the owned |chunk|, which is then added to the
+// |output| queue, or directly to the caller-provided output window.
 struct BitWriter {
   bool healthy;
   std::deque<OutputChunk>* output;
   OutputChunk chunk;
   uint8_t* data;
   size_t pos;
+  size_t capacity;
+  // Caller-provided output window; valid only when |is_direct| is true.
+  uint8_t** next_out;
+  size_t* available_out;
+  bool is_direct;
+  // Output window is exhausted; the rest of output goes to the |chunk|.
+  bool has_spilled;
   uint64_t put_buffer;
   int put_bits;
 };
@@ -56,6 +66,7 @@ struct EncodeScanState {
   Stage stage = HEAD;
 
   int mcu_y;
+  int mcu_x;
   BitWriter bw;
   coeff_t last_dc_coeff[kMaxComponents] = {0};
   int restarts_to_go;
@@ -68,6 +79,19 @@ struct EncodeScanState {
   int next_reset_point;
 };
 
+// Scan encoded ahead of time, along with the other scans of the image; see
+// SerializationState::fuse_scans.
+struct FusedScan {
+  EncodeScanState scan_state;
+  // Entropy-coded data; SOS marker is not included.
+  std::deque<OutputChunk> output;
+  // Huffman codes and restart interval in effect for this scan.
+  std::vector<HuffmanCodeTable> dc_huff_table;
+  std::vector<HuffmanCodeTable> ac_huff_table;
+  int restart_interval;
+  int mode;
+};
+
 struct SerializationState {
   enum Stage {
     INIT,
@@ -80,6 +104,11 @@ struct SerializationState {
 
   std::deque<OutputChunk> output_queue;
 
+  // Caller-provided output window for the current SerializeJpeg call; reset
+  // to nullptr before SerializeJpeg returns.
+  uint8_t** next_out = nullptr;
+  size_t* available_out = nullptr;
+
   size_t section_index = 0;
   int dht_index = 0;
   int dqt_index = 0;
@@ -95,6 +124,13 @@ struct SerializationState {
   bool is_progressive = false;
 
   EncodeScanState scan_state;
+
+  // If set and parsing is complete, multi-scan images are encoded band by
+  // band: each MCU row of coefficients is visited once for all scans, instead
+  // of once per scan. Entropy-coded data of all scans is kept in |fused_scans|
+  // until the corresponding SOS marker is reached.
+  bool fuse_scans = false;
+  std::vector<FusedScan> fused_scans;
 };
 
 }  // namespace dec
@@ -83,6 +83,10 @@ class State {
   const uint8_t* context_map;
   const ANSDecodingData* entropy_codes;
   bool use_legacy_context_model = false;
+  bool use_symbol_num_nonzeros = false;
+  bool use_decay_prob = false;
+  // Number of MCU rows per AC segment; 0 means that AC data is not segmented.
+  int ac_segment_mcu_rows = 0;
 
   bool is_storage_allocated = false;
   std::vector<ComponentMeta> meta;
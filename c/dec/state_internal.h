@@ -321,6 +321,8 @@ struct HistogramDataState {
 };
 
 struct Buffer {
+  // Buffered bytes are located at data[data_start ... data_start + data_len).
+  size_t data_start = 0;
   size_t data_len = 0;
   size_t borrowed_len;
   std::vector<uint8_t> data;
@@ -328,6 +330,10 @@ struct Buffer {
   const uint8_t* external_data;
   size_t external_pos;
   size_t external_len;
+
+  // Statistics.
+  size_t bytes_consumed = 0;
+  size_t bytes_copied = 0;
 };
 
 struct InternalState {
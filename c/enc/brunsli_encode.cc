@@ -7,7 +7,10 @@
 #include <brunsli/brunsli_encode.h>
 
 #include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cmath>
 #include <cstdlib>
+#include <functional>
 #include <iterator>
 #include <set>
 #include <string>
@@ -15,6 +18,7 @@
 #include <vector>
 
 #include <brotli/encode.h>
+#include "../common/base128.h"
 #include "../common/constants.h"
 #include "../common/context.h"
 #include "../common/distributions.h"
@@ -23,6 +27,7 @@
 #include "../common/platform.h"
 #include "../common/predict.h"
 #include "../common/quant_matrix.h"
+#include "../common/trace.h"
 #include <brunsli/types.h>
 #include "./ans_encode.h"
 #include "./cluster.h"
@@ -32,19 +37,40 @@
 #include "./state.h"
 #include "./write_bits.h"
 
+#if defined(BRUNSLI_X86_DISPATCH)
+#include <immintrin.h>
+#elif defined(BRUNSLI_NEON_DISPATCH)
+#include <arm_neon.h>
+#endif
+
 namespace brunsli {
 
 static const int kNumDirectCodes = 8;
 static const int kBrotliQuality = 6;
 static const int kBrotliWindowBits = 18;
+// AC segments are made at least this tall, so that the cost of restarting
+// the adaptive models is not too high.
+static const int kMinACSegmentMcuRows = 4;
+static const int kMaxNumACSegments = 16;
+
+static int GetACSegmentMcuRows(int mcu_rows) {
+  return std::max(kMinACSegmentMcuRows,
+                  (mcu_rows + kMaxNumACSegments - 1) / kMaxNumACSegments);
+}
 
 using ::brunsli::internal::enc::BlockI32;
+using ::brunsli::internal::enc::CoeffOrderMode;
 using ::brunsli::internal::enc::ComponentMeta;
+using ::brunsli::internal::enc::ContextMapMode;
+using ::brunsli::internal::enc::CostSymbol;
+using ::brunsli::internal::enc::CostTracker;
 using ::brunsli::internal::enc::DataStream;
+using ::brunsli::internal::enc::EncodeParams;
 using ::brunsli::internal::enc::EntropyCodes;
 using ::brunsli::internal::enc::EntropySource;
 using ::brunsli::internal::enc::Histogram;
 using ::brunsli::internal::enc::State;
+using ::brunsli::internal::enc::kNumCostSymbols;
 
 using ::brunsli::internal::enc::SelectContextBits;
 
@@ -66,7 +92,9 @@ size_t EstimateAuxDataSize(const JPEGData& jpg) {
   return size;
 }
 
-size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
+// Returns an upper bound on the encoded size of all the sections, except
+// DC and AC data.
+size_t GetMaximumHeaderSize(const JPEGData& jpg) {
   size_t hdr_size = 1 << 20;  // Extra for header / entropy tables.
   hdr_size += EstimateAuxDataSize(jpg);
   for (const auto& data : jpg.app_data) {
@@ -76,6 +104,11 @@ size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
     hdr_size += data.size();
   }
   hdr_size += jpg.tail_data.size();
+  return hdr_size;
+}
+
+size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
+  size_t hdr_size = GetMaximumHeaderSize(jpg);
   size_t num_blocks = 0;
   for (const auto& component : jpg.components) {
     num_blocks += component.num_blocks;
@@ -108,7 +141,7 @@ void EncodeBase128Fix(size_t val, size_t len, uint8_t* data) {
   }
 }
 
-bool TransformApp0Marker(const std::vector<uint8_t>& s,
+bool TransformApp0Marker(const JPEGMarkerSegment& s,
                          std::vector<uint8_t>* out) {
   if (s.size() != 17) return false;
   if (memcmp(s.data(), AppData_0xe0, 9) != 0) return false;
@@ -137,7 +170,7 @@ bool TransformApp0Marker(const std::vector<uint8_t>& s,
   return false;
 }
 
-bool TransformApp2Marker(const std::vector<uint8_t>& s,
+bool TransformApp2Marker(const JPEGMarkerSegment& s,
                          std::vector<uint8_t>* out) {
   if (s.size() == 3161 && !memcmp(s.data(), AppData_0xe2, 84) &&
       !memcmp(s.data() + 85, AppData_0xe2 + 85, 3161 - 85)) {
@@ -150,7 +183,7 @@ bool TransformApp2Marker(const std::vector<uint8_t>& s,
   return false;
 }
 
-bool TransformApp12Marker(const std::vector<uint8_t>& s,
+bool TransformApp12Marker(const JPEGMarkerSegment& s,
                           std::vector<uint8_t>* out) {
   if (s.size() == 18 && !memcmp(s.data(), AppData_0xec, 15) &&
       !memcmp(s.data() + 16, AppData_0xec + 16, 18 - 16)) {
@@ -163,7 +196,7 @@ bool TransformApp12Marker(const std::vector<uint8_t>& s,
   return false;
 }
 
-bool TransformApp14Marker(const std::vector<uint8_t>& s,
+bool TransformApp14Marker(const JPEGMarkerSegment& s,
                           std::vector<uint8_t>* out) {
   if (s.size() == 15 && !memcmp(&s[0], AppData_0xee, 10) &&
       !memcmp(&s[11], AppData_0xee + 11, 15 - 11)) {
@@ -176,26 +209,18 @@ bool TransformApp14Marker(const std::vector<uint8_t>& s,
   return false;
 }
 
-std::vector<uint8_t> TransformAppMarker(const std::vector<uint8_t>& s,
-                                        size_t* transformed_marker_count) {
+// Appends the short form of |s| to *metadata, or |s| itself if there is none.
+void AppendAppMarker(const JPEGMarkerSegment& s,
+                     size_t* transformed_marker_count,
+                     std::vector<uint8_t>* metadata) {
   std::vector<uint8_t> out;
-  if (TransformApp0Marker(s, &out)) {
-    (*transformed_marker_count)++;
-    return out;
-  }
-  if (TransformApp2Marker(s, &out)) {
+  if (TransformApp0Marker(s, &out) || TransformApp2Marker(s, &out) ||
+      TransformApp12Marker(s, &out) || TransformApp14Marker(s, &out)) {
     (*transformed_marker_count)++;
-    return out;
+    Append(metadata, out);
+    return;
   }
-  if (TransformApp12Marker(s, &out)) {
-    (*transformed_marker_count)++;
-    return out;
-  }
-  if (TransformApp14Marker(s, &out)) {
-    (*transformed_marker_count)++;
-    return out;
-  }
-  return s;
+  Append(metadata, s.data(), s.size());
 }
 
 int GetQuantTableId(const JPEGQuantTable& q, bool is_chroma,
@@ -568,6 +593,13 @@ std::unique_ptr<EntropyCodes> EntropySource::Finish(
       new EntropyCodes(histograms, num_bands_, offsets));
 }
 
+std::unique_ptr<EntropyCodes> EntropySource::FinishFixed() {
+  std::vector<Histogram> histograms;
+  histograms.swap(histograms_);
+  return std::unique_ptr<EntropyCodes>(
+      new EntropyCodes(histograms, num_bands_));
+}
+
 void EntropySource::Merge(const EntropySource& other) {
   BRUNSLI_DCHECK(histograms_.size() >= other.histograms_.size());
   for (size_t i = 0; i < other.histograms_.size(); ++i) {
@@ -583,6 +615,43 @@ EntropyCodes::EntropyCodes(const std::vector<Histogram>& histograms,
                              &context_map_);
 }
 
+EntropyCodes::EntropyCodes(const std::vector<Histogram>& histograms,
+                           size_t num_bands) {
+  // Keep as many average contexts per band as the histogram limit allows;
+  // the rest is folded into the last kept one. With large context sets
+  // neighbouring bands are merged as well.
+  const size_t max_histograms = kMaxNumberOfHistograms;
+  const size_t per_band = std::max<size_t>(
+      1, std::min(kNumAvrgContexts, max_histograms / num_bands));
+  const size_t num_kept = num_bands * per_band;
+  const size_t num_folded = std::min(num_kept, max_histograms);
+  std::vector<Histogram> folded(num_folded);
+  context_map_.resize(num_bands * kNumAvrgContexts);
+  for (size_t band = 0; band < num_bands; ++band) {
+    for (size_t ctx = 0; ctx < kNumAvrgContexts; ++ctx) {
+      const size_t i = band * kNumAvrgContexts + ctx;
+      const size_t kept = band * per_band + std::min(ctx, per_band - 1);
+      const size_t dst = kept * num_folded / num_kept;
+      folded[dst].AddHistogram(histograms[i]);
+      context_map_[i] = static_cast<uint32_t>(dst);
+    }
+  }
+  // Empty histograms share a single entropy code; codes are numbered in the
+  // order of the first use, as EncodeContextMap expects.
+  const uint32_t kUnassigned = ~0u;
+  std::vector<uint32_t> new_index(folded.size(), kUnassigned);
+  uint32_t empty_index = kUnassigned;
+  for (uint32_t& entry : context_map_) {
+    const Histogram& h = folded[entry];
+    uint32_t* index = (h.total_count_ == 0) ? &empty_index : &new_index[entry];
+    if (*index == kUnassigned) {
+      *index = static_cast<uint32_t>(clustered_.size());
+      clustered_.push_back(h);
+    }
+    entry = *index;
+  }
+}
+
 void EntropyCodes::EncodeContextMap(Storage* storage) const {
   brunsli::EncodeContextMap(context_map_, clustered_.size(), storage);
 }
@@ -608,10 +677,14 @@ DataStream::DataStream()
       low_(0),
       high_(~0),
       bw_val_(0),
-      bw_bitpos_(0) {}
+      bw_bitpos_(0),
+      use_decay_prob_(false),
+      cost_tracker_(nullptr),
+      cost_slot_(0) {}
 
 void DataStream::Resize(size_t max_num_code_words) {
   code_words_.resize(max_num_code_words);
+  if (cost_tracker_ != nullptr) cost_slots_.resize(max_num_code_words);
 }
 
 void DataStream::ResizeForBlock() {
@@ -621,9 +694,15 @@ void DataStream::ResizeForBlock() {
         static_cast<size_t>(kGrowMult * code_words_.capacity()) +
         kSlackForOneBlock;
     code_words_.resize(new_size);
+    if (cost_tracker_ != nullptr) cost_slots_.resize(new_size);
   }
 }
 
+void DataStream::SetCostTracker(CostTracker* tracker) {
+  cost_tracker_ = tracker;
+  if (tracker != nullptr) cost_slots_.resize(code_words_.size());
+}
+
 void DataStream::AddCode(size_t code, size_t band, size_t context,
                          EntropySource* s) {
   size_t histo_ix = band * kNumAvrgContexts + context;
@@ -633,11 +712,21 @@ void DataStream::AddCode(size_t code, size_t band, size_t context,
   word.nbits = 0;
   word.value = 0;
   BRUNSLI_DCHECK(static_cast<size_t>(pos_) < code_words_.size());
+  if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+    // Bits are counted in EncodeCodeWords, when ANS tables are known.
+    cost_tracker_->costs[cost_slot_].count++;
+    cost_slots_[pos_] = static_cast<uint32_t>(cost_slot_);
+  }
   code_words_[pos_++] = word;
-  s->AddCode(code, histo_ix);
+  if (s != nullptr) s->AddCode(code, histo_ix);
 }
 
 void DataStream::AddBits(int nbits, int bits) {
+  if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+    CostTracker::Cost& cost = cost_tracker_->costs[cost_slot_];
+    cost.count++;
+    cost.bits += nbits;
+  }
   bw_val_ |= (bits << bw_bitpos_);
   bw_bitpos_ += nbits;
   if (bw_bitpos_ > 16) {
@@ -672,7 +761,22 @@ void DataStream::FlushBitWriter() {
 // probability, i.e. P(bit = 0) = prob / 256. Statistics are updated in 'p'.
 void DataStream::AddBit(Prob* const p, int bit) {
   const uint8_t prob = p->get_proba();
-  p->Add(bit);
+  if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+    CostTracker::Cost& cost = cost_tracker_->costs[cost_slot_];
+    // Zero probability still leaves a tiny range for "0".
+    const int prob0 = std::max<int>(prob, 1);
+    cost.count++;
+    cost.bits += 8.0 - std::log2(bit ? 256 - prob0 : prob0);
+  }
+  if (use_decay_prob_) {
+    p->AddDecay(bit);
+  } else {
+    p->Add(bit);
+  }
+  EncodeBit(prob, bit);
+}
+
+void DataStream::EncodeBit(uint8_t prob, int bit) {
   const uint32_t diff = high_ - low_;
   const uint32_t split = low_ + (((uint64_t)diff * prob) >> 8);
   if (bit) {
@@ -692,6 +796,45 @@ void DataStream::AddBit(Prob* const p, int bit) {
   }
 }
 
+void DataStream::AddSymbol(SymbolProb* const p, size_t val) {
+  BRUNSLI_DCHECK(val < SymbolProb::kSize);
+  const uint32_t diff = high_ - low_;
+  const uint32_t total = p->total();
+  if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+    CostTracker::Cost& cost = cost_tracker_->costs[cost_slot_];
+    const uint16_t* cumul = p->cumul();
+    cost.count++;
+    cost.bits += std::log2(static_cast<double>(total) /
+                           (cumul[val + 1] - cumul[val]));
+  }
+  if (BRUNSLI_PREDICT_FALSE(diff < total)) {
+    // Range is too narrow to fit all the symbols; use equiprobable bits.
+    for (size_t mask = SymbolProb::kSize >> 1; mask != 0; mask >>= 1) {
+      EncodeBit(128, (val & mask) != 0);
+    }
+    p->Add(val);
+    return;
+  }
+  const uint32_t range = diff / total;
+  const uint16_t* cumul = p->cumul();
+  // Symbol |val| occupies [low + range * cumul[val] + (val ? 1 : 0),
+  // low + range * cumul[val + 1]]; the last symbol gets the remainder.
+  const uint32_t low = low_;
+  if (val + 1 < SymbolProb::kSize) high_ = low + range * cumul[val + 1];
+  if (val > 0) low_ = low + range * cumul[val] + 1;
+  p->Add(val);
+  if (((low_ ^ high_) >> 16) == 0) {
+    code_words_[ac_pos0_].value = high_ >> 16;
+    code_words_[ac_pos0_].nbits = 16;
+    ac_pos0_ = ac_pos1_;
+    ac_pos1_ = pos_;
+    ++pos_;
+    low_ <<= 16;
+    high_ <<= 16;
+    high_ |= 0xffff;
+  }
+}
+
 void DataStream::EncodeCodeWords(EntropyCodes* s, Storage* storage) {
   FlushBitWriter();
   FlushArithmeticCoder();
@@ -702,6 +845,10 @@ void DataStream::EncodeCodeWords(EntropyCodes* s, Storage* storage) {
       const ANSEncSymbolInfo info =
           s->GetANSTable(word->context)->info_[word->code];
       word->value = ans.PutSymbol(info, &word->nbits);
+      if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+        cost_tracker_->costs[cost_slots_[i]].bits +=
+            BRUNSLI_ANS_LOG_TAB_SIZE - std::log2(info.freq_);
+      }
     }
   }
   const uint32_t state = ans.GetState();
@@ -733,15 +880,136 @@ void EncodeNumNonzeros(size_t val, Prob* p, DataStream* data_stream) {
   }
 }
 
-// Or'ing of all coeffs [1..63], for quick zero-test:
-coeff_t CollectAllCoeffs(const coeff_t coeffs[kDCTBlockSize]) {
+// Sets block_state of the component blocks to whether block is empty, i.e.
+// both DC prediction error and AC coefficients [1..63] are zero.
+// Kernels process a whole component: the dispatched call is made once per
+// component, while the block test is inlined into the loop.
+typedef void (*FindEmptyBlocksFn)(const ComponentMeta& m);
+
+// AC coefficients are not loaded at all if DC prediction error is non-zero.
+#define BRUNSLI_FIND_EMPTY_BLOCKS(HAS_NONZERO_AC, m)                     \
+  for (int y = 0; y < m.height_in_blocks; ++y) {                         \
+    const coeff_t* dc = m.dc_prediction_errors + y * m.dc_stride;        \
+    const coeff_t* ac = m.ac_coeffs + y * m.ac_stride;                   \
+    uint8_t* block_state = m.block_state + y * m.b_stride;               \
+    for (int x = 0; x < m.width_in_blocks; ++x) {                        \
+      block_state[x] =                                                   \
+          (dc[x] == 0) && !HAS_NONZERO_AC(ac + x * kDCTBlockSize);       \
+    }                                                                    \
+  }
+
+static BRUNSLI_INLINE bool HasNonzeroAcScalar(const coeff_t* coeffs) {
   coeff_t all_coeffs = 0;
   for (int k = 1; all_coeffs == 0 && k < kDCTBlockSize; ++k) {
     all_coeffs |= coeffs[k];
   }
+  return all_coeffs != 0;
+}
+
+void FindEmptyBlocksScalar(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcScalar, m);
+}
+
+#if defined(BRUNSLI_X86_DISPATCH)
+BRUNSLI_ATTRIBUTE_TARGET("sse2")
+static BRUNSLI_INLINE __m128i OrAcCoeffsSSE2(const coeff_t* coeffs) {
+  const __m128i* in = reinterpret_cast<const __m128i*>(coeffs);
+  const __m128i no_dc = _mm_setr_epi16(0, -1, -1, -1, -1, -1, -1, -1);
+  __m128i all_coeffs = _mm_and_si128(_mm_loadu_si128(in), no_dc);
+  for (size_t i = 1; i < kDCTBlockSize / 8; ++i) {
+    all_coeffs = _mm_or_si128(all_coeffs, _mm_loadu_si128(in + i));
+  }
   return all_coeffs;
 }
 
+BRUNSLI_ATTRIBUTE_TARGET("sse2")
+static BRUNSLI_INLINE bool HasNonzeroAcSSE2(const coeff_t* coeffs) {
+  const __m128i all_coeffs = OrAcCoeffsSSE2(coeffs);
+  const __m128i is_zero = _mm_cmpeq_epi16(all_coeffs, _mm_setzero_si128());
+  return _mm_movemask_epi8(is_zero) != 0xFFFF;
+}
+
+BRUNSLI_ATTRIBUTE_TARGET("sse2")
+void FindEmptyBlocksSSE2(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcSSE2, m);
+}
+
+// PTEST replaces compare + movemask.
+BRUNSLI_ATTRIBUTE_TARGET("sse4.1")
+static BRUNSLI_INLINE bool HasNonzeroAcSSE4(const coeff_t* coeffs) {
+  const __m128i all_coeffs = OrAcCoeffsSSE2(coeffs);
+  return !_mm_testz_si128(all_coeffs, all_coeffs);
+}
+
+BRUNSLI_ATTRIBUTE_TARGET("sse4.1")
+void FindEmptyBlocksSSE4(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcSSE4, m);
+}
+
+BRUNSLI_ATTRIBUTE_TARGET("avx2")
+static BRUNSLI_INLINE bool HasNonzeroAcAVX2(const coeff_t* coeffs) {
+  const __m256i* in = reinterpret_cast<const __m256i*>(coeffs);
+  const __m256i no_dc = _mm256_setr_epi16(0, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1);
+  __m256i all_coeffs = _mm256_and_si256(_mm256_loadu_si256(in), no_dc);
+  for (size_t i = 1; i < kDCTBlockSize / 16; ++i) {
+    all_coeffs = _mm256_or_si256(all_coeffs, _mm256_loadu_si256(in + i));
+  }
+  return !_mm256_testz_si256(all_coeffs, all_coeffs);
+}
+
+BRUNSLI_ATTRIBUTE_TARGET("avx2")
+void FindEmptyBlocksAVX2(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcAVX2, m);
+}
+
+// Block fits into two registers; only AVX-512F instructions are used.
+BRUNSLI_ATTRIBUTE_TARGET("avx512f")
+static BRUNSLI_INLINE bool HasNonzeroAcAVX512(const coeff_t* coeffs) {
+  // DC is the lower half of the first 32-bit lane.
+  const __m512i no_dc = _mm512_set_epi32(-1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -65536);
+  const __m512i all_coeffs =
+      _mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512(coeffs), no_dc),
+                      _mm512_loadu_si512(coeffs + 32));
+  return _mm512_test_epi32_mask(all_coeffs, all_coeffs) != 0;
+}
+
+BRUNSLI_ATTRIBUTE_TARGET("avx512f")
+void FindEmptyBlocksAVX512(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcAVX512, m);
+}
+#endif  // defined(BRUNSLI_X86_DISPATCH)
+
+#if defined(BRUNSLI_NEON_DISPATCH)
+static BRUNSLI_INLINE bool HasNonzeroAcNEON(const coeff_t* coeffs) {
+  int16x8_t all_coeffs = vsetq_lane_s16(0, vld1q_s16(coeffs), 0);
+  for (size_t i = 1; i < kDCTBlockSize / 8; ++i) {
+    all_coeffs = vorrq_s16(all_coeffs, vld1q_s16(coeffs + 8 * i));
+  }
+  const uint64x2_t halves = vreinterpretq_u64_s16(all_coeffs);
+  return (vgetq_lane_u64(halves, 0) | vgetq_lane_u64(halves, 1)) != 0;
+}
+
+void FindEmptyBlocksNEON(const ComponentMeta& m) {
+  BRUNSLI_FIND_EMPTY_BLOCKS(HasNonzeroAcNEON, m);
+}
+#endif  // defined(BRUNSLI_NEON_DISPATCH)
+
+#undef BRUNSLI_FIND_EMPTY_BLOCKS
+
+FindEmptyBlocksFn GetFindEmptyBlocks() {
+  static const FindEmptyBlocksFn kImplementations[kNumCpuTargets] = {
+      FindEmptyBlocksScalar,
+      BRUNSLI_X86_KERNEL(FindEmptyBlocksSSE2),
+      BRUNSLI_X86_KERNEL(FindEmptyBlocksSSE4),
+      BRUNSLI_X86_KERNEL(FindEmptyBlocksAVX2),
+      BRUNSLI_X86_KERNEL(FindEmptyBlocksAVX512),
+      BRUNSLI_NEON_KERNEL(FindEmptyBlocksNEON)};
+  static CpuDispatch<FindEmptyBlocksFn> dispatch(kImplementations);
+  return dispatch.Get();
+}
+
 void EncodeCoeffOrder(const uint32_t* order, DataStream* data_stream) {
   uint32_t order_zigzag[kDCTBlockSize];
   for (size_t i = 0; i < kDCTBlockSize; ++i) {
@@ -805,10 +1073,13 @@ static void EncodeValue(uint8_t tag, size_t value, uint8_t* data, size_t* pos) {
   *pos += EncodeBase128(value, data + *pos);
 }
 
+int GetVersion(const JPEGData& jpg, const State& state) {
+  return (state.params.version >= 0) ? state.params.version : jpg.version;
+}
+
 bool EncodeHeader(const JPEGData& jpg, State* state, uint8_t* data,
                   size_t* len) {
-  BRUNSLI_UNUSED(state);
-  size_t version = jpg.version;
+  size_t version = GetVersion(jpg, *state);
   bool is_fallback = ((version & 1) == kFallbackVersion);
   // Fallback can not be combined with anything else.
   if (is_fallback && (version != kFallbackVersion)) return false;
@@ -817,8 +1088,7 @@ bool EncodeHeader(const JPEGData& jpg, State* state, uint8_t* data,
       jpg.components.empty() || jpg.components.size() > kMaxComponents) {
     return false;
   }
-  // Only 3 bits are defined.
-  if (version & ~7u) return false;
+  if (version & ~static_cast<size_t>(kVersionMask)) return false;
 
   size_t version_comp = (jpg.components.size() - 1) | (version << 2);
   size_t subsampling = FrameTypeCode(jpg);
@@ -828,6 +1098,11 @@ bool EncodeHeader(const JPEGData& jpg, State* state, uint8_t* data,
   EncodeValue(kBrunsliHeaderHeightTag, jpg.height, data, &pos);
   EncodeValue(kBrunsliHeaderVersionCompTag, version_comp, data, &pos);
   EncodeValue(kBrunsliHeaderSubsamplingTag, subsampling, data, &pos);
+  if (version & kACSegmentsVersion) {
+    if (state->ac_segment_mcu_rows <= 0) return false;
+    EncodeValue(kBrunsliHeaderACSegmentRowsTag, state->ac_segment_mcu_rows,
+                data, &pos);
+  }
 
   *len = pos;
   return true;
@@ -840,8 +1115,7 @@ bool EncodeMetaData(const JPEGData& jpg, State* state, uint8_t* data,
   std::vector<uint8_t> metadata;
   size_t transformed_marker_count = 0;
   for (size_t i = 0; i < jpg.app_data.size(); ++i) {
-    const auto& s = jpg.app_data[i];
-    Append(&metadata, TransformAppMarker(s, &transformed_marker_count));
+    AppendAppMarker(jpg.app_data[i], &transformed_marker_count, &metadata);
   }
   if (transformed_marker_count > kBrunsliShortMarkerLimit) {
     BRUNSLI_LOG_ERROR() << "Too many short markers: "
@@ -861,7 +1135,7 @@ bool EncodeMetaData(const JPEGData& jpg, State* state, uint8_t* data,
     return false;
   }
   for (const auto& s : jpg.com_data) {
-    Append(&metadata, s);
+    Append(&metadata, s.data(), s.size());
   }
   if (!jpg.tail_data.empty()) {
     const uint8_t marker[] = {0xD9};
@@ -882,6 +1156,7 @@ bool EncodeMetaData(const JPEGData& jpg, State* state, uint8_t* data,
 
   // Write the compressed metadata directly to the output.
   size_t compressed_size = *len - pos;
+  BRUNSLI_TRACE_SCOPE("BrotliEncoderCompress");
   if (!BrotliEncoderCompress(kBrotliQuality, kBrotliWindowBits,
                              BROTLI_DEFAULT_MODE, metadata.size(),
                              metadata.data(), &compressed_size, &data[pos])) {
@@ -997,27 +1272,36 @@ bool EncodeSection(const JPEGData& jpg, State* s, uint8_t tag,
 namespace internal {
 namespace enc {
 
-size_t SampleNumNonZeros(ComponentMeta* m) {
+// Adds zero coefficients of every |block_stride|-th block to m->num_zeros;
+// returns the number of visited blocks.
+static size_t CountZeroCoeffs(ComponentMeta* m, size_t block_stride) {
   size_t num_blocks = m->width_in_blocks * m->height_in_blocks;
-  if (num_blocks < 32 * 32) return kDCTBlockSize * num_blocks;
-
   const coeff_t* coeffs = m->ac_coeffs;
   size_t stride = m->ac_stride;
   size_t width_in_blocks = m->width_in_blocks;
   BlockI32& num_zeros = m->num_zeros;
 
-  // For faster compression we only go over a sample of the blocks here.
-  static const int kStride = 5;
-  size_t total_nonzeros = 0;
-  for (size_t i = 0; i < num_blocks; i += kStride) {
+  size_t num_visited = 0;
+  for (size_t i = 0; i < num_blocks; i += block_stride) {
     size_t x = i % width_in_blocks;
     size_t y = i / width_in_blocks;
     const coeff_t* block = coeffs + x * kDCTBlockSize + y * stride;
     for (size_t k = 0; k < kDCTBlockSize; ++k) {
       if (block[k] == 0) ++num_zeros[k];
     }
-    total_nonzeros += kDCTBlockSize;
+    ++num_visited;
   }
+  return num_visited;
+}
+
+size_t SampleNumNonZeros(ComponentMeta* m) {
+  size_t num_blocks = m->width_in_blocks * m->height_in_blocks;
+  if (num_blocks < 32 * 32) return kDCTBlockSize * num_blocks;
+
+  // For faster compression we only go over a sample of the blocks here.
+  static const int kStride = 5;
+  size_t total_nonzeros = kDCTBlockSize * CountZeroCoeffs(m, kStride);
+  BlockI32& num_zeros = m->num_zeros;
   for (size_t i = 0; i < kDCTBlockSize; ++i) total_nonzeros -= num_zeros[i];
   num_zeros[0] = 0;  // DC coefficient is always the first one.
   return total_nonzeros * kStride;
@@ -1084,6 +1368,7 @@ bool CalculateMeta(const JPEGData& jpg, State* state) {
 }
 
 void EncodeDC(State* state) {
+  BRUNSLI_TRACE_SCOPE("EncodeDC");
   const std::vector<ComponentMeta>& meta = state->meta;
   const size_t num_components = meta.size();
   const int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
@@ -1091,14 +1376,19 @@ void EncodeDC(State* state) {
   DataStream& data_stream = state->data_stream_dc;
 
   std::vector<ComponentStateDC> comps(num_components);
+  const FindEmptyBlocksFn find_empty_blocks = GetFindEmptyBlocks();
   size_t total_num_blocks = 0;
   for (size_t i = 0; i < num_components; ++i) {
     const ComponentMeta& m = meta[i];
     comps[i].SetWidth(m.width_in_blocks);
+    if (state->use_decay_prob) comps[i].InitDecay();
     total_num_blocks += m.width_in_blocks * m.height_in_blocks;
+    find_empty_blocks(m);
   }
   entropy_source.Resize(num_components);
   data_stream.Resize(3u * total_num_blocks + 128u);
+  data_stream.SetDecayAdaptation(state->use_decay_prob);
+  data_stream.SetCostTracker(state->dc_costs);
 
   // We encode image components in the following interleaved manner:
   //   v_samp[0] rows of 8x8 blocks from component 0
@@ -1116,7 +1406,6 @@ void EncodeDC(State* state) {
       ComponentStateDC* c = &comps[i];
       const ComponentMeta& m = meta[i];
       const int width = c->width;
-      const int ac_stride = m.ac_stride;
       const int dc_stride = m.dc_stride;
       const int b_stride = m.b_stride;
       int y = mcu_y * m.v_samp;
@@ -1124,29 +1413,30 @@ void EncodeDC(State* state) {
       int* prev_abs = &c->prev_abs_coeff[2];
       for (int iy = 0; iy < m.v_samp; ++iy, ++y) {
         const coeff_t* dc_coeffs_in = m.dc_prediction_errors + y * dc_stride;
-        const coeff_t* ac_coeffs_in = m.ac_coeffs + y * ac_stride;
         uint8_t* block_state = m.block_state + y * b_stride;
         for (int x = 0; x < width; ++x) {
           data_stream.ResizeForBlock();
           const coeff_t coeff = dc_coeffs_in[0];
           const int sign = (coeff > 0) ? 1 : (coeff < 0) ? 2 : 0;
           const int absval = (sign == 2) ? -coeff : coeff;
-          const coeff_t all_coeffs = coeff | CollectAllCoeffs(ac_coeffs_in);
-          const bool is_empty_block = (all_coeffs == 0);
+          const bool is_empty_block = (*block_state != 0);
           const int is_empty_ctx =
               IsEmptyBlockContext(&c->prev_is_nonempty[1], x);
+          data_stream.SetCostSlot(i, kDCTBlockSize, CostSymbol::kEmptyBlock);
           data_stream.AddBit(&c->is_empty_block_prob[is_empty_ctx],
                              !is_empty_block);
           c->prev_is_nonempty[x + 1] = !is_empty_block;
-          *block_state = is_empty_block;
           if (!is_empty_block) {
             const int is_zero = (coeff == 0);
+            data_stream.SetCostSlot(i, 0, CostSymbol::kIsZero);
             data_stream.AddBit(&c->is_zero_prob, is_zero);
             if (!is_zero) {
               const int avrg_ctx = WeightedAverageContextDC(prev_abs, x);
               const int sign_ctx = prev_sgn[x] * 3 + prev_sgn[x - 1];
+              data_stream.SetCostSlot(i, 0, CostSymbol::kSign);
               data_stream.AddBit(&c->sign_prob[sign_ctx], sign - 1);
               const size_t zdens_ctx = i;
+              data_stream.SetCostSlot(i, 0, CostSymbol::kMagnitude);
               if (absval <= kNumDirectCodes) {
                 data_stream.AddCode(absval - 1, zdens_ctx,
                                     static_cast<uint32_t>(avrg_ctx),
@@ -1155,6 +1445,7 @@ void EncodeDC(State* state) {
                 int nbits = Log2FloorNonZero(absval - kNumDirectCodes + 1) - 1;
                 data_stream.AddCode(kNumDirectCodes + nbits, zdens_ctx,
                                     avrg_ctx, &entropy_source);
+                data_stream.SetCostSlot(i, 0, CostSymbol::kExtraBits);
                 int extra_bits = absval - (kNumDirectCodes - 1 + (2 << nbits));
                 int first_extra_bit = (extra_bits >> nbits) & 1;
                 data_stream.AddBit(&c->first_extra_bit_prob[nbits],
@@ -1170,21 +1461,95 @@ void EncodeDC(State* state) {
           prev_abs[x] = absval;
           ++block_state;
           ++dc_coeffs_in;
-          ac_coeffs_in += kDCTBlockSize;
         }
       }
     }
   }
 }
 
-void EncodeAC(State* state) {
-  const std::vector<ComponentMeta>& meta = state->meta;
+// Loads AC coefficients of the block in coding order; returns the position
+// of the last non-zero one, or 0 if there is none.
+static BRUNSLI_INLINE int LoadACCoeffs(const coeff_t* coeffs_in,
+                                       const uint32_t* order,
+                                       coeff_t coeffs[kDCTBlockSize]) {
+  int last_nz = 0;
+  for (int k = 1; k < kDCTBlockSize; ++k) {
+    coeffs[k] = coeffs_in[order[k]];
+    if (coeffs[k]) last_nz = k;
+  }
+  return last_nz;
+}
+
+// Surroundings of the block seen by AC context model; shared by EncodeAC and
+// CollectACHistograms, so that both produce the same histogram indices.
+struct ACNeighbourhood {
+  const uint8_t* context_modes;
+  const int* mult_row;
+  const int* mult_col;
+  // Block above; used only if |has_row|.
+  const coeff_t* prev_row_coeffs;
+  // Block to the left; used only if |has_col|.
+  const coeff_t* prev_col_coeffs;
+  bool has_row;
+  bool has_col;
+  // Absolute values (and signs, if tracked) of coefficients of the current
+  // block position in ComponentState::prev_abs_coeff layout.
+  const int* prev_abs;
+  const int* prev_sgn;
+  int prev_row_delta;
+};
+
+// Returns "average" context of the coefficient at position |k| (coding
+// order); |*sign_ctx| is set to sign context (not yet combined with |k|).
+// If signs are not tracked, the sign context is not meaningful.
+static BRUNSLI_INLINE size_t ACCoeffContext(const ACNeighbourhood& n, int k,
+                                            int k_nat,
+                                            const coeff_t* encoded_coeffs,
+                                            size_t* sign_ctx) {
+  const size_t context_type = n.context_modes[k_nat];
+  size_t avg_ctx = 0;
+  *sign_ctx = kMaxAverageContext;
+  if ((context_type & 1) && n.has_row) {
+    const size_t offset = k_nat & 7;
+    ACPredictContextRow(n.prev_row_coeffs + offset, encoded_coeffs + offset,
+                        &n.mult_col[offset * 8], &avg_ctx, sign_ctx);
+  } else if ((context_type & 2) && n.has_col) {
+    const size_t offset = k_nat & ~7;
+    ACPredictContextCol(n.prev_col_coeffs + offset, encoded_coeffs + offset,
+                        &n.mult_row[offset], &avg_ctx, sign_ctx);
+  } else if (!context_type) {
+    avg_ctx = WeightedAverageContext(n.prev_abs + k, n.prev_row_delta);
+    if (n.prev_sgn != nullptr) {
+      *sign_ctx = n.prev_sgn[k] * 3 + n.prev_sgn[k - kDCTBlockSize];
+    }
+  }
+  return avg_ctx;
+}
+
+// Returns entropy code of non-zero coefficient magnitude; for escape codes
+// |*nbits| + 1 extra bits follow.
+static BRUNSLI_INLINE size_t ACMagnitudeCode(int absval, int* nbits) {
+  if (absval <= kNumDirectCodes) {
+    *nbits = -1;
+    return absval - 1;
+  }
+  const int base_code = absval - kNumDirectCodes + 1;
+  *nbits = Log2FloorNonZero(base_code) - 1;
+  return kNumDirectCodes + *nbits;
+}
+
+// Encodes AC coefficients described by |meta| as if it were a whole image.
+// If |histograms| is not nullptr, then codes are recorded there.
+static void EncodeACSegment(const State& state,
+                            const std::vector<ComponentMeta>& meta,
+                            DataStream* data_stream_ptr,
+                            EntropySource* histograms) {
   const size_t num_components = meta.size();
   const int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
-  EntropySource& entropy_source = state->entropy_source;
-  DataStream& data_stream = state->data_stream_ac;
+  DataStream& data_stream = *data_stream_ptr;
   const uint8_t* context_modes =
-      kContextAlgorithm + (state->use_legacy_context_model ? 64 : 0);
+      kContextAlgorithm + (state.use_legacy_context_model ? 64 : 0);
+  const bool use_symbol_num_nonzeros = state.use_symbol_num_nonzeros;
 
   size_t num_code_words = 0;
   std::vector<ComponentState> comps(num_components);
@@ -1199,12 +1564,15 @@ void EncodeAC(State* state) {
     ComputeACPredictMultipliers(m.quant.data(), &comps[i].mult_row[0],
                                 &comps[i].mult_col[0]);
     comps[i].SetWidth(m.width_in_blocks);
+    if (state.use_decay_prob) comps[i].InitDecay();
   }
 
-  entropy_source.Resize(state->num_contexts);
   data_stream.Resize(num_code_words);
+  data_stream.SetDecayAdaptation(state.use_decay_prob);
+  data_stream.SetCostTracker(state.ac_costs);
 
   for (size_t i = 0; i < num_components; ++i) {
+    data_stream.SetCostSlot(i, kDCTBlockSize, CostSymbol::kCoeffOrder);
     EncodeCoeffOrder(&comps[i].order[0], &data_stream);
   }
 
@@ -1229,12 +1597,17 @@ void EncodeAC(State* state) {
       int y = mcu_y * m.v_samp;
       const int ac_stride = m.ac_stride;
       const int b_stride = m.b_stride;
-      int prev_row_delta = (1 - 2 * (y & 1)) * (width + 3) * kDCTBlockSize;
+      ACNeighbourhood n;
+      n.context_modes = context_modes;
+      n.mult_row = c->mult_row;
+      n.mult_col = c->mult_col;
+      n.prev_row_delta = (1 - 2 * (y & 1)) * (width + 3) * kDCTBlockSize;
       for (int iy = 0; iy < m.v_samp; ++iy, ++y) {
         const coeff_t* coeffs_in = m.ac_coeffs + y * ac_stride;
         const uint8_t* block_state = m.block_state + y * b_stride;
-        const coeff_t* prev_row_coeffs = coeffs_in - ac_stride;
-        const coeff_t* prev_col_coeffs = coeffs_in - kDCTBlockSize;
+        n.prev_row_coeffs = coeffs_in - ac_stride;
+        n.prev_col_coeffs = coeffs_in - kDCTBlockSize;
+        n.has_row = (y > 0);
         int* prev_sgn = &c->prev_sign[kDCTBlockSize];
         int* prev_abs =
             &c->prev_abs_coeff[((y & 1) * (width + 3) + 2) * kDCTBlockSize];
@@ -1244,75 +1617,63 @@ void EncodeAC(State* state) {
           int last_nz = 0;
           const bool is_empty_block = *block_state;
           if (!is_empty_block) {
-            for (int k = 1; k < kDCTBlockSize; ++k) {
-              const int k_nat = cur_order[k];
-              coeffs[k] = coeffs_in[k_nat];
-              if (coeffs[k]) last_nz = k;
-            }
+            last_nz = LoadACCoeffs(coeffs_in, cur_order, coeffs);
             const uint8_t nzero_context =
                 NumNonzerosContext(c->prev_num_nonzeros.data(), x, y);
-            EncodeNumNonzeros(
-                last_nz,
-                c->num_nonzero_prob + kNumNonZeroTreeSize * nzero_context,
-                &data_stream);
+            data_stream.SetCostSlot(i, kDCTBlockSize,
+                                    CostSymbol::kNumNonzeros);
+            if (use_symbol_num_nonzeros) {
+              data_stream.AddSymbol(
+                  &c->num_nonzero_symbol_prob[nzero_context], last_nz);
+            } else {
+              EncodeNumNonzeros(
+                  last_nz,
+                  c->num_nonzero_prob + kNumNonZeroTreeSize * nzero_context,
+                  &data_stream);
+            }
           }
           for (int k = kDCTBlockSize - 1; k > last_nz; --k) {
             prev_sgn[k] = 0;
             prev_abs[k] = 0;
           }
+          n.has_col = (x > 0);
+          n.prev_abs = prev_abs;
+          n.prev_sgn = prev_sgn;
           size_t num_nzeros = 0;
           coeff_t encoded_coeffs[kDCTBlockSize] = {0};
           for (int k = last_nz; k >= 1; --k) {
             coeff_t coeff = coeffs[k];
             const int is_zero = (coeff == 0);
+            const int k_nat = cur_order[k];
             if (k < last_nz) {
               const int bucket = kNonzeroBuckets[num_nzeros - 1];
               const int is_zero_ctx = bucket * kDCTBlockSize + k;
               Prob* const p = &c->is_zero_prob[is_zero_ctx];
+              data_stream.SetCostSlot(i, k_nat, CostSymbol::kIsZero);
               data_stream.AddBit(p, is_zero);
             }
             if (!is_zero) {
               const int sign = (coeff > 0 ? 0 : 1);
               const int absval = sign ? -coeff : coeff;
 
-              const int k_nat = cur_order[k];
-              size_t context_type = context_modes[k_nat];
-              size_t avg_ctx = 0;
-              size_t sign_ctx = kMaxAverageContext;
-              if ((context_type & 1) && (y > 0)) {
-                if (y > 0) {
-                  size_t offset = k_nat & 7;
-                  ACPredictContextRow(
-                      prev_row_coeffs + offset, encoded_coeffs + offset,
-                      &c->mult_col[offset * 8], &avg_ctx, &sign_ctx);
-                }
-              } else if ((context_type & 2) && (x > 0)) {
-                if (x > 0) {
-                  size_t offset = k_nat & ~7;
-                  ACPredictContextCol(
-                      prev_col_coeffs + offset, encoded_coeffs + offset,
-                      &c->mult_row[offset], &avg_ctx, &sign_ctx);
-                }
-              } else if (!context_type) {
-                avg_ctx = WeightedAverageContext(prev_abs + k, prev_row_delta);
-                sign_ctx = prev_sgn[k] * 3 + prev_sgn[k - kDCTBlockSize];
-              }
+              size_t sign_ctx;
+              const size_t avg_ctx =
+                  ACCoeffContext(n, k, k_nat, encoded_coeffs, &sign_ctx);
               sign_ctx = sign_ctx * kDCTBlockSize + k;
               Prob* const sign_p = &c->sign_prob[sign_ctx];
+              data_stream.SetCostSlot(i, k_nat, CostSymbol::kSign);
               data_stream.AddBit(sign_p, sign);
               prev_sgn[k] = sign + 1;
               const size_t zdens_ctx =
                   m.context_offset +
                   ZeroDensityContext(num_nzeros, k, cur_ctx_bits);
-              if (absval <= kNumDirectCodes) {
-                data_stream.AddCode(absval - 1, zdens_ctx, avg_ctx,
-                                    &entropy_source);
-              } else {
+              data_stream.SetCostSlot(i, k_nat, CostSymbol::kMagnitude);
+              int nbits;
+              const size_t code = ACMagnitudeCode(absval, &nbits);
+              data_stream.AddCode(code, zdens_ctx, avg_ctx, histograms);
+              if (absval > kNumDirectCodes) {
+                data_stream.SetCostSlot(i, k_nat, CostSymbol::kExtraBits);
                 const int base_code = absval - kNumDirectCodes + 1;
-                const int nbits = Log2FloorNonZero(base_code) - 1;
-                data_stream.AddCode(kNumDirectCodes + nbits, zdens_ctx,
-                                    static_cast<uint32_t>(avg_ctx),
-                                    &entropy_source);
                 const int extra_bits = base_code - (2 << nbits);
                 const int first_extra_bit = (extra_bits >> nbits) & 1;
                 Prob* const p = &c->first_extra_bit_prob[k * 10 + nbits];
@@ -1336,16 +1697,152 @@ void EncodeAC(State* state) {
           coeffs_in += kDCTBlockSize;
           prev_sgn += kDCTBlockSize;
           prev_abs += kDCTBlockSize;
-          prev_row_coeffs += kDCTBlockSize;
-          prev_col_coeffs += kDCTBlockSize;
+          n.prev_row_coeffs += kDCTBlockSize;
+          n.prev_col_coeffs += kDCTBlockSize;
         }
-        prev_row_delta *= -1;
+        n.prev_row_delta *= -1;
+      }
+    }
+  }
+}
+
+void EncodeAC(State* state) {
+  BRUNSLI_TRACE_SCOPE("EncodeAC");
+  // Histograms might be already collected by CollectACHistograms; in that
+  // case |entropy_source| could be concurrently used by clustering.
+  EntropySource* histograms = nullptr;
+  if (!state->ac_histograms_collected) {
+    state->entropy_source.Resize(state->num_contexts);
+    histograms = &state->entropy_source;
+  }
+
+  const int segment_mcu_rows = state->ac_segment_mcu_rows;
+  if (segment_mcu_rows == 0) {
+    EncodeACSegment(*state, state->meta, &state->data_stream_ac, histograms);
+    return;
+  }
+
+  // Each segment is coded as a separate image made of the corresponding rows.
+  const std::vector<ComponentMeta>& meta = state->meta;
+  const int mcu_rows = meta[0].height_in_blocks / meta[0].v_samp;
+  std::vector<DataStream>& segments = state->data_stream_ac_segments;
+  segments.clear();
+  segments.reserve((mcu_rows + segment_mcu_rows - 1) / segment_mcu_rows);
+  for (int mcu_y = 0; mcu_y < mcu_rows; mcu_y += segment_mcu_rows) {
+    const int num_rows = std::min(segment_mcu_rows, mcu_rows - mcu_y);
+    std::vector<ComponentMeta> band = meta;
+    for (ComponentMeta& m : band) {
+      const int y0 = mcu_y * m.v_samp;
+      m.ac_coeffs += y0 * m.ac_stride;
+      m.block_state += y0 * m.b_stride;
+      m.height_in_blocks = num_rows * m.v_samp;
+      m.approx_total_nonzeros =
+          m.approx_total_nonzeros * num_rows / mcu_rows;
+    }
+    segments.emplace_back();
+    EncodeACSegment(*state, band, &segments.back(), histograms);
+  }
+}
+
+void CollectACHistograms(const State& state, int mcu_y_begin, int mcu_y_end,
+                         EntropySource* entropy_source) {
+  BRUNSLI_TRACE_SCOPE("CollectACHistograms");
+  const std::vector<ComponentMeta>& meta = state.meta;
+  const size_t num_components = meta.size();
+  const uint8_t* context_modes =
+      kContextAlgorithm + (state.use_legacy_context_model ? 64 : 0);
+  entropy_source->Resize(state.num_contexts);
+
+  for (size_t i = 0; i < num_components; ++i) {
+    const ComponentMeta& m = meta[i];
+    const int width = m.width_in_blocks;
+    const int ac_stride = m.ac_stride;
+    const int cur_ctx_bits = m.context_bits;
+    uint32_t order[kDCTBlockSize];
+    int mult_row[kDCTBlockSize];
+    int mult_col[kDCTBlockSize];
+    ComputeCoeffOrder(m.num_zeros, order);
+    ComputeACPredictMultipliers(m.quant.data(), mult_row, mult_col);
+
+    // Same ring-buffer layout as ComponentState::prev_abs_coeff. Unlike
+    // EncodeAC, rows above the range are filled directly from coefficients.
+    std::vector<int> prev_abs_coeff(kDCTBlockSize * 2 * (width + 3));
+    const int y_begin = mcu_y_begin * m.v_samp;
+    const int y_end = std::min(mcu_y_end * m.v_samp, m.height_in_blocks);
+    // Rows above the AC segment start are not visible to the context model.
+    const int segment_rows = state.ac_segment_mcu_rows * m.v_samp;
+    const int segment_y_begin =
+        segment_rows ? y_begin - y_begin % segment_rows : 0;
+    for (int y = std::max(segment_y_begin, y_begin - 2); y < y_begin; ++y) {
+      const coeff_t* coeffs_in = m.ac_coeffs + y * ac_stride;
+      int* prev_abs =
+          &prev_abs_coeff[((y & 1) * (width + 3) + 2) * kDCTBlockSize];
+      for (int x = 0; x < width; ++x) {
+        for (int k = 1; k < kDCTBlockSize; ++k) {
+          prev_abs[k] = std::abs(coeffs_in[order[k]]);
+        }
+        coeffs_in += kDCTBlockSize;
+        prev_abs += kDCTBlockSize;
+      }
+    }
+
+    ACNeighbourhood n;
+    n.context_modes = context_modes;
+    n.mult_row = mult_row;
+    n.mult_col = mult_col;
+    n.prev_sgn = nullptr;
+    for (int y = y_begin; y < y_end; ++y) {
+      const int segment_y = segment_rows ? y % segment_rows : y;
+      if (segment_y == 0) {
+        std::fill(prev_abs_coeff.begin(), prev_abs_coeff.end(), 0);
+      }
+      n.prev_row_delta = (1 - 2 * (y & 1)) * (width + 3) * kDCTBlockSize;
+      const coeff_t* coeffs_in = m.ac_coeffs + y * ac_stride;
+      n.prev_row_coeffs = coeffs_in - ac_stride;
+      n.prev_col_coeffs = coeffs_in - kDCTBlockSize;
+      n.has_row = (segment_y > 0);
+      int* prev_abs =
+          &prev_abs_coeff[((y & 1) * (width + 3) + 2) * kDCTBlockSize];
+      for (int x = 0; x < width; ++x) {
+        coeff_t coeffs[kDCTBlockSize] = {0};
+        const int last_nz = LoadACCoeffs(coeffs_in, order, coeffs);
+        for (int k = kDCTBlockSize - 1; k > last_nz; --k) prev_abs[k] = 0;
+        n.has_col = (x > 0);
+        n.prev_abs = prev_abs;
+        size_t num_nzeros = 0;
+        coeff_t encoded_coeffs[kDCTBlockSize] = {0};
+        for (int k = last_nz; k >= 1; --k) {
+          const coeff_t coeff = coeffs[k];
+          if (coeff == 0) {
+            prev_abs[k] = 0;
+            continue;
+          }
+          const int absval = std::abs(coeff);
+          const int k_nat = order[k];
+          size_t sign_ctx;
+          const size_t avg_ctx =
+              ACCoeffContext(n, k, k_nat, encoded_coeffs, &sign_ctx);
+          const size_t zdens_ctx =
+              m.context_offset +
+              ZeroDensityContext(num_nzeros, k, cur_ctx_bits);
+          int nbits;
+          const size_t code = ACMagnitudeCode(absval, &nbits);
+          entropy_source->AddCode(code, zdens_ctx * kNumAvrgContexts + avg_ctx);
+          ++num_nzeros;
+          encoded_coeffs[k_nat] = coeff;
+          prev_abs[k] = absval;
+        }
+        coeffs_in += kDCTBlockSize;
+        prev_abs += kDCTBlockSize;
+        n.prev_row_coeffs += kDCTBlockSize;
+        n.prev_col_coeffs += kDCTBlockSize;
       }
     }
   }
 }
 
 std::unique_ptr<EntropyCodes> PrepareEntropyCodes(State* state) {
+  BRUNSLI_TRACE_SCOPE("PrepareEntropyCodes");
   std::vector<ComponentMeta>& meta = state->meta;
   const size_t num_components = meta.size();
   // Prepend DC context group (starts at 0).
@@ -1353,11 +1850,21 @@ std::unique_ptr<EntropyCodes> PrepareEntropyCodes(State* state) {
   for (size_t i = 0; i < num_components; ++i) {
     group_context_offsets[i + 1] = meta[i].context_offset;
   }
+  switch (state->params.context_map) {
+    case ContextMapMode::kFixed:
+      return state->entropy_source.FinishFixed();
+    case ContextMapMode::kGlobalClustered:
+      group_context_offsets.resize(1);
+      break;
+    case ContextMapMode::kClustered:
+      break;
+  }
   return state->entropy_source.Finish(group_context_offsets);
 }
 
 bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
                       uint8_t* data, size_t* len) {
+  BRUNSLI_TRACE_SCOPE("BrunsliSerialize");
   size_t pos = 0;
 
   // TODO(eustas): refactor to remove repetitive params.
@@ -1408,37 +1915,69 @@ bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
   }
 
   if (!(skip_sections & (1u << kBrunsliACDataTag))) {
-    ok = encode_section(kBrunsliACDataTag, EncodeACData,
-                        Base128Size(*len - pos));
-    if (!ok) return false;
+    if (state->ac_segment_mcu_rows == 0) {
+      ok = encode_section(kBrunsliACDataTag, EncodeACData,
+                          Base128Size(*len - pos));
+      if (!ok) return false;
+    }
+    // Each segment goes to a separate section.
+    for (DataStream& segment : state->data_stream_ac_segments) {
+      std::swap(state->data_stream_ac, segment);
+      ok = encode_section(kBrunsliACDataTag, EncodeACData,
+                          Base128Size(*len - pos));
+      std::swap(state->data_stream_ac, segment);
+      if (!ok) return false;
+    }
   }
 
   *len = pos;
   return true;
 }
 
-}  // namespace enc
-}  // namespace internal
+// Unlike SampleNumNonZeros, looks at all the blocks.
+static void CountNumZeros(ComponentMeta* m) {
+  m->num_zeros.fill(0);
+  CountZeroCoeffs(m, 1);
+  m->num_zeros[0] = 0;  // DC coefficient is always the first one.
+}
 
-/* Regular Brunsli workflow.
- *
- * For "groups" workflow, few more stages are required, see comments.
- */
-bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len) {
-  State state;
-  std::vector<ComponentMeta>& meta = state.meta;
+bool PrepareState(const JPEGData& jpg, State* state) {
+  BRUNSLI_TRACE_SCOPE("PrepareState");
+  std::vector<ComponentMeta>& meta = state->meta;
   size_t num_components = jpg.components.size();
-  state.use_legacy_context_model = !(jpg.version & 2);
+  const int version = GetVersion(jpg, *state);
+  state->use_legacy_context_model = !(version & 2);
+  state->use_symbol_num_nonzeros = (version & kSymbolNumNonzerosVersion) != 0;
+  state->use_decay_prob = (version & kDecayProbVersion) != 0;
 
-  if (!CalculateMeta(jpg, &state)) return false;
+  if (!CalculateMeta(jpg, state)) return false;
+  if (version & kACSegmentsVersion) {
+    state->ac_segment_mcu_rows = GetACSegmentMcuRows(jpg.MCU_rows);
+  }
   // Groups workflow: update width_in_blocks, height_in_blocks, ac_coeffs.
 
   for (size_t i = 0; i < num_components; ++i) {
-    meta[i].approx_total_nonzeros = SampleNumNonZeros(&state.meta[i]);
+    meta[i].approx_total_nonzeros = SampleNumNonZeros(&meta[i]);
   }
   // Groups workflow: reduce approx_total_nonzeros.
+  const EncodeParams& params = state->params;
+  if (!params.context_bits.empty() &&
+      params.context_bits.size() != num_components) {
+    return false;
+  }
   for (size_t i = 0; i < num_components; ++i) {
-    meta[i].context_bits = SelectContextBits(meta[i].approx_total_nonzeros + 1);
+    const int context_bits =
+        (params.context_bits.empty()
+             ? SelectContextBits(meta[i].approx_total_nonzeros + 1)
+             : params.context_bits[i]) +
+        params.context_bits_delta;
+    meta[i].context_bits = std::max(0, std::min(kNumSchemes - 1, context_bits));
+    if (params.coeff_order == CoeffOrderMode::kExact) {
+      CountNumZeros(&meta[i]);
+    } else if (params.coeff_order == CoeffOrderMode::kZigZag) {
+      // Equal statistics make ComputeCoeffOrder produce zig-zag order.
+      meta[i].num_zeros.fill(0);
+    }
   }
   // Groups workflow: distribute context_bits.
 
@@ -1448,22 +1987,38 @@ bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len) {
     meta[i].context_offset = num_contexts;
     num_contexts += kNumNonzeroContextSkip[meta[i].context_bits];
   }
-  state.num_contexts = num_contexts;
+  state->num_contexts = num_contexts;
 
-  std::vector<std::vector<coeff_t>> dc_prediction_errors(num_components);
+  state->dc_prediction_errors.resize(num_components);
   for (size_t i = 0; i < num_components; ++i) {
-    dc_prediction_errors[i].resize(meta[i].width_in_blocks *
-                                   meta[i].height_in_blocks);
-    meta[i].dc_prediction_errors = dc_prediction_errors[i].data();
+    state->dc_prediction_errors[i].resize(meta[i].width_in_blocks *
+                                          meta[i].height_in_blocks);
+    meta[i].dc_prediction_errors = state->dc_prediction_errors[i].data();
   }
 
-  if (!PredictDCCoeffs(&state)) return false;
+  if (!PredictDCCoeffs(state)) return false;
 
-  std::vector<std::vector<uint8_t>> block_state(num_components);
+  state->block_state.resize(num_components);
   for (size_t i = 0; i < num_components; ++i) {
-    block_state[i].resize(meta[i].width_in_blocks * meta[i].height_in_blocks);
-    meta[i].block_state = block_state[i].data();
+    state->block_state[i].resize(meta[i].width_in_blocks *
+                                 meta[i].height_in_blocks);
+    meta[i].block_state = state->block_state[i].data();
   }
+  return true;
+}
+
+}  // namespace enc
+}  // namespace internal
+
+/* Regular Brunsli workflow.
+ *
+ * For "groups" workflow, few more stages are required, see comments.
+ */
+static bool EncodeWithParams(const JPEGData& jpg, const EncodeParams& params,
+                             uint8_t* data, size_t* len) {
+  State state;
+  state.params = params;
+  if (!PrepareState(jpg, &state)) return false;
 
   EncodeDC(&state);
 
@@ -1478,6 +2033,288 @@ bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len) {
   return BrunsliSerialize(&state, jpg, 0, data, len);
 }
 
+bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len) {
+  return BrunsliEncodeJpeg(jpg, BRUNSLI_ENCODE_DEFAULT, data, len);
+}
+
+bool BrunsliEncodeJpeg(const JPEGData& jpg, BrunsliEncodeLevel level,
+                       uint8_t* data, size_t* len) {
+  EncodeParams params;
+  switch (level) {
+    case BRUNSLI_ENCODE_DEFAULT:
+      break;
+    case BRUNSLI_ENCODE_FAST:
+      params.context_bits_delta = -kNumSchemes;
+      params.coeff_order = CoeffOrderMode::kZigZag;
+      params.context_map = ContextMapMode::kFixed;
+      break;
+    case BRUNSLI_ENCODE_MAX: {
+      const BrunsliTaskRunner runner =
+          [](const std::function<void(size_t)>& task, size_t num_tasks) {
+            for (size_t i = 0; i < num_tasks; ++i) task(i);
+          };
+      return BrunsliEncodeJpegSearch(jpg, runner, 0, data, len);
+    }
+  }
+  return EncodeWithParams(jpg, params, data, len);
+}
+
+/* Parameter search: a greedy walk over the encoder choices. Each stage varies
+ * one choice of the best candidate found so far; candidates of a stage are
+ * encoded concurrently. The best candidate is the smallest one, ties are
+ * resolved in favour of the lower index, so the result depends only on the
+ * set of encoded candidates. Once the time budget is exhausted, candidates
+ * that have not started yet are skipped; the very first one is always
+ * encoded. */
+bool BrunsliEncodeJpegSearch(const JPEGData& jpg,
+                             const BrunsliTaskRunner& runner,
+                             uint32_t time_budget_ms, uint8_t* data,
+                             size_t* len) {
+  if (jpg.version == kFallbackVersion) {
+    return EncodeWithParams(jpg, EncodeParams(), data, len);
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const auto out_of_time = [&start, time_budget_ms]() {
+    if (time_budget_ms == 0) return false;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed >= std::chrono::milliseconds(time_budget_ms);
+  };
+  const size_t max_size = GetMaximumBrunsliEncodedSize(jpg);
+
+  // Context bits chosen by the encoder for each component before
+  // context_bits_delta is applied; they do not depend on the version.
+  std::vector<int> base_context_bits;
+  {
+    State state;
+    if (!CalculateMeta(jpg, &state)) return false;
+    for (ComponentMeta& m : state.meta) {
+      base_context_bits.push_back(SelectContextBits(SampleNumNonZeros(&m) + 1));
+    }
+  }
+  const auto effective_context_bits = [&base_context_bits](int delta) {
+    std::vector<int> result;
+    for (int bits : base_context_bits) {
+      result.push_back(std::max(0, std::min(kNumSchemes - 1, bits + delta)));
+    }
+    return result;
+  };
+
+  EncodeParams best;
+  std::vector<uint8_t> best_output;
+  // Returns false if none of the candidates could be encoded.
+  const auto run_stage = [&](const std::vector<EncodeParams>& candidates) {
+    std::vector<std::vector<uint8_t>> outputs(candidates.size());
+    std::vector<char> ok(candidates.size());
+    runner(
+        [&](size_t i) {
+          if (out_of_time() && (i != 0 || !best_output.empty())) return;
+          outputs[i].resize(max_size);
+          size_t size = max_size;
+          ok[i] =
+              EncodeWithParams(jpg, candidates[i], outputs[i].data(), &size);
+          outputs[i].resize(ok[i] ? size : 0);
+        },
+        candidates.size());
+    bool found = false;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (!ok[i]) continue;
+      if (best_output.empty() || outputs[i].size() < best_output.size()) {
+        best = candidates[i];
+        best_output.swap(outputs[i]);
+      }
+      found = true;
+    }
+    return found;
+  };
+
+  // Stage 1: context model and coding features; original version goes first.
+  const int kModelBits[] = {2, kSymbolNumNonzerosVersion, kDecayProbVersion};
+  std::vector<EncodeParams> candidates;
+  for (int mask = 0; mask < 8; ++mask) {
+    EncodeParams params;
+    params.version = jpg.version;
+    for (int j = 0; j < 3; ++j) {
+      if (mask & (1 << j)) params.version ^= kModelBits[j];
+    }
+    candidates.push_back(params);
+  }
+  if (!run_stage(candidates)) return false;
+
+  // Other stages: context set size, coefficient order, histogram clustering.
+  for (int stage = 0; stage < 3 && !out_of_time(); ++stage) {
+    candidates.clear();
+    EncodeParams params = best;
+    if (stage == 0) {
+      // Deltas clamped to the same context bits produce the same output.
+      std::set<std::vector<int>> seen = {
+          effective_context_bits(best.context_bits_delta)};
+      for (int delta : {-2, -1, 1, 2}) {
+        params.context_bits_delta = best.context_bits_delta + delta;
+        if (!seen.insert(effective_context_bits(params.context_bits_delta))
+                 .second) {
+          continue;
+        }
+        candidates.push_back(params);
+      }
+    } else if (stage == 1) {
+      for (CoeffOrderMode mode : {CoeffOrderMode::kSampled,
+                                  CoeffOrderMode::kExact,
+                                  CoeffOrderMode::kZigZag}) {
+        if (mode == best.coeff_order) continue;
+        params.coeff_order = mode;
+        candidates.push_back(params);
+      }
+    } else {
+      for (ContextMapMode mode : {ContextMapMode::kClustered,
+                                  ContextMapMode::kGlobalClustered,
+                                  ContextMapMode::kFixed}) {
+        if (mode == best.context_map) continue;
+        params.context_map = mode;
+        candidates.push_back(params);
+      }
+    }
+    run_stage(candidates);
+  }
+
+  if (best_output.size() > *len) return false;
+  memcpy(data, best_output.data(), best_output.size());
+  *len = best_output.size();
+  return true;
+}
+
+/* Size estimation: sections that do not depend on the coefficients are
+ * encoded as is; DC and AC data is encoded for evenly spaced stripes of MCU
+ * rows, and its size is extrapolated. Stripes are encoded as a single image
+ * with the same context schemes as the whole image. */
+size_t BrunsliEstimateEncodedSize(const JPEGData& jpg) {
+  if (jpg.version == kFallbackVersion) {
+    return GetBrunsliBypassSize(jpg.original_jpg_size);
+  }
+  const size_t num_components = jpg.components.size();
+  if (num_components == 0 || jpg.MCU_rows <= 0 || jpg.MCU_cols <= 0) {
+    return 0;
+  }
+
+  State state;
+  if (!CalculateMeta(jpg, &state)) return 0;
+  if (jpg.version & kACSegmentsVersion) {
+    state.ac_segment_mcu_rows = GetACSegmentMcuRows(jpg.MCU_rows);
+  }
+  const uint32_t kDataSections = (1u << kBrunsliHistogramDataTag) |
+                                 (1u << kBrunsliDCDataTag) |
+                                 (1u << kBrunsliACDataTag);
+  size_t header_size = GetMaximumHeaderSize(jpg);
+  std::vector<uint8_t> buffer(header_size);
+  if (!BrunsliSerialize(&state, jpg, kDataSections, buffer.data(),
+                        &header_size)) {
+    return 0;
+  }
+
+  // Stripes of kStripeMcuRows rows; about 1/kSamplingRate of rows in total,
+  // but at least kMinSampleBlocks blocks, otherwise the cost of training the
+  // adaptive models is overrepresented.
+  static const int kStripeMcuRows = 6;
+  static const int kSamplingRate = 16;
+  static const size_t kMinSampleBlocks = 3072;
+  size_t blocks_per_mcu_row = 0;
+  for (const ComponentMeta& m : state.meta) {
+    blocks_per_mcu_row += static_cast<size_t>(m.width_in_blocks) * m.v_samp;
+  }
+  const int min_rows = static_cast<int>(std::min<size_t>(
+      jpg.MCU_rows,
+      (kMinSampleBlocks + blocks_per_mcu_row - 1) / blocks_per_mcu_row));
+  const int target_rows = std::max(
+      min_rows, (jpg.MCU_rows + kSamplingRate - 1) / kSamplingRate);
+  int num_stripes = (target_rows + kStripeMcuRows - 1) / kStripeMcuRows;
+  int stripe_rows = kStripeMcuRows;
+  if (num_stripes * kStripeMcuRows >= jpg.MCU_rows) {
+    num_stripes = 1;
+    stripe_rows = jpg.MCU_rows;
+  }
+  const int sample_mcu_rows = num_stripes * stripe_rows;
+  // Stripes are centered in equal parts of the image.
+  std::vector<int> stripe_start(num_stripes);
+  for (int i = 0; i < num_stripes; ++i) {
+    const int center = static_cast<int>(
+        (2 * i + 1) * static_cast<int64_t>(jpg.MCU_rows) / (2 * num_stripes));
+    stripe_start[i] = std::max(
+        0, std::min(center - stripe_rows / 2, jpg.MCU_rows - stripe_rows));
+  }
+
+  JPEGData sample;
+  sample.width = jpg.width;
+  sample.height = sample_mcu_rows * jpg.max_v_samp_factor * 8;
+  sample.version = jpg.version & ~kACSegmentsVersion;
+  sample.max_h_samp_factor = jpg.max_h_samp_factor;
+  sample.max_v_samp_factor = jpg.max_v_samp_factor;
+  sample.MCU_rows = sample_mcu_rows;
+  sample.MCU_cols = jpg.MCU_cols;
+  sample.quant = jpg.quant;
+  const double scale = static_cast<double>(jpg.MCU_rows) / sample_mcu_rows;
+  EncodeParams params;
+  params.version = sample.version;
+  params.context_bits.resize(num_components);
+  for (size_t i = 0; i < num_components; ++i) {
+    const JPEGComponent& c = jpg.components[i];
+    ComponentMeta& m = state.meta[i];
+    sample.components.emplace_back();
+    JPEGComponent& s = sample.components.back();
+    s.id = c.id;
+    s.h_samp_factor = c.h_samp_factor;
+    s.v_samp_factor = c.v_samp_factor;
+    s.quant_idx = c.quant_idx;
+    s.width_in_blocks = c.width_in_blocks;
+    s.height_in_blocks = sample_mcu_rows * c.v_samp_factor;
+    s.num_blocks = s.width_in_blocks * s.height_in_blocks;
+    s.coeffs.reserve(static_cast<size_t>(s.num_blocks) * kDCTBlockSize);
+    const size_t row_size = static_cast<size_t>(m.ac_stride) * m.v_samp;
+    for (int start : stripe_start) {
+      const coeff_t* in = m.ac_coeffs + row_size * start;
+      s.coeffs.insert(s.coeffs.end(), in, in + row_size * stripe_rows);
+    }
+    // Context bits are selected as by the encoder; unless the sample covers
+    // the whole image, non-zeros are counted on the sample rather than on a
+    // pass over all the blocks.
+    size_t num_nonzeros;
+    if (sample_mcu_rows == jpg.MCU_rows ||
+        m.width_in_blocks * m.height_in_blocks < 32 * 32) {
+      num_nonzeros = SampleNumNonZeros(&m);
+    } else {
+      const size_t num_zeros = static_cast<size_t>(
+          std::count(s.coeffs.begin(), s.coeffs.end(), 0));
+      num_nonzeros = static_cast<size_t>(
+          (s.coeffs.size() - num_zeros) * scale + 0.5);
+    }
+    params.context_bits[i] = SelectContextBits(num_nonzeros + 1);
+  }
+
+  State sample_state;
+  sample_state.params = params;
+  if (!PrepareState(sample, &sample_state)) return 0;
+  EncodeDC(&sample_state);
+  EncodeAC(&sample_state);
+  std::unique_ptr<EntropyCodes> entropy_codes =
+      PrepareEntropyCodes(&sample_state);
+  sample_state.entropy_codes = entropy_codes.get();
+  const uint32_t kAllSections = ~0u;
+  size_t histogram_size = GetMaximumBrunsliEncodedSize(sample);
+  buffer.resize(histogram_size);
+  if (!BrunsliSerialize(&sample_state, sample,
+                        kAllSections & ~(1u << kBrunsliHistogramDataTag),
+                        buffer.data(), &histogram_size)) {
+    return 0;
+  }
+  size_t data_size = buffer.size();
+  if (!BrunsliSerialize(&sample_state, sample,
+                        kAllSections & ~(1u << kBrunsliDCDataTag) &
+                            ~(1u << kBrunsliACDataTag),
+                        buffer.data(), &data_size)) {
+    return 0;
+  }
+  return header_size + histogram_size +
+         static_cast<size_t>(data_size * scale + 0.5);
+}
+
 #if defined(BRUNSLI_EXTRA_API)
 // The memory usage of BrunsliEncodeJpeg() looks roughly like this:
 // - either:
@@ -1581,4 +2418,165 @@ bool BrunsliEncodeJpegBypass(const uint8_t* jpg_data, size_t jpg_data_len,
   return true;
 }
 
+// Metadata rewriting
+
+size_t GetMaximumBrunsliMetadataRewriteSize(size_t len, const JPEGData& jpg) {
+  size_t metadata_size = 1 + jpg.tail_data.size();
+  for (const auto& data : jpg.app_data) {
+    metadata_size += data.size();
+  }
+  for (const auto& data : jpg.com_data) {
+    metadata_size += data.size();
+  }
+  // Section headers, base-128 metadata size and bit writer slack.
+  const size_t kExtraSize = 64;
+  return len + EstimateAuxDataSize(jpg) +
+         BrotliEncoderMaxCompressedSize(metadata_size) + kExtraSize;
+}
+
+bool BrunsliRewriteMetadata(const uint8_t* data, size_t len,
+                            const JPEGData& jpg, uint8_t* out,
+                            size_t* out_len) {
+  if (jpg.version == kFallbackVersion) return false;
+  if (*out_len < GetMaximumBrunsliMetadataRewriteSize(len, jpg)) return false;
+  // Each APP / COM marker should have its payload.
+  size_t num_app_markers = 0;
+  size_t num_com_markers = 0;
+  for (uint8_t marker : jpg.marker_order) {
+    if ((marker & 0xF0) == 0xE0) ++num_app_markers;
+    if (marker == 0xFE) ++num_com_markers;
+  }
+  if (num_app_markers != jpg.app_data.size() ||
+      num_com_markers != jpg.com_data.size()) {
+    return false;
+  }
+
+  if (len < kBrunsliSignatureSize ||
+      memcmp(data, kBrunsliSignature, kBrunsliSignatureSize) != 0) {
+    return false;
+  }
+  size_t pos = kBrunsliSignatureSize;
+  size_t out_pos = 0;
+  if (!EncodeSignature(*out_len, out, &out_pos)) return false;
+
+  // Marker order (with APP / COM markers) is a part of JPEG internals
+  // section, so both sections are re-encoded; all the others are copied.
+  State state;
+  uint32_t tags_met = 0;
+  while (pos < len) {
+    const size_t section_start = pos;
+    const uint8_t marker = data[pos++];
+    const uint8_t tag = marker >> 3;
+    const uint8_t wiring_type = marker & 0x7;
+    size_t value;
+    if (DecodeBase128(data, len, &pos, &value) != BRUNSLI_OK) return false;
+    if (wiring_type == kBrunsliWiringTypeLengthDelimited) {
+      if (value > len - pos) return false;
+      pos += value;
+    } else if (wiring_type != kBrunsliWiringTypeVarint) {
+      return false;
+    }
+    if (wiring_type == kBrunsliWiringTypeLengthDelimited && tag < 32) {
+      tags_met |= 1u << tag;
+    }
+    if (marker == SectionMarker(kBrunsliJPEGInternalsTag)) {
+      if (!EncodeSection(jpg, &state, kBrunsliJPEGInternalsTag,
+                         EncodeJPEGInternals,
+                         Base128Size(EstimateAuxDataSize(jpg)), *out_len, out,
+                         &out_pos)) {
+        return false;
+      }
+    } else if (marker == SectionMarker(kBrunsliMetaDataTag)) {
+      if (!EncodeSection(jpg, &state, kBrunsliMetaDataTag, EncodeMetaData,
+                         Base128Size(*out_len - out_pos), *out_len, out,
+                         &out_pos)) {
+        return false;
+      }
+    } else {
+      memcpy(out + out_pos, data + section_start, pos - section_start);
+      out_pos += pos - section_start;
+    }
+  }
+  // Original JPEG (fallback mode) contains metadata inside.
+  if (tags_met & (1u << kBrunsliOriginalJpgTag)) return false;
+  const uint32_t kRequiredTags =
+      (1u << kBrunsliJPEGInternalsTag) | (1u << kBrunsliMetaDataTag);
+  if ((tags_met & kRequiredTags) != kRequiredTags) return false;
+  *out_len = out_pos;
+  return true;
+}
+
+// Bit cost analysis
+
+static const char* kCostSymbolNames[kNumCostSymbols] = {
+    "empty_block", "num_nonzeros", "is_zero",    "sign",
+    "magnitude",   "extra_bits",   "coeff_order"};
+
+bool BrunsliAnalyzeJpeg(const JPEGData& jpg,
+                        std::vector<BrunsliCostEntry>* entries) {
+  if (jpg.version == kFallbackVersion) return false;
+  const size_t num_components = jpg.components.size();
+  CostTracker dc_costs(num_components);
+  CostTracker ac_costs(num_components);
+  State state;
+  state.dc_costs = &dc_costs;
+  state.ac_costs = &ac_costs;
+  if (!PrepareState(jpg, &state)) return false;
+  EncodeDC(&state);
+  EncodeAC(&state);
+  std::unique_ptr<EntropyCodes> entropy_codes = PrepareEntropyCodes(&state);
+  state.entropy_codes = entropy_codes.get();
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> data(len);
+  if (!BrunsliSerialize(&state, jpg, 0, data.data(), &len)) return false;
+
+  // Sizes of sections, indexed by tag; signature is accounted as a part of
+  // the header. AC data might span several sections.
+  size_t section_bytes[kBrunsliACDataTag + 1] = {0};
+  size_t num_sections[kBrunsliACDataTag + 1] = {0};
+  section_bytes[kBrunsliHeaderTag] = kBrunsliSignatureSize;
+  size_t pos = kBrunsliSignatureSize;
+  while (pos < len) {
+    const size_t section_start = pos;
+    const uint8_t tag = data[pos++] >> 3;
+    size_t section_len;
+    if (DecodeBase128(data.data(), len, &pos, &section_len) != BRUNSLI_OK) {
+      return false;
+    }
+    if (tag > kBrunsliACDataTag || section_len > len - pos) return false;
+    pos += section_len;
+    section_bytes[tag] += pos - section_start;
+    num_sections[tag]++;
+  }
+
+  entries->clear();
+  const auto add_section = [&](const char* name, uint8_t tag,
+                               const CostTracker* costs) {
+    double attributed_bits = 0.0;
+    for (size_t c = 0; costs != nullptr && c < num_components; ++c) {
+      for (size_t k = 0; k <= kDCTBlockSize; ++k) {
+        for (size_t i = 0; i < kNumCostSymbols; ++i) {
+          const CostTracker::Cost& cost = costs->costs[CostTracker::Slot(
+              c, k, static_cast<CostSymbol>(i))];
+          if (cost.count == 0) continue;
+          const int coeff = (k == kDCTBlockSize) ? -1 : static_cast<int>(k);
+          entries->push_back({name, kCostSymbolNames[i], static_cast<int>(c),
+                              coeff, cost.count, cost.bits});
+          attributed_bits += cost.bits;
+        }
+      }
+    }
+    entries->push_back({name, "other", -1, -1, num_sections[tag],
+                        8.0 * section_bytes[tag] - attributed_bits});
+  };
+  add_section("header", kBrunsliHeaderTag, nullptr);
+  add_section("internals", kBrunsliJPEGInternalsTag, nullptr);
+  add_section("metadata", kBrunsliMetaDataTag, nullptr);
+  add_section("quant", kBrunsliQuantDataTag, nullptr);
+  add_section("histograms", kBrunsliHistogramDataTag, nullptr);
+  add_section("dc", kBrunsliDCDataTag, &dc_costs);
+  add_section("ac", kBrunsliACDataTag, &ac_costs);
+  return true;
+}
+
 }  // namespace brunsli
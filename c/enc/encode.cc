@@ -19,7 +19,7 @@ int EncodeBrunsli(size_t insize, const unsigned char* in, void* outdata,
     size_t (*outfun)(void* outdata, const unsigned char* buf, size_t size)) {
   std::vector<uint8_t> output;
   brunsli::JPEGData jpg;
-  if (!brunsli::ReadJpeg(in, insize, brunsli::JPEG_READ_ALL, &jpg)) {
+  if (!brunsli::ReadJpegInPlace(in, insize, brunsli::JPEG_READ_ALL, &jpg)) {
     return 0;
   }
   size_t output_size = brunsli::GetMaximumBrunsliEncodedSize(jpg);
@@ -13,6 +13,7 @@
 #include "../common/constants.h"
 #include <brunsli/jpeg_data.h>
 #include "../common/platform.h"
+#include "../common/trace.h"
 #include <brunsli/types.h>
 #include "./jpeg_huffman_decode.h"
 
@@ -390,32 +391,44 @@ bool ProcessDRI(const uint8_t* data, const size_t len, size_t* pos,
   return true;
 }
 
-// Saves the APP marker segment as a string to *jpg.
+// Saves the APP marker segment to *jpg; if |reference| is true, the segment
+// refers to |data| instead of owning a copy.
 bool ProcessAPP(const uint8_t* data, const size_t len, size_t* pos,
-                JPEGData* jpg) {
+                bool reference, JPEGData* jpg) {
   BRUNSLI_VERIFY_LEN(2);
   size_t marker_len = ReadUint16(data, pos);
   BRUNSLI_VERIFY_INPUT(marker_len, 2, 65535, MARKER_LEN);
   BRUNSLI_VERIFY_LEN(marker_len - 2);
   // Save the marker type together with the app data.
   const uint8_t* app_str_start = data + *pos - 3;
-  std::vector<uint8_t> app_str(app_str_start, app_str_start + marker_len + 1);
   *pos += marker_len - 2;
-  jpg->app_data.push_back(app_str);
+  if (reference) {
+    jpg->app_data.push_back(
+        JPEGMarkerSegment::Reference(app_str_start, marker_len + 1));
+  } else {
+    jpg->app_data.emplace_back(app_str_start,
+                               app_str_start + marker_len + 1);
+  }
   return true;
 }
 
-// Saves the COM marker segment as a string to *jpg.
+// Saves the COM marker segment to *jpg; if |reference| is true, the segment
+// refers to |data| instead of owning a copy.
 bool ProcessCOM(const uint8_t* data, const size_t len, size_t* pos,
-                JPEGData* jpg) {
+                bool reference, JPEGData* jpg) {
   BRUNSLI_VERIFY_LEN(2);
   size_t marker_len = ReadUint16(data, pos);
   BRUNSLI_VERIFY_INPUT(marker_len, 2, 65535, MARKER_LEN);
   BRUNSLI_VERIFY_LEN(marker_len - 2);
   const uint8_t* com_str_start = data + *pos - 3;
-  std::vector<uint8_t> com_str(com_str_start, com_str_start + marker_len + 1);
   *pos += marker_len - 2;
-  jpg->com_data.push_back(com_str);
+  if (reference) {
+    jpg->com_data.push_back(
+        JPEGMarkerSegment::Reference(com_str_start, marker_len + 1));
+  } else {
+    jpg->com_data.emplace_back(com_str_start,
+                               com_str_start + marker_len + 1);
+  }
   return true;
 }
 
@@ -1016,10 +1029,9 @@ size_t FindNextMarker(const uint8_t* data, const size_t len, size_t pos) {
   return num_skipped;
 }
 
-}  // namespace
-
-bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
-              JPEGData* jpg) {
+bool ReadJpegImpl(const uint8_t* data, const size_t len, JpegReadMode mode,
+                  bool reference_markers, JPEGData* jpg) {
+  BRUNSLI_TRACE_SCOPE("ReadJpeg");
   size_t pos = 0;
   // Check SOI marker.
   BRUNSLI_EXPECT_MARKER();
@@ -1107,12 +1119,12 @@ bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
       case 0xee:
       case 0xef:
         if (mode != JPEG_READ_TABLES) {
-          ok = ProcessAPP(data, len, &pos, jpg);
+          ok = ProcessAPP(data, len, &pos, reference_markers, jpg);
         }
         break;
       case 0xfe:
         if (mode != JPEG_READ_TABLES) {
-          ok = ProcessCOM(data, len, &pos, jpg);
+          ok = ProcessCOM(data, len, &pos, reference_markers, jpg);
         }
         break;
       default:
@@ -1163,4 +1175,16 @@ bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
   return true;
 }
 
+}  // namespace
+
+bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
+              JPEGData* jpg) {
+  return ReadJpegImpl(data, len, mode, false, jpg);
+}
+
+bool ReadJpegInPlace(const uint8_t* data, const size_t len, JpegReadMode mode,
+                     JPEGData* jpg) {
+  return ReadJpegImpl(data, len, mode, true, jpg);
+}
+
 }  // namespace brunsli
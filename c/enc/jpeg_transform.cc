@@ -0,0 +1,260 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <brunsli/jpeg_transform.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "../common/baseline_jpeg.h"
+#include "../common/constants.h"
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+namespace {
+
+// Any transform is a (optional) transposition followed by (optional) flips.
+struct TransformSteps {
+  bool transpose;
+  bool flip_h;
+  bool flip_v;
+};
+
+TransformSteps GetTransformSteps(JPEGTransformType transform) {
+  switch (transform) {
+    case JPEG_TRANSFORM_FLIP_H:     return {false, true, false};
+    case JPEG_TRANSFORM_FLIP_V:     return {false, false, true};
+    case JPEG_TRANSFORM_TRANSPOSE:  return {true, false, false};
+    case JPEG_TRANSFORM_TRANSVERSE: return {true, true, true};
+    case JPEG_TRANSFORM_ROT_90:     return {true, true, false};
+    case JPEG_TRANSFORM_ROT_180:    return {false, true, true};
+    case JPEG_TRANSFORM_ROT_270:    return {true, false, true};
+    default:                        return {false, false, false};
+  }
+}
+
+// Starts a new image of the given size with components, quantization tables
+// and metadata borrowed from |jpg|; sampling factors are swapped if
+// |transpose|.
+bool StartImage(const JPEGData& jpg, int width, int height, bool transpose,
+                JPEGData* out) {
+  *out = JPEGData();
+  out->width = width;
+  out->height = height;
+  out->version = jpg.version;
+  out->app_data = jpg.app_data;
+  out->com_data = jpg.com_data;
+  out->marker_order = jpg.marker_order;
+  out->quant = jpg.quant;
+  if (transpose) {
+    for (JPEGQuantTable& q : out->quant) {
+      for (int v = 0; v < 8; ++v) {
+        for (int u = v + 1; u < 8; ++u) {
+          std::swap(q.values[v * 8 + u], q.values[u * 8 + v]);
+        }
+      }
+    }
+  }
+  out->components.resize(jpg.components.size());
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = jpg.components[i];
+    JPEGComponent& to = out->components[i];
+    to.id = from.id;
+    to.h_samp_factor = transpose ? from.v_samp_factor : from.h_samp_factor;
+    to.v_samp_factor = transpose ? from.h_samp_factor : from.v_samp_factor;
+    to.quant_idx = from.quant_idx;
+    out->max_h_samp_factor = std::max(out->max_h_samp_factor, to.h_samp_factor);
+    out->max_v_samp_factor = std::max(out->max_v_samp_factor, to.v_samp_factor);
+  }
+  out->MCU_rows = DivCeil(out->height, out->max_v_samp_factor * 8);
+  out->MCU_cols = DivCeil(out->width, out->max_h_samp_factor * 8);
+  for (JPEGComponent& c : out->components) {
+    c.width_in_blocks = out->MCU_cols * c.h_samp_factor;
+    c.height_in_blocks = out->MCU_rows * c.v_samp_factor;
+    const uint64_t num_blocks =
+        static_cast<uint64_t>(c.width_in_blocks) * c.height_in_blocks;
+    if (num_blocks > kBrunsliMaxNumBlocks) return false;
+    c.num_blocks = static_cast<uint32_t>(num_blocks);
+    c.coeffs.resize(c.num_blocks * kDCTBlockSize);
+  }
+  return true;
+}
+
+// Copies the block with coefficients transposed and odd horizontal / vertical
+// frequencies negated, as needed.
+void TransformBlock(const coeff_t* from, const TransformSteps& steps,
+                    coeff_t* to) {
+  for (int v = 0; v < 8; ++v) {
+    const bool negate_row = steps.flip_v && (v & 1);
+    for (int u = 0; u < 8; ++u) {
+      const bool negate = negate_row != (steps.flip_h && (u & 1));
+      const coeff_t value = steps.transpose ? from[u * 8 + v] : from[v * 8 + u];
+      to[v * 8 + u] = negate ? -value : value;
+    }
+  }
+}
+
+// EXIF orientation tag.
+const uint16_t kOrientationTag = 0x0112;
+// "Exif\0\0" marker signature + TIFF header.
+const uint8_t kExifSignature[6] = {'E', 'x', 'i', 'f', 0, 0};
+// Marker byte and 2 bytes of length precede the payload in app_data.
+const size_t kExifStart = 3 + sizeof(kExifSignature);
+
+uint32_t ReadTiffValue(const uint8_t* data, size_t size, bool big_endian) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < size; ++i) {
+    const size_t shift = 8 * (big_endian ? (size - 1 - i) : i);
+    result |= static_cast<uint32_t>(data[i]) << shift;
+  }
+  return result;
+}
+
+// Returns the position of orientation value in APP1 marker data, or 0 if
+// there is none.
+size_t FindExifOrientation(const JPEGMarkerSegment& app, bool* big_endian) {
+  if (app.size() < kExifStart + 8 || app[0] != 0xE1) return 0;
+  if (memcmp(&app[3], kExifSignature, sizeof(kExifSignature)) != 0) return 0;
+  const uint8_t* tiff = &app[kExifStart];
+  const size_t tiff_size = app.size() - kExifStart;
+  if (tiff[0] == 'M' && tiff[1] == 'M') {
+    *big_endian = true;
+  } else if (tiff[0] == 'I' && tiff[1] == 'I') {
+    *big_endian = false;
+  } else {
+    return 0;
+  }
+  if (ReadTiffValue(tiff + 2, 2, *big_endian) != 42) return 0;
+  const size_t ifd = ReadTiffValue(tiff + 4, 4, *big_endian);
+  if (ifd > tiff_size || tiff_size - ifd < 2) return 0;
+  const size_t num_entries = ReadTiffValue(tiff + ifd, 2, *big_endian);
+  if ((tiff_size - ifd - 2) / 12 < num_entries) return 0;
+  for (size_t i = 0; i < num_entries; ++i) {
+    const uint8_t* entry = tiff + ifd + 2 + 12 * i;
+    if (ReadTiffValue(entry, 2, *big_endian) != kOrientationTag) continue;
+    // Type should be SHORT, count should be 1.
+    if (ReadTiffValue(entry + 2, 2, *big_endian) != 3) return 0;
+    if (ReadTiffValue(entry + 4, 4, *big_endian) != 1) return 0;
+    return kExifStart + (entry + 8 - tiff);
+  }
+  return 0;
+}
+
+}  // namespace
+
+bool TransformJpeg(const JPEGData& jpg, JPEGTransformType transform,
+                   JPEGData* out) {
+  if (!HasValidCoefficientLayout(jpg)) return false;
+  const TransformSteps steps = GetTransformSteps(transform);
+
+  int width = steps.transpose ? jpg.height : jpg.width;
+  int height = steps.transpose ? jpg.width : jpg.height;
+  // Flipped partial MCUs can not be placed on the top / left edge.
+  const int mcu_width =
+      8 * (steps.transpose ? jpg.max_v_samp_factor : jpg.max_h_samp_factor);
+  const int mcu_height =
+      8 * (steps.transpose ? jpg.max_h_samp_factor : jpg.max_v_samp_factor);
+  if (steps.flip_h) width -= width % mcu_width;
+  if (steps.flip_v) height -= height % mcu_height;
+  if (width == 0 || height == 0) return false;
+  if (!StartImage(jpg, width, height, steps.transpose, out)) return false;
+
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = jpg.components[i];
+    JPEGComponent& to = out->components[i];
+    for (uint32_t y = 0; y < to.height_in_blocks; ++y) {
+      const uint32_t ty = steps.flip_v ? to.height_in_blocks - 1 - y : y;
+      for (uint32_t x = 0; x < to.width_in_blocks; ++x) {
+        const uint32_t tx = steps.flip_h ? to.width_in_blocks - 1 - x : x;
+        const uint32_t sx = steps.transpose ? ty : tx;
+        const uint32_t sy = steps.transpose ? tx : ty;
+        if (sx >= from.width_in_blocks || sy >= from.height_in_blocks) {
+          return false;
+        }
+        TransformBlock(
+            &from.coeffs[(sy * from.width_in_blocks + sx) * kDCTBlockSize],
+            steps, &to.coeffs[(y * to.width_in_blocks + x) * kDCTBlockSize]);
+      }
+    }
+  }
+  SetBaselineJpegStructure(out);
+  return true;
+}
+
+bool CropJpeg(const JPEGData& jpg, int x, int y, int width, int height,
+              JPEGData* out) {
+  if (!HasValidCoefficientLayout(jpg)) return false;
+  const int mcu_width = 8 * jpg.max_h_samp_factor;
+  const int mcu_height = 8 * jpg.max_v_samp_factor;
+  if (x < 0 || y < 0 || width <= 0 || height <= 0) return false;
+  if (x % mcu_width != 0 || y % mcu_height != 0) return false;
+  if (width > jpg.width - x || height > jpg.height - y) return false;
+  if (!StartImage(jpg, width, height, false, out)) return false;
+
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = jpg.components[i];
+    JPEGComponent& to = out->components[i];
+    const uint32_t x0 = (x / mcu_width) * from.h_samp_factor;
+    const uint32_t y0 = (y / mcu_height) * from.v_samp_factor;
+    const size_t row_size = to.width_in_blocks * kDCTBlockSize;
+    for (uint32_t by = 0; by < to.height_in_blocks; ++by) {
+      const coeff_t* src =
+          &from.coeffs[((y0 + by) * from.width_in_blocks + x0) * kDCTBlockSize];
+      std::copy(src, src + row_size, &to.coeffs[by * row_size]);
+    }
+  }
+  SetBaselineJpegStructure(out);
+  return true;
+}
+
+int GetExifOrientation(const JPEGData& jpg) {
+  for (const JPEGMarkerSegment& app : jpg.app_data) {
+    bool big_endian;
+    const size_t pos = FindExifOrientation(app, &big_endian);
+    if (pos == 0) continue;
+    const uint32_t orientation = ReadTiffValue(&app[pos], 2, big_endian);
+    return (orientation >= 1 && orientation <= 8) ? orientation : 0;
+  }
+  return 0;
+}
+
+JPEGTransformType GetOrientationTransform(int orientation) {
+  switch (orientation) {
+    case 2: return JPEG_TRANSFORM_FLIP_H;
+    case 3: return JPEG_TRANSFORM_ROT_180;
+    case 4: return JPEG_TRANSFORM_FLIP_V;
+    case 5: return JPEG_TRANSFORM_TRANSPOSE;
+    case 6: return JPEG_TRANSFORM_ROT_90;
+    case 7: return JPEG_TRANSFORM_TRANSVERSE;
+    case 8: return JPEG_TRANSFORM_ROT_270;
+    default: return JPEG_TRANSFORM_NONE;
+  }
+}
+
+bool NormalizeJpegOrientation(const JPEGData& jpg, JPEGData* out) {
+  const JPEGTransformType transform =
+      GetOrientationTransform(GetExifOrientation(jpg));
+  if (transform == JPEG_TRANSFORM_NONE) {
+    *out = jpg;
+    return true;
+  }
+  if (!TransformJpeg(jpg, transform, out)) return false;
+  for (JPEGMarkerSegment& app : out->app_data) {
+    bool big_endian;
+    const size_t pos = FindExifOrientation(app, &big_endian);
+    if (pos == 0) continue;
+    std::vector<uint8_t>& bytes = *app.mutable_bytes();
+    bytes[pos] = big_endian ? 0 : 1;
+    bytes[pos + 1] = big_endian ? 1 : 0;
+    break;
+  }
+  return true;
+}
+
+}  // namespace brunsli
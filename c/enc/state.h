@@ -61,6 +61,8 @@ class EntropyCodes {
  public:
   EntropyCodes(const std::vector<Histogram>& histograms, size_t num_bands,
                const std::vector<size_t>& offsets);
+  // Uses fixed context map instead of clustering |histograms|.
+  EntropyCodes(const std::vector<Histogram>& histograms, size_t num_bands);
   // GCC declares it won't apply RVO, even if it actually does.
   // EntropyCodes(const EntropyCodes&) = delete;
   void EncodeContextMap(Storage* storage) const;
@@ -83,12 +85,49 @@ class EntropySource {
   void AddCode(size_t code, size_t histo_ix);
   void Merge(const EntropySource& other);
   std::unique_ptr<EntropyCodes> Finish(const std::vector<size_t>& offsets);
+  // Same as Finish, but histograms are not clustered.
+  std::unique_ptr<EntropyCodes> FinishFixed();
 
  private:
   size_t num_bands_;
   std::vector<Histogram> histograms_;
 };
 
+// Kinds of symbols coded in DC / AC data.
+enum class CostSymbol {
+  kEmptyBlock,
+  kNumNonzeros,
+  kIsZero,
+  kSign,
+  // Entropy (ANS) coded part of the absolute value.
+  kMagnitude,
+  kExtraBits,
+  kCoeffOrder,
+};
+static const size_t kNumCostSymbols = 7;
+
+// Accumulates the cost of symbols coded by DataStream, per component,
+// coefficient and symbol kind. Bits of arithmetic and ANS coded symbols are
+// estimated as -log2 of their probability.
+struct CostTracker {
+  struct Cost {
+    size_t count = 0;
+    double bits = 0.0;
+  };
+
+  explicit CostTracker(size_t num_components)
+      : costs(num_components * (kDCTBlockSize + 1) * kNumCostSymbols) {}
+
+  // |k| is the coefficient index in natural order; kDCTBlockSize is used for
+  // the symbols that are not related to a particular coefficient.
+  static size_t Slot(size_t component, size_t k, CostSymbol symbol) {
+    return (component * (kDCTBlockSize + 1) + k) * kNumCostSymbols +
+           static_cast<size_t>(symbol);
+  }
+
+  std::vector<Cost> costs;
+};
+
 // Manages the multiplexing of the ANS-coded and arithmetic coded bits.
 class DataStream {
  public:
@@ -102,7 +141,22 @@ class DataStream {
   // Encodes the next bit to the bit stream, based on the 8-bit precision
   // probability, i.e. P(bit = 0) = prob / 256. Statistics are updated in 'p'.
   void AddBit(Prob* const p, int bit);
+  // Selects the way statistics are updated by AddBit.
+  void SetDecayAdaptation(bool use_decay) { use_decay_prob_ = use_decay; }
+  // Encodes the value in the range 0..63 as a single decision, based on
+  // the distribution 'p'; afterwards 'p' is updated.
+  void AddSymbol(SymbolProb* const p, size_t val);
   void EncodeCodeWords(EntropyCodes* s, Storage* storage);
+  // Cost of the symbols added afterwards is accumulated in |tracker|, until
+  // it is reset with nullptr; ANS coded symbols are accounted in
+  // EncodeCodeWords.
+  void SetCostTracker(CostTracker* tracker);
+  // Selects the CostTracker slot for the symbols added afterwards.
+  void SetCostSlot(size_t component, size_t k, CostSymbol symbol) {
+    if (BRUNSLI_PREDICT_FALSE(cost_tracker_ != nullptr)) {
+      cost_slot_ = CostTracker::Slot(component, k, symbol);
+    }
+  }
 
  private:
   struct CodeWord {
@@ -117,6 +171,8 @@ class DataStream {
 
   static const size_t kSlackForOneBlock = 1024;
 
+  void EncodeBit(uint8_t prob, int bit);
+
   int pos_;
   int bw_pos_;
   int ac_pos0_;
@@ -125,7 +181,45 @@ class DataStream {
   uint32_t high_;
   uint32_t bw_val_;
   int bw_bitpos_;
+  bool use_decay_prob_;
   std::vector<CodeWord> code_words_;
+  CostTracker* cost_tracker_;
+  size_t cost_slot_;
+  // CostTracker slots of ANS coded symbols; parallel to |code_words_|.
+  std::vector<uint32_t> cost_slots_;
+};
+
+enum class CoeffOrderMode {
+  // Sorted by the number of zeros in a sample of blocks.
+  kSampled,
+  // Sorted by the number of zeros in all blocks.
+  kExact,
+  kZigZag,
+};
+
+enum class ContextMapMode {
+  // Histograms are clustered within context groups first.
+  kClustered,
+  // Histograms of all context groups are clustered at once.
+  kGlobalClustered,
+  // No clustering; see EntropySource::FinishFixed.
+  kFixed,
+};
+
+// Encoder choices that do not affect the decoded JPEG. Defaults correspond
+// to BRUNSLI_ENCODE_DEFAULT.
+struct EncodeParams {
+  // If non-negative, used instead of jpg.version; selects the context model
+  // and coding features, e.g. kSymbolNumNonzerosVersion.
+  int version = -1;
+  // Added to the context scheme chosen by SelectContextBits; the result is
+  // clamped to [0, kNumSchemes).
+  int context_bits_delta = 0;
+  // If not empty, used instead of SelectContextBits result for each
+  // component.
+  std::vector<int> context_bits;
+  CoeffOrderMode coeff_order = CoeffOrderMode::kSampled;
+  ContextMapMode context_map = ContextMapMode::kClustered;
 };
 
 struct State {
@@ -133,10 +227,30 @@ struct State {
   EntropyCodes* entropy_codes;
   DataStream data_stream_dc;
   DataStream data_stream_ac;
+  // Used instead of |data_stream_ac| when AC data is segmented.
+  std::vector<DataStream> data_stream_ac_segments;
 
   std::vector<ComponentMeta> meta;
   size_t num_contexts;
   bool use_legacy_context_model = false;
+  bool use_symbol_num_nonzeros = false;
+  bool use_decay_prob = false;
+  // Should be set before PrepareState.
+  EncodeParams params;
+  // Number of MCU rows per AC segment; 0 means that AC data is not segmented.
+  int ac_segment_mcu_rows = 0;
+  // When set, EncodeAC does not record AC histograms; those are expected to
+  // be supplied by CollectACHistograms.
+  bool ac_histograms_collected = false;
+
+  // If set, costs of the coded DC / AC symbols are accumulated there.
+  CostTracker* dc_costs = nullptr;
+  CostTracker* ac_costs = nullptr;
+
+  // Backing storage for ComponentMeta::dc_prediction_errors / block_state;
+  // populated by PrepareState.
+  std::vector<std::vector<coeff_t>> dc_prediction_errors;
+  std::vector<std::vector<uint8_t>> block_state;
 };
 
 // Encoder workflow:
@@ -144,8 +258,16 @@ bool CalculateMeta(const JPEGData& jpg, State* state);
 size_t SampleNumNonZeros(ComponentMeta* m);
 int SelectContextBits(size_t num_symbols);
 bool PredictDCCoeffs(State* state);
+// Performs all the steps preceding EncodeDC / EncodeAC for the whole image.
+bool PrepareState(const JPEGData& jpg, State* state);
 void EncodeDC(State* state);
 void EncodeAC(State* state);
+// Adds the AC histogram codes of MCU rows [mcu_y_begin, mcu_y_end) to
+// |entropy_source|. Does not depend on adaptive probabilities, so disjoint
+// row ranges could be processed concurrently and combined with
+// EntropySource::Merge.
+void CollectACHistograms(const State& state, int mcu_y_begin, int mcu_y_end,
+                         EntropySource* entropy_source);
 std::unique_ptr<EntropyCodes> PrepareEntropyCodes(State* state);
 bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
                       uint8_t* data, size_t* len);
@@ -10,10 +10,12 @@
 
 #include <algorithm>
 #include <atomic>
+#include <memory>
 #include <vector>
 
 #include "../common/constants.h"
 #include "../common/context.h"
+#include "../common/trace.h"
 #include <brunsli/jpeg_data.h>
 #include <brunsli/status.h>
 #include <brunsli/types.h>
@@ -66,6 +68,7 @@ ParallelExecutor::ParallelExecutor(size_t num_threads)
       while (true) {
         size_t my_task = next_task++;
         if (my_task >= num_tasks) break;
+        BRUNSLI_TRACE_SCOPE("ParallelExecutor task");
         (*runnable)(my_task);
       }
       {
@@ -84,7 +87,7 @@ ParallelExecutor::ParallelExecutor(size_t num_threads)
 ParallelExecutor::~ParallelExecutor() {
   std::unique_lock<std::mutex> lock(this->lock);
   terminate = true;
-  next_task.store(1);
+  next_task.store(0);
   this->num_tasks = 1;
   this->runnable = nullptr;
   start_latch.notify_all();
@@ -98,6 +101,7 @@ Executor ParallelExecutor::getExecutor() {
 }
 
 void ParallelExecutor::execute(const Runnable& runnable, size_t num_tasks) {
+  BRUNSLI_TRACE_SCOPE("ParallelExecutor::execute");
   std::unique_lock<std::mutex> lock(this->lock);
   next_task.store(0);
   this->num_tasks = num_tasks;
@@ -303,10 +307,10 @@ bool EncodeGroups(const brunsli::JPEGData& jpg, uint8_t* data, size_t* len,
     for (size_t i = 0; i < jpg.inter_marker_data.size(); ++i) {
       part_size += 5 + jpg.inter_marker_data[i].size();
     }
-    for (const std::vector<uint8_t>& chunk : jpg.app_data) {
+    for (const JPEGMarkerSegment& chunk : jpg.app_data) {
       part_size += chunk.size();
     }
-    for (const std::vector<uint8_t>& chunk : jpg.com_data) {
+    for (const JPEGMarkerSegment& chunk : jpg.com_data) {
       part_size += chunk.size();
     }
     part_size += jpg.tail_data.size();
@@ -374,6 +378,54 @@ bool EncodeGroups(const brunsli::JPEGData& jpg, uint8_t* data, size_t* len,
   return true;
 }
 
+bool EncodeParallel(const brunsli::JPEGData& jpg, uint8_t* data, size_t* len,
+                    size_t stripe_mcu_rows, Executor* executor) {
+  using ::brunsli::internal::enc::EntropyCodes;
+  using ::brunsli::internal::enc::EntropySource;
+  using ::brunsli::internal::enc::State;
+
+  if (stripe_mcu_rows == 0) return false;
+
+  State state;
+  if (!PrepareState(jpg, &state)) return false;
+
+  const int mcu_rows = jpg.MCU_rows;
+  const size_t num_stripes = (mcu_rows + stripe_mcu_rows - 1) / stripe_mcu_rows;
+  std::vector<EntropySource> stripes(num_stripes);
+  // Task 0 is DC coding; the rest are AC statistics stripes.
+  const auto collect = [&](size_t idx) {
+    if (idx == 0) {
+      EncodeDC(&state);
+      return;
+    }
+    idx--;
+    const int y0 = static_cast<int>(idx * stripe_mcu_rows);
+    const int y1 = std::min(mcu_rows, static_cast<int>(y0 + stripe_mcu_rows));
+    CollectACHistograms(state, y0, y1, &stripes[idx]);
+  };
+  (*executor)(collect, 1 + num_stripes);
+
+  state.entropy_source.Resize(state.num_contexts);
+  for (const EntropySource& stripe : stripes) {
+    state.entropy_source.Merge(stripe);
+  }
+  state.ac_histograms_collected = true;
+
+  // Clustering runs concurrently with AC coding.
+  std::unique_ptr<EntropyCodes> entropy_codes;
+  const auto finish = [&](size_t idx) {
+    if (idx == 0) {
+      entropy_codes = PrepareEntropyCodes(&state);
+    } else {
+      EncodeAC(&state);
+    }
+  };
+  (*executor)(finish, 2);
+  state.entropy_codes = entropy_codes.get();
+
+  return BrunsliSerialize(&state, jpg, 0, data, len);
+}
+
 bool DecodeGroups(const uint8_t* data, size_t len, brunsli::JPEGData* jpg,
                   size_t ac_group_dim, size_t dc_group_dim,
                   Executor* executor) {
@@ -535,4 +587,86 @@ bool DecodeGroups(const uint8_t* data, size_t len, brunsli::JPEGData* jpg,
   return true;
 }
 
+bool DecodeParallel(const uint8_t* data, size_t len, brunsli::JPEGData* jpg,
+                    Executor* executor) {
+  using ::brunsli::BrunsliStatus;
+  using ::brunsli::internal::dec::ComponentMeta;
+  using ::brunsli::internal::dec::PrepareMeta;
+  using ::brunsli::internal::dec::ProcessJpeg;
+  using ::brunsli::internal::dec::Stage;
+  using ::brunsli::internal::dec::State;
+  using ::brunsli::internal::dec::WarmupMeta;
+
+  const uint8_t kACMarker = brunsli::SectionMarker(brunsli::kBrunsliACDataTag);
+  const uint8_t* data_end = data + len;
+  const uint8_t* chunk_end = data;
+  // Everything before the first AC data section.
+  while (chunk_end < data_end && *chunk_end != kACMarker) {
+    if (!SkipSection(&chunk_end, data_end - chunk_end)) return false;
+  }
+
+  State state;
+  state.data = data;
+  state.len = chunk_end - data;
+  BrunsliStatus status = ProcessJpeg(&state, jpg);
+  if (status != BrunsliStatus::BRUNSLI_NOT_ENOUGH_DATA) return false;
+  if (state.meta.empty()) return false;
+  WarmupMeta(jpg, &state);
+
+  const int mcu_rows = jpg->MCU_rows;
+  const int segment_mcu_rows =
+      state.ac_segment_mcu_rows ? state.ac_segment_mcu_rows : mcu_rows;
+  const size_t num_segments =
+      (mcu_rows + segment_mcu_rows - 1) / segment_mcu_rows;
+
+  std::vector<const uint8_t*> section_start(num_segments);
+  std::vector<size_t> section_length(num_segments);
+  for (size_t i = 0; i < num_segments; ++i) {
+    if (chunk_end == data_end || *chunk_end != kACMarker) return false;
+    section_start[i] = chunk_end;
+    if (!SkipSection(&chunk_end, data_end - chunk_end)) return false;
+    section_length[i] = chunk_end - section_start[i];
+  }
+  if (chunk_end != data_end) return false;
+
+  std::atomic<bool> failed{false};
+  const auto decode_ac = [&](size_t idx) {
+    if (failed.load()) return;
+    const int mcu_y = static_cast<int>(idx) * segment_mcu_rows;
+    const int num_rows = std::min(segment_mcu_rows, mcu_rows - mcu_y);
+    State ac_state;
+    ac_state.stage = Stage::SECTION;
+    ac_state.tags_met = ~(1u << brunsli::kBrunsliACDataTag);
+    ac_state.data = section_start[idx];
+    ac_state.len = section_length[idx];
+
+    ac_state.context_map = state.context_map;
+    ac_state.entropy_codes = state.entropy_codes;
+    ac_state.use_legacy_context_model = state.use_legacy_context_model;
+    ac_state.use_symbol_num_nonzeros = state.use_symbol_num_nonzeros;
+    ac_state.use_decay_prob = state.use_decay_prob;
+
+    // Segment is decoded as a separate image made of the corresponding rows.
+    std::vector<ComponentMeta>& meta = ac_state.meta;
+    PrepareMeta(jpg, &ac_state);
+    ac_state.is_storage_allocated = true;
+    WarmupMeta(jpg, &ac_state);
+    for (size_t c = 0; c < meta.size(); ++c) {
+      ComponentMeta& m = meta[c];
+      const int first_y = mcu_y * m.v_samp;
+      m.context_bits = state.meta[c].context_bits;
+      m.context_offset = state.meta[c].context_offset;
+      m.ac_coeffs += first_y * m.ac_stride;
+      m.block_state = state.meta[c].block_state + first_y * m.b_stride;
+      m.height_in_blocks = num_rows * m.v_samp;
+    }
+
+    if (ProcessJpeg(&ac_state, jpg) != BrunsliStatus::BRUNSLI_OK) {
+      failed.store(true);
+    }
+  };
+  (*executor)(decode_ac, num_segments);
+  return !failed.load();
+}
+
 }  // namespace brunsli
@@ -48,9 +48,20 @@ class ParallelExecutor {
 bool DecodeGroups(const uint8_t* data, size_t len, brunsli::JPEGData* jpg,
                   size_t ac_group_dim, size_t dc_group_dim, Executor* executor);
 
+// Decodes regular (non-groups) Brunsli stream. If it uses AC segments
+// (see kACSegmentsVersion), then those are decoded in parallel.
+bool DecodeParallel(const uint8_t* data, size_t len, brunsli::JPEGData* jpg,
+                    Executor* executor);
+
 bool EncodeGroups(const brunsli::JPEGData& jpg, uint8_t* data, size_t* len,
                   size_t ac_group_dim, size_t dc_group_dim, Executor* executor);
 
+// Produces the same output as BrunsliEncodeJpeg. AC histograms are collected
+// for stripes of |stripe_mcu_rows| MCU rows in parallel; entropy codes are
+// built while the (serial) AC arithmetic coding is in progress.
+bool EncodeParallel(const brunsli::JPEGData& jpg, uint8_t* data, size_t* len,
+                    size_t stripe_mcu_rows, Executor* executor);
+
 }  // namespace brunsli
 
 #endif  // BRUNSLI_EXPERIMENTAL_GROUPS_H_
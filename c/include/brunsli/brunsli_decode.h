@@ -30,6 +30,12 @@ class State;
 // truncated.
 BrunsliStatus BrunsliDecodeJpeg(const uint8_t* data, size_t len, JPEGData* jpg);
 
+// Same as BrunsliDecodeJpeg, but DCT coefficients are not decoded.
+// APP / COM markers of the result could be edited and passed to
+// BrunsliRewriteMetadata. Files stored in fallback mode are rejected.
+BrunsliStatus BrunsliDecodeJpegMetadata(const uint8_t* data, size_t len,
+                                        JPEGData* jpg);
+
 /* Check if data looks like Brunsli stream.
  * Currently, only 6 byte signature is compared
  * (i.e. if |len| < 6, result is always "false").
@@ -55,6 +61,17 @@ class BrunsliDecoder {
   Status Decode(size_t* available_in, const uint8_t** next_in,
                 size_t* available_out, uint8_t** next_out);
 
+  struct Stats {
+    // Number of input bytes consumed so far.
+    size_t bytes_consumed;
+    // Number of input bytes copied to the internal buffer so far. Input is
+    // copied when parsing unit straddles the boundary of input chunks;
+    // bytes_copied / bytes_consumed is the input copy overhead.
+    size_t bytes_copied;
+  };
+
+  Stats GetStats() const;
+
  private:
   std::unique_ptr<JPEGData> jpg_;
   std::unique_ptr<::brunsli::internal::dec::State> state_;
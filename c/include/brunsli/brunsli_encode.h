@@ -10,6 +10,9 @@
 #ifndef BRUNSLI_ENC_BRUNSLI_ENCODE_H_
 #define BRUNSLI_ENC_BRUNSLI_ENCODE_H_
 
+#include <functional>
+#include <vector>
+
 #include <brunsli/jpeg_data.h>
 #include <brunsli/types.h>
 
@@ -25,11 +28,105 @@ size_t EstimateBrunsliEncodePeakMemoryUsage(size_t jpg_size,
                                             const JPEGData& jpg);
 #endif  // defined(BRUNSLI_EXTRA_API)
 
+// Encoder speed vs. compression density tradeoff.
+enum BrunsliEncodeLevel {
+  // Context model, coefficient order and histogram clustering are tuned for
+  // each image.
+  BRUNSLI_ENCODE_DEFAULT,
+  // Uses the smallest context set, zig-zag coefficient order and a fixed
+  // context map (no histogram clustering). Output is typically ~1% larger,
+  // while encoding takes 10-20% less time; meant for latency-critical paths,
+  // e.g. uploads that could be re-encoded later.
+  BRUNSLI_ENCODE_FAST,
+  // Tries several context models, context set sizes, coefficient orders and
+  // histogram clusterings, and keeps the smallest output; see
+  // BrunsliEncodeJpegSearch. Meant for cold storage: it takes up to 16 full
+  // encodings (which could run in parallel), for output typically 0.5-2%
+  // smaller than the default one.
+  BRUNSLI_ENCODE_MAX,
+};
+
 // Encodes the given jpg to the buffer data[0 ... *len) in brunsli format and
 // sets *len to the encoded size. Returns false on buffer overflow or invalid
 // jpg data.
 bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len);
 
+// Same as above, with the given encoder level.
+bool BrunsliEncodeJpeg(const JPEGData& jpg, BrunsliEncodeLevel level,
+                       uint8_t* data, size_t* len);
+
+// Runs task(0), ..., task(num_tasks - 1), possibly concurrently, and returns
+// after all of them are finished.
+typedef std::function<void(const std::function<void(size_t)>& task,
+                           size_t num_tasks)>
+    BrunsliTaskRunner;
+
+// Same as BrunsliEncodeJpeg with BRUNSLI_ENCODE_MAX level, but candidate
+// encodings are distributed with |runner| (e.g. a thread pool).
+// The search goes in stages; no new candidate encoding is started after
+// |time_budget_ms| milliseconds (0 means no limit), except for the first one,
+// so that there is always a result. The result does not depend on |runner|;
+// without time limit it is fully deterministic.
+bool BrunsliEncodeJpegSearch(const JPEGData& jpg,
+                             const BrunsliTaskRunner& runner,
+                             uint32_t time_budget_ms, uint8_t* data,
+                             size_t* len);
+
+// Returns an estimate of BrunsliEncodeJpeg output size (default level).
+// Only a sample of MCU rows (about 1/16, but at least ~3000 blocks) is
+// encoded. It costs 7-15% of the full encoding time for images of 2 MP and
+// more, and 15-45% at 0.5-1 MP, where the sample is relatively larger and
+// fixed costs (e.g. histogram clustering) matter. For photographic content of
+// 0.5 MP and more the estimate is typically within 3% of the actual size, and
+// within 5% at 0.25 MP. Fixed costs are overestimated several times for
+// nearly empty images; periodic synthetic content can be off by more than
+// 10%. Images that are not larger than the sample are encoded completely,
+// i.e. the estimate is exact, but costs as much as the encoding.
+// Returns 0 for invalid |jpg|.
+size_t BrunsliEstimateEncodedSize(const JPEGData& jpg);
+
+// Part of the encoded data, as reported by BrunsliAnalyzeJpeg.
+struct BrunsliCostEntry {
+  // Section of the stream: "header" (including signature), "internals",
+  // "metadata", "quant", "histograms", "dc" or "ac".
+  const char* section;
+  // Kind of the coded symbols: "empty_block", "num_nonzeros", "is_zero",
+  // "sign", "magnitude", "extra_bits", "coeff_order", or "other" for the rest
+  // of the section (framing, coder state flushing, estimation error).
+  const char* symbol;
+  // Component index, or -1 if not applicable.
+  int component;
+  // Coefficient index in natural order, or -1 if not applicable.
+  int k;
+  // Number of symbols; number of sections for "other" entries.
+  size_t count;
+  double bits;
+};
+
+// Encodes |jpg| like BrunsliEncodeJpeg (default level) does, and reports how
+// the output bits are distributed. The cost of each entropy coded symbol is
+// estimated as -log2 of its probability; "other" entries make the sum of
+// |bits| exactly match the encoded size. Returns false on invalid |jpg| or if
+// it is in fallback mode.
+bool BrunsliAnalyzeJpeg(const JPEGData& jpg,
+                        std::vector<BrunsliCostEntry>* entries);
+
+// Returns an upper bound on the size of the buffer needed for
+// BrunsliRewriteMetadata output.
+size_t GetMaximumBrunsliMetadataRewriteSize(size_t len, const JPEGData& jpg);
+
+// Replaces the metadata (APP / COM markers and the data after EOI) of the
+// brunsli-encoded image data[0 ... len) with the one in |jpg|, and writes the
+// result to out[0 ... *out_len); *out_len is updated to the actual size.
+// Only the metadata and JPEG internals sections are re-encoded; the rest is
+// copied as is, so the cost does not depend on the image dimensions.
+// |jpg| is expected to be obtained with BrunsliDecodeJpegMetadata from the same
+// data; only APP / COM markers (including their place in |marker_order|) and
+// |tail_data| could be changed.
+// Returns false on buffer overflow, invalid input or fallback mode files.
+bool BrunsliRewriteMetadata(const uint8_t* data, size_t len,
+                            const JPEGData& jpg, uint8_t* out, size_t* out_len);
+
 // Return the storage size needed to store raw jpg data in bypass mode.
 size_t GetBrunsliBypassSize(size_t jpg_size);
 
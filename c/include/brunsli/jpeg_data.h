@@ -9,7 +9,10 @@
 #ifndef BRUNSLI_COMMON_JPEG_DATA_H_
 #define BRUNSLI_COMMON_JPEG_DATA_H_
 
+#include <algorithm>
 #include <array>
+#include <initializer_list>
+#include <utility>
 #include <vector>
 
 #include <brunsli/types.h>
@@ -17,6 +20,17 @@
 namespace brunsli {
 
 static const int kFallbackVersion = 1;
+// Version bit; when set, the position of the last non-zero AC coefficient is
+// coded as a single adaptive 64-ary decision, rather than 6 binary ones.
+static const int kSymbolNumNonzerosVersion = 8;
+// Version bit; when set, adaptive binary probabilities are updated with
+// exponential decay, rather than with counting.
+static const int kDecayProbVersion = 16;
+// Version bit; when set, AC data is split into independently decodable
+// horizontal bands (segments), each stored in a separate AC data section.
+static const int kACSegmentsVersion = 32;
+// Mask of all the defined version bits.
+static const int kVersionMask = 0x3F;
 
 static const int kDCTBlockSize = 64;
 static const int kMaxComponents = 4;
@@ -209,7 +223,68 @@ struct JPEGComponent {
   std::vector<coeff_t> coeffs;
 };
 
+// Bytes of APP / COM marker segment: marker byte, 2 bytes of length and the
+// payload.
+//
+// Bytes are either owned, or reference external memory (see ReadJpegInPlace);
+// in the latter case the memory should outlive the object and all its copies:
+// copying a segment copies the reference, not the bytes. Referenced bytes are
+// copied only when mutable access is requested.
+class JPEGMarkerSegment {
+ public:
+  JPEGMarkerSegment() : ref_(NULL), ref_size_(0) {}
+  JPEGMarkerSegment(std::vector<uint8_t> bytes)  // NOLINT: implicit
+      : bytes_(std::move(bytes)), ref_(NULL), ref_size_(0) {}
+  JPEGMarkerSegment(std::initializer_list<uint8_t> bytes)
+      : bytes_(bytes), ref_(NULL), ref_size_(0) {}
+  JPEGMarkerSegment(const uint8_t* begin, const uint8_t* end)
+      : bytes_(begin, end), ref_(NULL), ref_size_(0) {}
+
+  static JPEGMarkerSegment Reference(const uint8_t* data, size_t size) {
+    JPEGMarkerSegment result;
+    result.ref_ = data;
+    result.ref_size_ = size;
+    return result;
+  }
+
+  const uint8_t* data() const { return ref_ ? ref_ : bytes_.data(); }
+  size_t size() const { return ref_ ? ref_size_ : bytes_.size(); }
+  bool empty() const { return size() == 0; }
+  const uint8_t* begin() const { return data(); }
+  const uint8_t* end() const { return data() + size(); }
+  const uint8_t& operator[](size_t i) const { return data()[i]; }
+  bool is_reference() const { return ref_ != NULL; }
+
+  // Returns owned bytes; referenced bytes are copied first.
+  std::vector<uint8_t>* mutable_bytes() {
+    if (ref_) {
+      bytes_.assign(ref_, ref_ + ref_size_);
+      ref_ = NULL;
+      ref_size_ = 0;
+    }
+    return &bytes_;
+  }
+
+  friend bool operator==(const JPEGMarkerSegment& a,
+                         const JPEGMarkerSegment& b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+  }
+  friend bool operator!=(const JPEGMarkerSegment& a,
+                         const JPEGMarkerSegment& b) {
+    return !(a == b);
+  }
+
+ private:
+  std::vector<uint8_t> bytes_;
+  const uint8_t* ref_;
+  size_t ref_size_;
+};
+
 // Represents a parsed jpeg file.
+//
+// APP / COM marker segments might reference external memory (see
+// JPEGMarkerSegment); copies of JPEGData reference the same memory, so it
+// should outlive every copy.
 struct JPEGData {
   JPEGData() : width(0),
                height(0),
@@ -232,8 +307,8 @@ struct JPEGData {
   int MCU_rows;
   int MCU_cols;
   int restart_interval;
-  std::vector<std::vector<uint8_t>> app_data;
-  std::vector<std::vector<uint8_t>> com_data;
+  std::vector<JPEGMarkerSegment> app_data;
+  std::vector<JPEGMarkerSegment> com_data;
   std::vector<JPEGQuantTable> quant;
   std::vector<JPEGHuffmanCode> huffman_code;
   std::vector<JPEGComponent> components;
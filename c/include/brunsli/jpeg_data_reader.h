@@ -28,6 +28,12 @@ enum JpegReadMode {
 bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
               JPEGData* jpg);
 
+// Same as ReadJpeg, but APP and COM marker segments in *jpg reference |data|
+// instead of owning a copy; |data| should outlive *jpg and all copies made of
+// it (copying JPEGData does not copy the referenced bytes).
+bool ReadJpegInPlace(const uint8_t* data, const size_t len, JpegReadMode mode,
+                     JPEGData* jpg);
+
 }  // namespace brunsli
 
 #endif  // BRUNSLI_ENC_JPEG_DATA_READER_H_
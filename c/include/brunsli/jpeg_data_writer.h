@@ -9,6 +9,9 @@
 #ifndef BRUNSLI_DEC_JPEG_DATA_WRITER_H_
 #define BRUNSLI_DEC_JPEG_DATA_WRITER_H_
 
+#include <memory>
+#include <vector>
+
 #include <brunsli/jpeg_data.h>
 #include <brunsli/types.h>
 
@@ -34,6 +37,59 @@ struct JPEGOutput {
 
 bool WriteJpeg(const JPEGData& jpg, JPEGOutput out);
 
+enum JPEGWriteMode {
+  // Bit-exact reconstruction of the original file.
+  JPEG_WRITE_ORIGINAL,
+  // Same coefficients; sequential scans with optimal Huffman codes.
+  JPEG_WRITE_OPTIMIZED,
+  // Same coefficients; progressive scans with optimal Huffman codes.
+  JPEG_WRITE_OPTIMIZED_PROGRESSIVE,
+};
+
+// Replaces entropy coding parameters of |jpg| with ones that produce smaller
+// output: Huffman codes are built from coefficient statistics, scans are
+// replaced with sequential (or progressive, spectral selection only) ones.
+// Restart markers, padding bits, extra zero runs and other data required only
+// for bit-exact reconstruction are dropped; APP / COM markers are kept.
+// Returns false if |jpg| has no coefficients (e.g. fallback mode).
+bool OptimizeJpegCoding(JPEGData* jpg, bool progressive);
+
+// Same as WriteJpeg, but allows non-bit-exact output. Images without
+// coefficients (fallback mode) are always written as is.
+bool WriteJpeg(const JPEGData& jpg, JPEGWriteMode mode, JPEGOutput out);
+
+// Contiguous piece of serialized JPEG.
+struct JPEGOutputSpan {
+  const uint8_t* data;
+  size_t len;
+};
+
+// Serialized JPEG as a sequence of spans, e.g. for writev / sendmsg.
+//
+// APP / COM / inter-marker / tail data (and the original file in fallback
+// mode) is referenced in place; marker segments and entropy-coded data are
+// owned by |storage|.
+struct JPEGIov {
+  std::vector<JPEGOutputSpan> spans;
+  std::vector<std::unique_ptr<std::vector<uint8_t>>> storage;
+
+  size_t TotalSize() const;
+};
+
+// Same as WriteJpeg, but the result is not concatenated. The spans are valid
+// as long as both |jpg| and |out| are alive and not modified.
+bool WriteJpegIov(const JPEGData& jpg, JPEGIov* out);
+
+// Same as WriteJpegIov; if |fuse_scans| is set, scans of multi-scan (e.g.
+// progressive) images are encoded simultaneously, MCU row by MCU row, so that
+// coefficients are read from memory once, rather than once per scan. Images
+// with padding bits are still encoded scan by scan. Output is the same.
+//
+// Fusing is off by default: on a 4000x3000 10-scan progressive image both
+// modes run within noise of each other, as entropy coding dominates; it could
+// pay off only on memory-bound hosts.
+bool WriteJpegIov(const JPEGData& jpg, bool fuse_scans, JPEGIov* out);
+
 }  // namespace brunsli
 
 #endif  // BRUNSLI_DEC_JPEG_DATA_WRITER_H_
@@ -0,0 +1,31 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Functions for producing downscaled JPEG images (e.g. thumbnails) without
+// going through pixels.
+
+#ifndef BRUNSLI_DEC_JPEG_DOWNSCALE_H_
+#define BRUNSLI_DEC_JPEG_DOWNSCALE_H_
+
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+// Produces the image downscaled by |scale_denom| (1, 2, 4 or 8) in *out.
+//
+// Downscaling is done in the DCT domain: low-frequency coefficients of each
+// group of scale_denom x scale_denom blocks are combined into a single block.
+// Quantization tables, sampling factors and APP / COM markers are preserved;
+// result is a baseline JPEG with standard Huffman codes, so it could be
+// serialized with WriteJpeg or encoded with BrunsliEncodeJpeg.
+// Returns false, if |jpg| has no coefficients (e.g. fallback mode) or
+// |scale_denom| is not supported.
+bool BrunsliDownscale(const JPEGData& jpg, int scale_denom, JPEGData* out);
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_DEC_JPEG_DOWNSCALE_H_
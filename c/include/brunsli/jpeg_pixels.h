@@ -0,0 +1,53 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Functions for rendering a JPEGData object to pixels, without producing
+// the intermediate JPEG byte stream.
+
+#ifndef BRUNSLI_DEC_JPEG_PIXELS_H_
+#define BRUNSLI_DEC_JPEG_PIXELS_H_
+
+#include <vector>
+
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+enum JPEGPixelFormat {
+  JPEG_PIXELS_RGB,    // interleaved 8-bit R, G, B
+  JPEG_PIXELS_YCBCR,  // interleaved 8-bit Y, Cb, Cr (no color conversion)
+};
+
+// Output has 3 bytes per pixel in any format; grayscale images are
+// rendered as R = G = B (or Cb = Cr = 128).
+static const int kJPEGPixelsBytesPerPixel = 3;
+
+// Calculates the dimensions of the image rendered at 1 / |scale_denom| scale.
+// Supported |scale_denom| values are 1, 2, 4 and 8; downscaled images are
+// produced by a reduced-size IDCT, as thumbnailers do.
+bool GetJpegPixelsSize(const JPEGData& jpg, int scale_denom, int* xsize,
+                       int* ysize);
+
+// Renders MCU rows [mcu_y_begin, mcu_y_end) of the image. The first rendered
+// pixel row is (mcu_y_begin * 8 * max_v_samp_factor / scale_denom); it goes
+// to |out|, next rows follow with |stride| bytes step.
+//
+// MCU rows are rendered independently (chroma upsampling does not look at
+// neighbouring rows), so it is possible to render image stripes as soon as the
+// corresponding coefficients are decoded.
+// Only 1- and 3-component (YCbCr) images are supported.
+bool RenderJpegPixelRows(const JPEGData& jpg, int scale_denom,
+                         JPEGPixelFormat format, int mcu_y_begin,
+                         int mcu_y_end, uint8_t* out, size_t stride);
+
+// Renders the whole image; |pixels| is resized to fit the tightly packed image.
+bool RenderJpegPixels(const JPEGData& jpg, int scale_denom,
+                      JPEGPixelFormat format, std::vector<uint8_t>* pixels);
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_DEC_JPEG_PIXELS_H_
@@ -0,0 +1,63 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Lossless geometric transformations of JPEGData objects, performed on
+// quantized DCT coefficients (like "jpegtran" does).
+
+#ifndef BRUNSLI_ENC_JPEG_TRANSFORM_H_
+#define BRUNSLI_ENC_JPEG_TRANSFORM_H_
+
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+enum JPEGTransformType {
+  JPEG_TRANSFORM_NONE,
+  JPEG_TRANSFORM_FLIP_H,      // left-right mirror
+  JPEG_TRANSFORM_FLIP_V,      // top-bottom mirror
+  JPEG_TRANSFORM_TRANSPOSE,   // mirror across the main diagonal
+  JPEG_TRANSFORM_TRANSVERSE,  // mirror across the anti-diagonal
+  JPEG_TRANSFORM_ROT_90,      // 90 degrees clockwise
+  JPEG_TRANSFORM_ROT_180,
+  JPEG_TRANSFORM_ROT_270,     // 90 degrees counter-clockwise
+};
+
+// Applies |transform| to |jpg| and stores the result in *out.
+//
+// Blocks are moved and coefficients are transposed / negated, so that no
+// information is lost; quantization tables are transposed when needed.
+// Partial MCUs that would end up on the top or left edge are dropped (as with
+// "jpegtran -trim"), so the image could get slightly smaller.
+// Result is a baseline JPEG with standard Huffman codes; APP and COM markers
+// are preserved. It could be serialized with WriteJpeg or directly passed
+// to BrunsliEncodeJpeg.
+// Returns false if |jpg| has no coefficients (e.g. fallback mode), or if
+// nothing is left after trimming.
+bool TransformJpeg(const JPEGData& jpg, JPEGTransformType transform,
+                   JPEGData* out);
+
+// Crops the rectangle [x, x + width) x [y, y + height) of |jpg| to *out.
+// |x| and |y| have to be multiples of MCU size (8 * max_samp_factor);
+// the result has the same properties as TransformJpeg output.
+bool CropJpeg(const JPEGData& jpg, int x, int y, int width, int height,
+              JPEGData* out);
+
+// Returns EXIF orientation (1..8) found in APP1 marker, or 0 if there is none.
+int GetExifOrientation(const JPEGData& jpg);
+
+// Returns the transform that makes an image with the given EXIF orientation
+// look upright.
+JPEGTransformType GetOrientationTransform(int orientation);
+
+// Applies the EXIF orientation, so that the image is upright without any
+// help from the viewer; the orientation tag is reset to 1 in *out.
+// If orientation is absent or already normal, |jpg| is copied as is.
+bool NormalizeJpegOrientation(const JPEGData& jpg, JPEGData* out);
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_ENC_JPEG_TRANSFORM_H_
@@ -0,0 +1,28 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Recording of trace events in Chrome trace event format; the result could be
+// loaded into chrome://tracing or Perfetto UI.
+//
+// Library code emits events (encoder / decoder stages, JPEG serialization,
+// Brotli calls, executor tasks) only if built with BRUNSLI_ENABLE_TRACE;
+// otherwise instrumentation is compiled out and the trace stays empty.
+
+#ifndef BRUNSLI_TRACE_H_
+#define BRUNSLI_TRACE_H_
+
+namespace brunsli {
+
+// Starts recording of trace events; previously recorded events are dropped.
+void BrunsliStartTrace();
+
+// Stops recording and writes the recorded events to the file at |path| as
+// Chrome trace JSON. Returns false on I/O failure.
+bool BrunsliStopTrace(const char* path);
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_TRACE_H_
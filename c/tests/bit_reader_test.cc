@@ -54,4 +54,29 @@ TEST(BitReader, CheckPadding) {
   }
 }
 
+TEST(BitReader, SuspendReturnsPrefetchedBytes) {
+  uint8_t data[32];
+  for (size_t i = 0; i < sizeof(data); ++i) data[i] = static_cast<uint8_t>(i);
+  BrunsliBitReader br;
+  BrunsliBitReaderInit(&br);
+  BrunsliBitReaderResume(&br, data, sizeof(data));
+
+  // Whole window is refilled at once, but only consumed bits are accounted.
+  ASSERT_EQ(0u, BrunsliBitReaderRead(&br, 8));
+  ASSERT_EQ(0x0201u, BrunsliBitReaderRead(&br, 16));
+  ASSERT_EQ(0x03u, BrunsliBitReaderRead(&br, 4));
+  size_t unused_bytes = BrunsliBitReaderSuspend(&br);
+  ASSERT_EQ(sizeof(data) - 4, unused_bytes);
+  ASSERT_TRUE(BrunsliBitReaderIsHealthy(&br));
+
+  // Reading continues from the same bit position.
+  BrunsliBitReaderResume(&br, data + 4, unused_bytes);
+  ASSERT_EQ(0x0u, BrunsliBitReaderRead(&br, 4));
+  for (size_t i = 4; i < sizeof(data); ++i) {
+    ASSERT_EQ(i, BrunsliBitReaderRead(&br, 8));
+  }
+  ASSERT_EQ(0u, BrunsliBitReaderSuspend(&br));
+  ASSERT_TRUE(BrunsliBitReaderIsHealthy(&br));
+}
+
 }  // namespace brunsli
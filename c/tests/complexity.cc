@@ -0,0 +1,335 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "./complexity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../common/ans_params.h"
+#include "../common/base128.h"
+#include "../common/baseline_jpeg.h"
+#include "../common/constants.h"
+#include "../common/context.h"
+#include "../common/platform.h"
+#include "../dec/state.h"
+#include "../enc/ans_encode.h"
+#include "../enc/context_map_encode.h"
+#include "../enc/state.h"
+#include "../enc/write_bits.h"
+#include "./test_utils.h"
+
+namespace {
+
+std::atomic<size_t> num_allocations(0);
+std::atomic<size_t> allocated_bytes(0);
+
+void* CountedAlloc(size_t size) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* result = malloc(size > 0 ? size : 1);
+  // Library is built without exceptions; OOM is fatal anyway.
+  if (result == nullptr) abort();
+  return result;
+}
+
+}  // namespace
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+namespace brunsli {
+
+namespace {
+
+size_t DiscardOutput(void* data, const uint8_t* buf, size_t count) {
+  BRUNSLI_UNUSED(data);
+  BRUNSLI_UNUSED(buf);
+  return count;
+}
+
+bool Decode(const uint8_t* data, size_t size) {
+  JPEGData jpg;
+  if (BrunsliDecodeJpeg(data, size, &jpg) != BRUNSLI_OK) return false;
+  return WriteJpeg(jpg, JPEGOutput(DiscardOutput, nullptr));
+}
+
+// Mimics a transport that delivers one byte at a time; unconsumed bytes are
+// offered again, together with the next one.
+bool DecodeStreaming(const uint8_t* data, size_t size) {
+  JPEGData jpg;
+  internal::dec::State state;
+  size_t start = 0;
+  for (size_t end = 0; end <= size; ++end) {
+    state.data = data + start;
+    state.pos = 0;
+    state.len = end - start;
+    const BrunsliStatus status = internal::dec::ProcessJpeg(&state, &jpg);
+    const BrunsliStatus expected_status =
+        (end < size) ? BRUNSLI_NOT_ENOUGH_DATA : BRUNSLI_OK;
+    if (status != expected_status) return false;
+    start += state.pos;
+  }
+  return WriteJpeg(jpg, JPEGOutput(DiscardOutput, nullptr));
+}
+
+bool Encode(const uint8_t* data, size_t size) {
+  JPEGData jpg;
+  if (!ReadJpeg(data, size, JPEG_READ_ALL, &jpg)) return false;
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  return BrunsliEncodeJpeg(jpg, out.data(), &len);
+}
+
+double PerByte(double value, size_t size) {
+  return value / std::max<size_t>(size, 1);
+}
+
+// Stock Huffman codes cover all the symbols, so that the result could be
+// serialized whatever the coefficients are.
+JPEGData MakeBaselineJpeg(JPEGData jpg) {
+  SetBaselineJpegStructure(&jpg);
+  return jpg;
+}
+
+// Adds copies of Huffman codes, each in a separate DHT marker, up to
+// the kMaxDHTMarkers limit.
+void AddMaxDHTMarkers(JPEGData* jpg) {
+  const std::vector<JPEGHuffmanCode> codes = jpg->huffman_code;
+  const auto sos = std::find(jpg->marker_order.begin(),
+                             jpg->marker_order.end(), 0xDA);
+  const size_t num_extra = kMaxDHTMarkers - 1 - codes.size();
+  jpg->marker_order.insert(sos, num_extra, 0xC4);
+  for (size_t i = 0; i < num_extra; ++i) {
+    jpg->huffman_code.push_back(codes[i % codes.size()]);
+    jpg->huffman_code.back().is_last = true;
+  }
+}
+
+// Each padding bit costs at least one bit of output.
+void AddMaxPaddingBits(JPEGData* jpg) {
+  jpg->has_zero_padding_bit = true;
+  jpg->padding_bits.assign(PaddingBitsLimit(*jpg), 1);
+}
+
+std::vector<uint8_t> ToBrunsli(const JPEGData& jpg) {
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  if (!BrunsliEncodeJpeg(jpg, out.data(), &len)) len = 0;
+  out.resize(len);
+  return out;
+}
+
+// Histogram section for the largest context map that cycles through all 256
+// (identical) entropy codes. Each inverse move-to-front step then moves the
+// whole table, while the map itself costs just a few bits.
+std::vector<uint8_t> MakeCyclicHistogramSection(
+    const internal::enc::State& state,
+    const internal::enc::Histogram& histogram) {
+  const size_t kNumHistograms = 256;
+  const size_t map_size = state.num_contexts * kNumAvrgContexts;
+  std::vector<uint32_t> context_map(map_size);
+  for (size_t i = 0; i < map_size; ++i) context_map[i] = i % kNumHistograms;
+  std::vector<uint8_t> out(1024 + map_size + kNumHistograms * 64);
+  size_t len;
+  {
+    Storage storage(out.data(), out.size());
+    for (const internal::enc::ComponentMeta& m : state.meta) {
+      WriteBits(3, m.context_bits, &storage);
+    }
+    EncodeContextMap(context_map, kNumHistograms, &storage);
+    ANSTable table;
+    for (size_t i = 0; i < kNumHistograms; ++i) {
+      BuildAndStoreANSEncodingData(histogram.data_, &table, &storage);
+    }
+    len = storage.GetBytesUsed();
+  }
+  out.resize(len);
+  return out;
+}
+
+// Encodes |jpg| with the largest context set and a single entropy code, then
+// replaces the histogram section with an equivalent cyclic one.
+std::vector<uint8_t> ToBrunsliWithCyclicContextMap(const JPEGData& jpg) {
+  using ::brunsli::internal::enc::EntropyCodes;
+  using ::brunsli::internal::enc::Histogram;
+  using ::brunsli::internal::enc::State;
+  State state;
+  state.params.context_bits.assign(jpg.components.size(), kNumSchemes - 1);
+  if (!PrepareState(jpg, &state)) return {};
+  EncodeDC(&state);
+  EncodeAC(&state);
+  // All the symbols are possible; identical histograms form a single cluster.
+  const size_t num_bands = state.num_contexts;
+  Histogram flat;
+  for (size_t i = 0; i < BRUNSLI_ANS_MAX_SYMBOLS; ++i) flat.Add(i);
+  const std::vector<Histogram> histograms(num_bands * kNumAvrgContexts, flat);
+  Histogram merged;
+  for (const Histogram& h : histograms) merged.AddHistogram(h);
+  EntropyCodes entropy_codes(histograms, num_bands, {0});
+  state.entropy_codes = &entropy_codes;
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  if (!BrunsliSerialize(&state, jpg, 0, encoded.data(), &len)) return {};
+
+  const std::vector<uint8_t> section =
+      MakeCyclicHistogramSection(state, merged);
+  std::vector<uint8_t> out(encoded.begin(),
+                           encoded.begin() + kBrunsliSignatureSize);
+  size_t pos = kBrunsliSignatureSize;
+  while (pos < len) {
+    const size_t section_start = pos;
+    const uint8_t marker = encoded[pos++];
+    size_t section_len;
+    if (DecodeBase128(encoded.data(), len, &pos, &section_len) != BRUNSLI_OK) {
+      return {};
+    }
+    pos += section_len;
+    if (marker != SectionMarker(kBrunsliHistogramDataTag)) {
+      out.insert(out.end(), encoded.begin() + section_start,
+                 encoded.begin() + pos);
+      continue;
+    }
+    out.push_back(marker);
+    for (size_t v = section.size(); ; v >>= 7) {
+      out.push_back((v & 0x7F) | ((v >> 7) ? 0x80 : 0));
+      if ((v >> 7) == 0) break;
+    }
+    out.insert(out.end(), section.begin(), section.end());
+  }
+  return out;
+}
+
+std::vector<uint8_t> ToJpeg(const JPEGData& jpg) {
+  std::string out;
+  if (!WriteJpeg(jpg, JPEGOutput(StringOutputFunction, &out))) out.clear();
+  return std::vector<uint8_t>(out.begin(), out.end());
+}
+
+}  // namespace
+
+const char* ComplexityWorkloadName(ComplexityWorkload workload) {
+  switch (workload) {
+    case ComplexityWorkload::kDecode:
+      return "decode";
+    case ComplexityWorkload::kDecodeStreaming:
+      return "decode_streaming";
+    case ComplexityWorkload::kEncode:
+      return "encode";
+  }
+  return "unknown";
+}
+
+double ComplexityCost::NanosPerByte() const {
+  return PerByte(seconds * 1e9, input_size);
+}
+
+double ComplexityCost::AllocationsPerByte() const {
+  return PerByte(static_cast<double>(num_allocations), input_size);
+}
+
+double ComplexityCost::AllocatedBytesPerByte() const {
+  return PerByte(static_cast<double>(allocated_bytes), input_size);
+}
+
+ComplexityCost MeasureComplexity(ComplexityWorkload workload,
+                                 const uint8_t* data, size_t size) {
+  ComplexityCost cost;
+  cost.input_size = size;
+  const size_t allocations_before = num_allocations.load();
+  const size_t bytes_before = allocated_bytes.load();
+  const auto start = std::chrono::steady_clock::now();
+  switch (workload) {
+    case ComplexityWorkload::kDecode:
+      cost.ok = Decode(data, size);
+      break;
+    case ComplexityWorkload::kDecodeStreaming:
+      cost.ok = DecodeStreaming(data, size);
+      break;
+    case ComplexityWorkload::kEncode:
+      cost.ok = Encode(data, size);
+      break;
+  }
+  cost.seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  cost.num_allocations = num_allocations.load() - allocations_before;
+  cost.allocated_bytes = allocated_bytes.load() - bytes_before;
+  return cost;
+}
+
+std::vector<ComplexitySeed> GetComplexitySeeds() {
+  std::vector<ComplexitySeed> seeds;
+  const auto add = [&seeds](const char* name, ComplexityWorkload workload,
+                            std::vector<uint8_t> data,
+                            ComplexityBudget budget) {
+    seeds.push_back({name, workload, std::move(data), budget});
+  };
+
+  const JPEGData random =
+      MakeBaselineJpeg(MakeRandomJpeg(256, 256, 3, 1, 1, 1));
+  // Nothing special; sets the baseline for the rest.
+  add("random_coefficients", ComplexityWorkload::kDecode, ToBrunsli(random),
+      {2.5e4, 0.02, 100.0});
+  add("random_coefficients", ComplexityWorkload::kDecodeStreaming,
+      ToBrunsli(random), {6e4, 0.02, 100.0});
+  add("random_coefficients", ComplexityWorkload::kEncode, ToJpeg(random),
+      {2e4, 0.02, 100.0});
+
+  // Tiny input, huge output; cost is dominated by the number of blocks.
+  const JPEGData zero = MakeBaselineJpeg(MakeJpeg(2048, 2048, 3, 1, 1));
+  add("zero_coefficients", ComplexityWorkload::kDecode, ToBrunsli(zero),
+      {2.5e7, 2.0, 4e5});
+  add("zero_coefficients", ComplexityWorkload::kEncode, ToJpeg(zero),
+      {5e4, 0.005, 1500.0});
+
+  JPEGData dht = MakeBaselineJpeg(MakeJpeg(16, 16, 3, 1, 1));
+  AddMaxDHTMarkers(&dht);
+  add("max_dht_markers", ComplexityWorkload::kDecode, ToBrunsli(dht),
+      {5e4, 2.0, 1600.0});
+  add("max_dht_markers", ComplexityWorkload::kDecodeStreaming, ToBrunsli(dht),
+      {8e4, 2.0, 1600.0});
+  add("max_dht_markers", ComplexityWorkload::kEncode, ToJpeg(dht),
+      {2e4, 0.4, 800.0});
+
+  JPEGData padding = MakeBaselineJpeg(MakeJpeg(256, 256, 3, 1, 1));
+  AddMaxPaddingBits(&padding);
+  add("max_padding_bits", ComplexityWorkload::kDecode, ToBrunsli(padding),
+      {6e4, 0.2, 1200.0});
+  add("max_padding_bits", ComplexityWorkload::kDecodeStreaming,
+      ToBrunsli(padding), {8e4, 0.2, 1200.0});
+
+  // Largest context map; each entry moves the whole inverse move-to-front
+  // table.
+  const JPEGData cyclic =
+      MakeBaselineJpeg(MakeRandomJpeg(16, 16, 3, 1, 1, 2));
+  const std::vector<uint8_t> cyclic_brunsli =
+      ToBrunsliWithCyclicContextMap(cyclic);
+  add("cyclic_context_map", ComplexityWorkload::kDecode, cyclic_brunsli,
+      {5e4, 0.08, 1300.0});
+  add("cyclic_context_map", ComplexityWorkload::kDecodeStreaming,
+      cyclic_brunsli, {8e4, 0.08, 1300.0});
+
+  return seeds;
+}
+
+}  // namespace brunsli
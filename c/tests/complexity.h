@@ -0,0 +1,82 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+/* Algorithmic complexity harness.
+
+   Measures (wall) time and heap allocations spent on a single input,
+   normalized by input size. Inputs that drive the codec to the known worst cases are
+   produced by GetComplexitySeeds; each one is paired with a budget that
+   complexity_test enforces. fuzz_complexity uses the same measurement to
+   steer fuzzing towards inputs that are expensive per byte.
+
+   Allocations are counted by replacing global operator new / delete; link
+   complexity.cc only into binaries dedicated to complexity measurement. */
+
+#ifndef BRUNSLI_TESTS_COMPLEXITY_H_
+#define BRUNSLI_TESTS_COMPLEXITY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace brunsli {
+
+enum class ComplexityWorkload {
+  // BrunsliDecodeJpeg + WriteJpeg.
+  kDecode,
+  // Same, but Brunsli input is fed to the streaming decoder byte by byte.
+  kDecodeStreaming,
+  // ReadJpeg + BrunsliEncodeJpeg.
+  kEncode,
+};
+const size_t kNumComplexityWorkloads = 3;
+
+const char* ComplexityWorkloadName(ComplexityWorkload workload);
+
+struct ComplexityCost {
+  size_t input_size = 0;
+  // Whether input was successfully processed.
+  bool ok = false;
+  double seconds = 0.0;
+  size_t num_allocations = 0;
+  size_t allocated_bytes = 0;
+
+  // Empty input is accounted as 1 byte long.
+  double NanosPerByte() const;
+  double AllocationsPerByte() const;
+  double AllocatedBytesPerByte() const;
+};
+
+// Limits, per input byte.
+struct ComplexityBudget {
+  double nanos_per_byte;
+  double allocations_per_byte;
+  double allocated_bytes_per_byte;
+};
+
+ComplexityCost MeasureComplexity(ComplexityWorkload workload,
+                                 const uint8_t* data, size_t size);
+
+struct ComplexitySeed {
+  std::string name;
+  ComplexityWorkload workload;
+  std::vector<uint8_t> data;
+  ComplexityBudget budget;
+};
+
+// Inputs that drive workloads to known worst cases, with budgets.
+//
+// Time is measured with a monotonic clock, so it includes waiting for the CPU
+// on loaded machines; time budgets are set roughly 50x above the values
+// observed in unoptimized builds, so that only algorithmic regressions (rather
+// than load, sanitizers or slow machines) trip them. Allocations are
+// deterministic, thus budgets are tighter: roughly 4x.
+std::vector<ComplexitySeed> GetComplexitySeeds();
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_TESTS_COMPLEXITY_H_
@@ -0,0 +1,45 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "./complexity.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "./test_utils.h"
+
+namespace brunsli {
+
+TEST(ComplexityTest, CountsAllocations) {
+  const std::vector<uint8_t> src = GetSmallBrunsliFile();
+  const ComplexityCost cost =
+      MeasureComplexity(ComplexityWorkload::kDecode, src.data(), src.size());
+  EXPECT_TRUE(cost.ok);
+  EXPECT_EQ(src.size(), cost.input_size);
+  EXPECT_LT(0u, cost.num_allocations);
+  EXPECT_LT(0u, cost.allocated_bytes);
+}
+
+TEST(ComplexityTest, SeedsWithinBudget) {
+  const std::vector<ComplexitySeed> seeds = GetComplexitySeeds();
+  ASSERT_FALSE(seeds.empty());
+  for (const ComplexitySeed& seed : seeds) {
+    const std::string name =
+        std::string(ComplexityWorkloadName(seed.workload)) + "/" + seed.name;
+    SCOPED_TRACE(name);
+    const ComplexityCost cost =
+        MeasureComplexity(seed.workload, seed.data.data(), seed.data.size());
+    // Seeds that are rejected early do not exercise the worst case.
+    EXPECT_TRUE(cost.ok);
+    EXPECT_LE(cost.NanosPerByte(), seed.budget.nanos_per_byte);
+    EXPECT_LE(cost.AllocationsPerByte(), seed.budget.allocations_per_byte);
+    EXPECT_LE(cost.AllocatedBytesPerByte(),
+              seed.budget.allocated_bytes_per_byte);
+  }
+}
+
+}  // namespace brunsli
@@ -0,0 +1,138 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdio>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../dec/bit_reader.h"
+#include "../dec/context_map_decode.h"
+#include "../dec/huffman_decode.h"
+#include "../enc/context_map_encode.h"
+#include "../enc/write_bits.h"
+#include "../tools/jpeg_synth.h"
+
+namespace brunsli {
+
+namespace {
+
+// Context map with long runs of repeated values, like real ones.
+std::vector<uint32_t> MakeContextMap(size_t length, size_t num_clusters,
+                                     uint32_t seed) {
+  std::vector<uint32_t> map(length);
+  Random rnd(seed);
+  uint32_t value = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const uint32_t r = rnd.Next();
+    if ((r & 7) == 0) value = (r >> 3) % num_clusters;
+    map[i] = value;
+  }
+  // Make sure all clusters are used.
+  for (size_t i = 0; i < num_clusters; ++i) map[i] = static_cast<uint32_t>(i);
+  return map;
+}
+
+std::vector<uint8_t> EncodeMap(const std::vector<uint32_t>& map,
+                               size_t num_clusters) {
+  std::vector<uint8_t> output(16 + 4 * map.size());
+  size_t len;
+  {
+    Storage storage(output.data(), output.size());
+    EncodeContextMap(map, num_clusters, &storage);
+    len = storage.GetBytesUsed();
+  }
+  // Add some padding, so that the bulk path could be taken.
+  output.resize(len + 8);
+  return output;
+}
+
+// Reads the (VarLenUint8) number of clusters and the context map code.
+void ReadPrefix(BrunsliBitReader* br, size_t num_clusters,
+                size_t* max_run_length_prefix, HuffmanDecodingData* entropy) {
+  uint32_t num_clusters_minus_one = 0;
+  if (BrunsliBitReaderRead(br, 1)) {
+    uint32_t nbits = BrunsliBitReaderRead(br, 3);
+    num_clusters_minus_one =
+        (nbits == 0) ? 1u : BrunsliBitReaderRead(br, nbits) + (1u << nbits);
+  }
+  ASSERT_EQ(num_clusters - 1, num_clusters_minus_one);
+  *max_run_length_prefix = 0;
+  if (BrunsliBitReaderRead(br, 1)) {
+    *max_run_length_prefix = BrunsliBitReaderRead(br, 4) + 1;
+  }
+  ASSERT_TRUE(entropy->ReadFromBitStream(
+      num_clusters + *max_run_length_prefix, br));
+}
+
+// Decodes context map supplying |chunk_size| bytes at a time.
+std::vector<uint8_t> DecodeMap(const std::vector<uint8_t>& data, size_t length,
+                               size_t num_clusters, size_t chunk_size) {
+  std::vector<uint8_t> map(length);
+  BrunsliBitReader br;
+  BrunsliBitReaderInit(&br);
+  // Prefix is read from fully available input.
+  BrunsliBitReaderResume(&br, data.data(), data.size());
+  size_t max_run_length_prefix;
+  HuffmanDecodingData entropy;
+  ReadPrefix(&br, num_clusters, &max_run_length_prefix, &entropy);
+  size_t pos = data.size() - BrunsliBitReaderSuspend(&br);
+
+  size_t index = 0;
+  size_t end = pos;
+  BrunsliStatus status = BRUNSLI_NOT_ENOUGH_DATA;
+  while (status == BRUNSLI_NOT_ENOUGH_DATA) {
+    EXPECT_LT(pos, data.size());
+    if (pos >= data.size()) break;
+    end = std::min(data.size(), std::max(end, pos) + chunk_size);
+    BrunsliBitReaderResume(&br, data.data() + pos, end - pos);
+    status = DecodeContextMap(entropy, max_run_length_prefix, &index, &map,
+                              &br);
+    pos = end - BrunsliBitReaderSuspend(&br);
+  }
+  EXPECT_EQ(BRUNSLI_OK, status);
+  return map;
+}
+
+}  // namespace
+
+TEST(ContextMapTest, Roundtrip) {
+  for (size_t num_clusters : {2, 3, 17, 255}) {
+    const std::vector<uint32_t> map =
+        MakeContextMap(3000, num_clusters, static_cast<uint32_t>(num_clusters));
+    const std::vector<uint8_t> expected(map.begin(), map.end());
+    const std::vector<uint8_t> encoded = EncodeMap(map, num_clusters);
+    // Bulk path.
+    EXPECT_EQ(expected,
+              DecodeMap(encoded, map.size(), num_clusters, encoded.size()));
+    // Streaming path.
+    EXPECT_EQ(expected, DecodeMap(encoded, map.size(), num_clusters, 1));
+    EXPECT_EQ(expected, DecodeMap(encoded, map.size(), num_clusters, 7));
+  }
+}
+
+// Microbenchmark; run with --gtest_also_run_disabled_tests.
+TEST(ContextMapTest, DISABLED_DecodeSpeed) {
+  const size_t kNumClusters = 255;
+  const std::vector<uint32_t> map = MakeContextMap(20000, kNumClusters, 1);
+  const std::vector<uint8_t> encoded = EncodeMap(map, kNumClusters);
+  const size_t kNumReps = 200;
+  for (size_t chunk_size : {encoded.size(), size_t(64)}) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kNumReps; ++i) {
+      DecodeMap(encoded, map.size(), kNumClusters, chunk_size);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    printf("chunk %zu: %.1f MB/s\n", chunk_size,
+           kNumReps * map.size() / seconds * 1e-6);
+  }
+}
+
+}  // namespace brunsli
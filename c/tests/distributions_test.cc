@@ -156,6 +156,30 @@ TEST(Distributions, TowardsOne) {
   }
 }
 
+TEST(Distributions, DecayTowardsZero) {
+  Prob p;
+  p.Init(0);
+  p.InitDecay();
+  EXPECT_EQ(1, p.get_proba());
+  for (size_t i = 0; i < 10000; ++i) {
+    p.AddDecay(0);
+    ASSERT_GE(p.get_proba(), 1) << i;
+  }
+  EXPECT_EQ(255, p.get_proba());
+}
+
+TEST(Distributions, DecayTowardsOne) {
+  Prob p;
+  p.Init(255);
+  p.InitDecay();
+  EXPECT_EQ(255, p.get_proba());
+  for (size_t i = 0; i < 10000; ++i) {
+    p.AddDecay(1);
+    ASSERT_GE(p.get_proba(), 1) << i;
+  }
+  EXPECT_EQ(1, p.get_proba());
+}
+
 TEST(Distributions, Extremes) {
   std::vector<int> text;
   for (size_t i = 0; i < 50000; ++i) {
@@ -0,0 +1,107 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Fuzzer that looks for inputs that are expensive per byte, rather than for
+// crashes.
+//
+// The first byte of input selects the workload (see ComplexityWorkload), the
+// rest is passed to it. Measured cost is reported to libFuzzer as "extra
+// coverage": each order of magnitude of CPU time / allocated memory per byte
+// is a separate feature, so inputs that reach a new magnitude are kept in the
+// corpus and mutated further. Newly reached maximums are logged to stderr.
+//
+// If BRUNSLI_COMPLEXITY_MAX_NS_PER_BYTE environment variable is set, inputs
+// that exceed it are reported as crashes. Findings should be added to
+// GetComplexitySeeds along with the fix.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// #include "gtest/gtest.h"
+// #include "testing/fuzzing/fuzztest.h"
+#include "./complexity.h"
+#include "./test_utils.h"
+
+namespace {
+
+const size_t kNumBuckets = 32;
+
+// libFuzzer treats this section as additional coverage counters.
+#if defined(__linux__)
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+uint8_t cost_counters[brunsli::kNumComplexityWorkloads][2][kNumBuckets];
+
+size_t Bucket(double value) {
+  // log2 granularity.
+  const double bucket = std::log2(1.0 + value);
+  return (bucket < kNumBuckets - 1) ? static_cast<size_t>(bucket)
+                                    : kNumBuckets - 1;
+}
+
+double GetLimit() {
+  const char* limit = getenv("BRUNSLI_COMPLEXITY_MAX_NS_PER_BYTE");
+  return (limit != nullptr) ? atof(limit) : 0.0;
+}
+
+}  // namespace
+
+int DoTestOneInput(const uint8_t* data, size_t size) {
+  if (size == 0) return 0;
+  const size_t workload_id = data[0] % brunsli::kNumComplexityWorkloads;
+  const brunsli::ComplexityWorkload workload =
+      static_cast<brunsli::ComplexityWorkload>(workload_id);
+  const brunsli::ComplexityCost cost =
+      brunsli::MeasureComplexity(workload, data + 1, size - 1);
+
+  const double ns_per_byte = cost.NanosPerByte();
+  const double bytes_per_byte = cost.AllocatedBytesPerByte();
+  cost_counters[workload_id][0][Bucket(ns_per_byte)] = 1;
+  cost_counters[workload_id][1][Bucket(bytes_per_byte)] = 1;
+
+  static double max_ns_per_byte[brunsli::kNumComplexityWorkloads] = {};
+  if (ns_per_byte > max_ns_per_byte[workload_id]) {
+    max_ns_per_byte[workload_id] = ns_per_byte;
+    fprintf(stderr, "New maximum for %s: %.0f ns/B, %.1f alloc B/B (%zu B)\n",
+            brunsli::ComplexityWorkloadName(workload), ns_per_byte,
+            bytes_per_byte, cost.input_size);
+  }
+
+  static const double limit = GetLimit();
+  if (limit > 0.0 && ns_per_byte > limit) __builtin_trap();
+  return 0;
+}
+
+// Entry point for LibFuzzer.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  return DoTestOneInput(data, size);
+}
+
+void TestOneInput(const std::vector<uint8_t>& data) {
+  DoTestOneInput(data.data(), data.size());
+}
+
+std::vector<std::tuple<std::vector<uint8_t>>> ReadSeeds() {
+  std::vector<std::tuple<std::vector<uint8_t>>> result;
+  for (const brunsli::ComplexitySeed& seed : brunsli::GetComplexitySeeds()) {
+    std::vector<uint8_t> input(1, static_cast<uint8_t>(seed.workload));
+    input.insert(input.end(), seed.data.begin(), seed.data.end());
+    result.emplace_back(std::move(input));
+  }
+  return result;
+}
+
+FUZZ_TEST(BrunsliComplexityFuzz, TestOneInput).WithSeeds(ReadSeeds);
+
+TEST(BrunsliComplexityFuzz, Empty) {
+  DoTestOneInput(nullptr, 0);
+}
@@ -0,0 +1,137 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <atomic>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../common/constants.h"
+#include "../dec/state.h"
+#include "../experimental/groups.h"
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+std::vector<uint8_t> Encode(const JPEGData& jpg) {
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  EXPECT_TRUE(BrunsliEncodeJpeg(jpg, out.data(), &len));
+  out.resize(len);
+  return out;
+}
+
+}  // namespace
+
+TEST(GroupsTest, ParallelExecutorShutdown) {
+  // Idle workers used to wait forever for the termination signal.
+  { ParallelExecutor idle(4); }
+
+  ParallelExecutor parallel(3);
+  Executor executor = parallel.getExecutor();
+  std::atomic<size_t> sum{0};
+  for (size_t round = 0; round < 3; ++round) {
+    executor([&sum](size_t i) { sum += i + 1; }, 100);
+  }
+  EXPECT_EQ(3u * 5050u, sum.load());
+}
+
+TEST(GroupsTest, EncodeParallel) {
+  ParallelExecutor parallel(4);
+  Executor executor = parallel.getExecutor();
+  for (int version : {2, 2 | kACSegmentsVersion}) {
+    JPEGData jpg = MakeRandomJpeg(97, 150, 7);
+    jpg.version = version;
+    const std::vector<uint8_t> expected = Encode(jpg);
+    for (size_t stripe_mcu_rows : {1, 3, 1000}) {
+      SCOPED_TRACE(testing::Message() << "version: " << version
+                                      << " stripe: " << stripe_mcu_rows);
+      size_t len = GetMaximumBrunsliEncodedSize(jpg);
+      std::vector<uint8_t> encoded(len);
+      ASSERT_TRUE(EncodeParallel(jpg, encoded.data(), &len, stripe_mcu_rows,
+                                 &executor));
+      encoded.resize(len);
+      EXPECT_EQ(expected, encoded);
+
+      JPEGData decoded;
+      ASSERT_EQ(BRUNSLI_OK,
+                BrunsliDecodeJpeg(encoded.data(), encoded.size(), &decoded));
+      ExpectSameCoefficients(jpg, decoded);
+    }
+  }
+
+  JPEGData jpg = MakeRandomJpeg(16, 16, 1);
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  EXPECT_FALSE(EncodeParallel(jpg, encoded.data(), &len, 0, &executor));
+}
+
+TEST(GroupsTest, DecodeParallel) {
+  ParallelExecutor parallel(4);
+  Executor executor = parallel.getExecutor();
+  for (int version : {2, 2 | kACSegmentsVersion}) {
+    SCOPED_TRACE(testing::Message() << "version: " << version);
+    JPEGData jpg = MakeRandomJpeg(120, 300, 3);
+    jpg.version = version;
+    const std::vector<uint8_t> encoded = Encode(jpg);
+
+    // Stream is expected to contain several segments.
+    internal::dec::State state;
+    state.data = encoded.data();
+    state.len = encoded.size();
+    JPEGData sequential;
+    ASSERT_EQ(BRUNSLI_OK, internal::dec::ProcessJpeg(&state, &sequential));
+    if (version & kACSegmentsVersion) {
+      EXPECT_GT(state.ac_segment_mcu_rows, 0);
+      EXPECT_LT(state.ac_segment_mcu_rows, sequential.MCU_rows / 2);
+    }
+
+    JPEGData decoded;
+    ASSERT_TRUE(
+        DecodeParallel(encoded.data(), encoded.size(), &decoded, &executor));
+    EXPECT_EQ(version, decoded.version);
+    ExpectSameCoefficients(jpg, decoded);
+  }
+}
+
+TEST(GroupsTest, DecodeParallelInvalidInput) {
+  ParallelExecutor parallel(4);
+  Executor executor = parallel.getExecutor();
+  JPEGData jpg = MakeRandomJpeg(120, 300, 3);
+  jpg.version = 2 | kACSegmentsVersion;
+  const std::vector<uint8_t> encoded = Encode(jpg);
+  const uint8_t* data = encoded.data();
+  JPEGData decoded;
+
+  // Truncated inside the last segment.
+  EXPECT_FALSE(DecodeParallel(data, encoded.size() - 1, &decoded, &executor));
+  // Truncated in the middle; some segments are missing.
+  EXPECT_FALSE(DecodeParallel(data, encoded.size() / 2, &decoded, &executor));
+  // Header only.
+  EXPECT_FALSE(DecodeParallel(data, 16, &decoded, &executor));
+
+  // Trailing garbage.
+  std::vector<uint8_t> extended = encoded;
+  extended.push_back(0);
+  EXPECT_FALSE(
+      DecodeParallel(extended.data(), extended.size(), &decoded, &executor));
+
+  // Corrupted payload of the last segment; sections are still well-formed.
+  std::vector<uint8_t> corrupted = encoded;
+  for (size_t i = corrupted.size() - 40; i < corrupted.size(); ++i) {
+    corrupted[i] = 0xFF;
+  }
+  EXPECT_FALSE(
+      DecodeParallel(corrupted.data(), corrupted.size(), &decoded, &executor));
+}
+
+}  // namespace brunsli
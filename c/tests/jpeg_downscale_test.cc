@@ -0,0 +1,175 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/jpeg_downscale.h>
+#include <brunsli/jpeg_pixels.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "./test_utils.h"
+
+namespace brunsli {
+
+TEST(JpegDownscaleTest, FlatColor) {
+  JPEGData jpg = MakeJpeg(45, 29, 3, 2, 3);
+  const coeff_t dc[3] = {-150, 17, 40};
+  for (size_t i = 0; i < 3; ++i) {
+    JPEGComponent& c = jpg.components[i];
+    for (size_t b = 0; b < c.num_blocks; ++b) {
+      c.coeffs[b * kDCTBlockSize] = dc[i];
+    }
+  }
+  for (int scale : {1, 2, 4, 8}) {
+    JPEGData small;
+    ASSERT_TRUE(BrunsliDownscale(jpg, scale, &small));
+    EXPECT_EQ((45 + scale - 1) / scale, small.width);
+    EXPECT_EQ((29 + scale - 1) / scale, small.height);
+    ASSERT_EQ(3u, small.components.size());
+    for (size_t i = 0; i < 3; ++i) {
+      const JPEGComponent& c = small.components[i];
+      ASSERT_EQ(c.num_blocks * kDCTBlockSize, c.coeffs.size());
+      for (size_t k = 0; k < c.coeffs.size(); ++k) {
+        ASSERT_EQ((k % kDCTBlockSize == 0) ? dc[i] : 0, c.coeffs[k]);
+      }
+    }
+  }
+}
+
+TEST(JpegDownscaleTest, MatchesScaledRendering) {
+  for (int samp : {1, 2}) {
+    JPEGData jpg = MakeJpeg(70, 50, 3, samp, 1);
+    for (size_t i = 0; i < 3; ++i) FillSmooth(&jpg.components[i], i + 3);
+    for (int scale : {1, 2, 4, 8}) {
+      JPEGData small;
+      ASSERT_TRUE(BrunsliDownscale(jpg, scale, &small));
+      std::vector<uint8_t> expected;
+      ASSERT_TRUE(RenderJpegPixels(jpg, scale, JPEG_PIXELS_YCBCR, &expected));
+      std::vector<uint8_t> actual;
+      ASSERT_TRUE(RenderJpegPixels(small, 1, JPEG_PIXELS_YCBCR, &actual));
+      ASSERT_EQ(expected.size(), actual.size());
+      for (size_t k = 0; k < expected.size(); ++k) {
+        ASSERT_LE(std::abs(expected[k] - actual[k]), 2)
+            << "samp " << samp << " scale " << scale << " at " << k;
+      }
+    }
+  }
+}
+
+TEST(JpegDownscaleTest, SerializeAndEncode) {
+  JPEGData jpg = MakeJpeg(99, 67, 3, 2, 2);
+  for (size_t i = 0; i < 3; ++i) FillSmooth(&jpg.components[i], i + 5);
+  const std::vector<uint8_t> app = {0xE1, 0x00, 0x06, 'E', 'x', 'i', 'f'};
+  const std::vector<uint8_t> com = {0xFE, 0x00, 0x04, 'h', 'i'};
+  jpg.app_data.push_back(app);
+  jpg.com_data.push_back(com);
+  jpg.marker_order = {0xE1, 0xFE};
+
+  for (int scale : {2, 8}) {
+    JPEGData small;
+    ASSERT_TRUE(BrunsliDownscale(jpg, scale, &small));
+
+    std::vector<uint8_t> serialized;
+    ASSERT_TRUE(
+        WriteJpeg(small, JPEGOutput(VectorOutputFunction, &serialized)));
+    JPEGData parsed;
+    ASSERT_TRUE(ReadJpeg(serialized.data(), serialized.size(), JPEG_READ_ALL,
+                         &parsed));
+    EXPECT_EQ(small.width, parsed.width);
+    EXPECT_EQ(small.height, parsed.height);
+    ExpectSameCoefficients(small, parsed);
+    ASSERT_EQ(1u, parsed.app_data.size());
+    EXPECT_EQ(app, parsed.app_data[0]);
+    ASSERT_EQ(1u, parsed.com_data.size());
+    EXPECT_EQ(com, parsed.com_data[0]);
+
+    size_t len = GetMaximumBrunsliEncodedSize(small);
+    std::vector<uint8_t> encoded(len);
+    ASSERT_TRUE(BrunsliEncodeJpeg(small, encoded.data(), &len));
+    JPEGData decoded;
+    ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+    ExpectSameCoefficients(small, decoded);
+    std::vector<uint8_t> reserialized;
+    ASSERT_TRUE(
+        WriteJpeg(decoded, JPEGOutput(VectorOutputFunction, &reserialized)));
+    EXPECT_EQ(serialized, reserialized);
+  }
+}
+
+TEST(JpegDownscaleTest, InvalidInput) {
+  JPEGData jpg = MakeJpeg(16, 16, 1, 1, 1);
+  JPEGData small;
+  EXPECT_TRUE(BrunsliDownscale(jpg, 2, &small));
+  EXPECT_FALSE(BrunsliDownscale(jpg, 3, &small));
+  EXPECT_FALSE(BrunsliDownscale(jpg, 16, &small));
+  jpg.components[0].coeffs.clear();
+  EXPECT_FALSE(BrunsliDownscale(jpg, 2, &small));
+  // Fallback mode: no parsed image data.
+  EXPECT_FALSE(BrunsliDownscale(JPEGData(), 2, &small));
+}
+
+// Compares thumbnail generation in DCT domain with the pixel pipeline
+// (full-size IDCT + box filter); run with --gtest_also_run_disabled_tests.
+// Pixel pipeline time does not include JPEG encoding of the result.
+TEST(JpegDownscaleTest, DISABLED_Speed) {
+  JPEGData jpg = MakeJpeg(2048, 1536, 3, 2, 2);
+  for (size_t i = 0; i < 3; ++i) FillSmooth(&jpg.components[i], i + 1);
+  const size_t kNumReps = 5;
+  for (int scale : {2, 4, 8}) {
+    size_t output_size = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kNumReps; ++i) {
+      JPEGData small;
+      BrunsliDownscale(jpg, scale, &small);
+      std::vector<uint8_t> serialized;
+      WriteJpeg(small, JPEGOutput(VectorOutputFunction, &serialized));
+      output_size = serialized.size();
+    }
+    auto end = std::chrono::steady_clock::now();
+    const double dct_seconds =
+        std::chrono::duration<double>(end - start).count() / kNumReps;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kNumReps; ++i) {
+      std::vector<uint8_t> full;
+      RenderJpegPixels(jpg, 1, JPEG_PIXELS_RGB, &full);
+      const int xsize = jpg.width / scale;
+      const int ysize = jpg.height / scale;
+      std::vector<uint8_t> thumbnail(xsize * ysize * 3);
+      const size_t full_stride = jpg.width * 3;
+      for (int y = 0; y < ysize; ++y) {
+        for (int x = 0; x < xsize * 3; ++x) {
+          const int c = x % 3;
+          const int x0 = (x / 3) * scale;
+          int sum = 0;
+          for (int dy = 0; dy < scale; ++dy) {
+            const uint8_t* row = &full[(y * scale + dy) * full_stride];
+            for (int dx = 0; dx < scale; ++dx) sum += row[(x0 + dx) * 3 + c];
+          }
+          thumbnail[y * xsize * 3 + x] =
+              static_cast<uint8_t>(sum / (scale * scale));
+        }
+      }
+    }
+    end = std::chrono::steady_clock::now();
+    const double pixel_seconds =
+        std::chrono::duration<double>(end - start).count() / kNumReps;
+    printf("1/%d: DCT domain + WriteJpeg %.2f ms (%zu bytes), "
+           "pixels + box filter %.2f ms\n",
+           scale, dct_seconds * 1e3, output_size, pixel_seconds * 1e3);
+  }
+}
+
+}  // namespace brunsli
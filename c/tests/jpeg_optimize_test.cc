@@ -0,0 +1,138 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "../common/baseline_jpeg.h"
+#include "../common/constants.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../dec/state.h"
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+bool IsProgressive(const JPEGData& jpg) {
+  return std::find(jpg.marker_order.begin(), jpg.marker_order.end(), 0xC2) !=
+         jpg.marker_order.end();
+}
+
+}  // namespace
+
+TEST(JpegOptimizeTest, Roundtrip) {
+  const JPEGData images[] = {MakeRandomJpeg(123, 77, 3, 2, 4, 1),
+                             MakeRandomJpeg(64, 40, 3, 1, 4, 2),
+                             MakeRandomJpeg(50, 50, 1, 1, 4, 3)};
+  for (const JPEGData& source : images) {
+    // Stock Huffman codes; optimized output should be smaller.
+    JPEGData jpg = source;
+    SetBaselineJpegStructure(&jpg);
+    const std::vector<uint8_t> stock =
+        WriteJpegToVector(jpg, JPEG_WRITE_ORIGINAL);
+
+    for (JPEGWriteMode mode :
+         {JPEG_WRITE_OPTIMIZED, JPEG_WRITE_OPTIMIZED_PROGRESSIVE}) {
+      const std::vector<uint8_t> optimized = WriteJpegToVector(jpg, mode);
+      EXPECT_LT(optimized.size(), stock.size());
+      JPEGData parsed;
+      ASSERT_TRUE(ReadJpeg(optimized.data(), optimized.size(), JPEG_READ_ALL,
+                           &parsed));
+      ExpectSameCoefficients(jpg, parsed);
+      EXPECT_EQ(mode == JPEG_WRITE_OPTIMIZED_PROGRESSIVE,
+                IsProgressive(parsed));
+    }
+  }
+}
+
+TEST(JpegOptimizeTest, RealImage) {
+  std::vector<uint8_t> src = GetSmallBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(src.data(), src.size(), &jpg));
+  jpg.app_data.push_back({0xE1, 0x00, 0x04, 'h', 'i'});
+  jpg.marker_order.insert(jpg.marker_order.begin(), 0xE1);
+  for (JPEGWriteMode mode :
+       {JPEG_WRITE_OPTIMIZED, JPEG_WRITE_OPTIMIZED_PROGRESSIVE}) {
+    const std::vector<uint8_t> optimized = WriteJpegToVector(jpg, mode);
+    JPEGData parsed;
+    ASSERT_TRUE(ReadJpeg(optimized.data(), optimized.size(), JPEG_READ_ALL,
+                         &parsed));
+    ExpectSameCoefficients(jpg, parsed);
+    EXPECT_EQ(jpg.app_data, parsed.app_data);
+  }
+}
+
+TEST(JpegOptimizeTest, BrunsliRoundtrip) {
+  JPEGData jpg = MakeRandomJpeg(99, 61, 3, 2, 4, 4);
+  ASSERT_TRUE(OptimizeJpegCoding(&jpg, true));
+  const std::vector<uint8_t> expected =
+      WriteJpegToVector(jpg, JPEG_WRITE_ORIGINAL);
+
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  ASSERT_TRUE(BrunsliEncodeJpeg(jpg, encoded.data(), &len));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+  EXPECT_EQ(expected, WriteJpegToVector(decoded, JPEG_WRITE_ORIGINAL));
+}
+
+TEST(JpegOptimizeTest, CodeLengthLimit) {
+  // Symbol frequencies follow Fibonacci sequence, which makes the optimal
+  // tree very deep (the sentinel symbol has frequency 1).
+  std::vector<int> freq = {2, 3};
+  while (freq.size() < 20) {
+    freq.push_back(freq[freq.size() - 1] + freq[freq.size() - 2]);
+  }
+  int num_blocks = 0;
+  for (int f : freq) num_blocks += f;
+  JPEGData jpg = MakeJpeg(8 * 256, 8 * ((num_blocks + 255) / 256), 1, 1, 4);
+  JPEGComponent& c = jpg.components[0];
+  size_t block = 0;
+  for (size_t i = 0; i < freq.size(); ++i) {
+    // Symbol: run of (i / 8) zeros, followed by value of (i % 8 + 1) bits.
+    const int run = static_cast<int>(i / 8);
+    const coeff_t value = static_cast<coeff_t>(1 << (i % 8));
+    for (int j = 0; j < freq[i]; ++j, ++block) {
+      c.coeffs[block * kDCTBlockSize + kJPEGNaturalOrder[1 + run]] = value;
+    }
+  }
+  ASSERT_TRUE(OptimizeJpegCoding(&jpg, false));
+  // Code lengths are limited; AC code is the last one.
+  EXPECT_GT(jpg.huffman_code.back().counts[kJpegHuffmanMaxBitLength], 0);
+  for (const JPEGHuffmanCode& huff : jpg.huffman_code) {
+    // Kraft inequality; the sentinel occupies the all-ones code.
+    uint32_t space = 0;
+    for (int i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
+      space += huff.counts[i] << (kJpegHuffmanMaxBitLength - i);
+    }
+    EXPECT_LE(space, 1u << kJpegHuffmanMaxBitLength);
+  }
+  const std::vector<uint8_t> optimized =
+      WriteJpegToVector(jpg, JPEG_WRITE_ORIGINAL);
+  JPEGData parsed;
+  ASSERT_TRUE(
+      ReadJpeg(optimized.data(), optimized.size(), JPEG_READ_ALL, &parsed));
+  ExpectSameCoefficients(jpg, parsed);
+}
+
+TEST(JpegOptimizeTest, Fallback) {
+  std::vector<uint8_t> src = GetFallbackBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(src.data(), src.size(), &jpg));
+  EXPECT_FALSE(OptimizeJpegCoding(&jpg, false));
+  EXPECT_EQ(WriteJpegToVector(jpg, JPEG_WRITE_ORIGINAL),
+            WriteJpegToVector(jpg, JPEG_WRITE_OPTIMIZED));
+}
+
+}  // namespace brunsli
@@ -0,0 +1,130 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <cstdlib>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_pixels.h>
+#include <brunsli/types.h>
+#include "./test_utils.h"
+
+namespace brunsli {
+
+TEST(JpegPixelsTest, Size) {
+  JPEGData jpg = MakeJpeg(33, 17, 3, 2, 1);
+  int xsize;
+  int ysize;
+  ASSERT_TRUE(GetJpegPixelsSize(jpg, 1, &xsize, &ysize));
+  EXPECT_EQ(33, xsize);
+  EXPECT_EQ(17, ysize);
+  ASSERT_TRUE(GetJpegPixelsSize(jpg, 8, &xsize, &ysize));
+  EXPECT_EQ(5, xsize);
+  EXPECT_EQ(3, ysize);
+  EXPECT_FALSE(GetJpegPixelsSize(jpg, 3, &xsize, &ysize));
+}
+
+TEST(JpegPixelsTest, FlatColor) {
+  for (int samp : {1, 2}) {
+    JPEGData jpg = MakeJpeg(37, 21, 3, samp, 1);
+    // Y = 200, Cb = 138, Cr = 128; DC is 8x the level-shifted sample value.
+    const coeff_t dc[3] = {8 * 72, 8 * 10, 0};
+    for (size_t i = 0; i < 3; ++i) {
+      JPEGComponent& c = jpg.components[i];
+      for (size_t b = 0; b < c.num_blocks; ++b) {
+        c.coeffs[b * kDCTBlockSize] = dc[i];
+      }
+    }
+    for (int scale : {1, 2, 4, 8}) {
+      std::vector<uint8_t> pixels;
+      ASSERT_TRUE(RenderJpegPixels(jpg, scale, JPEG_PIXELS_YCBCR, &pixels));
+      for (size_t i = 0; i < pixels.size(); i += 3) {
+        ASSERT_EQ(200, pixels[i]);
+        ASSERT_EQ(138, pixels[i + 1]);
+        ASSERT_EQ(128, pixels[i + 2]);
+      }
+      ASSERT_TRUE(RenderJpegPixels(jpg, scale, JPEG_PIXELS_RGB, &pixels));
+      for (size_t i = 0; i < pixels.size(); i += 3) {
+        ASSERT_EQ(200, pixels[i]);
+        ASSERT_EQ(197, pixels[i + 1]);
+        ASSERT_EQ(218, pixels[i + 2]);
+      }
+    }
+  }
+}
+
+TEST(JpegPixelsTest, StripesMatchWholeImage) {
+  JPEGData jpg = MakeJpeg(50, 70, 3, 2, 1);
+  for (size_t i = 0; i < 3; ++i) FillSmooth(&jpg.components[i], i + 1);
+  for (int scale : {1, 2, 8}) {
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(RenderJpegPixels(jpg, scale, JPEG_PIXELS_RGB, &expected));
+    int xsize;
+    int ysize;
+    ASSERT_TRUE(GetJpegPixelsSize(jpg, scale, &xsize, &ysize));
+    const size_t stride = xsize * kJPEGPixelsBytesPerPixel;
+    const int mcu_height = 16 / scale;
+    // Last stripe is cropped, but other stripes are written completely.
+    std::vector<uint8_t> actual(stride * jpg.MCU_rows * mcu_height);
+    for (int mcu_y = 0; mcu_y < jpg.MCU_rows; ++mcu_y) {
+      ASSERT_TRUE(RenderJpegPixelRows(jpg, scale, JPEG_PIXELS_RGB, mcu_y,
+                                      mcu_y + 1,
+                                      &actual[mcu_y * mcu_height * stride],
+                                      stride));
+    }
+    actual.resize(expected.size());
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST(JpegPixelsTest, DownscaledIsAverage) {
+  JPEGData jpg = MakeJpeg(64, 48, 1, 1, 1);
+  FillSmooth(&jpg.components[0], 7);
+  std::vector<uint8_t> full;
+  ASSERT_TRUE(RenderJpegPixels(jpg, 1, JPEG_PIXELS_YCBCR, &full));
+  const size_t full_stride = 64 * 3;
+  for (int scale : {2, 4, 8}) {
+    std::vector<uint8_t> scaled;
+    ASSERT_TRUE(RenderJpegPixels(jpg, scale, JPEG_PIXELS_YCBCR, &scaled));
+    const int xsize = 64 / scale;
+    const int ysize = 48 / scale;
+    ASSERT_EQ(static_cast<size_t>(xsize * ysize * 3), scaled.size());
+    for (int y = 0; y < ysize; ++y) {
+      for (int x = 0; x < xsize; ++x) {
+        int sum = 0;
+        for (int dy = 0; dy < scale; ++dy) {
+          for (int dx = 0; dx < scale; ++dx) {
+            sum += full[(y * scale + dy) * full_stride + (x * scale + dx) * 3];
+          }
+        }
+        const int average = (sum + scale * scale / 2) / (scale * scale);
+        ASSERT_LE(std::abs(average - scaled[(y * xsize + x) * 3]), 2)
+            << "scale " << scale << " at " << x << ", " << y;
+      }
+    }
+  }
+}
+
+TEST(JpegPixelsTest, InvalidInput) {
+  JPEGData jpg = MakeJpeg(16, 16, 3, 1, 1);
+  std::vector<uint8_t> pixels;
+  EXPECT_TRUE(RenderJpegPixels(jpg, 1, JPEG_PIXELS_RGB, &pixels));
+  const size_t stride = 16 * 3;
+  std::vector<uint8_t> out(16 * stride);
+  // Out of range MCU row.
+  EXPECT_FALSE(RenderJpegPixelRows(jpg, 1, JPEG_PIXELS_RGB, 1, 3, out.data(),
+                                   stride));
+  // Stride too small.
+  EXPECT_FALSE(RenderJpegPixelRows(jpg, 1, JPEG_PIXELS_RGB, 0, 1, out.data(),
+                                   stride - 1));
+  jpg.components[1].coeffs.clear();
+  EXPECT_FALSE(RenderJpegPixels(jpg, 1, JPEG_PIXELS_RGB, &pixels));
+  jpg.components.resize(2);
+  EXPECT_FALSE(RenderJpegPixels(jpg, 1, JPEG_PIXELS_RGB, &pixels));
+}
+
+}  // namespace brunsli
@@ -0,0 +1,157 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../tools/jpeg_synth.h"
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+std::string Synthesize(const JPEGSynthParams& params) {
+  JPEGData jpg;
+  EXPECT_TRUE(SynthesizeJpeg(params, &jpg));
+  std::string out;
+  EXPECT_TRUE(WriteJpeg(jpg, JPEGOutput(StringOutputFunction, &out)));
+  return out;
+}
+
+// Checks that serialized image is parsed back and survives Brunsli roundtrip.
+void ExpectValid(const JPEGSynthParams& params) {
+  JPEGData expected;
+  ASSERT_TRUE(SynthesizeJpeg(params, &expected));
+  const std::string jpeg = Synthesize(params);
+  ASSERT_FALSE(jpeg.empty());
+
+  JPEGData jpg;
+  ASSERT_TRUE(ReadJpeg(reinterpret_cast<const uint8_t*>(jpeg.data()),
+                       jpeg.size(), JPEG_READ_ALL, &jpg));
+  EXPECT_EQ(params.width, jpg.width);
+  EXPECT_EQ(params.height, jpg.height);
+  EXPECT_EQ(params.restart_interval, jpg.restart_interval);
+  ASSERT_EQ(expected.components.size(), jpg.components.size());
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    EXPECT_EQ(expected.components[i].coeffs, jpg.components[i].coeffs);
+  }
+
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  ASSERT_TRUE(BrunsliEncodeJpeg(jpg, encoded.data(), &len));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+  std::string reconstructed;
+  ASSERT_TRUE(
+      WriteJpeg(decoded, JPEGOutput(StringOutputFunction, &reconstructed)));
+  EXPECT_EQ(jpeg, reconstructed);
+}
+
+}  // namespace
+
+TEST(JpegSynthTest, AllCombinations) {
+  JPEGSynthParams params;
+  // Partial MCUs on both edges.
+  params.width = 67;
+  params.height = 45;
+  for (JPEGSynthSubsampling subsampling :
+       {JPEG_SYNTH_444, JPEG_SYNTH_422, JPEG_SYNTH_420, JPEG_SYNTH_GRAY}) {
+    for (JPEGSynthScans scans :
+         {JPEG_SYNTH_SEQUENTIAL, JPEG_SYNTH_PROGRESSIVE,
+          JPEG_SYNTH_PROGRESSIVE_REFINEMENT}) {
+      for (JPEGSynthContent content :
+           {JPEG_SYNTH_ZERO, JPEG_SYNTH_RANDOM, JPEG_SYNTH_STRUCTURED}) {
+        for (int restart_interval : {0, 3}) {
+          SCOPED_TRACE(testing::Message()
+                       << "subsampling: " << subsampling << " scans: "
+                       << scans << " content: " << content
+                       << " restart: " << restart_interval);
+          params.subsampling = subsampling;
+          params.scans = scans;
+          params.content = content;
+          params.restart_interval = restart_interval;
+          ExpectValid(params);
+        }
+      }
+    }
+  }
+}
+
+TEST(JpegSynthTest, ResetPointsAndPadding) {
+  JPEGSynthParams params;
+  params.width = 100;
+  params.height = 60;
+  params.reset_interval = 5;
+  params.zero_padding = true;
+  for (JPEGSynthScans scans :
+       {JPEG_SYNTH_SEQUENTIAL, JPEG_SYNTH_PROGRESSIVE,
+        JPEG_SYNTH_PROGRESSIVE_REFINEMENT}) {
+    for (int restart_interval : {0, 2}) {
+      SCOPED_TRACE(testing::Message() << "scans: " << scans
+                                      << " restart: " << restart_interval);
+      params.scans = scans;
+      params.restart_interval = restart_interval;
+      ExpectValid(params);
+    }
+  }
+}
+
+TEST(JpegSynthTest, PaddingBitsPerRestartInterval) {
+  JPEGSynthParams params;
+  params.width = 100;
+  params.height = 60;
+  params.restart_interval = 2;
+  params.zero_padding = true;
+  JPEGData jpg;
+  ASSERT_TRUE(SynthesizeJpeg(params, &jpg));
+  // Single interleaved scan of 7 x 4 MCUs, i.e. 14 restart intervals.
+  ASSERT_EQ(1u, jpg.scan_info.size());
+  EXPECT_EQ(7u * 14, jpg.padding_bits.size());
+}
+
+TEST(JpegSynthTest, Deterministic) {
+  JPEGSynthParams params;
+  const std::string first = Synthesize(params);
+  EXPECT_EQ(first, Synthesize(params));
+  params.seed = 2;
+  EXPECT_NE(first, Synthesize(params));
+}
+
+TEST(JpegSynthTest, QualityAffectsSize) {
+  JPEGSynthParams params;
+  params.quality = 10;
+  const size_t low = Synthesize(params).size();
+  params.quality = 95;
+  const size_t high = Synthesize(params).size();
+  EXPECT_LT(2 * low, high);
+}
+
+TEST(JpegSynthTest, InvalidParams) {
+  JPEGData jpg;
+  JPEGSynthParams params;
+  params.width = 0;
+  EXPECT_FALSE(SynthesizeJpeg(params, &jpg));
+  params = JPEGSynthParams();
+  params.height = kMaxDimPixels + 1;
+  EXPECT_FALSE(SynthesizeJpeg(params, &jpg));
+  params = JPEGSynthParams();
+  params.quality = 101;
+  EXPECT_FALSE(SynthesizeJpeg(params, &jpg));
+  params = JPEGSynthParams();
+  params.restart_interval = -1;
+  EXPECT_FALSE(SynthesizeJpeg(params, &jpg));
+}
+
+}  // namespace brunsli
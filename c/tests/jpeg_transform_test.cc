@@ -0,0 +1,238 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <cstdlib>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/jpeg_pixels.h>
+#include <brunsli/jpeg_transform.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+// Produces JPEGData with pseudo-random coefficients and two quantization
+// tables, neither of which is symmetric.
+JPEGData MakeAsymmetricJpeg(int width, int height, int samp, uint32_t seed) {
+  JPEGData jpg = MakeRandomJpeg(width, height, 3, samp, 1, seed);
+  jpg.quant.resize(2);
+  for (size_t i = 0; i < jpg.quant.size(); ++i) {
+    jpg.quant[i].index = static_cast<int>(i);
+    for (int k = 0; k < kDCTBlockSize; ++k) {
+      jpg.quant[i].values[k] = 1 + (k * (i + 2)) % 5;
+    }
+  }
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    jpg.components[i].quant_idx = (i == 0) ? 0 : 1;
+  }
+  return jpg;
+}
+
+// Produces APP1 marker with a single IFD0 entry: orientation.
+std::vector<uint8_t> MakeExif(int orientation, bool big_endian) {
+  const uint8_t o = static_cast<uint8_t>(orientation);
+  // Marker, length (filled below), "Exif\0\0" and TIFF header.
+  std::vector<uint8_t> app =
+      big_endian ? std::vector<uint8_t>{0xE1, 0, 0, 'E', 'x', 'i', 'f', 0, 0,
+                                        'M', 'M', 0, 42, 0, 0, 0, 8,
+                                        0, 1,  // 1 entry
+                                        0x01, 0x12, 0, 3, 0, 0, 0, 1,
+                                        0, o, 0, 0,
+                                        0, 0, 0, 0}
+                 : std::vector<uint8_t>{0xE1, 0, 0, 'E', 'x', 'i', 'f', 0, 0,
+                                        'I', 'I', 42, 0, 8, 0, 0, 0,
+                                        1, 0,  // 1 entry
+                                        0x12, 0x01, 3, 0, 1, 0, 0, 0,
+                                        o, 0, 0, 0,
+                                        0, 0, 0, 0};
+  const size_t len = app.size() - 1;
+  app[1] = static_cast<uint8_t>(len >> 8);
+  app[2] = static_cast<uint8_t>(len & 0xFF);
+  return app;
+}
+
+std::vector<uint8_t> Render(const JPEGData& jpg) {
+  std::vector<uint8_t> pixels;
+  EXPECT_TRUE(RenderJpegPixels(jpg, 1, JPEG_PIXELS_YCBCR, &pixels));
+  return pixels;
+}
+
+// Reference implementation: |in| is a |width| pixels wide image, |out| has
+// |out_width| x |out_height| pixels.
+void ExpectTransformedPixels(const std::vector<uint8_t>& in, int width,
+                             JPEGTransformType transform,
+                             const std::vector<uint8_t>& out, int out_width,
+                             int out_height) {
+  const bool transpose =
+      transform == JPEG_TRANSFORM_TRANSPOSE ||
+      transform == JPEG_TRANSFORM_TRANSVERSE ||
+      transform == JPEG_TRANSFORM_ROT_90 || transform == JPEG_TRANSFORM_ROT_270;
+  const bool flip_h =
+      transform == JPEG_TRANSFORM_FLIP_H ||
+      transform == JPEG_TRANSFORM_TRANSVERSE ||
+      transform == JPEG_TRANSFORM_ROT_90 || transform == JPEG_TRANSFORM_ROT_180;
+  const bool flip_v =
+      transform == JPEG_TRANSFORM_FLIP_V ||
+      transform == JPEG_TRANSFORM_TRANSVERSE ||
+      transform == JPEG_TRANSFORM_ROT_270 ||
+      transform == JPEG_TRANSFORM_ROT_180;
+  ASSERT_EQ(static_cast<size_t>(out_width * out_height * 3), out.size());
+  for (int y = 0; y < out_height; ++y) {
+    for (int x = 0; x < out_width; ++x) {
+      const int tx = flip_h ? out_width - 1 - x : x;
+      const int ty = flip_v ? out_height - 1 - y : y;
+      const int sx = transpose ? ty : tx;
+      const int sy = transpose ? tx : ty;
+      for (int c = 0; c < 3; ++c) {
+        const int expected = in[(sy * width + sx) * 3 + c];
+        const int actual = out[(y * out_width + x) * 3 + c];
+        ASSERT_LE(std::abs(expected - actual), 1)
+            << "transform " << transform << " at " << x << ", " << y;
+      }
+    }
+  }
+}
+
+const JPEGTransformType kAllTransforms[] = {
+    JPEG_TRANSFORM_NONE,       JPEG_TRANSFORM_FLIP_H,
+    JPEG_TRANSFORM_FLIP_V,     JPEG_TRANSFORM_TRANSPOSE,
+    JPEG_TRANSFORM_TRANSVERSE, JPEG_TRANSFORM_ROT_90,
+    JPEG_TRANSFORM_ROT_180,    JPEG_TRANSFORM_ROT_270};
+
+}  // namespace
+
+TEST(JpegTransformTest, PixelsAreTransformed) {
+  for (int samp : {1, 2}) {
+    // Partial MCUs on both edges.
+    JPEGData jpg = MakeAsymmetricJpeg(61, 45, samp, samp);
+    const std::vector<uint8_t> pixels = Render(jpg);
+    for (JPEGTransformType transform : kAllTransforms) {
+      JPEGData out;
+      ASSERT_TRUE(TransformJpeg(jpg, transform, &out));
+      const std::vector<uint8_t> actual = Render(out);
+      ExpectTransformedPixels(pixels, jpg.width, transform, actual, out.width,
+                              out.height);
+    }
+  }
+}
+
+TEST(JpegTransformTest, Trim) {
+  JPEGData jpg = MakeAsymmetricJpeg(61, 45, 2, 1);
+  JPEGData out;
+  ASSERT_TRUE(TransformJpeg(jpg, JPEG_TRANSFORM_FLIP_H, &out));
+  EXPECT_EQ(48, out.width);
+  EXPECT_EQ(45, out.height);
+  ASSERT_TRUE(TransformJpeg(jpg, JPEG_TRANSFORM_ROT_90, &out));
+  EXPECT_EQ(32, out.width);
+  EXPECT_EQ(61, out.height);
+  ASSERT_TRUE(TransformJpeg(jpg, JPEG_TRANSFORM_TRANSPOSE, &out));
+  EXPECT_EQ(45, out.width);
+  EXPECT_EQ(61, out.height);
+  // Nothing is left.
+  jpg = MakeAsymmetricJpeg(15, 15, 2, 1);
+  EXPECT_FALSE(TransformJpeg(jpg, JPEG_TRANSFORM_FLIP_V, &out));
+  EXPECT_TRUE(TransformJpeg(jpg, JPEG_TRANSFORM_TRANSPOSE, &out));
+}
+
+TEST(JpegTransformTest, InverseIsLossless) {
+  JPEGData jpg = MakeAsymmetricJpeg(64, 48, 2, 3);
+  JPEGData rotated;
+  JPEGData restored;
+  ASSERT_TRUE(TransformJpeg(jpg, JPEG_TRANSFORM_ROT_90, &rotated));
+  ASSERT_TRUE(TransformJpeg(rotated, JPEG_TRANSFORM_ROT_270, &restored));
+  ASSERT_EQ(jpg.width, restored.width);
+  ASSERT_EQ(jpg.height, restored.height);
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    EXPECT_EQ(jpg.components[i].coeffs, restored.components[i].coeffs);
+  }
+  for (size_t i = 0; i < jpg.quant.size(); ++i) {
+    EXPECT_EQ(jpg.quant[i].values, restored.quant[i].values);
+  }
+}
+
+TEST(JpegTransformTest, Crop) {
+  JPEGData jpg = MakeAsymmetricJpeg(61, 45, 2, 4);
+  const std::vector<uint8_t> pixels = Render(jpg);
+  JPEGData out;
+  ASSERT_TRUE(CropJpeg(jpg, 16, 32, 40, 13, &out));
+  EXPECT_EQ(40, out.width);
+  EXPECT_EQ(13, out.height);
+  const std::vector<uint8_t> actual = Render(out);
+  ASSERT_EQ(static_cast<size_t>(40 * 13 * 3), actual.size());
+  for (int y = 0; y < 13; ++y) {
+    for (int x = 0; x < 40 * 3; ++x) {
+      ASSERT_EQ(pixels[((y + 32) * 61 + 16) * 3 + x], actual[y * 40 * 3 + x]);
+    }
+  }
+  // Not aligned to MCU.
+  EXPECT_FALSE(CropJpeg(jpg, 8, 0, 16, 16, &out));
+  // Out of bounds.
+  EXPECT_FALSE(CropJpeg(jpg, 16, 32, 46, 13, &out));
+  EXPECT_FALSE(CropJpeg(jpg, 0, 0, 0, 13, &out));
+}
+
+TEST(JpegTransformTest, NormalizeOrientation) {
+  for (bool big_endian : {false, true}) {
+    JPEGData jpg = MakeAsymmetricJpeg(64, 32, 2, 5);
+    jpg.app_data.push_back(MakeExif(6, big_endian));
+    jpg.marker_order = {0xE1};
+    EXPECT_EQ(6, GetExifOrientation(jpg));
+
+    JPEGData out;
+    ASSERT_TRUE(NormalizeJpegOrientation(jpg, &out));
+    EXPECT_EQ(32, out.width);
+    EXPECT_EQ(64, out.height);
+    EXPECT_EQ(1, GetExifOrientation(out));
+    ExpectTransformedPixels(Render(jpg), jpg.width, JPEG_TRANSFORM_ROT_90,
+                            Render(out), out.width, out.height);
+
+    // Normal orientation is kept as is.
+    JPEGData again;
+    ASSERT_TRUE(NormalizeJpegOrientation(out, &again));
+    EXPECT_EQ(out.components[0].coeffs, again.components[0].coeffs);
+    EXPECT_EQ(out.app_data, again.app_data);
+  }
+  EXPECT_EQ(0, GetExifOrientation(MakeJpeg(16, 16, 3, 1, 1)));
+}
+
+TEST(JpegTransformTest, SerializeAndEncode) {
+  JPEGData jpg = MakeAsymmetricJpeg(61, 45, 2, 6);
+  jpg.app_data.push_back(MakeExif(8, false));
+  jpg.marker_order = {0xE1};
+  JPEGData out;
+  ASSERT_TRUE(NormalizeJpegOrientation(jpg, &out));
+
+  std::vector<uint8_t> serialized;
+  ASSERT_TRUE(WriteJpeg(out, JPEGOutput(VectorOutputFunction, &serialized)));
+  JPEGData parsed;
+  ASSERT_TRUE(
+      ReadJpeg(serialized.data(), serialized.size(), JPEG_READ_ALL, &parsed));
+  EXPECT_EQ(1, GetExifOrientation(parsed));
+
+  size_t len = GetMaximumBrunsliEncodedSize(parsed);
+  std::vector<uint8_t> encoded(len);
+  ASSERT_TRUE(BrunsliEncodeJpeg(parsed, encoded.data(), &len));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+  for (size_t i = 0; i < out.components.size(); ++i) {
+    EXPECT_EQ(out.components[i].coeffs, decoded.components[i].coeffs);
+  }
+  std::vector<uint8_t> reserialized;
+  ASSERT_TRUE(
+      WriteJpeg(decoded, JPEGOutput(VectorOutputFunction, &reserialized)));
+  EXPECT_EQ(serialized, reserialized);
+}
+
+}  // namespace brunsli
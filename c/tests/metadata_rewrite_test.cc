@@ -0,0 +1,128 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+bool Rewrite(const std::vector<uint8_t>& src, const JPEGData& metadata,
+             std::vector<uint8_t>* out) {
+  size_t len = GetMaximumBrunsliMetadataRewriteSize(src.size(), metadata);
+  out->resize(len);
+  if (!BrunsliRewriteMetadata(src.data(), src.size(), metadata, out->data(),
+                              &len)) {
+    return false;
+  }
+  out->resize(len);
+  return true;
+}
+
+// Drops all APP markers and adds a comment in front of the frame.
+void ScrubMetadata(JPEGData* jpg) {
+  std::vector<uint8_t>& order = jpg->marker_order;
+  order.erase(std::remove_if(order.begin(), order.end(),
+                             [](uint8_t m) { return (m & 0xF0) == 0xE0; }),
+              order.end());
+  jpg->app_data.clear();
+  order.insert(order.begin(), 0xFE);
+  jpg->com_data.insert(jpg->com_data.begin(), {0xFE, 0x00, 0x05, 'o', 'k', '!'});
+}
+
+}  // namespace
+
+TEST(MetadataRewriteTest, Scrub) {
+  std::vector<uint8_t> src = GetSmallBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(src.data(), src.size(), &jpg));
+  ASSERT_FALSE(jpg.app_data.empty());
+
+  JPEGData metadata;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpegMetadata(src.data(), src.size(), &metadata));
+  EXPECT_EQ(jpg.app_data, metadata.app_data);
+  EXPECT_EQ(jpg.marker_order, metadata.marker_order);
+  for (const JPEGComponent& c : metadata.components) {
+    EXPECT_TRUE(c.coeffs.empty());
+  }
+
+  // Unchanged metadata produces an equivalent file.
+  std::vector<uint8_t> same;
+  ASSERT_TRUE(Rewrite(src, metadata, &same));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(same.data(), same.size(), &decoded));
+  EXPECT_EQ(WriteJpegToVector(jpg), WriteJpegToVector(decoded));
+
+  ScrubMetadata(&metadata);
+  std::vector<uint8_t> scrubbed;
+  ASSERT_TRUE(Rewrite(src, metadata, &scrubbed));
+  decoded = JPEGData();
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(scrubbed.data(), scrubbed.size(), &decoded));
+  ScrubMetadata(&jpg);
+  EXPECT_EQ(WriteJpegToVector(jpg), WriteJpegToVector(decoded));
+}
+
+TEST(MetadataRewriteTest, ACSegments) {
+  std::vector<uint8_t> original = GetSmallBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(original.data(), original.size(), &jpg));
+  std::vector<uint8_t> src = EncodeSegmented(jpg, 1);
+  JPEGData metadata;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpegMetadata(src.data(), src.size(), &metadata));
+  ScrubMetadata(&metadata);
+  std::vector<uint8_t> scrubbed;
+  ASSERT_TRUE(Rewrite(src, metadata, &scrubbed));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(scrubbed.data(), scrubbed.size(), &decoded));
+  ScrubMetadata(&jpg);
+  EXPECT_EQ(WriteJpegToVector(jpg), WriteJpegToVector(decoded));
+}
+
+TEST(MetadataRewriteTest, InvalidInput) {
+  std::vector<uint8_t> src = GetSmallBrunsliFile();
+  JPEGData metadata;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpegMetadata(src.data(), src.size(), &metadata));
+  std::vector<uint8_t> out;
+
+  // APP marker without payload.
+  JPEGData broken = metadata;
+  broken.app_data.pop_back();
+  EXPECT_FALSE(Rewrite(src, broken, &out));
+
+  // Truncated input.
+  std::vector<uint8_t> truncated(src.begin(), src.end() - 1);
+  EXPECT_FALSE(Rewrite(truncated, metadata, &out));
+
+  // Not enough space for output.
+  size_t len = src.size();
+  out.resize(len);
+  EXPECT_FALSE(BrunsliRewriteMetadata(src.data(), src.size(), metadata,
+                                      out.data(), &len));
+
+  // Fallback mode.
+  std::vector<uint8_t> fallback = GetFallbackBrunsliFile();
+  JPEGData jpg;
+  EXPECT_NE(BRUNSLI_OK, BrunsliDecodeJpegMetadata(fallback.data(),
+                                                  fallback.size(), &jpg));
+  EXPECT_FALSE(Rewrite(fallback, metadata, &out));
+}
+
+}  // namespace brunsli
@@ -0,0 +1,137 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "../common/platform.h"
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+#include "../tools/jpeg_synth.h"
+
+namespace brunsli {
+
+namespace {
+
+int ScalarKernel() { return CPU_TARGET_SCALAR; }
+int SSE2Kernel() { return CPU_TARGET_SSE2; }
+int AVX2Kernel() { return CPU_TARGET_AVX2; }
+int NEONKernel() { return CPU_TARGET_NEON; }
+
+typedef int (*KernelFn)();
+
+const KernelFn kKernels[kNumCpuTargets] = {
+    ScalarKernel, SSE2Kernel, nullptr, AVX2Kernel, nullptr, NEONKernel};
+
+bool IsSupported(CpuTarget target) {
+  return (GetCpuTargets() >> target) & 1u;
+}
+
+std::vector<uint8_t> Encode(const JPEGData& jpg) {
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  EXPECT_TRUE(BrunsliEncodeJpeg(jpg, encoded.data(), &len));
+  encoded.resize(len);
+  return encoded;
+}
+
+}  // namespace
+
+TEST(PlatformTest, DetectCpuTargets) {
+  ResetCpuTarget();
+  EXPECT_TRUE(IsSupported(CPU_TARGET_SCALAR));
+  for (size_t i = 0; i < kNumCpuTargets; ++i) {
+    EXPECT_STRNE("unknown", CpuTargetName(static_cast<CpuTarget>(i)));
+  }
+#if defined(BRUNSLI_X86_DISPATCH) && \
+    (BRUNSLI_GNUC_VERSION_CHECK(4, 9, 0) || defined(__clang__))
+  __builtin_cpu_init();
+  EXPECT_EQ(!!__builtin_cpu_supports("sse2"), IsSupported(CPU_TARGET_SSE2));
+  EXPECT_EQ(!!__builtin_cpu_supports("sse4.1"),
+            IsSupported(CPU_TARGET_SSE4_1));
+  EXPECT_EQ(!!__builtin_cpu_supports("avx2"), IsSupported(CPU_TARGET_AVX2));
+#endif
+#if defined(BRUNSLI_TARGET_X64) && defined(BRUNSLI_X86_DISPATCH)
+  // SSE2 is the part of x86-64 baseline.
+  EXPECT_TRUE(IsSupported(CPU_TARGET_SSE2));
+#endif
+#if !defined(BRUNSLI_X86_DISPATCH)
+  EXPECT_FALSE(IsSupported(CPU_TARGET_SSE2));
+#endif
+#if !defined(BRUNSLI_NEON_DISPATCH)
+  EXPECT_FALSE(IsSupported(CPU_TARGET_NEON));
+#endif
+}
+
+TEST(PlatformTest, ForceCpuTarget) {
+  ResetCpuTarget();
+  const uint32_t supported = GetCpuTargets();
+
+  EXPECT_TRUE(ForceCpuTarget(CPU_TARGET_SCALAR));
+  EXPECT_EQ(1u << CPU_TARGET_SCALAR, GetCpuTargets());
+
+  // Target implies the ones it extends.
+  EXPECT_EQ(((supported >> CPU_TARGET_SSE4_1) & 1u) != 0,
+            ForceCpuTarget(CPU_TARGET_SSE4_1));
+  EXPECT_EQ(0u, GetCpuTargets() & ~supported);
+  EXPECT_EQ(0u, GetCpuTargets() & (1u << CPU_TARGET_AVX2));
+  EXPECT_EQ(0u, GetCpuTargets() & (1u << CPU_TARGET_NEON));
+  EXPECT_EQ((supported >> CPU_TARGET_SSE2) & 1u,
+            (GetCpuTargets() >> CPU_TARGET_SSE2) & 1u);
+
+  // x86 and ARM targets never coexist.
+  const bool has_neon = (supported >> CPU_TARGET_NEON) & 1u;
+  const bool has_avx2 = (supported >> CPU_TARGET_AVX2) & 1u;
+  EXPECT_FALSE(has_neon && has_avx2);
+  EXPECT_EQ(has_avx2, ForceCpuTarget(CPU_TARGET_AVX2));
+  EXPECT_EQ(has_neon, ForceCpuTarget(CPU_TARGET_NEON));
+
+  ResetCpuTarget();
+  EXPECT_EQ(supported, GetCpuTargets());
+}
+
+TEST(PlatformTest, DispatchSelectsBestImplemented) {
+  CpuDispatch<KernelFn> dispatch(kKernels);
+  for (size_t i = 0; i < kNumCpuTargets; ++i) {
+    const CpuTarget target = static_cast<CpuTarget>(i);
+    SCOPED_TRACE(CpuTargetName(target));
+    if (!ForceCpuTarget(target)) continue;
+    CpuTarget expected = target;
+    if (target == CPU_TARGET_SSE4_1) expected = CPU_TARGET_SSE2;
+    if (target == CPU_TARGET_AVX512) expected = CPU_TARGET_AVX2;
+    EXPECT_EQ(expected, dispatch.SelectTarget());
+    // Forcing is observed by already initialized dispatcher.
+    EXPECT_EQ(static_cast<int>(expected), dispatch.Get()());
+  }
+  ResetCpuTarget();
+}
+
+TEST(PlatformTest, EncodingMatchesAcrossTargets) {
+  JPEGSynthParams params;
+  params.width = 203;
+  params.height = 117;
+  // Low quality produces many empty blocks.
+  for (int quality : {75, 10}) {
+    SCOPED_TRACE(quality);
+    params.quality = quality;
+    JPEGData jpg;
+    ASSERT_TRUE(SynthesizeJpeg(params, &jpg));
+
+    ASSERT_TRUE(ForceCpuTarget(CPU_TARGET_SCALAR));
+    const std::vector<uint8_t> expected = Encode(jpg);
+    for (size_t i = 1; i < kNumCpuTargets; ++i) {
+      const CpuTarget target = static_cast<CpuTarget>(i);
+      SCOPED_TRACE(CpuTargetName(target));
+      if (!ForceCpuTarget(target)) continue;
+      EXPECT_EQ(expected, Encode(jpg));
+    }
+  }
+  ResetCpuTarget();
+}
+
+}  // namespace brunsli
@@ -10,10 +10,56 @@
 #include <utility>
 
 #include "gtest/gtest.h"
+#include "../common/constants.h"
+#include "../common/platform.h"
 #include <brunsli/types.h>
+#include "../tools/jpeg_synth.h"
 
 namespace brunsli {
 
+namespace {
+
+// Exhaustive search; reference for FindBestMatrix.
+uint32_t FindBestMatrixSlow(const int* src, bool is_chroma) {
+  uint32_t best_q = 0;
+  const size_t kWorstLen = (kDCTBlockSize + 1) * (33 + 1);
+  size_t best_len = kWorstLen;
+  for (uint32_t q = 0; q < kQFactorLimit; ++q) {
+    uint8_t dst[kDCTBlockSize];
+    FillQuantMatrix(is_chroma, q, dst);
+    int last_diff = 0;
+    size_t len = 0;
+    for (int k = 0; k < kDCTBlockSize; ++k) {
+      const int j = kJPEGNaturalOrder[k];
+      const int new_diff = src[j] - dst[j];
+      int diff = new_diff - last_diff;
+      last_diff = new_diff;
+      if (diff != 0) {
+        len += 1;
+        if (diff < 0) diff = -diff;
+        diff -= 1;
+        if (diff == 0) {
+          len++;
+        } else if (diff > 65535) {
+          len = kWorstLen;
+          break;
+        } else {
+          uint32_t diff_len = Log2FloorNonZero(diff) + 1;
+          if (diff_len == 16) diff_len--;
+          len += 2 * diff_len + 1;
+        }
+      }
+    }
+    if (len < best_len) {
+      best_len = len;
+      best_q = q;
+    }
+  }
+  return best_q;
+}
+
+}  // namespace
+
 TEST(QuantMatrixTest, TestFindQ) {
   for (size_t c = 0; c < 2; ++c) {
     for (uint32_t q = 0; q < kQFactorLimit; ++q) {
@@ -28,4 +74,33 @@ TEST(QuantMatrixTest, TestFindQ) {
   }
 }
 
+TEST(QuantMatrixTest, TestFindQMatchesExhaustiveSearch) {
+  Random rnd(42);
+  for (size_t round = 0; round < 2000; ++round) {
+    const bool is_chroma = (round & 1) != 0;
+    uint8_t base[kDCTBlockSize];
+    FillQuantMatrix(is_chroma, rnd.Next() % kQFactorLimit, base);
+    int src[kDCTBlockSize];
+    // Perturb a random subset of coefficients.
+    const uint32_t spread = 1 + (round % 7) * (round % 11);
+    for (size_t k = 0; k < kDCTBlockSize; ++k) {
+      int v = base[k];
+      if (rnd.Next() % 4 == 0) v += rnd.Symmetric(static_cast<int>(spread));
+      src[k] = (v < 1) ? 1 : (v > 255) ? 255 : v;
+    }
+    if (round % 97 == 0) {
+      // Completely random table.
+      for (size_t k = 0; k < kDCTBlockSize; ++k) src[k] = 1 + rnd.Next() % 255;
+    }
+    uint8_t dst[kDCTBlockSize];
+    uint8_t expected_dst[kDCTBlockSize];
+    const uint32_t expected_q = FindBestMatrixSlow(src, is_chroma);
+    EXPECT_EQ(expected_q, FindBestMatrix(src, is_chroma, dst));
+    FillQuantMatrix(is_chroma, expected_q, expected_dst);
+    for (size_t k = 0; k < kDCTBlockSize; ++k) {
+      EXPECT_EQ(expected_dst[k], dst[k]);
+    }
+  }
+}
+
 }  // namespace brunsli
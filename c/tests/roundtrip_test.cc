@@ -0,0 +1,594 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/status.h>
+#include <brunsli/types.h>
+#include "../dec/serialization_state.h"
+#include "../dec/state.h"
+#include "../dec/state_internal.h"
+#include "../enc/state.h"
+#include "../tools/jpeg_synth.h"
+#include "./test_utils.h"
+
+namespace brunsli {
+
+namespace {
+
+// Produces JPEGData of given size by tiling AC coefficients of the "small"
+// test file; unlike MakeRandomJpeg output, result could be serialized to JPEG.
+JPEGData MakeTiledJpeg(int width, int height) {
+  std::vector<uint8_t> src = GetSmallBrunsliFile();
+  JPEGData original;
+  EXPECT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(src.data(), src.size(), &original));
+  JPEGData jpg = original;
+  jpg.width = width;
+  jpg.height = height;
+  EXPECT_TRUE(internal::dec::UpdateSubsamplingDerivatives(&jpg));
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    const JPEGComponent& from = original.components[i];
+    JPEGComponent& c = jpg.components[i];
+    c.coeffs.resize(c.num_blocks * kDCTBlockSize);
+    for (uint32_t y = 0; y < c.height_in_blocks; ++y) {
+      for (uint32_t x = 0; x < c.width_in_blocks; ++x) {
+        const size_t from_block =
+            (y % from.height_in_blocks) * from.width_in_blocks +
+            x % from.width_in_blocks;
+        const coeff_t* block = &from.coeffs[from_block * kDCTBlockSize];
+        coeff_t* out = &c.coeffs[(y * c.width_in_blocks + x) * kDCTBlockSize];
+        std::copy(block, block + kDCTBlockSize, out);
+        // Keep DC flat, so that DC differences fit into Huffman codes.
+        out[0] = 0;
+      }
+    }
+  }
+  return jpg;
+}
+
+// Produces progressive JPEGData with spectral selection, successive
+// approximation and restart markers.
+JPEGData MakeProgressiveJpeg(int width, int height, uint32_t seed) {
+  JPEGData jpg = MakeRandomJpeg(width, height, seed);
+  jpg.huffman_code = {MakeCompleteHuffmanCode(0x00),
+                      MakeCompleteHuffmanCode(0x10)};
+  jpg.huffman_code.back().is_last = true;
+  jpg.restart_interval = 7;
+  jpg.scan_info.clear();
+  // Keep the quantization tables layout.
+  const size_t num_dqt =
+      std::count(jpg.marker_order.begin(), jpg.marker_order.end(), 0xDB);
+  jpg.marker_order.assign(num_dqt, 0xDB);
+  jpg.marker_order.insert(jpg.marker_order.end(), {0xC2, 0xC4, 0xDD});
+  const auto add_scan = [&jpg](int Ss, int Se, int Ah, int Al,
+                               std::vector<uint8_t> components) {
+    JPEGScanInfo scan;
+    scan.Ss = Ss;
+    scan.Se = Se;
+    scan.Ah = Ah;
+    scan.Al = Al;
+    scan.num_components = components.size();
+    for (size_t i = 0; i < components.size(); ++i) {
+      scan.components[i] = {components[i], 0, 0};
+    }
+    jpg.scan_info.push_back(scan);
+    jpg.marker_order.push_back(0xDA);
+  };
+  std::vector<uint8_t> all_components;
+  for (size_t i = 0; i < jpg.components.size(); ++i) {
+    all_components.push_back(static_cast<uint8_t>(i));
+  }
+  add_scan(0, 0, 0, 1, all_components);
+  add_scan(1, 5, 0, 0, {0});
+  for (uint8_t c = 1; c < jpg.components.size(); ++c) {
+    add_scan(1, 63, 0, 1, {c});
+    add_scan(1, 63, 1, 0, {c});
+  }
+  add_scan(6, 63, 0, 2, {0});
+  add_scan(6, 63, 2, 1, {0});
+  add_scan(6, 63, 1, 0, {0});
+  add_scan(0, 0, 1, 0, all_components);
+  jpg.marker_order.push_back(0xD9);
+  return jpg;
+}
+
+std::vector<uint8_t> Encode(const JPEGData& jpg) {
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  EXPECT_TRUE(BrunsliEncodeJpeg(jpg, out.data(), &len));
+  out.resize(len);
+  return out;
+}
+
+void TestRoundtrip(int version) {
+  for (uint32_t seed = 1; seed <= 3; ++seed) {
+    JPEGData jpg = MakeRandomJpeg(17 * seed + 40, 23 * seed + 30, seed);
+    jpg.version = version;
+    std::vector<uint8_t> encoded = Encode(jpg);
+    JPEGData decoded;
+    ASSERT_EQ(BRUNSLI_OK,
+              BrunsliDecodeJpeg(encoded.data(), encoded.size(), &decoded));
+    EXPECT_EQ(version, decoded.version);
+    ExpectSameCoefficients(jpg, decoded);
+  }
+}
+
+// Same as BrunsliEncodeJpeg, but AC histograms are collected in stripes.
+std::vector<uint8_t> EncodeStriped(const JPEGData& jpg, int stripe_mcu_rows) {
+  using ::brunsli::internal::enc::EntropyCodes;
+  using ::brunsli::internal::enc::EntropySource;
+  using ::brunsli::internal::enc::State;
+  State state;
+  EXPECT_TRUE(PrepareState(jpg, &state));
+  std::vector<EntropySource> stripes;
+  for (int y = 0; y < jpg.MCU_rows; y += stripe_mcu_rows) {
+    stripes.emplace_back();
+    CollectACHistograms(state, y, std::min(jpg.MCU_rows, y + stripe_mcu_rows),
+                        &stripes.back());
+  }
+  EncodeDC(&state);
+  state.entropy_source.Resize(state.num_contexts);
+  for (const EntropySource& stripe : stripes) {
+    state.entropy_source.Merge(stripe);
+  }
+  state.ac_histograms_collected = true;
+  std::unique_ptr<EntropyCodes> entropy_codes = PrepareEntropyCodes(&state);
+  state.entropy_codes = entropy_codes.get();
+  EncodeAC(&state);
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  EXPECT_TRUE(BrunsliSerialize(&state, jpg, 0, out.data(), &len));
+  out.resize(len);
+  return out;
+}
+
+}  // namespace
+
+TEST(RoundtripTest, LegacyContextModel) { TestRoundtrip(0); }
+
+TEST(RoundtripTest, DefaultVersion) { TestRoundtrip(JPEGData().version); }
+
+TEST(RoundtripTest, SymbolNumNonzeros) {
+  TestRoundtrip(2 | kSymbolNumNonzerosVersion);
+  TestRoundtrip(kSymbolNumNonzerosVersion);
+}
+
+TEST(RoundtripTest, DecayProb) {
+  TestRoundtrip(2 | kDecayProbVersion);
+  TestRoundtrip(2 | kDecayProbVersion | kSymbolNumNonzerosVersion);
+}
+
+TEST(RoundtripTest, FastLevel) {
+  for (size_t num_components : {3, 4}) {
+    JPEGData jpg = MakeRandomJpeg(300, 200, 7);
+    while (jpg.components.size() < num_components) {
+      jpg.components.push_back(jpg.components.back());
+      jpg.components.back().id++;
+    }
+    size_t len = GetMaximumBrunsliEncodedSize(jpg);
+    std::vector<uint8_t> encoded(len);
+    ASSERT_TRUE(BrunsliEncodeJpeg(jpg, BRUNSLI_ENCODE_FAST, encoded.data(),
+                                  &len));
+    JPEGData decoded;
+    ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+    ExpectSameCoefficients(jpg, decoded);
+  }
+
+  std::vector<uint8_t> original = GetSmallBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(original.data(), original.size(), &jpg));
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &expected)));
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> encoded(len);
+  ASSERT_TRUE(
+      BrunsliEncodeJpeg(jpg, BRUNSLI_ENCODE_FAST, encoded.data(), &len));
+  JPEGData decoded;
+  ASSERT_EQ(BRUNSLI_OK, BrunsliDecodeJpeg(encoded.data(), len, &decoded));
+  std::vector<uint8_t> actual;
+  ASSERT_TRUE(WriteJpeg(decoded, JPEGOutput(VectorOutputFunction, &actual)));
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(RoundtripTest, MaxLevel) {
+  // Runs each task in a separate thread.
+  const BrunsliTaskRunner threaded_runner =
+      [](const std::function<void(size_t)>& task, size_t num_tasks) {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_tasks; ++i) threads.emplace_back(task, i);
+        for (std::thread& thread : threads) thread.join();
+      };
+  std::vector<JPEGData> inputs;
+  inputs.push_back(MakeRandomJpeg(200, 120, 8));
+  inputs.push_back(MakeTiledJpeg(160, 160));
+  inputs.back().version |= kACSegmentsVersion;
+  for (const JPEGData& jpg : inputs) {
+    const std::vector<uint8_t> reference = Encode(jpg);
+    size_t len = GetMaximumBrunsliEncodedSize(jpg);
+    std::vector<uint8_t> encoded(len);
+    ASSERT_TRUE(
+        BrunsliEncodeJpeg(jpg, BRUNSLI_ENCODE_MAX, encoded.data(), &len));
+    encoded.resize(len);
+    EXPECT_LE(encoded.size(), reference.size());
+    JPEGData decoded;
+    ASSERT_EQ(BRUNSLI_OK,
+              BrunsliDecodeJpeg(encoded.data(), encoded.size(), &decoded));
+    ExpectSameCoefficients(jpg, decoded);
+
+    // Result does not depend on the way tasks are run.
+    len = GetMaximumBrunsliEncodedSize(jpg);
+    std::vector<uint8_t> parallel(len);
+    ASSERT_TRUE(BrunsliEncodeJpegSearch(jpg, threaded_runner, 0,
+                                        parallel.data(), &len));
+    parallel.resize(len);
+    EXPECT_EQ(encoded, parallel);
+
+    // Tiny time budget: only the first candidate (the default parameters) is
+    // encoded; the time budget is exhausted before the second one starts.
+    const BrunsliTaskRunner slow_runner =
+        [](const std::function<void(size_t)>& task, size_t num_tasks) {
+          for (size_t i = 0; i < num_tasks; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            task(i);
+          }
+        };
+    len = GetMaximumBrunsliEncodedSize(jpg);
+    std::vector<uint8_t> quick(len);
+    ASSERT_TRUE(
+        BrunsliEncodeJpegSearch(jpg, slow_runner, 1, quick.data(), &len));
+    quick.resize(len);
+    EXPECT_EQ(reference, quick);
+  }
+}
+
+TEST(RoundtripTest, EstimateEncodedSize) {
+  // Random coefficients have photo-like statistics: the documented bound
+  // applies.
+  std::vector<JPEGData> inputs;
+  inputs.push_back(MakeRandomJpeg(800, 800, 1));
+  inputs.push_back(MakeRandomJpeg(640, 1200, 9));
+  inputs.back().version |= kACSegmentsVersion;
+  for (const JPEGData& jpg : inputs) {
+    const double actual = static_cast<double>(Encode(jpg).size());
+    const double estimate =
+        static_cast<double>(BrunsliEstimateEncodedSize(jpg));
+    EXPECT_NEAR(actual, estimate, 0.03 * actual);
+  }
+
+  // Periodic content is poorly represented by the sample.
+  const JPEGData tiled = MakeTiledJpeg(1024, 768);
+  const double actual = static_cast<double>(Encode(tiled).size());
+  EXPECT_NEAR(actual, static_cast<double>(BrunsliEstimateEncodedSize(tiled)),
+              0.15 * actual);
+
+  // Whole image fits into the sample.
+  const JPEGData small = MakeTiledJpeg(64, 64);
+  EXPECT_EQ(Encode(small).size(), BrunsliEstimateEncodedSize(small));
+
+  JPEGData invalid;
+  EXPECT_EQ(0u, BrunsliEstimateEncodedSize(invalid));
+}
+
+TEST(RoundtripTest, AnalyzeCosts) {
+  std::vector<JPEGData> inputs;
+  inputs.push_back(MakeRandomJpeg(200, 120, 10));
+  inputs.push_back(MakeTiledJpeg(256, 256));
+  inputs.back().version |= kACSegmentsVersion;
+  for (const JPEGData& jpg : inputs) {
+    std::vector<BrunsliCostEntry> entries;
+    ASSERT_TRUE(BrunsliAnalyzeJpeg(jpg, &entries));
+    double total_bits = 0.0;
+    double ac_bits = 0.0;
+    double ac_other_bits = 0.0;
+    for (const BrunsliCostEntry& e : entries) {
+      total_bits += e.bits;
+      if (std::string(e.section) != "ac") continue;
+      ac_bits += e.bits;
+      if (std::string(e.symbol) == "other") {
+        ac_other_bits += e.bits;
+      } else {
+        EXPECT_LT(e.component, static_cast<int>(jpg.components.size()));
+        EXPECT_LT(e.k, kDCTBlockSize);
+        EXPECT_GT(e.count, 0u);
+      }
+    }
+    EXPECT_NEAR(8.0 * Encode(jpg).size(), total_bits, 1e-3);
+    // Estimated symbol costs are close to the actual ones.
+    EXPECT_LT(std::abs(ac_other_bits), 0.01 * ac_bits);
+  }
+
+  std::vector<BrunsliCostEntry> entries;
+  JPEGData fallback;
+  fallback.version = kFallbackVersion;
+  EXPECT_FALSE(BrunsliAnalyzeJpeg(fallback, &entries));
+}
+
+TEST(RoundtripTest, ACSegments) {
+  TestRoundtrip(2 | kACSegmentsVersion);
+  TestRoundtrip(kACSegmentsVersion | kSymbolNumNonzerosVersion);
+}
+
+TEST(RoundtripTest, ACSegmentsBytewiseInput) {
+  JPEGData jpg = MakeRandomJpeg(61, 83, 5);
+  std::vector<uint8_t> src = EncodeSegmented(jpg, 1);
+  JPEGData decoded;
+  internal::dec::State state;
+  for (size_t start = 0; start < src.size(); ++start) {
+    state.data = src.data() + start;
+    state.pos = 0;
+    state.len = 1;
+    ASSERT_EQ(start + 1 < src.size() ? BRUNSLI_NOT_ENOUGH_DATA : BRUNSLI_OK,
+              internal::dec::ProcessJpeg(&state, &decoded));
+  }
+  EXPECT_EQ(1, state.ac_segment_mcu_rows);
+  ExpectSameCoefficients(jpg, decoded);
+}
+
+TEST(RoundtripTest, ACSegmentsStreamingOutput) {
+  std::vector<uint8_t> original = GetSmallBrunsliFile();
+  JPEGData jpg;
+  ASSERT_EQ(BRUNSLI_OK,
+            BrunsliDecodeJpeg(original.data(), original.size(), &jpg));
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &expected)));
+
+  std::vector<uint8_t> src = EncodeSegmented(jpg, 1);
+  BrunsliDecoder decoder;
+  std::vector<uint8_t> actual;
+  BrunsliDecoder::Status result = BrunsliDecoder::NEEDS_MORE_INPUT;
+  for (size_t start = 0; start < src.size(); ++start) {
+    size_t available_in = 1;
+    const uint8_t* next_in = src.data() + start;
+    do {
+      uint8_t out[16];
+      size_t available_out = sizeof(out);
+      uint8_t* next_out = out;
+      result =
+          decoder.Decode(&available_in, &next_in, &available_out, &next_out);
+      ASSERT_NE(BrunsliDecoder::ERROR, result);
+      actual.insert(actual.end(), out, next_out);
+    } while (result == BrunsliDecoder::NEEDS_MORE_OUTPUT);
+  }
+  EXPECT_EQ(BrunsliDecoder::DONE, result);
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(RoundtripTest, StreamingInputCopyOverhead) {
+  std::vector<uint8_t> src = Encode(MakeTiledJpeg(512, 512));
+  for (size_t chunk_size : {1, 64, 1500}) {
+    BrunsliDecoder decoder;
+    std::vector<uint8_t> out(1 << 16);
+    BrunsliDecoder::Status result = BrunsliDecoder::NEEDS_MORE_INPUT;
+    for (size_t start = 0; start < src.size(); start += chunk_size) {
+      size_t available_in = std::min(chunk_size, src.size() - start);
+      const uint8_t* next_in = src.data() + start;
+      do {
+        size_t available_out = out.size();
+        uint8_t* next_out = out.data();
+        result =
+            decoder.Decode(&available_in, &next_in, &available_out, &next_out);
+        ASSERT_NE(BrunsliDecoder::ERROR, result);
+      } while (result == BrunsliDecoder::NEEDS_MORE_OUTPUT);
+    }
+    ASSERT_EQ(BrunsliDecoder::DONE, result);
+    BrunsliDecoder::Stats stats = decoder.GetStats();
+    EXPECT_EQ(src.size(), stats.bytes_consumed);
+    // Small chunks must not cause repeated copying of buffered input.
+    EXPECT_LT(stats.bytes_copied, 2 * src.size()) << chunk_size;
+  }
+}
+
+TEST(RoundtripTest, StreamingOutputWindows) {
+  JPEGData jpg = MakeTiledJpeg(512, 512);
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &expected)));
+  std::vector<uint8_t> src = Encode(jpg);
+  for (size_t chunk_size : {size_t(1000), src.size()}) {
+    // Small windows are served from internal buffers, larger ones are
+    // written to directly; window overflow is handled in both cases.
+    for (size_t window_size : {1, 63, 64, 100, 5000, 1 << 20}) {
+      BrunsliDecoder decoder;
+      std::vector<uint8_t> out(window_size);
+      std::vector<uint8_t> actual;
+      BrunsliDecoder::Status result = BrunsliDecoder::NEEDS_MORE_INPUT;
+      for (size_t start = 0; start < src.size(); start += chunk_size) {
+        size_t available_in = std::min(chunk_size, src.size() - start);
+        const uint8_t* next_in = src.data() + start;
+        do {
+          size_t available_out = out.size();
+          uint8_t* next_out = out.data();
+          result = decoder.Decode(&available_in, &next_in, &available_out,
+                                  &next_out);
+          ASSERT_NE(BrunsliDecoder::ERROR, result);
+          actual.insert(actual.end(), out.data(), next_out);
+        } while (result == BrunsliDecoder::NEEDS_MORE_OUTPUT);
+      }
+      EXPECT_EQ(BrunsliDecoder::DONE, result);
+      EXPECT_EQ(expected, actual) << chunk_size << " " << window_size;
+    }
+  }
+}
+
+TEST(RoundtripTest, WriteJpegIov) {
+  std::vector<JPEGData> inputs;
+  for (const std::vector<uint8_t>& src :
+       {GetSmallBrunsliFile(), GetFallbackBrunsliFile()}) {
+    inputs.emplace_back();
+    ASSERT_EQ(BRUNSLI_OK,
+              BrunsliDecodeJpeg(src.data(), src.size(), &inputs.back()));
+  }
+  inputs.push_back(MakeTiledJpeg(512, 512));
+  std::vector<uint8_t> big_app(5000, 0xE1);
+  big_app[1] = (5000 - 1) >> 8;
+  big_app[2] = (5000 - 1) & 0xFF;
+  inputs.back().app_data.push_back(big_app);
+  inputs.back().marker_order.insert(inputs.back().marker_order.begin(), 0xE1);
+
+  for (const JPEGData& jpg : inputs) {
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &expected)));
+    JPEGIov iov;
+    ASSERT_TRUE(WriteJpegIov(jpg, &iov));
+    std::vector<uint8_t> actual;
+    for (const JPEGOutputSpan& span : iov.spans) {
+      actual.insert(actual.end(), span.data, span.data + span.len);
+    }
+    EXPECT_EQ(expected.size(), iov.TotalSize());
+    EXPECT_EQ(expected, actual);
+    // Metadata is referenced, not copied.
+    for (const JPEGMarkerSegment& app : jpg.app_data) {
+      EXPECT_TRUE(std::any_of(
+          iov.spans.begin(), iov.spans.end(),
+          [&app](const JPEGOutputSpan& span) {
+            return span.data == app.data() && span.len == app.size();
+          }));
+    }
+  }
+}
+
+TEST(RoundtripTest, ReadJpegInPlace) {
+  JPEGData source = MakeTiledJpeg(256, 256);
+  std::vector<uint8_t> big_app(5000, 0xE2);
+  big_app[1] = (5000 - 1) >> 8;
+  big_app[2] = (5000 - 1) & 0xFF;
+  source.app_data.push_back(big_app);
+  source.com_data.push_back({0xFE, 0x00, 0x04, 'h', 'i'});
+  source.marker_order.insert(source.marker_order.begin(), {0xE2, 0xFE});
+  std::vector<uint8_t> input;
+  ASSERT_TRUE(WriteJpeg(source, JPEGOutput(VectorOutputFunction, &input)));
+
+  JPEGData copied;
+  ASSERT_TRUE(ReadJpeg(input.data(), input.size(), JPEG_READ_ALL, &copied));
+  JPEGData jpg;
+  ASSERT_TRUE(ReadJpegInPlace(input.data(), input.size(), JPEG_READ_ALL, &jpg));
+  EXPECT_EQ(copied.app_data, jpg.app_data);
+  EXPECT_EQ(copied.com_data, jpg.com_data);
+  std::vector<const JPEGMarkerSegment*> segments;
+  for (const JPEGMarkerSegment& s : jpg.app_data) segments.push_back(&s);
+  for (const JPEGMarkerSegment& s : jpg.com_data) segments.push_back(&s);
+  ASSERT_EQ(source.app_data.size() + source.com_data.size(), segments.size());
+  for (const JPEGMarkerSegment* s : segments) {
+    EXPECT_TRUE(s->is_reference());
+    EXPECT_GE(s->data(), input.data());
+    EXPECT_LE(s->end(), input.data() + input.size());
+  }
+  for (const JPEGMarkerSegment& s : copied.app_data) {
+    EXPECT_FALSE(s.is_reference());
+  }
+
+  // Writer output refers to the input buffer directly.
+  JPEGIov iov;
+  ASSERT_TRUE(WriteJpegIov(jpg, &iov));
+  EXPECT_TRUE(std::any_of(iov.spans.begin(), iov.spans.end(),
+                          [&jpg](const JPEGOutputSpan& span) {
+                            return span.data == jpg.app_data.back().data();
+                          }));
+  std::vector<uint8_t> output;
+  for (const JPEGOutputSpan& span : iov.spans) {
+    output.insert(output.end(), span.data, span.data + span.len);
+  }
+  EXPECT_EQ(input, output);
+
+  // Encoder produces the same result for referenced and owned markers.
+  EXPECT_EQ(Encode(copied), Encode(jpg));
+
+  // Copies reference the same input.
+  JPEGData copy = jpg;
+  EXPECT_TRUE(copy.app_data.back().is_reference());
+  EXPECT_EQ(jpg.app_data.back().data(), copy.app_data.back().data());
+
+  // Mutable access detaches the segment from the input.
+  (*jpg.com_data[0].mutable_bytes())[3] = 'H';
+  EXPECT_FALSE(jpg.com_data[0].is_reference());
+  EXPECT_NE(copied.com_data[0], jpg.com_data[0]);
+  EXPECT_EQ(input, output);
+}
+
+TEST(RoundtripTest, FusedProgressiveScans) {
+  JPEGData jpg = MakeProgressiveJpeg(333, 215, 5);
+  for (bool has_padding_bits : {false, true}) {
+    SCOPED_TRACE(has_padding_bits);
+    if (has_padding_bits) {
+      jpg.has_zero_padding_bit = true;
+      jpg.padding_bits.assign(8 * 1000, 0);
+    }
+    // WriteJpeg encodes scans one by one.
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &expected)));
+    JPEGData parsed;
+    ASSERT_TRUE(
+        ReadJpeg(expected.data(), expected.size(), JPEG_READ_ALL, &parsed));
+    EXPECT_EQ(jpg.scan_info.size(), parsed.scan_info.size());
+    ExpectSameCoefficients(jpg, parsed);
+
+    for (bool fuse_scans : {false, true}) {
+      JPEGIov iov;
+      ASSERT_TRUE(WriteJpegIov(jpg, fuse_scans, &iov));
+      std::vector<uint8_t> actual;
+      for (const JPEGOutputSpan& span : iov.spans) {
+        actual.insert(actual.end(), span.data, span.data + span.len);
+      }
+      EXPECT_EQ(expected, actual);
+    }
+
+    // Padding bits are consumed in scan order; fused mode is not used then.
+    internal::dec::State state;
+    state.stage = internal::dec::Stage::DONE;
+    internal::dec::SerializationState& ss = state.internal->serialization;
+    ss.fuse_scans = true;
+    uint8_t* next_out = nullptr;
+    size_t available_out = 0;
+    EXPECT_NE(internal::dec::SerializationStatus::ERROR,
+              internal::dec::SerializeJpeg(&state, jpg, &available_out,
+                                           &next_out));
+    // Caller-provided output window is not kept after the call.
+    EXPECT_EQ(nullptr, ss.next_out);
+    EXPECT_EQ(nullptr, ss.available_out);
+    EXPECT_EQ(has_padding_bits, ss.fused_scans.empty());
+    std::vector<uint8_t> actual;
+    for (const internal::dec::OutputChunk& chunk : ss.output_queue) {
+      actual.insert(actual.end(), chunk.next, chunk.next + chunk.len);
+    }
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST(RoundtripTest, StripedHistogramsMatchSerial) {
+  for (int version : {0, 2, 2 | kACSegmentsVersion}) {
+    JPEGData jpg = MakeRandomJpeg(97, 150, 7);
+    jpg.version = version;
+    std::vector<uint8_t> expected = Encode(jpg);
+    for (int stripe_mcu_rows : {1, 2, 3, 1000}) {
+      EXPECT_EQ(expected, EncodeStriped(jpg, stripe_mcu_rows));
+    }
+  }
+}
+
+TEST(RoundtripTest, UnknownVersionIsRejected) {
+  JPEGData jpg = MakeRandomJpeg(16, 16, 1);
+  jpg.version = kVersionMask + 1;
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  EXPECT_FALSE(BrunsliEncodeJpeg(jpg, out.data(), &len));
+}
+
+}  // namespace brunsli
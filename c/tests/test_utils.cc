@@ -15,6 +15,16 @@
 #include <tuple>
 #include <vector>
 
+#include <brunsli/brunsli_decode.h>
+#include <brunsli/brunsli_encode.h>
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/status.h>
+#include "../common/constants.h"
+#include "../common/platform.h"
+#include "../dec/state.h"
+#include "../enc/state.h"
+#include "../tools/jpeg_synth.h"
 #include "./test_utils.h"
 
 #if !defined(TEST_DATA_PATH)
@@ -29,6 +39,43 @@ size_t StringOutputFunction(void* data, const uint8_t* buf, size_t count) {
   return count;
 }
 
+size_t VectorOutputFunction(void* data, const uint8_t* buf, size_t count) {
+  std::vector<uint8_t>* output = reinterpret_cast<std::vector<uint8_t>*>(data);
+  output->insert(output->end(), buf, buf + count);
+  return count;
+}
+
+std::vector<uint8_t> WriteJpegToVector(const JPEGData& jpg) {
+  std::vector<uint8_t> out;
+  BRUNSLI_CHECK(WriteJpeg(jpg, JPEGOutput(VectorOutputFunction, &out)));
+  return out;
+}
+
+std::vector<uint8_t> WriteJpegToVector(const JPEGData& jpg,
+                                       JPEGWriteMode mode) {
+  std::vector<uint8_t> out;
+  BRUNSLI_CHECK(WriteJpeg(jpg, mode, JPEGOutput(VectorOutputFunction, &out)));
+  return out;
+}
+
+std::vector<uint8_t> EncodeSegmented(JPEGData jpg, int segment_mcu_rows) {
+  using ::brunsli::internal::enc::EntropyCodes;
+  using ::brunsli::internal::enc::State;
+  jpg.version |= kACSegmentsVersion;
+  State state;
+  BRUNSLI_CHECK(PrepareState(jpg, &state));
+  state.ac_segment_mcu_rows = segment_mcu_rows;
+  EncodeDC(&state);
+  EncodeAC(&state);
+  std::unique_ptr<EntropyCodes> entropy_codes = PrepareEntropyCodes(&state);
+  state.entropy_codes = entropy_codes.get();
+  size_t len = GetMaximumBrunsliEncodedSize(jpg);
+  std::vector<uint8_t> out(len);
+  BRUNSLI_CHECK(BrunsliSerialize(&state, jpg, 0, out.data(), &len));
+  out.resize(len);
+  return out;
+}
+
 static const uint8_t kSmallBrunsliFile[] = {
   /* Signature */
   0x0a, 0x04,
@@ -146,6 +193,76 @@ std::vector<uint8_t> GetFallbackBrunsliFile() {
       kFallbackBrunsliFile + sizeof(kFallbackBrunsliFile));
 }
 
+namespace {
+void FillRandom(uint32_t seed, JPEGData* jpg) {
+  Random rnd(seed);
+  for (JPEGComponent& c : jpg->components) {
+    c.coeffs.resize(c.num_blocks * kDCTBlockSize);
+    for (size_t i = 0; i < c.coeffs.size(); ++i) {
+      const uint32_t r = rnd.Next();
+      const size_t k = i % kDCTBlockSize;
+      // Sparse, mostly small values; density decreases with frequency.
+      coeff_t v = 0;
+      if ((r & 0xFF) < 255u / (1 + k / 4)) {
+        v = static_cast<coeff_t>(
+            1 + (r >> 8) % (k == 0 ? 200 : 1 + 32 / (1 + k)));
+        if (r & 0x100) v = -v;
+      }
+      c.coeffs[i] = v;
+    }
+  }
+}
+}  // namespace
+
+JPEGData MakeRandomJpeg(int width, int height, uint32_t seed) {
+  std::vector<uint8_t> src = GetSmallBrunsliFile();
+  JPEGData jpg;
+  BRUNSLI_CHECK(BrunsliDecodeJpeg(src.data(), src.size(), &jpg) == BRUNSLI_OK);
+  jpg.width = width;
+  jpg.height = height;
+  BRUNSLI_CHECK(internal::dec::UpdateSubsamplingDerivatives(&jpg));
+  FillRandom(seed, &jpg);
+  return jpg;
+}
+
+JPEGData MakeJpeg(int width, int height, size_t num_components, int samp,
+                  int quant) {
+  JPEGData jpg;
+  jpg.width = width;
+  jpg.height = height;
+  jpg.quant.resize(1);
+  jpg.quant[0].values.fill(quant);
+  jpg.components.resize(num_components);
+  for (size_t i = 0; i < num_components; ++i) {
+    jpg.components[i].id = static_cast<int>(i + 1);
+  }
+  jpg.components[0].h_samp_factor = samp;
+  jpg.components[0].v_samp_factor = samp;
+  BRUNSLI_CHECK(internal::dec::UpdateSubsamplingDerivatives(&jpg));
+  for (JPEGComponent& c : jpg.components) {
+    c.coeffs.resize(c.num_blocks * kDCTBlockSize);
+  }
+  return jpg;
+}
+
+JPEGData MakeRandomJpeg(int width, int height, size_t num_components, int samp,
+                        int quant, uint32_t seed) {
+  JPEGData jpg = MakeJpeg(width, height, num_components, samp, quant);
+  FillRandom(seed, &jpg);
+  return jpg;
+}
+
+void FillSmooth(JPEGComponent* c, uint32_t seed) {
+  Random rnd(seed);
+  for (size_t i = 0; i < c->num_blocks; ++i) {
+    coeff_t* block = &c->coeffs[i * kDCTBlockSize];
+    for (int k : {0, 1, 8, 9}) {
+      const int r = rnd.Symmetric(100);
+      block[k] = static_cast<coeff_t>(k == 0 ? 4 * r : r / 4);
+    }
+  }
+}
+
 namespace {
 uint32_t readU32(const uint8_t* data) {
   return data[3] | (data[2] << 8) | (data[1] << 16) | (data[0] << 24);
@@ -13,6 +13,9 @@
 #include <tuple>
 #include <vector>
 
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
+
 namespace brunsli {
 
 /**
@@ -22,17 +25,65 @@ namespace brunsli {
  */
 size_t StringOutputFunction(void* data, const uint8_t* buf, size_t count);
 
+/**
+ * Output callback for JPEGOutput.
+ *
+ * assert(data instanceof std::vector<uint8_t>)
+ */
+size_t VectorOutputFunction(void* data, const uint8_t* buf, size_t count);
+
+// Serializes |jpg| with WriteJpeg; aborts on failure.
+std::vector<uint8_t> WriteJpegToVector(const JPEGData& jpg);
+std::vector<uint8_t> WriteJpegToVector(const JPEGData& jpg,
+                                       JPEGWriteMode mode);
+
+// Same as BrunsliEncodeJpeg, but AC data is split into segments of the given
+// height.
+std::vector<uint8_t> EncodeSegmented(JPEGData jpg, int segment_mcu_rows);
+
 std::vector<uint8_t> GetSmallBrunsliFile();
 const size_t kSmallBrunsliSignatuteSize = 6;
 const size_t kSmallBrunsliHeaderSize = 10;
 
 std::vector<uint8_t> GetFallbackBrunsliFile();
 
+// Produces JPEGData of given size with pseudo-random coefficients; the rest
+// of the image properties is borrowed from the "small" test file.
+JPEGData MakeRandomJpeg(int width, int height, uint32_t seed);
+
+// Produces JPEGData of given size with |num_components| components; the first
+// one has |samp| x |samp| sampling factors, the others 1 x 1. All components
+// use a single quantization table filled with |quant|. Coefficients are zero;
+// the result is not yet ready to be serialized (see SetBaselineJpegStructure).
+JPEGData MakeJpeg(int width, int height, size_t num_components, int samp,
+                  int quant);
+
+// Same as MakeJpeg, but coefficients are filled the same way as
+// MakeRandomJpeg does.
+JPEGData MakeRandomJpeg(int width, int height, size_t num_components, int samp,
+                        int quant, uint32_t seed);
+
+// Fills component with smooth content without clipping: DC and lowest AC.
+void FillSmooth(JPEGComponent* c, uint32_t seed);
+
 std::vector<std::tuple<std::vector<uint8_t>>> ParseMar(const void* data,
                                                              size_t size);
 
 std::vector<uint8_t> ReadTestData(const std::string& filename);
 
+#if defined(EXPECT_EQ)
+// Expects images to have the same size and coefficients.
+inline void ExpectSameCoefficients(const JPEGData& expected,
+                                   const JPEGData& actual) {
+  ASSERT_EQ(expected.width, actual.width);
+  ASSERT_EQ(expected.height, actual.height);
+  ASSERT_EQ(expected.components.size(), actual.components.size());
+  for (size_t i = 0; i < expected.components.size(); ++i) {
+    EXPECT_EQ(expected.components[i].coeffs, actual.components[i].coeffs);
+  }
+}
+#endif
+
 }  // namespace brunsli
 
 #if !defined(TEST)
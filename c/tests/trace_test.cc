@@ -0,0 +1,81 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Instrumentation in this file is enabled regardless of the library build.
+#if !defined(BRUNSLI_ENABLE_TRACE)
+#define BRUNSLI_ENABLE_TRACE
+#endif
+#include "../common/trace.h"
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include <brunsli/trace.h>
+
+namespace brunsli {
+
+namespace {
+
+std::string StopAndRead() {
+  const std::string path = testing::TempDir() + "brunsli_trace_test.json";
+  EXPECT_TRUE(BrunsliStopTrace(path.c_str()));
+  std::ifstream file(path);
+  return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+size_t CountOccurrences(const std::string& haystack,
+                        const std::string& needle) {
+  size_t count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+}  // namespace
+
+TEST(TraceTest, BeginEndEvents) {
+  { BRUNSLI_TRACE_SCOPE("NotRecorded"); }
+  BrunsliStartTrace();
+  {
+    BRUNSLI_TRACE_SCOPE("Outer");
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 2; ++i) {
+      threads.emplace_back([]() { BRUNSLI_TRACE_SCOPE("Inner"); });
+    }
+    for (std::thread& thread : threads) thread.join();
+  }
+  const std::string trace = StopAndRead();
+  { BRUNSLI_TRACE_SCOPE("NotRecorded"); }
+
+  EXPECT_EQ(0u, trace.find("{\"traceEvents\":["));
+  EXPECT_EQ(0u, CountOccurrences(trace, "NotRecorded"));
+  EXPECT_EQ(2u, CountOccurrences(trace, "\"name\":\"Outer\""));
+  EXPECT_EQ(4u, CountOccurrences(trace, "\"name\":\"Inner\""));
+  EXPECT_EQ(3u, CountOccurrences(trace, "\"ph\":\"B\""));
+  EXPECT_EQ(3u, CountOccurrences(trace, "\"ph\":\"E\""));
+  // Each thread gets its own ID.
+  EXPECT_EQ(2u, CountOccurrences(trace, "\"tid\":1,"));
+  EXPECT_EQ(2u, CountOccurrences(trace, "\"tid\":2,"));
+  EXPECT_EQ(2u, CountOccurrences(trace, "\"tid\":3,"));
+}
+
+TEST(TraceTest, RestartDropsEvents) {
+  BrunsliStartTrace();
+  { BRUNSLI_TRACE_SCOPE("First"); }
+  BrunsliStartTrace();
+  { BRUNSLI_TRACE_SCOPE("Second"); }
+  const std::string trace = StopAndRead();
+  EXPECT_EQ(0u, CountOccurrences(trace, "First"));
+  EXPECT_EQ(2u, CountOccurrences(trace, "Second"));
+}
+
+}  // namespace brunsli
@@ -7,11 +7,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <brunsli/jpeg_data.h>
 #include <brunsli/types.h>
 #include <brunsli/brunsli_encode.h>
 #include <brunsli/jpeg_data_reader.h>
+#include <brunsli/jpeg_transform.h>
+#include <brunsli/trace.h>
 
 #if defined(BRUNSLI_EXPERIMENTAL_GROUPS)
 #include "../experimental/groups.h"
@@ -100,24 +104,38 @@ bool WriteFile(const std::string& file_name, const std::string& content) {
   return ok;
 }
 
-bool ProcessFile(const std::string& file_name,
-                 const std::string& outfile_name) {
+bool LoadJpeg(const std::string& file_name, bool normalize_orientation,
+              brunsli::JPEGData* jpg) {
   std::string input;
   bool ok = ReadFile(file_name, &input);
   if (!ok) return false;
 
+  const uint8_t* input_data = reinterpret_cast<const uint8_t*>(input.data());
+  ok = brunsli::ReadJpeg(input_data, input.size(), brunsli::JPEG_READ_ALL, jpg);
+  if (!ok) {
+    fprintf(stderr, "Failed to parse JPEG input.\n");
+    return false;
+  }
+
+  if (normalize_orientation) {
+    brunsli::JPEGData oriented;
+    if (!brunsli::NormalizeJpegOrientation(*jpg, &oriented)) {
+      fprintf(stderr, "Failed to apply EXIF orientation.\n");
+      return false;
+    }
+    *jpg = std::move(oriented);
+  }
+  return true;
+}
+
+bool ProcessFile(const std::string& file_name,
+                 const std::string& outfile_name, bool normalize_orientation,
+                 brunsli::BrunsliEncodeLevel level) {
+  bool ok;
   std::string output;
   {
     brunsli::JPEGData jpg;
-    const uint8_t* input_data = reinterpret_cast<const uint8_t*>(input.data());
-    ok = brunsli::ReadJpeg(input_data, input.size(), brunsli::JPEG_READ_ALL,
-                           &jpg);
-    input.clear();
-    input.shrink_to_fit();
-    if (!ok) {
-      fprintf(stderr, "Failed to parse JPEG input.\n");
-      return false;
-    }
+    if (!LoadJpeg(file_name, normalize_orientation, &jpg)) return false;
 
     size_t output_size = brunsli::GetMaximumBrunsliEncodedSize(jpg);
     output.resize(output_size);
@@ -127,11 +145,18 @@ bool ProcessFile(const std::string& file_name,
     {
       brunsli::ParallelExecutor pool(4);
       brunsli::Executor executor = pool.getExecutor();
-      ok = brunsli::EncodeGroups(jpg, output_data, &output_size, 32, 128,
-                                 &executor);
+      if (level == brunsli::BRUNSLI_ENCODE_MAX) {
+        // Parameter search produces regular (non-groups) stream.
+        ok = brunsli::BrunsliEncodeJpegSearch(jpg, executor, 0, output_data,
+                                              &output_size);
+      } else {
+        // Groups encoder has a single level.
+        ok = brunsli::EncodeGroups(jpg, output_data, &output_size, 32, 128,
+                                   &executor);
+      }
     }
 #else
-    ok = brunsli::BrunsliEncodeJpeg(jpg, output_data, &output_size);
+    ok = brunsli::BrunsliEncodeJpeg(jpg, level, output_data, &output_size);
 #endif
 
     if (!ok) {
@@ -146,9 +171,88 @@ bool ProcessFile(const std::string& file_name,
   return ok;
 }
 
+// Writes the BrunsliAnalyzeJpeg report as CSV, or as JSON if |outfile_name|
+// has ".json" extension.
+bool AnalyzeFile(const std::string& file_name, const std::string& outfile_name,
+                 bool normalize_orientation) {
+  std::vector<brunsli::BrunsliCostEntry> entries;
+  {
+    brunsli::JPEGData jpg;
+    if (!LoadJpeg(file_name, normalize_orientation, &jpg)) return false;
+    if (!brunsli::BrunsliAnalyzeJpeg(jpg, &entries)) {
+      fprintf(stderr, "Failed to analyze JPEG\n");
+      return false;
+    }
+  }
+
+  const std::string kJsonExtension = ".json";
+  const bool json =
+      outfile_name.size() >= kJsonExtension.size() &&
+      outfile_name.compare(outfile_name.size() - kJsonExtension.size(),
+                           kJsonExtension.size(), kJsonExtension) == 0;
+  std::string output = json ? "[\n" : "section,symbol,component,k,count,bits\n";
+  char line[256];
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const brunsli::BrunsliCostEntry& e = entries[i];
+    if (json) {
+      snprintf(line, sizeof(line),
+               "  {\"section\": \"%s\", \"symbol\": \"%s\", "
+               "\"component\": %d, \"k\": %d, \"count\": %zu, "
+               "\"bits\": %.2f}%s\n",
+               e.section, e.symbol, e.component, e.k, e.count, e.bits,
+               (i + 1 < entries.size()) ? "," : "");
+    } else {
+      snprintf(line, sizeof(line), "%s,%s,%d,%d,%zu,%.2f\n", e.section,
+               e.symbol, e.component, e.k, e.count, e.bits);
+    }
+    output += line;
+  }
+  if (json) output += "]\n";
+  return WriteFile(outfile_name, output);
+}
+
 int main(int argc, char** argv) {
+  bool normalize_orientation = false;
+  brunsli::BrunsliEncodeLevel level = brunsli::BRUNSLI_ENCODE_DEFAULT;
+  bool analyze = false;
+  std::string trace_file_name;
+  while (argc > 1) {
+    const std::string flag(argv[1]);
+    if (flag == "--normalize-orientation") {
+      normalize_orientation = true;
+    } else if (flag == "--fast") {
+#if defined(BRUNSLI_EXPERIMENTAL_GROUPS)
+      // Groups encoder has a single level.
+      fprintf(stderr, "--fast is not supported by groups encoder.\n");
+      return EXIT_FAILURE;
+#else
+      level = brunsli::BRUNSLI_ENCODE_FAST;
+#endif
+    } else if (flag == "--max") {
+      level = brunsli::BRUNSLI_ENCODE_MAX;
+    } else if (flag == "--analyze") {
+      analyze = true;
+    } else if (flag == "--trace" && argc > 2) {
+      trace_file_name = argv[2];
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
   if (argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: cbrunsli FILE [OUTPUT_FILE, default=FILE.brn]\n");
+    fprintf(stderr,
+            "Usage: cbrunsli [--normalize-orientation] [--fast | --max] "
+            "[--trace TRACE_FILE] FILE [OUTPUT_FILE, default=FILE.brn]\n"
+            "       cbrunsli [--normalize-orientation] --analyze FILE "
+            "[OUTPUT_FILE, default=FILE.csv]\n"
+            "  --analyze writes per-symbol breakdown of the encoded size as "
+            "CSV (or JSON,\n"
+            "  if OUTPUT_FILE ends with .json) instead of encoding.\n"
+            "  --trace writes Chrome trace events (only if built with "
+            "BRUNSLI_ENABLE_TRACE).\n");
     return EXIT_FAILURE;
   }
   const std::string file_name = std::string(argv[1]);
@@ -157,7 +261,17 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
   const std::string outfile_name =
-      argc == 2 ? file_name + ".brn" : std::string(argv[2]);
-  bool ok = ProcessFile(file_name, outfile_name);
+      argc == 2 ? file_name + (analyze ? ".csv" : ".brn")
+                : std::string(argv[2]);
+  if (!trace_file_name.empty()) brunsli::BrunsliStartTrace();
+  bool ok =
+      analyze
+          ? AnalyzeFile(file_name, outfile_name, normalize_orientation)
+          : ProcessFile(file_name, outfile_name, normalize_orientation, level);
+  if (!trace_file_name.empty() &&
+      !brunsli::BrunsliStopTrace(trace_file_name.c_str())) {
+    fprintf(stderr, "Failed to write trace.\n");
+    ok = false;
+  }
   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -13,6 +13,7 @@
 #include <brunsli/types.h>
 #include <brunsli/brunsli_decode.h>
 #include <brunsli/jpeg_data_writer.h>
+#include <brunsli/trace.h>
 
 #if defined(BRUNSLI_EXPERIMENTAL_GROUPS)
 #include "../experimental/groups.h"
@@ -155,8 +156,18 @@ bool ProcessFile(const std::string& file_name,
 }
 
 int main(int argc, char** argv) {
+  std::string trace_file_name;
+  if (argc > 2 && std::string(argv[1]) == "--trace") {
+    trace_file_name = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
   if (argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: dbrunsli FILE [OUTPUT_FILE, default=FILE.jpg]\n");
+    fprintf(stderr,
+            "Usage: dbrunsli [--trace TRACE_FILE] FILE "
+            "[OUTPUT_FILE, default=FILE.jpg]\n"
+            "  --trace writes Chrome trace events (only if built with "
+            "BRUNSLI_ENABLE_TRACE).\n");
     return EXIT_FAILURE;
   }
   const std::string file_name = std::string(argv[1]);
@@ -167,6 +178,12 @@ int main(int argc, char** argv) {
   const std::string outfile_name =
       argc == 2 ? file_name + ".jpg" : std::string(argv[2]);
 
+  if (!trace_file_name.empty()) brunsli::BrunsliStartTrace();
   bool ok = ProcessFile(file_name, outfile_name);
+  if (!trace_file_name.empty() &&
+      !brunsli::BrunsliStopTrace(trace_file_name.c_str())) {
+    fprintf(stderr, "Failed to write trace.\n");
+    ok = false;
+  }
   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
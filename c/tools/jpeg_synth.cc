@@ -0,0 +1,352 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include "./jpeg_synth.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../common/baseline_jpeg.h"
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+namespace {
+
+// Baseline JPEG limits for quantized coefficients; differences of DC values
+// then fit into 11 bits as well.
+const int kMaxACCoeff = 1023;
+const int kMaxDCCoeff = 1023;
+
+// Standard (JPEG specification, Annex K) quantization tables, natural order.
+const int kStdLumaQuant[kDCTBlockSize] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+const int kStdChromaQuant[kDCTBlockSize] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+JPEGQuantTable MakeQuantTable(const int* base, int quality, int index) {
+  // Same scaling as in libjpeg jpeg_quality_scaling.
+  const int scale = (quality < 50) ? (5000 / quality) : (200 - 2 * quality);
+  JPEGQuantTable q;
+  for (int i = 0; i < kDCTBlockSize; ++i) {
+    q.values[i] = std::min(255, std::max(1, (base[i] * scale + 50) / 100));
+  }
+  q.precision = 0;
+  q.index = index;
+  q.is_last = true;
+  return q;
+}
+
+void StartImage(const JPEGSynthParams& params, JPEGData* jpg) {
+  *jpg = JPEGData();
+  jpg->width = params.width;
+  jpg->height = params.height;
+  const bool is_gray = (params.subsampling == JPEG_SYNTH_GRAY);
+  const int luma_h = (params.subsampling == JPEG_SYNTH_444 || is_gray) ? 1 : 2;
+  const int luma_v = (params.subsampling == JPEG_SYNTH_420) ? 2 : 1;
+  jpg->quant.push_back(MakeQuantTable(kStdLumaQuant, params.quality, 0));
+  if (!is_gray) {
+    jpg->quant.push_back(MakeQuantTable(kStdChromaQuant, params.quality, 1));
+  }
+  jpg->components.resize(is_gray ? 1 : 3);
+  for (size_t i = 0; i < jpg->components.size(); ++i) {
+    JPEGComponent& c = jpg->components[i];
+    c.id = static_cast<int>(i + 1);
+    c.h_samp_factor = (i == 0) ? luma_h : 1;
+    c.v_samp_factor = (i == 0) ? luma_v : 1;
+    c.quant_idx = (i == 0) ? 0 : 1;
+  }
+  jpg->max_h_samp_factor = luma_h;
+  jpg->max_v_samp_factor = luma_v;
+  jpg->MCU_rows = DivCeil(jpg->height, jpg->max_v_samp_factor * 8);
+  jpg->MCU_cols = DivCeil(jpg->width, jpg->max_h_samp_factor * 8);
+  for (JPEGComponent& c : jpg->components) {
+    c.width_in_blocks = jpg->MCU_cols * c.h_samp_factor;
+    c.height_in_blocks = jpg->MCU_rows * c.v_samp_factor;
+    c.num_blocks = static_cast<uint32_t>(c.width_in_blocks) *
+                   static_cast<uint32_t>(c.height_in_blocks);
+    c.coeffs.assign(static_cast<size_t>(c.num_blocks) * kDCTBlockSize, 0);
+  }
+  // Markers are filled later by SetBaselineJpegStructure.
+}
+
+void FillRandom(const JPEGQuantTable& q, Random* rnd, JPEGComponent* c) {
+  for (size_t i = 0; i < c->coeffs.size(); ++i) {
+    const size_t k = i % kDCTBlockSize;
+    if (k == 0) {
+      c->coeffs[i] = static_cast<coeff_t>(
+          rnd->Symmetric(std::min(kMaxDCCoeff / 2, 1016 / q.values[0])));
+    } else {
+      // Values of [-255, 255] in pixel domain.
+      const int range = std::min(kMaxACCoeff, std::max(1, 510 / q.values[k]));
+      c->coeffs[i] = static_cast<coeff_t>(rnd->Symmetric(range));
+    }
+  }
+}
+
+// Pixel (x, y) of component |comp| (in component resolution) is
+// wave_x[x] * wave_y[y] + checkerboard + noise.
+void FillStructured(const JPEGData& jpg, size_t comp, Random* rnd,
+                    JPEGComponent* c) {
+  const int width = c->width_in_blocks * 8;
+  const int height = c->height_in_blocks * 8;
+  // Scale to full resolution, so that all components show the same image.
+  const int x_scale = jpg.max_h_samp_factor / c->h_samp_factor;
+  const int y_scale = jpg.max_v_samp_factor / c->v_samp_factor;
+  const double amplitude = (comp == 0) ? 80.0 : 30.0;
+  const double phase = 1.3 * comp;
+  std::vector<double> wave_x(width);
+  std::vector<double> wave_y(height);
+  for (int x = 0; x < width; ++x) {
+    wave_x[x] = amplitude * std::sin(0.011 * x * x_scale + phase);
+  }
+  for (int y = 0; y < height; ++y) {
+    wave_y[y] = std::cos(0.007 * y * y_scale - phase);
+  }
+  const int edge = (comp == 0) ? 24 : 8;
+  const int noise = (comp == 0) ? 6 : 2;
+
+  const double kPi = 3.14159265358979323846;
+  double cosine[8][8];
+  for (int u = 0; u < 8; ++u) {
+    const double scale = (u == 0) ? std::sqrt(0.125) : 0.5;
+    for (int x = 0; x < 8; ++x) {
+      cosine[u][x] = scale * std::cos((2 * x + 1) * u * kPi / 16);
+    }
+  }
+  const JPEGQuantTable& q = jpg.quant[c->quant_idx];
+  double pixels[kDCTBlockSize];
+  double rows[kDCTBlockSize];
+  for (uint32_t by = 0; by < c->height_in_blocks; ++by) {
+    for (uint32_t bx = 0; bx < c->width_in_blocks; ++bx) {
+      for (int iy = 0; iy < 8; ++iy) {
+        for (int ix = 0; ix < 8; ++ix) {
+          const int x = static_cast<int>(bx * 8) + ix;
+          const int y = static_cast<int>(by * 8) + iy;
+          const bool cell = (((x * x_scale) >> 6) ^ ((y * y_scale) >> 6)) & 1;
+          const double value = wave_x[x] * wave_y[y] + (cell ? edge : -edge) +
+                               rnd->Symmetric(noise);
+          pixels[iy * 8 + ix] = std::min(127.0, std::max(-128.0, value));
+        }
+      }
+      // Separable DCT-II: rows, then columns.
+      for (int iy = 0; iy < 8; ++iy) {
+        for (int u = 0; u < 8; ++u) {
+          double sum = 0.0;
+          for (int ix = 0; ix < 8; ++ix) {
+            sum += cosine[u][ix] * pixels[iy * 8 + ix];
+          }
+          rows[iy * 8 + u] = sum;
+        }
+      }
+      coeff_t* out =
+          &c->coeffs[(static_cast<size_t>(by) * c->width_in_blocks + bx) *
+                     kDCTBlockSize];
+      for (int v = 0; v < 8; ++v) {
+        for (int u = 0; u < 8; ++u) {
+          double sum = 0.0;
+          for (int iy = 0; iy < 8; ++iy) {
+            sum += cosine[v][iy] * rows[iy * 8 + u];
+          }
+          const int k = v * 8 + u;
+          const int limit = (k == 0) ? kMaxDCCoeff : kMaxACCoeff;
+          const int value = static_cast<int>(std::lround(sum / q.values[k]));
+          out[k] =
+              static_cast<coeff_t>(std::min(limit, std::max(-limit, value)));
+        }
+      }
+    }
+  }
+}
+
+// Blocks of partial MCUs that are outside of the image are coded only in
+// interleaved scans, i.e. AC coefficients of those are lost in progressive
+// mode. Clear them, so that all scan scripts produce the same coefficients.
+void ClearPaddingAC(const JPEGData& jpg, JPEGComponent* c) {
+  const uint32_t width =
+      DivCeil(jpg.width * c->h_samp_factor, 8 * jpg.max_h_samp_factor);
+  const uint32_t height =
+      DivCeil(jpg.height * c->v_samp_factor, 8 * jpg.max_v_samp_factor);
+  for (uint32_t by = 0; by < c->height_in_blocks; ++by) {
+    for (uint32_t bx = 0; bx < c->width_in_blocks; ++bx) {
+      if (bx < width && by < height) continue;
+      coeff_t* block =
+          &c->coeffs[(static_cast<size_t>(by) * c->width_in_blocks + bx) *
+                     kDCTBlockSize];
+      std::fill(block + 1, block + kDCTBlockSize, 0);
+    }
+  }
+}
+
+// Script of libjpeg jpeg_simple_progression for YCbCr / grayscale images.
+void SetRefinementScans(JPEGData* jpg) {
+  const size_t num_components = jpg->components.size();
+  std::vector<JPEGScanInfo>& scans = jpg->scan_info;
+  scans.clear();
+  const auto add_dc = [&](int Ah, int Al) {
+    scans.push_back(MakeScan(0, 0, Ah, Al));
+    for (size_t i = 0; i < num_components; ++i) {
+      AddComponentToScan(i, &scans.back());
+    }
+  };
+  const auto add_ac = [&](size_t comp_idx, int Ss, int Se, int Ah, int Al) {
+    scans.push_back(MakeScan(Ss, Se, Ah, Al));
+    AddComponentToScan(comp_idx, &scans.back());
+  };
+  add_dc(0, 1);
+  add_ac(0, 1, 5, 0, 2);
+  for (size_t i = num_components; i > 1; --i) add_ac(i - 1, 1, 63, 0, 1);
+  add_ac(0, 6, 63, 0, 2);
+  add_ac(0, 1, 63, 2, 1);
+  add_dc(1, 0);
+  for (size_t i = num_components; i > 1; --i) add_ac(i - 1, 1, 63, 1, 0);
+  add_ac(0, 1, 63, 1, 0);
+
+  jpg->huffman_code.clear();
+  for (int slot_id : {0x00, 0x10, 0x01, 0x11}) {
+    if ((slot_id & 0xF) > 0 && num_components == 1) continue;
+    jpg->huffman_code.push_back(MakeCompleteHuffmanCode(slot_id));
+  }
+  jpg->huffman_code.back().is_last = true;
+
+  std::vector<uint8_t> marker_order = {0xDB, 0xC2, 0xC4};
+  marker_order.insert(marker_order.end(), scans.size(), 0xDA);
+  marker_order.push_back(0xD9);
+  jpg->marker_order.swap(marker_order);
+}
+
+// Number of MCUs coded in the scan; MCU of a non-interleaved scan is a single
+// block.
+int NumScanMCUs(const JPEGData& jpg, const JPEGScanInfo& scan) {
+  if (scan.num_components > 1) return jpg.MCU_rows * jpg.MCU_cols;
+  const JPEGComponent& c = jpg.components[scan.components[0].comp_idx];
+  return DivCeil(jpg.width * c.h_samp_factor, 8 * jpg.max_h_samp_factor) *
+         DivCeil(jpg.height * c.v_samp_factor, 8 * jpg.max_v_samp_factor);
+}
+
+// Number of blocks coded in the scan.
+int NumScanBlocks(const JPEGData& jpg, const JPEGScanInfo& scan) {
+  if (scan.num_components == 1) return NumScanMCUs(jpg, scan);
+  int blocks_per_mcu = 0;
+  for (size_t i = 0; i < scan.num_components; ++i) {
+    const JPEGComponent& c = jpg.components[scan.components[i].comp_idx];
+    blocks_per_mcu += c.h_samp_factor * c.v_samp_factor;
+  }
+  return NumScanMCUs(jpg, scan) * blocks_per_mcu;
+}
+
+}  // namespace
+
+JPEGHuffmanCode MakeCompleteHuffmanCode(int slot_id) {
+  const bool is_ac = (slot_id >= 0x10);
+  const int num_symbols =
+      is_ac ? kJpegHuffmanAlphabetSize : kJpegDCAlphabetSize;
+  JPEGHuffmanCode huff;
+  huff.slot_id = slot_id;
+  // Sentinel symbol takes the last (all-ones) code.
+  if (is_ac) {
+    huff.counts[8] = 255;
+    huff.counts[9] = 2;
+  } else {
+    huff.counts[4] = num_symbols + 1;
+  }
+  for (int i = 0; i < num_symbols; ++i) huff.values[i] = i;
+  huff.values[num_symbols] = kJpegHuffmanAlphabetSize;
+  huff.is_last = false;
+  return huff;
+}
+
+bool SynthesizeJpeg(const JPEGSynthParams& params, JPEGData* jpg) {
+  if (params.width < 1 || params.width > kMaxDimPixels) return false;
+  if (params.height < 1 || params.height > kMaxDimPixels) return false;
+  if (params.quality < 1 || params.quality > 100) return false;
+  if (params.restart_interval < 0 || params.restart_interval > 0xFFFF) {
+    return false;
+  }
+  if (params.reset_interval < 0) return false;
+  StartImage(params, jpg);
+
+  Random rnd(params.seed);
+  for (size_t i = 0; i < jpg->components.size(); ++i) {
+    JPEGComponent& c = jpg->components[i];
+    if (params.content == JPEG_SYNTH_RANDOM) {
+      FillRandom(jpg->quant[c.quant_idx], &rnd, &c);
+    } else if (params.content == JPEG_SYNTH_STRUCTURED) {
+      FillStructured(*jpg, i, &rnd, &c);
+    }
+    ClearPaddingAC(*jpg, &c);
+  }
+
+  const bool extra_flushes =
+      (params.restart_interval > 0) || (params.reset_interval > 0);
+  switch (params.scans) {
+    case JPEG_SYNTH_SEQUENTIAL:
+      SetBaselineJpegStructure(jpg);
+      break;
+    case JPEG_SYNTH_PROGRESSIVE:
+      if (!OptimizeJpegCoding(jpg, /* progressive= */ true)) return false;
+      // Optimal codes are built without extra flushes, which produce
+      // different symbols.
+      if (extra_flushes) {
+        for (JPEGHuffmanCode& huff : jpg->huffman_code) {
+          const bool is_last = huff.is_last;
+          huff = MakeCompleteHuffmanCode(huff.slot_id);
+          huff.is_last = is_last;
+        }
+      }
+      break;
+    case JPEG_SYNTH_PROGRESSIVE_REFINEMENT:
+      SetBaselineJpegStructure(jpg);
+      SetRefinementScans(jpg);
+      break;
+    default:
+      return false;
+  }
+
+  if (params.restart_interval > 0) {
+    jpg->restart_interval = params.restart_interval;
+    const auto sos =
+        std::find(jpg->marker_order.begin(), jpg->marker_order.end(), 0xDA);
+    jpg->marker_order.insert(sos, 0xDD);
+  }
+  if (params.reset_interval > 0 && params.scans != JPEG_SYNTH_SEQUENTIAL) {
+    for (JPEGScanInfo& scan : jpg->scan_info) {
+      if (scan.Ss == 0) continue;
+      const int num_blocks = NumScanBlocks(*jpg, scan);
+      for (int b = params.reset_interval; b < num_blocks;
+           b += params.reset_interval) {
+        scan.reset_points.push_back(b);
+      }
+    }
+  }
+  if (params.zero_padding) {
+    // At most 7 bits per entropy-coded segment; restart markers split scans
+    // into segments of |restart_interval| MCUs.
+    size_t num_segments = 0;
+    for (const JPEGScanInfo& scan : jpg->scan_info) {
+      if (params.restart_interval > 0) {
+        num_segments +=
+            DivCeil(NumScanMCUs(*jpg, scan), params.restart_interval);
+      } else {
+        num_segments += 1;
+      }
+    }
+    jpg->has_zero_padding_bit = true;
+    jpg->padding_bits.assign(7 * num_segments, 0);
+  }
+  return true;
+}
+
+}  // namespace brunsli
@@ -0,0 +1,103 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Functions for producing synthetic JPEG images, e.g. for deterministic
+// benchmark corpora and tests. Not a part of the library.
+
+#ifndef BRUNSLI_TOOLS_JPEG_SYNTH_H_
+#define BRUNSLI_TOOLS_JPEG_SYNTH_H_
+
+#include <brunsli/jpeg_data.h>
+#include <brunsli/types.h>
+
+namespace brunsli {
+
+enum JPEGSynthSubsampling {
+  JPEG_SYNTH_444,
+  JPEG_SYNTH_422,
+  JPEG_SYNTH_420,
+  JPEG_SYNTH_GRAY,
+};
+
+enum JPEGSynthScans {
+  // Single sequential scan (baseline), standard Huffman codes.
+  JPEG_SYNTH_SEQUENTIAL,
+  // Progressive, spectral selection only.
+  JPEG_SYNTH_PROGRESSIVE,
+  // Progressive, spectral selection and successive approximation; same
+  // script as libjpeg uses by default.
+  JPEG_SYNTH_PROGRESSIVE_REFINEMENT,
+};
+
+enum JPEGSynthContent {
+  // Flat gray image; all coefficients are zero.
+  JPEG_SYNTH_ZERO,
+  // Noise: random coefficients of all frequencies.
+  JPEG_SYNTH_RANDOM,
+  // Smooth gradients, sharp edges and a bit of noise; pixels go through DCT
+  // and quantization, so coefficient statistics resemble photos.
+  JPEG_SYNTH_STRUCTURED,
+};
+
+struct JPEGSynthParams {
+  int width = 256;
+  int height = 256;
+  JPEGSynthSubsampling subsampling = JPEG_SYNTH_420;
+  JPEGSynthScans scans = JPEG_SYNTH_SEQUENTIAL;
+  JPEGSynthContent content = JPEG_SYNTH_STRUCTURED;
+  // 1..100; standard quantization tables are scaled the same way as libjpeg
+  // does.
+  int quality = 75;
+  // In MCUs; 0 means no restart markers.
+  int restart_interval = 0;
+  // In blocks; progressive AC scans flush EOB runs and refinement bits at
+  // every |reset_interval|-th block ("reset points"). 0 means no extra
+  // flushes.
+  int reset_interval = 0;
+  // Pad entropy-coded segments with 0 bits instead of 1 bits.
+  bool zero_padding = false;
+  uint32_t seed = 1;
+};
+
+// Produces a synthetic image in *jpg; same parameters always produce the same
+// result. It could be serialized with WriteJpeg.
+//
+// Huffman codes are optimal for JPEG_SYNTH_PROGRESSIVE without restart
+// markers and reset points, standard for JPEG_SYNTH_SEQUENTIAL, and cover all
+// symbols (i.e. are far from optimal) otherwise.
+// Memory usage is 128 bytes per block, i.e. ~3GB per gigapixel with 4:2:0
+// subsampling. Note that ReadJpeg rejects images with more than
+// kBrunsliMaxNumBlocks blocks per component (~130 megapixels).
+// Returns false, if parameters are out of range.
+bool SynthesizeJpeg(const JPEGSynthParams& params, JPEGData* jpg);
+
+// Huffman code that assigns codes to all the symbols of the DC (slot_id <
+// 0x10) or AC alphabet; i.e. any coefficients that fit into the baseline
+// range could be serialized with it.
+JPEGHuffmanCode MakeCompleteHuffmanCode(int slot_id);
+
+// Linear congruential generator; good enough for synthetic images, and
+// produces the same sequence everywhere.
+class Random {
+ public:
+  explicit Random(uint32_t seed) : state_(seed) {}
+  // Returns a value in [0, 65536).
+  uint32_t Next() {
+    state_ = state_ * 1103515245u + 12345u;
+    return (state_ >> 8) & 0xFFFF;
+  }
+  // Returns a value in [-range, range].
+  int Symmetric(int range) {
+    return static_cast<int>(Next() % (2 * range + 1)) - range;
+  }
+
+ private:
+  uint32_t state_;
+};
+
+}  // namespace brunsli
+
+#endif  // BRUNSLI_TOOLS_JPEG_SYNTH_H_
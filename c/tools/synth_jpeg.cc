@@ -0,0 +1,185 @@
+// Copyright (c) Google LLC 2020
+//
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Produces synthetic JPEG files; see jpeg_synth.h.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
+#include <brunsli/types.h>
+#include "./jpeg_synth.h"
+
+#if defined(_WIN32)
+#define fopen ms_fopen
+static FILE* ms_fopen(const char* filename, const char* mode) {
+  FILE* result = 0;
+  fopen_s(&result, filename, mode);
+  return result;
+}
+#endif  /* WIN32 */
+
+const char* const kSubsamplingNames[] = {"444", "422", "420", "gray"};
+const char* const kScansNames[] = {"sequential", "progressive", "refinement"};
+const char* const kContentNames[] = {"zero", "random", "structured"};
+
+// Returns the index of |value| in |names|, or -1.
+template <size_t N>
+int FindName(const char* const (&names)[N], const std::string& value) {
+  for (size_t i = 0; i < N; ++i) {
+    if (value == names[i]) return static_cast<int>(i);
+  }
+  return -1;
+}
+
+bool ParseInt(const std::string& value, int* result) {
+  char* end = nullptr;
+  const long parsed = strtol(value.c_str(), &end, 10);  // NOLINT(runtime/int)
+  if (value.empty() || *end != 0 || parsed < 0 || parsed > 0x7FFFFFFF) {
+    return false;
+  }
+  *result = static_cast<int>(parsed);
+  return true;
+}
+
+size_t FileWriter(void* data, const uint8_t* buf, size_t count) {
+  return fwrite(buf, 1, count, reinterpret_cast<FILE*>(data));
+}
+
+bool WriteSynthJpeg(const brunsli::JPEGSynthParams& params,
+                    const std::string& file_name) {
+  brunsli::JPEGData jpg;
+  if (!brunsli::SynthesizeJpeg(params, &jpg)) {
+    fprintf(stderr, "Invalid image parameters.\n");
+    return false;
+  }
+  FILE* file = fopen(file_name.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Failed to open file for writing.\n");
+    return false;
+  }
+  bool ok = brunsli::WriteJpeg(jpg, brunsli::JPEGOutput(FileWriter, file));
+  if (!ok) fprintf(stderr, "Failed to write output.\n");
+  if (fclose(file) != 0) {
+    if (ok) {
+      fprintf(stderr, "Failed to close output file.\n");
+    }
+    return false;
+  }
+  return ok;
+}
+
+// Every subsampling / scan script combination, with and without restart
+// markers, in low and high quality, small and large.
+bool WriteCorpus(const std::string& dir, const brunsli::JPEGSynthParams& base) {
+  const int kSizes[][2] = {{640, 480}, {4096, 3072}};
+  for (int subsampling = 0; subsampling < 4; ++subsampling) {
+    for (int scans = 0; scans < 3; ++scans) {
+      for (int restart_interval : {0, 8}) {
+        for (int quality : {30, 90}) {
+          for (const auto& size : kSizes) {
+            brunsli::JPEGSynthParams params = base;
+            params.subsampling =
+                static_cast<brunsli::JPEGSynthSubsampling>(subsampling);
+            params.scans = static_cast<brunsli::JPEGSynthScans>(scans);
+            params.restart_interval = restart_interval;
+            params.quality = quality;
+            params.width = size[0];
+            params.height = size[1];
+            const std::string file_name =
+                dir + "/" + kSubsamplingNames[subsampling] + "_" +
+                kScansNames[scans] + "_r" + std::to_string(restart_interval) +
+                "_q" + std::to_string(quality) + "_" +
+                std::to_string(size[0]) + "x" + std::to_string(size[1]) +
+                ".jpg";
+            if (!WriteSynthJpeg(params, file_name)) return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  brunsli::JPEGSynthParams params;
+  std::string corpus_dir;
+  bool ok = true;
+  while (ok && argc > 1) {
+    const std::string flag(argv[1]);
+    if (flag == "--zero-padding") {
+      params.zero_padding = true;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (argc < 3 || flag.compare(0, 2, "--") != 0) break;
+    const std::string value(argv[2]);
+    if (flag == "--size") {
+      const size_t x = value.find('x');
+      ok = (x != std::string::npos) &&
+           ParseInt(value.substr(0, x), &params.width) &&
+           ParseInt(value.substr(x + 1), &params.height);
+    } else if (flag == "--subsampling") {
+      const int index = FindName(kSubsamplingNames, value);
+      params.subsampling = static_cast<brunsli::JPEGSynthSubsampling>(index);
+      ok = (index >= 0);
+    } else if (flag == "--scans") {
+      const int index = FindName(kScansNames, value);
+      params.scans = static_cast<brunsli::JPEGSynthScans>(index);
+      ok = (index >= 0);
+    } else if (flag == "--content") {
+      const int index = FindName(kContentNames, value);
+      params.content = static_cast<brunsli::JPEGSynthContent>(index);
+      ok = (index >= 0);
+    } else if (flag == "--quality") {
+      ok = ParseInt(value, &params.quality);
+    } else if (flag == "--restart") {
+      ok = ParseInt(value, &params.restart_interval);
+    } else if (flag == "--reset") {
+      ok = ParseInt(value, &params.reset_interval);
+    } else if (flag == "--seed") {
+      int seed = 0;
+      ok = ParseInt(value, &seed);
+      params.seed = static_cast<uint32_t>(seed);
+    } else if (flag == "--corpus") {
+      corpus_dir = value;
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  if (!ok || (argc != (corpus_dir.empty() ? 2 : 1))) {
+    fprintf(stderr,
+            "Usage: synth_jpeg [OPTIONS] OUTPUT_FILE\n"
+            "       synth_jpeg [OPTIONS] --corpus OUTPUT_DIR\n"
+            "  --size WxH                  default: 256x256\n"
+            "  --subsampling 444|422|420|gray\n"
+            "                              default: 420\n"
+            "  --scans sequential|progressive|refinement\n"
+            "                              default: sequential\n"
+            "  --content zero|random|structured\n"
+            "                              default: structured\n"
+            "  --quality 1..100            default: 75\n"
+            "  --restart MCUS              restart interval, default: 0\n"
+            "  --reset BLOCKS              progressive EOB run flush interval, "
+            "default: 0\n"
+            "  --zero-padding              pad with 0 bits instead of 1 bits\n"
+            "  --seed N                    default: 1\n"
+            "  --corpus writes every subsampling / scans combination, with "
+            "and without\n"
+            "  restart markers, in low and high quality, in 640x480 and "
+            "4096x3072 sizes;\n"
+            "  other options set the rest of parameters.\n");
+    return EXIT_FAILURE;
+  }
+  ok = corpus_dir.empty() ? WriteSynthJpeg(params, argv[1])
+                          : WriteCorpus(corpus_dir, params);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}